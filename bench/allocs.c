@@ -0,0 +1,154 @@
+/*
+ * LD_PRELOAD shim that counts heap allocations for bench.py.  It wraps
+ * malloc(), calloc() and realloc() as well as python's object allocator
+ * (PyObject_Malloc() and PyObject_Realloc(), which serve small objects
+ * from pymalloc arenas without going through malloc()), and exports the
+ * running total as pydtrace_bench_allocs().  A PyObject_Malloc() that falls
+ * through to malloc() is counted once.  Objects recycled through python's
+ * free lists (small tuples, ints, floats, ...) never reach an allocator and
+ * are not counted; calls that libpython binds directly rather than through
+ * its PLT are not seen either, so the figures are a lower bound.
+ */
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <stddef.h>
+#include <string.h>
+
+typedef void *(*alloc_f)(size_t);
+typedef void *(*calloc_f)(size_t, size_t);
+typedef void *(*realloc_f)(void *, size_t);
+typedef void (*free_f)(void *);
+
+static alloc_f next_malloc;
+static calloc_f next_calloc;
+static realloc_f next_realloc;
+static free_f next_free;
+static alloc_f next_pymalloc;
+static realloc_f next_pyrealloc;
+
+static unsigned long long allocs;
+static __thread int inside;
+
+/*
+ * dlsym() may itself allocate before the real allocator has been looked up,
+ * so the first few allocations are carved out of a static arena that is
+ * never freed.
+ */
+static char boot[8192];
+static size_t bootused;
+static int booting;
+
+static void *
+boot_alloc(size_t size) {
+  void *p;
+
+  size = (size + 15) & ~(size_t)15;
+  if (bootused + size > sizeof (boot))
+    return NULL;
+  p = boot + bootused;
+  bootused += size;
+  return p;
+}
+
+static int
+is_boot(void *p) {
+  return (char *)p >= boot && (char *)p < boot + sizeof (boot);
+}
+
+static void
+resolve(void) {
+  booting = 1;
+  next_malloc = (alloc_f)dlsym(RTLD_NEXT, "malloc");
+  next_calloc = (calloc_f)dlsym(RTLD_NEXT, "calloc");
+  next_realloc = (realloc_f)dlsym(RTLD_NEXT, "realloc");
+  next_free = (free_f)dlsym(RTLD_NEXT, "free");
+  booting = 0;
+}
+
+static void
+count(void) {
+  if (!inside)
+    __sync_fetch_and_add(&allocs, 1);
+}
+
+unsigned long long
+pydtrace_bench_allocs(void) {
+  return __sync_fetch_and_add(&allocs, 0);
+}
+
+void *
+malloc(size_t size) {
+  if (next_malloc == NULL) {
+    if (booting)
+      return boot_alloc(size);
+    resolve();
+  }
+  count();
+  return next_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size) {
+  if (next_calloc == NULL) {
+    if (booting)
+      return boot_alloc(nmemb * size);   /* static, hence zeroed */
+    resolve();
+  }
+  count();
+  return next_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size) {
+  void *p;
+
+  if (next_realloc == NULL)
+    resolve();
+
+  if (is_boot(ptr)) {
+    if ((p = malloc(size)) != NULL)
+      memcpy(p, ptr, size < (size_t)(boot + sizeof (boot) - (char *)ptr) ?
+          size : (size_t)(boot + sizeof (boot) - (char *)ptr));
+    return p;
+  }
+
+  count();
+  return next_realloc(ptr, size);
+}
+
+void
+free(void *ptr) {
+  if (ptr == NULL || is_boot(ptr))
+    return;
+  if (next_free == NULL)
+    resolve();
+  next_free(ptr);
+}
+
+void *
+PyObject_Malloc(size_t size) {
+  void *p;
+
+  if (next_pymalloc == NULL)
+    next_pymalloc = (alloc_f)dlsym(RTLD_NEXT, "PyObject_Malloc");
+
+  count();
+  inside++;
+  p = next_pymalloc(size);
+  inside--;
+  return p;
+}
+
+void *
+PyObject_Realloc(void *ptr, size_t size) {
+  void *p;
+
+  if (next_pyrealloc == NULL)
+    next_pyrealloc = (realloc_f)dlsym(RTLD_NEXT, "PyObject_Realloc");
+
+  count();
+  inside++;
+  p = next_pyrealloc(ptr, size);
+  inside--;
+  return p;
+}
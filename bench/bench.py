@@ -0,0 +1,285 @@
+#!/usr/bin/env python
+"""
+Benchmarks for the hot paths of pydtrace, run against the stand-in
+libdtrace in this directory rather than the kernel.  The shape of the
+synthetic data is controlled by the PYDTRACE_STUB_* environment variables
+documented in libdtrace_stub.c.
+
+Every case runs in a process of its own, so that its peak RSS is its own,
+and prints one line:
+
+  case            the method and mode being measured
+  units/s         trace records (consume) or aggregation keys (agg*) per second
+  allocs/unit     heap allocations per record or key, if bench/allocs.so is
+                  preloaded (see allocs.c), "-" otherwise
+  peak RSS        maximum resident set size of the process, in KB
+
+Usage: bench.py [-p passes] [case ...]
+"""
+
+import ctypes
+import optparse
+import os
+import resource
+import subprocess
+import sys
+import tempfile
+import time
+
+import dtrace
+
+# The stand-in compiles nothing: whatever the program, it produces the probes
+# and aggregations described in libdtrace_stub.c.
+PROGRAM = """
+profile-997 { @counts[execname] = count(); @latency[execname] = quantize(arg0); }
+"""
+
+
+def _allocs():
+  try:
+    return ctypes.CDLL(None).pydtrace_bench_allocs
+  except AttributeError:
+    return None
+
+_allocs_f = _allocs()
+if _allocs_f is not None:
+  _allocs_f.restype = ctypes.c_ulonglong
+
+
+def consumer(background=False):
+  c = dtrace.DTraceConsumer()
+  c.strcompile(PROGRAM)
+  c.go()
+  if background:
+    c.start_background(switchrate="1ms")
+  return c
+
+
+# Each case returns a function that performs one pass and returns the
+# number of units it handled.
+
+def case_consume():
+  c = consumer()
+  n = [0]
+  def walk(probe, rec):
+    n[0] += 1
+  def run():
+    n[0] = 0
+    c.consume(walk)
+    return n[0]
+  return run
+
+
+def case_consume_structured():
+  c = consumer()
+  c.structured_printf = True
+  n = [0]
+  def walk(probe, rec):
+    n[0] += 1
+  def run():
+    n[0] = 0
+    c.consume(walk)
+    return n[0]
+  return run
+
+
+def case_consume_batch():
+  c = consumer()
+  n = [0]
+  def walk(records):
+    n[0] += len(records)
+  def run():
+    n[0] = 0
+    c.consume_batch(walk)
+    return n[0]
+  return run
+
+
+def case_consume_iter():
+  c = consumer()
+  def run():
+    n = 0
+    for probe, rec in c.consume_iter():
+      n += 1
+    return n
+  return run
+
+
+def case_consume_routed():
+  # Only the printf() probe is routed; units are all the records of the
+  # pass, most of which are skipped without reaching python.
+  c = consumer()
+  c.route("ip:::", lambda probe, rec: None)
+  def walk(probe, rec):
+    pass
+  def run():
+    records = c.stats()['records']
+    c.consume(walk)
+    return c.stats()['records'] - records
+  return run
+
+
+def case_consume_rollup():
+  # The syscall probes are counted natively by their string record; units
+  # are all the records of the pass, as for consume_routed.
+  c = consumer()
+  c.rollup("calls", "syscall:::", keys=(1,))
+  def walk(probe, rec):
+    pass
+  def run():
+    records = c.stats()['records']
+    c.consume(walk)
+    c.rollup_snapshot(reset=True)
+    return c.stats()['records'] - records
+  return run
+
+
+def case_consume_background():
+  c = consumer(background=True)
+  n = [0]
+  def walk(probe, rec):
+    n[0] += 1
+  def run():
+    n[0] = 0
+    while n[0] == 0:
+      c.consume(walk)
+    return n[0]
+  return run
+
+
+def _case_aggwalk(mode):
+  c = consumer()
+  n = [0]
+  def walk(varid, key, value):
+    n[0] += 1
+  def run():
+    n[0] = 0
+    c.aggwalk(walk, mode)
+    return n[0]
+  return run
+
+
+def case_aggwalk():
+  return _case_aggwalk("remove")
+
+
+def case_aggwalk_snapshot():
+  return _case_aggwalk("snapshot")
+
+
+def case_aggwalk_delta():
+  return _case_aggwalk("delta")
+
+
+def case_aggwalk_histograms():
+  # Quantized values as dtrace.Histogram, and their p99.
+  c = consumer()
+  c.histograms = True
+  n = [0]
+  def walk(varid, key, value):
+    n[0] += 1
+    if isinstance(value, dtrace.Histogram):
+      value.percentile(99)
+  def run():
+    n[0] = 0
+    c.aggwalk(walk, "snapshot")
+    return n[0]
+  return run
+
+
+def case_aggwalk_selected():
+  # Only the count() aggregation, by name, leaving the others in place.
+  c = consumer()
+  n = [0]
+  def walk(varid, key, value):
+    n[0] += 1
+  def run():
+    n[0] = 0
+    c.aggwalk(callbacks={"counts": walk}, mode="snapshot")
+    return n[0]
+  return run
+
+
+def case_aggtop():
+  # The top 20 keys of the count() aggregation; units are all its keys.
+  c = consumer()
+  keys = [0]
+  c.aggwalk(lambda varid, key, value: keys.__setitem__(0, keys[0] + (varid == 1)), "snapshot")
+  def run():
+    c.aggtop(1, 20)
+    return keys[0]
+  return run
+
+
+def case_aggsnapshot():
+  c = consumer()
+  def run():
+    return sum(memoryview(snap['values']).shape[0]
+        for snap in c.aggsnapshot().values())
+  return run
+
+
+def case_snapshot_read():
+  # A dtrace.SnapshotReader reading what the consumer last published.
+  c = consumer()
+  path = os.path.join(tempfile.mkdtemp(), "aggs.snap")
+  c.publish(path)
+  c.aggsnapshot()
+  r = dtrace.SnapshotReader(path)
+  def run():
+    return sum(memoryview(snap['values']).shape[0]
+        for snap in r.read().values())
+  return run
+
+
+CASES = [name[5:] for name in sorted(globals()) if name.startswith('case_')]
+
+
+def measure(name, passes):
+  run = globals()['case_' + name]()
+  run()                                   # warm up caches and lookup tables
+
+  units = 0
+  allocs = _allocs_f() if _allocs_f is not None else 0
+  start = time.time()
+  for i in xrange(passes):
+    units += run()
+  elapsed = time.time() - start
+  if _allocs_f is not None:
+    allocs = "%.2f" % (float(_allocs_f() - allocs) / max(units, 1))
+  else:
+    allocs = "-"
+
+  rss = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+  if sys.platform == 'darwin':
+    rss /= 1024
+  print "%-24s %14.0f %12s %10d" % (name, units / elapsed, allocs, rss)
+  sys.stdout.flush()
+
+
+def main():
+  parser = optparse.OptionParser(usage="%prog [-p passes] [case ...]")
+  parser.add_option("-p", "--passes", type="int", default=20,
+      help="timed passes per case (default %default)")
+  parser.add_option("--child", action="store_true", help=optparse.SUPPRESS_HELP)
+  opts, args = parser.parse_args()
+
+  for name in args:
+    if name not in CASES:
+      parser.error("unknown case %s; cases are: %s" % (name, " ".join(CASES)))
+
+  if opts.child:
+    measure(args[0], opts.passes)
+    return
+
+  print "%-24s %14s %12s %10s" % ("case", "units/s", "allocs/unit", "peak RSS")
+  sys.stdout.flush()
+  for name in args or CASES:
+    status = subprocess.call([sys.executable, os.path.abspath(__file__),
+        "--child", "-p", str(opts.passes), name])
+    if status != 0:
+      sys.exit(status)
+
+
+if __name__ == '__main__':
+  main()
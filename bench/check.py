@@ -0,0 +1,877 @@
+#!/usr/bin/env python
+"""
+Tests of pydtrace against the stand-in libdtrace in this directory, for
+what can be checked without the kernel.  The stand-in's data is described
+at the top of libdtrace_stub.c; it is read from the PYDTRACE_STUB_*
+environment variables when a consumer is created, so each test sets up the
+data it needs through consumer().
+
+Usage: check.py [unittest options] [Test.case ...]
+"""
+
+import os
+import pickle
+import resource
+import shutil
+import signal
+import struct
+import tempfile
+import time
+import unittest
+
+import dtrace
+
+# The stand-in compiles nothing: whatever the program, it produces the probes
+# and aggregations described in libdtrace_stub.c.
+PROGRAM = "x"
+
+# The format strings of the printf() probe's records, in order.
+FORMATS = ("%6d bytes to %s", " via %s")
+
+
+def consumer(options={}, **env):
+  """A started consumer, with the stand-in configured by env."""
+  saved = dict((name, os.environ.get(name)) for name in env)
+  os.environ.update((name, str(value)) for name, value in env.items())
+  try:
+    c = dtrace.DTraceConsumer()
+  finally:
+    for name, value in saved.items():
+      if value is None:
+        del os.environ[name]
+      else:
+        os.environ[name] = value
+  c.strcompile(PROGRAM)
+  for name, value in options.items():
+    c.setopt(name, value)
+  c.go()
+  return c
+
+
+def records(c):
+  """The records of one consume() pass, with the probes they came from."""
+  out = []
+  c.consume(lambda probe, rec: out.append((probe['provider'], probe['function'], probe['name'], rec)))
+  return out
+
+
+def consume_background(c, callback, timeout=5.0):
+  """Consumes from the background thread until it has handed something out."""
+  n = [0]
+  def count(probe, rec):
+    n[0] += 1
+    callback(probe, rec)
+  deadline = time.time() + timeout
+  while n[0] == 0 and time.time() < deadline:
+    time.sleep(0.1)
+    c.consume(count)
+
+
+def symbolless(x):
+  """x with its symbol strings blanked, as replay can't resolve symbols."""
+  if isinstance(x, str) and ("`" in x or x.startswith("0x")):
+    return "SYM"
+  if isinstance(x, (tuple, list)):
+    return type(x)(symbolless(y) for y in x)
+  return x
+
+
+class TempDirTest(unittest.TestCase):
+  def setUp(self):
+    self.dir = tempfile.mkdtemp(prefix="pydtrace-check")
+
+  def tearDown(self):
+    shutil.rmtree(self.dir)
+
+
+class StubTest(unittest.TestCase):
+  def test_probes(self):
+    recs = records(consumer(PYDTRACE_STUB_PROBES=4, PYDTRACE_STUB_PRINTF=0, PYDTRACE_STUB_RECORDS=100))
+    # Three records per firing of a plain probe.
+    self.assertEqual(len(recs), 300)
+    self.assertEqual(set(provider for provider, function, name, rec in recs), set(["syscall"]))
+    self.assertEqual(set(function for provider, function, name, rec in recs), set("call%d" % i for i in range(4)))
+
+  def test_printf(self):
+    recs = records(consumer(PYDTRACE_STUB_PRINTF=100, PYDTRACE_STUB_RECORDS=100))
+    self.assertTrue(recs)
+    self.assertEqual(set((provider, function, name) for provider, function, name, rec in recs), set([("ip", "ip_output", "send")]))
+
+  def test_keys(self):
+    keys = {}
+    c = consumer(PYDTRACE_STUB_KEYS=50)
+    c.aggwalk(lambda varid, key, value: keys.setdefault(varid, set()).add(tuple(key)), mode="snapshot")
+    self.assertEqual(sorted(keys), [1, 2, 3, 4, 5])
+    for varid, varkeys in keys.items():
+      self.assertEqual(len(varkeys), 50)
+
+  def test_seed(self):
+    self.assertEqual(records(consumer(PYDTRACE_STUB_SEED=7)), records(consumer(PYDTRACE_STUB_SEED=7)))
+    self.assertNotEqual(records(consumer(PYDTRACE_STUB_SEED=7)), records(consumer(PYDTRACE_STUB_SEED=8)))
+
+
+class StatsTest(unittest.TestCase):
+  def test_counts(self):
+    c = consumer(PYDTRACE_STUB_PROBES=4, PYDTRACE_STUB_PRINTF=0, PYDTRACE_STUB_RECORDS=100)
+    n = len(records(c))
+    stats = c.stats()
+    self.assertEqual(stats['firings'], 100)
+    self.assertEqual(stats['records'], n)
+    self.assertTrue(stats['bytes'] >= 100 * (8 + 32 + 4))
+    self.assertEqual(stats['passes'], 1)
+    self.assertEqual(stats['errors'], 0)
+
+  def test_drops_and_errors(self):
+    # Counted, rather than failing the pass.
+    c = consumer(PYDTRACE_STUB_DROPS=3, PYDTRACE_STUB_ERRORS=2)
+    self.assertTrue(records(c))
+    self.assertTrue(records(c))
+    stats = c.stats()
+    self.assertEqual(stats['principal_drops'], 6)
+    self.assertEqual(stats['errors'], 4)
+    for kind in ('aggregation_drops', 'speculation_drops', 'dynvar_drops', 'other_drops'):
+      self.assertEqual(stats[kind], 0)
+
+  def test_reset(self):
+    c = consumer(PYDTRACE_STUB_DROPS=3)
+    records(c)
+    self.assertEqual(c.stats(reset=True)['principal_drops'], 3)
+    stats = c.stats()
+    self.assertEqual(stats['principal_drops'], 0)
+    self.assertEqual(stats['firings'], 0)
+    self.assertEqual(stats['passes'], 0)
+
+  def test_no_handlers(self):
+    # A consumer that couldn't count drops and errors isn't created.
+    os.environ["PYDTRACE_STUB_NOHANDLERS"] = "1"
+    try:
+      self.assertRaises(AttributeError, dtrace.DTraceConsumer)
+    finally:
+      del os.environ["PYDTRACE_STUB_NOHANDLERS"]
+
+  def strict(self, **env):
+    c = consumer(**env)
+    c.strict = True
+    return c
+
+  def test_strict(self):
+    # Drops and ERROR firings are still counted, then fail the pass.
+    c = self.strict(PYDTRACE_STUB_DROPS=3)
+    self.assertRaises(RuntimeError, c.consume, lambda probe, rec: None)
+    self.assertEqual(c.stats()['principal_drops'], 3)
+    self.assertRaises(RuntimeError, lambda: list(c.consume_iter()))
+    self.assertRaises(RuntimeError, c.consume_raw, lambda data, length: None)
+
+    c = self.strict(PYDTRACE_STUB_ERRORS=2)
+    self.assertRaises(RuntimeError, c.consume, lambda probe, rec: None)
+    self.assertEqual(c.stats()['errors'], 1)
+
+  def test_strict_background(self):
+    c = self.strict(PYDTRACE_STUB_DROPS=3)
+    c.start_background()
+    try:
+      deadline = time.time() + 5
+      while not c.background_done and time.time() < deadline:
+        time.sleep(0.1)
+      self.assertRaises(RuntimeError, c.consume, lambda probe, rec: None)
+    finally:
+      c.stop_background()
+
+
+class RunTest(unittest.TestCase):
+  def test_done(self):
+    c = consumer(PYDTRACE_STUB_PASSES=3, options={"switchrate": "10ms"})
+    n = [0]
+    def count(probe, rec):
+      n[0] += 1
+    c.run(count)
+    self.assertTrue(n[0] > 0)
+    self.assertEqual(c.stats()['passes'], 4)
+
+  def test_duration(self):
+    c = consumer(options={"switchrate": "10ms"})
+    start = time.time()
+    c.run(lambda probe, rec: None, duration=0.3)
+    elapsed = time.time() - start
+    self.assertTrue(0.3 <= elapsed < 2, elapsed)
+
+  def test_aggrate(self):
+    # Five variables of ten keys each, left in place: fifty calls a walk.
+    c = consumer(PYDTRACE_STUB_KEYS=10, options={"switchrate": "10ms", "aggrate": "100ms"})
+    n = [0]
+    def count(varid, key, value):
+      n[0] += 1
+    c.run(lambda probe, rec: None, aggcallback=count, duration=0.55, mode="snapshot")
+    self.assertEqual(n[0] % 50, 0)
+    # One walk every aggrate, and a last one on the way out.
+    self.assertTrue(4 <= n[0] / 50 <= 8, n[0] / 50)
+
+  def test_exception(self):
+    c = consumer(options={"switchrate": "10ms"})
+    def fail(probe, rec):
+      raise ValueError("from the callback")
+    self.assertRaises(ValueError, c.run, fail, duration=5)
+    def aggfail(varid, key, value):
+      raise KeyError("from the aggregation callback")
+    self.assertRaises(KeyError, c.run, lambda probe, rec: None, aggcallback=aggfail, duration=5)
+
+  def test_not_started(self):
+    # A pass that fails raises even when no callback said why.
+    c = dtrace.DTraceConsumer()
+    c.strcompile(PROGRAM)
+    self.assertRaises(RuntimeError, c.consume, lambda probe, rec: None)
+    self.assertRaises(RuntimeError, c.run, lambda probe, rec: None, duration=0.1)
+
+  def test_nested(self):
+    # A run() from the callback of a walk leaves the walk to its callback.
+    c = consumer(PYDTRACE_STUB_KEYS=10, options={"switchrate": "10ms"})
+    n = [0]
+    def walk(varid, keys, value):
+      if n[0] == 0:
+        c.run(lambda probe, rec: None, duration=0.05)
+      n[0] += 1
+    c.aggwalk(walk, mode="snapshot")
+    self.assertEqual(n[0], 50)
+
+
+class ConsumerGroupTest(unittest.TestCase):
+  OPTIONS = {"switchrate": "10ms", "aggrate": "50ms"}
+
+  def test_done(self):
+    # Each member leaves after its program is done, with a last walk of its
+    # aggregations; the group returns once they are all gone.
+    g = dtrace.ConsumerGroup()
+    walks = {}
+    for passes in (2, 4):
+      c = consumer(PYDTRACE_STUB_PASSES=passes, PYDTRACE_STUB_KEYS=10, options=self.OPTIONS)
+      def walk(varid, key, value, passes=passes):
+        walks[passes] = walks.get(passes, 0) + 1
+      g.add(c, lambda probe, rec: None, aggcallback=walk)
+    self.assertEqual(len(g), 2)
+    g.run(duration=10)
+    self.assertEqual(len(g), 0)
+    self.assertEqual(sorted(walks), [2, 4])
+
+  def test_remove_from_callback(self):
+    g = dtrace.ConsumerGroup()
+    a = consumer(options=self.OPTIONS)
+    b = consumer(PYDTRACE_STUB_PASSES=5, options=self.OPTIONS)
+    seen = []
+    def walk(probe, rec):
+      if not seen:
+        g.remove(a)
+      seen.append(rec)
+    g.add(a, walk)
+    g.add(b, lambda probe, rec: None)
+    g.run(duration=10)
+    self.assertEqual(len(g), 0)
+    # a was consumed once, in the pass whose callback removed it.
+    self.assertEqual(a.stats()['passes'], 1)
+    self.assertTrue(seen)
+
+  def test_add_from_callback(self):
+    # Adding members from a callback grows the member array under the
+    # running pass.
+    g = dtrace.ConsumerGroup()
+    added = []
+    passes = []
+    def add(probe, rec):
+      if not added:
+        for i in range(10):
+          c = consumer(PYDTRACE_STUB_PASSES=2, PYDTRACE_STUB_RECORDS=10, options=self.OPTIONS)
+          added.append(c)
+          g.add(c, lambda probe, rec, i=i: passes.append(i))
+    g.add(consumer(PYDTRACE_STUB_PASSES=2, PYDTRACE_STUB_RECORDS=10, options=self.OPTIONS), add)
+    g.run(duration=10)
+    self.assertEqual(len(g), 0)
+    self.assertEqual(sorted(set(passes)), range(10))
+
+  def test_duration(self):
+    g = dtrace.ConsumerGroup()
+    g.add(consumer(options=self.OPTIONS), lambda probe, rec: None)
+    start = time.time()
+    g.run(duration=0.3)
+    self.assertTrue(0.3 <= time.time() - start < 2)
+    self.assertEqual(len(g), 1)
+
+  def test_exception(self):
+    g = dtrace.ConsumerGroup()
+    def fail(probe, rec):
+      raise ValueError("from the callback")
+    g.add(consumer(options=self.OPTIONS), fail)
+    self.assertRaises(ValueError, g.run, duration=5)
+    self.assertEqual(len(g), 1)
+
+  def test_add_twice(self):
+    g = dtrace.ConsumerGroup()
+    c = consumer()
+    g.add(c, lambda probe, rec: None)
+    self.assertRaises(ValueError, g.add, c, lambda probe, rec: None)
+
+  def test_mode(self):
+    # The walk mode given to add() is the member's; the consumer's own walks
+    # keep what their last delta walk saw.
+    c = consumer(PYDTRACE_STUB_AGGPASSES=1, PYDTRACE_STUB_KEYS=10)
+    n = [0]
+    def count(varid, key, value):
+      n[0] += 1
+    c.aggwalk(count, mode="delta")
+    self.assertEqual(n[0], 50)
+    g = dtrace.ConsumerGroup()
+    g.add(c, lambda probe, rec: None, aggcallback=count, mode="remove")
+    c.aggwalk(count, mode="delta")
+    self.assertEqual(n[0], 50)
+    self.assertRaises(ValueError, g.add, consumer(), lambda probe, rec: None, aggcallback=count, mode="x")
+
+
+class RouteTest(unittest.TestCase):
+  def test_consume(self):
+    c = consumer()
+    routed = []
+    rest = []
+    c.route("syscall:::", lambda probe, rec: routed.append(probe.provider))
+    c.route("ip:::")
+    c.consume(lambda probe, rec: rest.append(probe.provider))
+    self.assertTrue(routed)
+    self.assertEqual(set(routed), set(["syscall"]))
+    self.assertEqual(set(rest), set(["ip"]))
+
+  def test_first_match(self):
+    c = consumer(PYDTRACE_STUB_PRINTF=0)
+    entry = []
+    other = []
+    c.route("syscall:::entry", lambda probe, rec: entry.append(probe.name))
+    c.route("syscall::call*:", lambda probe, rec: other.append(probe.name))
+    c.consume(None)
+    self.assertEqual(set(entry), set(["entry"]))
+    self.assertEqual(set(other), set(["return"]))
+
+  def test_unrouted_skipped(self):
+    c = consumer()
+    rest = []
+    c.route("ip:::")
+    c.consume(lambda probe, rec: rest.append(probe.provider))
+    self.assertEqual(set(rest), set(["ip"]))
+    # The skipped records are still counted as consumed.
+    self.assertTrue(c.stats()['records'] > len(rest))
+    c.unroute()
+    rest = []
+    c.consume(lambda probe, rec: rest.append(probe.provider))
+    self.assertEqual(set(rest), set(["syscall", "ip"]))
+
+  def test_batch(self):
+    c = consumer()
+    routed = []
+    batch = []
+    c.route("syscall:::", lambda probe, rec: routed.append(probe.provider))
+    c.route("ip:::")
+    c.consume_batch(batch.extend)
+    self.assertTrue(routed)
+    self.assertEqual(set(probe.provider for probe, rec in batch), set(["ip"]))
+
+  def test_iter(self):
+    c = consumer()
+    routed = []
+    c.route("syscall:::", lambda probe, rec: routed.append(probe.provider))
+    c.route("ip:::")
+    rest = list(c.consume_iter())
+    self.assertTrue(routed)
+    self.assertEqual(set(probe.provider for probe, rec in rest), set(["ip"]))
+
+  def test_unroute_background(self):
+    # Records the background thread queued for a route that is gone by the
+    # time they are handed out go to the callback of the consume().
+    c = consumer()
+    a = []
+    b = []
+    rest = []
+    c.route("syscall:::", lambda probe, rec: a.append(probe.provider))
+    c.route("ip:::", lambda probe, rec: b.append(probe.provider))
+    c.start_background()
+    time.sleep(1.5)
+    c.unroute("syscall:::")
+    consume_background(c, lambda probe, rec: rest.append(probe.provider))
+    c.stop_background()
+    self.assertEqual(a, [])
+    self.assertEqual(set(b), set(["ip"]))
+    self.assertEqual(set(rest), set(["syscall"]))
+
+  def test_unroute_from_callback(self):
+    c = consumer()
+    routed = []
+    rest = []
+    def once(probe, rec):
+      routed.append(probe.provider)
+      c.unroute("syscall:::")
+    c.route("syscall:::", once)
+    c.consume(lambda probe, rec: rest.append(probe.provider))
+    self.assertEqual(routed, ["syscall"])
+    self.assertTrue("syscall" in rest)
+
+
+class RollupTest(unittest.TestCase):
+  @staticmethod
+  def firings(c):
+    """The firings of the plain probes of a pass, as (probe, records)."""
+    out = []
+    rest = []
+    for provider, function, name, rec in records(c):
+      if provider != "syscall":
+        rest.append((provider, function, name, rec))
+      elif out and out[-1][0] == (function, name) and len(out[-1][1]) < 3:
+        out[-1][1].append(rec)
+      else:
+        out.append(((function, name), [rec]))
+    return out, rest
+
+  @staticmethod
+  def quantize(values):
+    buckets = {}
+    for v in values:
+      if v == 0:
+        bucket = (0, 0)
+      else:
+        k = abs(v).bit_length() - 1
+        bucket = (2 ** k, 2 ** (k + 1) - 1) if v > 0 else (-(2 ** (k + 1) - 1), -2 ** k)
+      buckets[bucket] = buckets.get(bucket, 0) + 1
+    return sorted(buckets.items())
+
+  def test_fold(self):
+    # Same seed, same firings: one consumer folds in python, the other
+    # natively.
+    firings, rest = self.firings(consumer())
+    c = consumer()
+    c.rollup("count", "syscall:::entry", keys=(1,))
+    c.rollup("sum", "syscall:::", keys=(1, 0), value=2, op="sum")
+    c.rollup("min", "syscall:::return", keys=[0], value=2, op="min")
+    c.rollup("max", "syscall:::return", keys=(), value=2, op="max")
+    c.rollup("quantize", "call1*:entry", keys=(1,), value=2, op="quantize")
+    self.assertEqual(records(c), rest)
+
+    count, total, least, most, values = {}, {}, {}, {}, {}
+    for (function, name), (a, b, v) in firings:
+      total[(b, a)] = total.get((b, a), 0) + v
+      if name == "entry":
+        count[(b,)] = count.get((b,), 0) + 1
+        if function.startswith("call1"):
+          values.setdefault((b,), []).append(v)
+      else:
+        least[(a,)] = min(least.get((a,), v), v)
+        most[()] = max(most.get((), v), v)
+
+    result = c.rollup_snapshot()
+    self.assertEqual(sorted(result), ["count", "max", "min", "quantize", "sum"])
+    self.assertEqual(result["count"], count)
+    self.assertEqual(result["sum"], total)
+    self.assertEqual(result["min"], least)
+    self.assertEqual(result["max"], most)
+    self.assertEqual(dict((key, [(tuple(bucket), n) for bucket, n in buckets]) for key, buckets in result["quantize"].items()),
+        dict((key, self.quantize(v)) for key, v in values.items()))
+
+  def test_reset(self):
+    ref = consumer()
+    self.firings(ref)
+    second = [name for (function, name), recs in self.firings(ref)[0] if name == "entry"]
+    c = consumer()
+    c.rollup("count", "syscall:::entry", keys=(1,))
+    records(c)
+    self.assertTrue(c.rollup_snapshot("count", reset=True))
+    self.assertEqual(c.rollup_snapshot("count"), {})
+    records(c)
+    self.assertEqual(sum(c.rollup_snapshot("count").values()), len(second))
+
+  def test_unrollup(self):
+    c = consumer()
+    c.rollup("count", "syscall:::", keys=(1,))
+    self.assertEqual(set(rec[0] for rec in records(c)), set(["ip"]))
+    c.unrollup("count")
+    self.assertRaises(KeyError, c.rollup_snapshot, "count")
+    self.assertEqual(set(rec[0] for rec in records(c)), set(["syscall", "ip"]))
+
+  def test_invalid(self):
+    c = consumer()
+    c.rollup("count", "syscall:::", keys=(1,))
+    self.assertRaises(ValueError, c.rollup, "count", "ip:::")
+    self.assertRaises(ValueError, c.rollup, "bogus", "ip:::", op="bogus")
+    self.assertRaises(ValueError, c.rollup, "sum", "ip:::", op="sum")
+    self.assertRaises(ValueError, c.rollup, "count2", "ip:::", value=1)
+    self.assertRaises(ValueError, c.rollup, "negative", "ip:::", keys=(-1,))
+
+  def test_bad_key(self):
+    # A probe that can't provide the key is left to the callbacks.
+    c = consumer()
+    c.rollup("bad", "syscall:::entry", keys=(5,))
+    names = set(rec[2] for rec in records(c) if rec[0] == "syscall")
+    self.assertEqual(names, set(["entry", "return"]))
+    self.assertRaises(RuntimeError, c.rollup_snapshot, "bad")
+    # The error is reported once; the probe stays out of the rollup.
+    self.assertEqual(c.rollup_snapshot("bad"), {})
+    records(c)
+    self.assertEqual(c.rollup_snapshot("bad"), {})
+
+
+class HistogramTest(unittest.TestCase):
+
+  def histogram(self):
+    return dtrace.Histogram([[(0, 0), 2], [(1, 1), 2], [(2, 3), 4]])
+
+  def test_percentiles(self):
+    h = self.histogram()
+    self.assertEqual(h.count, 8)
+    self.assertEqual(h.percentile(50), 1.0)
+    self.assertEqual(h.percentiles([0, 25, 50, 100]), [0.0, 0.0, 1.0, 3.0])
+
+    # Linear within a bucket.
+    h = dtrace.Histogram([[(0, 99), 100]])
+    for p, v in [(0, 0.0), (10, 9.9), (50, 49.5), (100, 99.0)]:
+      self.assertAlmostEqual(h.percentile(p), v)
+
+    # Underflow and overflow buckets clamp to their finite end.
+    h = dtrace.Histogram([[(-2 ** 63, -1), 3], [(0, 0), 1], [(10, 2 ** 63 - 1), 4]])
+    self.assertEqual(h.percentiles([0, 50, 100]), [-1.0, 0.0, 10.0])
+
+    for p in (-1, 101):
+      self.assertRaises(ValueError, h.percentile, p)
+      self.assertRaises(ValueError, h.percentiles, [50, p])
+
+  def test_moments(self):
+    h = self.histogram()
+    self.assertAlmostEqual(h.mean(), 1.5)
+    self.assertAlmostEqual(h.stddev(), 1.0606601717798212)
+    self.assertEqual(dtrace.Histogram([[(-2 ** 63, -1), 3], [(0, 0), 1]]).mean(), -0.75)
+
+  def test_empty(self):
+    h = dtrace.Histogram([])
+    self.assertEqual((h.count, list(h)), (0, []))
+    self.assertEqual((h.percentile(50), h.mean()), (None, None))
+
+  def test_merge(self):
+    h, g = self.histogram(), dtrace.Histogram([[(0, 0), 1], [(4, 7), 3]])
+    merged = [((0, 0), 3), ((1, 1), 2), ((2, 3), 4), ((4, 7), 3)]
+    self.assertEqual(list(h + g), merged)
+    self.assertEqual(list(h), [((0, 0), 2), ((1, 1), 2), ((2, 3), 4)])
+
+    k = h
+    k += g
+    self.assertEqual(list(h), merged)
+    self.assertEqual(h.count, 12)
+
+    for buckets in ([[(0, 1), 1]], [[(3, 4), 1]]):
+      self.assertRaises(ValueError, h.__add__, dtrace.Histogram(buckets))
+
+  def test_bytes(self):
+    h = self.histogram()
+    data = h.tobytes()
+    self.assertEqual(list(dtrace.Histogram.frombytes(data)), list(h))
+    for bad in (data[:-1], data[:3], "garbage!", ""):
+      self.assertRaises(ValueError, dtrace.Histogram.frombytes, bad)
+
+  def test_pickle(self):
+    h = self.histogram()
+    for proto in (0, 2):
+      self.assertEqual(list(pickle.loads(pickle.dumps(h, proto))), list(h))
+
+  def test_llquantize_ranges(self):
+    # llquantize(factor 10, low 0, high 6, 20 steps): the first bucket is
+    # [0, factor^low - 1], and the buckets tile the range.
+    ranges = consumer().aggsnapshot()[4]['ranges']
+    self.assertEqual(ranges[:3], ((0, 0), (1, 1), (2, 2)))
+    for (lo, hi), (nlo, nhi) in zip(ranges, ranges[1:]):
+      self.assertTrue(lo <= hi)
+      self.assertEqual(hi + 1, nlo)
+
+
+class AggtopTest(unittest.TestCase):
+  def setUp(self):
+    self.c = consumer(PYDTRACE_STUB_AGGPASSES=1)
+    self.recs = {}
+    self.c.aggwalk(lambda varid, keys, value: self.recs.setdefault(varid, []).append((tuple(keys), value)), mode="snapshot")
+
+  @staticmethod
+  def rank(value):
+    # The number of values of the quantizing actions.
+    if isinstance(value, list):
+      return sum(count for bucket, count in value)
+    return value
+
+  def test_order(self):
+    for varid, recs in sorted(self.recs.items()):
+      for by in ("value", "key"):
+        for order in ("desc", "asc"):
+          if by == "value":
+            ref = sorted(recs, key=lambda (keys, value): (self.rank(value), keys), reverse=order == "desc")
+          else:
+            ref = sorted(recs, reverse=order == "desc")
+          for n in (0, 1, 5, len(recs), len(recs) + 10):
+            got = [(tuple(keys), value) for keys, value in self.c.aggtop(varid, n, by=by, order=order)]
+            self.assertEqual(got, ref[:n], "aggtop(%d, %d, by=%r, order=%r)" % (varid, n, by, order))
+
+  def test_leaves_data(self):
+    self.c.aggtop(1, 3)
+    n = [0]
+    self.c.aggwalk(lambda varid, keys, value: n.__setitem__(0, n[0] + 1), mode="snapshot")
+    self.assertEqual(n[0], sum(len(recs) for recs in self.recs.values()))
+
+  def test_invalid(self):
+    self.assertEqual(self.c.aggtop(99, 3), [])
+    self.assertRaises(ValueError, self.c.aggtop, 1, -1)
+    self.assertRaises(ValueError, self.c.aggtop, 1, 2, by="x")
+    self.assertRaises(ValueError, self.c.aggtop, 1, 2, order="x")
+
+
+class SnapshotReaderTest(TempDirTest):
+  def setUp(self):
+    TempDirTest.setUp(self)
+    self.path = os.path.join(self.dir, "snapshot")
+
+  @staticmethod
+  def flat(snapshots):
+    out = {}
+    for varid, snap in snapshots.items():
+      keys = []
+      for key in snap.keys:
+        if isinstance(key, tuple):
+          keys.append((memoryview(key[0]).tobytes(), list(key[1])))
+        else:
+          keys.append(memoryview(key).tobytes())
+      values = memoryview(snap.values)
+      out[varid] = (snap.name, snap.action, keys, values.tobytes(), values.shape, values.format, snap.ranges)
+    return out
+
+  def test_read(self):
+    c = consumer(PYDTRACE_STUB_AGGPASSES=1)
+    c.publish(self.path, size=64)
+    r = dtrace.SnapshotReader(self.path)
+    self.assertEqual(r.read(), {})
+    self.assertEqual(r.generation, 0)
+
+    snap = c.aggsnapshot()
+    got = r.read()
+    self.assertEqual(self.flat(got), self.flat(snap))
+    self.assertEqual(r.published, 1)
+    self.assertEqual(r.generation, 1)
+    self.assertTrue(abs(r.time - time.time()) < 60)
+    self.assertEqual(self.flat({2: r.read(2)}), self.flat({2: snap[2]}))
+    self.assertEqual(r.read(99), None)
+    self.assertEqual(c.publish_error, None)
+
+  def test_not_a_snapshot(self):
+    path = os.path.join(self.dir, "text")
+    open(path, "w").write("not a snapshot\n" * 16)
+    self.assertRaises(ValueError, dtrace.SnapshotReader, path)
+    self.assertRaises(IOError, dtrace.SnapshotReader, os.path.join(self.dir, "missing"))
+
+  def test_publish_error(self):
+    # A snapshot that can't be published doesn't fail the walk; the error is
+    # kept until a later snapshot is published.
+    c = consumer(PYDTRACE_STUB_AGGPASSES=1)
+    c.publish(self.path, size=64)
+    handler = signal.signal(signal.SIGXFSZ, signal.SIG_IGN)
+    limit = resource.getrlimit(resource.RLIMIT_FSIZE)
+    resource.setrlimit(resource.RLIMIT_FSIZE, (4096, limit[1]))
+    try:
+      self.assertEqual(sorted(c.aggsnapshot()), [1, 2, 3, 4, 5])
+    finally:
+      resource.setrlimit(resource.RLIMIT_FSIZE, limit)
+      signal.signal(signal.SIGXFSZ, handler)
+    self.assertTrue(c.publish_error)
+    c.aggsnapshot()
+    self.assertEqual(c.publish_error, None)
+    self.assertEqual(sorted(dtrace.SnapshotReader(self.path).read()), [1, 2, 3, 4, 5])
+
+  def test_bad_count(self):
+    # A key count that runs past the end of the snapshot is refused before
+    # anything is allocated for it.
+    c = consumer(PYDTRACE_STUB_AGGPASSES=1)
+    c.publish(self.path)
+    c.aggsnapshot()
+    data = bytearray(open(self.path, "rb").read())
+    offset, length = struct.unpack_from("QQ", str(data), 48)
+    struct.pack_into("I", data, offset + 12, 0xffffffff)
+    bad = os.path.join(self.dir, "bad")
+    open(bad, "wb").write(str(data))
+    self.assertRaises(RuntimeError, dtrace.SnapshotReader(bad).read)
+
+
+class PrintfTest(unittest.TestCase):
+  def printfs(self, c, background=False):
+    out = []
+    def walk(probe, rec):
+      if probe.provider == "ip":
+        out.append(rec)
+    if background:
+      c.start_background()
+      consume_background(c, walk)
+      c.stop_background()
+    else:
+      c.consume(walk)
+    return out
+
+  def check_structured(self, out):
+    self.assertTrue(len(out) >= 3)
+    # Each printf() of the firing comes with its own format and takes only
+    # the arguments its format asks for; the trace() after them is its own
+    # record.
+    fmt, args = out[0]
+    self.assertEqual(fmt, FORMATS[0])
+    self.assertEqual(len(args), 2)
+    self.assertTrue(isinstance(args[0], (int, long)))
+    fmt, args = out[1]
+    self.assertEqual(fmt, FORMATS[1])
+    self.assertEqual(len(args), 1)
+    self.assertTrue(args[0].startswith("net"))
+    self.assertTrue(isinstance(out[2], (int, long)))
+
+  def test_structured(self):
+    c = consumer()
+    c.structured_printf = True
+    self.check_structured(self.printfs(c))
+
+  def test_structured_background(self):
+    c = consumer()
+    c.structured_printf = True
+    self.check_structured(self.printfs(c, background=True))
+
+  def test_formatted(self):
+    c = consumer()
+    structured = consumer()
+    structured.structured_printf = True
+    out = self.printfs(c)
+    for rec, (fmt, args) in zip(out[:2], self.printfs(structured)[:2]):
+      self.assertEqual(rec, fmt % args)
+    self.assertTrue(isinstance(out[2], (int, long)))
+
+
+class DeltaTest(unittest.TestCase):
+  def walk(self, c, **kwargs):
+    out = []
+    c.aggwalk(lambda varid, keys, value: out.append((varid, tuple(keys), value)), mode="delta", **kwargs)
+    return out
+
+  def test_unchanged_left_out(self):
+    c = consumer(PYDTRACE_STUB_AGGPASSES=1)
+    first = self.walk(c)
+    self.assertEqual(sorted(set(varid for varid, keys, value in first)), [1, 2, 3, 4, 5])
+    self.assertEqual(self.walk(c), [])
+
+  def test_increase(self):
+    # The stand-in updates its aggregations on the first two snapshots
+    # only, so the third walk sees what the second did.
+    c = consumer(PYDTRACE_STUB_AGGPASSES=2)
+    first = dict((keys, value) for varid, keys, value in self.walk(c, vars=[1]))
+    delta = dict((keys, value) for varid, keys, value in self.walk(c, vars=[1]))
+    snap = {}
+    c.aggwalk(lambda varid, keys, value: snap.__setitem__(tuple(keys), value), mode="snapshot", vars=[1])
+    self.assertTrue(first and delta)
+    for keys, value in snap.items():
+      self.assertEqual(first.get(keys, 0) + delta.get(keys, 0), value)
+    self.assertTrue(0 not in delta.values())
+
+
+class ReplayTest(TempDirTest):
+  def record(self, c, passes, replaying=False):
+    out = []
+    for i in range(passes):
+      recs = []
+      c.consume(lambda probe, rec: recs.append((probe.provider, probe.name, rec)))
+      aggs = []
+      c.aggwalk(lambda varid, keys, value: aggs.append((varid, tuple(keys), value)), mode="remove" if replaying else "snapshot")
+      out.append((recs, sorted(aggs)))
+    return out
+
+  def test_deterministic(self):
+    path = os.path.join(self.dir, "capture")
+    c = consumer()
+    c.structured_printf = True
+    c.capture(path)
+    live = self.record(c, 3)
+    c.capture(None)
+
+    for attempt in range(2):
+      r = dtrace.DTraceConsumer(replay=path)
+      self.assertEqual(symbolless(self.record(r, 3, replaying=True)), symbolless(live))
+      r.consume(lambda probe, rec: None)
+      self.assertTrue(r.replay_eof)
+
+  def test_structured_printf(self):
+    path = os.path.join(self.dir, "capture")
+    c = consumer()
+    c.capture(path)
+    records(c)
+    c.capture(None)
+    self.assertFalse(c.structured_printf)
+
+    r = dtrace.DTraceConsumer(replay=path)
+    self.assertTrue(r.structured_printf)
+    self.assertRaises(AttributeError, setattr, r, "structured_printf", False)
+    r.structured_printf = True
+    printfs = [rec for provider, function, name, rec in records(r) if provider == "ip"]
+    self.assertTrue(printfs)
+    self.assertEqual(printfs[0][0], FORMATS[0])
+    self.assertTrue(r.structured_printf)
+
+  def test_corrupt(self):
+    path = os.path.join(self.dir, "corrupt")
+    # A probe description with the one EPID no table can hold.
+    payload = struct.pack("=IiIi", 0xffffffff, 0, 8, 0) + "\0" * 1024
+    open(path, "wb").write("PYDTCAP2" + struct.pack("=II", 1, len(payload)) + payload)
+    r = dtrace.DTraceConsumer(replay=path)
+    self.assertRaises(RuntimeError, r.consume, lambda probe, rec: None)
+
+  def crafted(self, *entries):
+    """A capture file of the given (entry ID, payload) entries."""
+    path = os.path.join(self.dir, "crafted")
+    data = "PYDTCAP2"
+    for id, payload in entries:
+      data += struct.pack("=II", id, len(payload)) + payload + "\0" * (-len(payload) % 8)
+    open(path, "wb").write(data)
+    return path
+
+  @staticmethod
+  def probe(size, *recs):
+    """A probe description of EPID 1, with (action, size, offset) records."""
+    return (struct.pack("=IiIi", 1, 0, size, len(recs)) +
+        "".join(struct.pack("=HxxIIHHQQ", action, rsize, offset, 1, 0, 0, 0) for action, rsize, offset in recs) +
+        "\0" * (4 + 320) + "\0" * len(recs))
+
+  def test_record_out_of_bounds(self):
+    # A record past the end of the firings it describes.
+    path = self.crafted((1, self.probe(8, (1, 8, 0x40000000))), (3, struct.pack("=Ii", 1, 0) + "\0" * 8))
+    r = dtrace.DTraceConsumer(replay=path)
+    self.assertRaises(RuntimeError, r.consume, lambda probe, rec: None)
+
+    agg = (struct.pack("=IiIi", 1, 1, 16, 2) + struct.pack("=HxxIIHHQQ", 0, 4, 0, 1, 0, 0, 0) +
+        struct.pack("=HxxIIHHQQ", 0x701, 8, 0x40000000, 8, 0, 0, 0) + "count\0")
+    path = self.crafted((2, agg), (4, struct.pack("=Ii", 1, 0) + "\0" * 16))
+    r = dtrace.DTraceConsumer(replay=path)
+    self.assertRaises(RuntimeError, r.aggwalk, lambda varid, keys, value: None)
+
+  def test_unterminated_string(self):
+    path = self.crafted((1, self.probe(16, (1, 16, 0))), (3, struct.pack("=Ii", 1, 0) + "x" * 16))
+    r = dtrace.DTraceConsumer(replay=path)
+    self.assertRaises(RuntimeError, r.consume, lambda probe, rec: None)
+
+  def test_not_a_capture(self):
+    path = os.path.join(self.dir, "text")
+    open(path, "w").write("not a capture file\n")
+    self.assertRaises(ValueError, dtrace.DTraceConsumer, replay=path)
+
+
+class BackgroundTest(unittest.TestCase):
+  def test_refused(self):
+    # Whatever would reach libdtrace or the probe caches behind the thread's
+    # back.
+    c = consumer()
+    c.start_background()
+    try:
+      self.assertRaises(RuntimeError, c.strcompile, PROGRAM)
+      self.assertRaises(RuntimeError, c.go)
+      self.assertRaises(RuntimeError, c.consume_raw, lambda data, layouts: None)
+      self.assertRaises(RuntimeError, c.run, lambda probe, rec: None, duration=0.1)
+      consume_background(c, lambda probe, rec: None)
+    finally:
+      c.stop_background()
+
+
+if __name__ == '__main__':
+  unittest.main()
@@ -0,0 +1,346 @@
+/*
+ * Stand-in for <dtrace.h>: just enough of the libdtrace consumer interface
+ * (types, constants and prototypes as found in illumos/OSX) to build
+ * pydtrace against bench/libdtrace_stub.c.
+ */
+#ifndef _DTRACE_H
+#define _DTRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#ifndef NBBY
+#define NBBY 8
+#endif
+
+#ifndef __sun
+typedef unsigned int uint_t;
+#endif
+
+typedef struct dtrace_hdl dtrace_hdl_t;
+typedef struct dtrace_prog dtrace_prog_t;
+
+typedef uint32_t dtrace_epid_t;
+typedef uint32_t dtrace_aggid_t;
+typedef int64_t dtrace_aggvarid_t;
+typedef uint16_t dtrace_actkind_t;
+typedef int64_t dtrace_optval_t;
+typedef uint32_t dtrace_id_t;
+typedef int processorid_t;
+
+#define DTRACE_VERSION 3
+#define DTRACE_PROVNAMELEN 64
+#define DTRACE_MODNAMELEN 64
+#define DTRACE_FUNCNAMELEN 128
+#define DTRACE_NAMELEN 64
+
+#define DTRACE_AGGVARIDNONE 0
+#define DTRACEOPT_UNSET ((dtrace_optval_t)-2)
+
+typedef enum dtrace_probespec {
+  DTRACE_PROBESPEC_NONE = -1,
+  DTRACE_PROBESPEC_PROVIDER = 0,
+  DTRACE_PROBESPEC_MOD,
+  DTRACE_PROBESPEC_FUNC,
+  DTRACE_PROBESPEC_NAME
+} dtrace_probespec_t;
+
+#define DTRACEACT_NONE 0
+#define DTRACEACT_DIFEXPR 1
+#define DTRACEACT_EXIT 2
+#define DTRACEACT_PRINTF 3
+#define DTRACEACT_PRINTA 4
+#define DTRACEACT_LIBACT 5
+#define DTRACEACT_TRACEMEM 6
+#define DTRACEACT_TRACEMEM_DYNSIZE 7
+
+#define DTRACEACT_PROC 0x0100
+#define DTRACEACT_USTACK (DTRACEACT_PROC + 1)
+#define DTRACEACT_JSTACK (DTRACEACT_PROC + 2)
+#define DTRACEACT_USYM (DTRACEACT_PROC + 3)
+#define DTRACEACT_UMOD (DTRACEACT_PROC + 4)
+#define DTRACEACT_UADDR (DTRACEACT_PROC + 5)
+
+#define DTRACEACT_PROC_DESTRUCTIVE 0x0200
+#define DTRACEACT_STOP (DTRACEACT_PROC_DESTRUCTIVE + 1)
+#define DTRACEACT_RAISE (DTRACEACT_PROC_DESTRUCTIVE + 2)
+#define DTRACEACT_SYSTEM (DTRACEACT_PROC_DESTRUCTIVE + 3)
+#define DTRACEACT_FREOPEN (DTRACEACT_PROC_DESTRUCTIVE + 4)
+
+#define DTRACEACT_KERNEL 0x0400
+#define DTRACEACT_STACK (DTRACEACT_KERNEL + 1)
+#define DTRACEACT_SYM (DTRACEACT_KERNEL + 2)
+#define DTRACEACT_MOD (DTRACEACT_KERNEL + 3)
+
+#define DTRACEACT_SPECULATIVE 0x0600
+#define DTRACEACT_AGGREGATION 0x0700
+
+#define DTRACEACT_CLASS(x) ((x) & 0xff00)
+
+#define DTRACEAGG_COUNT (DTRACEACT_AGGREGATION + 1)
+#define DTRACEAGG_MIN (DTRACEACT_AGGREGATION + 2)
+#define DTRACEAGG_MAX (DTRACEACT_AGGREGATION + 3)
+#define DTRACEAGG_AVG (DTRACEACT_AGGREGATION + 4)
+#define DTRACEAGG_SUM (DTRACEACT_AGGREGATION + 5)
+#define DTRACEAGG_STDDEV (DTRACEACT_AGGREGATION + 6)
+#define DTRACEAGG_QUANTIZE (DTRACEACT_AGGREGATION + 7)
+#define DTRACEAGG_LQUANTIZE (DTRACEACT_AGGREGATION + 8)
+#define DTRACEAGG_LLQUANTIZE (DTRACEACT_AGGREGATION + 9)
+
+#define DTRACE_QUANTIZE_NBUCKETS \
+  (((sizeof (uint64_t) * NBBY) - 1) * 2 + 1)
+#define DTRACE_QUANTIZE_ZEROBUCKET ((sizeof (uint64_t) * NBBY) - 1)
+#define DTRACE_QUANTIZE_BUCKETVAL(buck) \
+  (int64_t)((buck) < DTRACE_QUANTIZE_ZEROBUCKET ? \
+  -(1LL << (DTRACE_QUANTIZE_ZEROBUCKET - 1 - (buck))) : \
+  (buck) == DTRACE_QUANTIZE_ZEROBUCKET ? 0 : \
+  1LL << ((buck) - DTRACE_QUANTIZE_ZEROBUCKET - 1))
+
+#define DTRACE_LQUANTIZE_STEPSHIFT 48
+#define DTRACE_LQUANTIZE_STEPMASK ((uint64_t)UINT16_MAX << 48)
+#define DTRACE_LQUANTIZE_LEVELSHIFT 32
+#define DTRACE_LQUANTIZE_LEVELMASK ((uint64_t)UINT16_MAX << 32)
+#define DTRACE_LQUANTIZE_BASESHIFT 0
+#define DTRACE_LQUANTIZE_BASEMASK UINT32_MAX
+#define DTRACE_LQUANTIZE_STEP(x) \
+  (uint16_t)(((x) & DTRACE_LQUANTIZE_STEPMASK) >> DTRACE_LQUANTIZE_STEPSHIFT)
+#define DTRACE_LQUANTIZE_LEVELS(x) \
+  (uint16_t)(((x) & DTRACE_LQUANTIZE_LEVELMASK) >> DTRACE_LQUANTIZE_LEVELSHIFT)
+#define DTRACE_LQUANTIZE_BASE(x) \
+  (int32_t)(((x) & DTRACE_LQUANTIZE_BASEMASK) >> DTRACE_LQUANTIZE_BASESHIFT)
+
+#define DTRACE_LLQUANTIZE_FACTORSHIFT 48
+#define DTRACE_LLQUANTIZE_FACTORMASK ((uint64_t)UINT16_MAX << 48)
+#define DTRACE_LLQUANTIZE_LOWSHIFT 32
+#define DTRACE_LLQUANTIZE_LOWMASK ((uint64_t)UINT16_MAX << 32)
+#define DTRACE_LLQUANTIZE_HIGHSHIFT 16
+#define DTRACE_LLQUANTIZE_HIGHMASK ((uint64_t)UINT16_MAX << 16)
+#define DTRACE_LLQUANTIZE_NSTEPSHIFT 0
+#define DTRACE_LLQUANTIZE_NSTEPMASK UINT16_MAX
+#define DTRACE_LLQUANTIZE_FACTOR(x) \
+  (uint16_t)(((x) & DTRACE_LLQUANTIZE_FACTORMASK) >> DTRACE_LLQUANTIZE_FACTORSHIFT)
+#define DTRACE_LLQUANTIZE_LOW(x) \
+  (uint16_t)(((x) & DTRACE_LLQUANTIZE_LOWMASK) >> DTRACE_LLQUANTIZE_LOWSHIFT)
+#define DTRACE_LLQUANTIZE_HIGH(x) \
+  (uint16_t)(((x) & DTRACE_LLQUANTIZE_HIGHMASK) >> DTRACE_LLQUANTIZE_HIGHSHIFT)
+#define DTRACE_LLQUANTIZE_NSTEP(x) \
+  (uint16_t)(((x) & DTRACE_LLQUANTIZE_NSTEPMASK) >> DTRACE_LLQUANTIZE_NSTEPSHIFT)
+
+#define DTRACE_USTACK_NFRAMES(x) (uint32_t)((x) & UINT32_MAX)
+#define DTRACE_USTACK_STRSIZE(x) (uint32_t)((x) >> 32)
+#define DTRACE_USTACK_ARG(x, y) \
+  ((((uint64_t)(y)) << 32) | ((x) & UINT32_MAX))
+
+typedef struct dtrace_recdesc {
+  dtrace_actkind_t dtrd_action;
+  uint32_t dtrd_size;
+  uint32_t dtrd_offset;
+  uint16_t dtrd_alignment;
+  uint16_t dtrd_format;
+  uint64_t dtrd_arg;
+  uint64_t dtrd_uarg;
+} dtrace_recdesc_t;
+
+typedef struct dtrace_eprobedesc {
+  dtrace_epid_t dtepd_epid;
+  dtrace_id_t dtepd_probeid;
+  uint64_t dtepd_uarg;
+  uint32_t dtepd_size;
+  int dtepd_nrecs;
+  dtrace_recdesc_t dtepd_rec[1];
+} dtrace_eprobedesc_t;
+
+typedef struct dtrace_aggdesc {
+  char *dtagd_name;
+  dtrace_aggvarid_t dtagd_varid;
+  int dtagd_flags;
+  dtrace_aggid_t dtagd_id;
+  dtrace_epid_t dtagd_epid;
+  uint32_t dtagd_size;
+  int dtagd_nrecs;
+  uint32_t dtagd_pad;
+  dtrace_recdesc_t dtagd_rec[1];
+} dtrace_aggdesc_t;
+
+typedef struct dtrace_probedesc {
+  dtrace_id_t dtpd_id;
+  char dtpd_provider[DTRACE_PROVNAMELEN];
+  char dtpd_mod[DTRACE_MODNAMELEN];
+  char dtpd_func[DTRACE_FUNCNAMELEN];
+  char dtpd_name[DTRACE_NAMELEN];
+} dtrace_probedesc_t;
+
+typedef enum {
+  DTRACEFLOW_ENTRY,
+  DTRACEFLOW_RETURN,
+  DTRACEFLOW_NONE
+} dtrace_flowkind_t;
+
+typedef struct dtrace_probedata {
+  dtrace_hdl_t *dtpda_handle;
+  dtrace_eprobedesc_t *dtpda_edesc;
+  dtrace_probedesc_t *dtpda_pdesc;
+  processorid_t dtpda_cpu;
+  caddr_t dtpda_data;
+  dtrace_flowkind_t dtpda_flow;
+  const char *dtpda_prefix;
+  int dtpda_indent;
+} dtrace_probedata_t;
+
+typedef struct dtrace_aggdata {
+  dtrace_hdl_t *dtada_handle;
+  dtrace_aggdesc_t *dtada_desc;
+  dtrace_eprobedesc_t *dtada_edesc;
+  dtrace_probedesc_t *dtada_pdesc;
+  caddr_t dtada_data;
+  uint64_t dtada_normal;
+  size_t dtada_size;
+  caddr_t dtada_delta;
+  caddr_t *dtada_percpu;
+  caddr_t *dtada_percpu_delta;
+  int64_t dtada_total;
+  uint16_t dtada_minbin;
+  uint16_t dtada_maxbin;
+  uint32_t dtada_flags;
+} dtrace_aggdata_t;
+
+typedef struct dtrace_bufdata {
+  dtrace_hdl_t *dtbda_handle;
+  const char *dtbda_buffered;
+  dtrace_probedata_t *dtbda_probe;
+  const dtrace_recdesc_t *dtbda_recdesc;
+  const dtrace_aggdata_t *dtbda_aggdata;
+  uint32_t dtbda_flags;
+} dtrace_bufdata_t;
+
+typedef enum {
+  DTRACEDROP_PRINCIPAL,
+  DTRACEDROP_AGGREGATION,
+  DTRACEDROP_DYNAMIC,
+  DTRACEDROP_DYNRINSE,
+  DTRACEDROP_DYNDIRTY,
+  DTRACEDROP_SPEC,
+  DTRACEDROP_SPECBUSY,
+  DTRACEDROP_SPECUNAVAIL,
+  DTRACEDROP_STKSTROVERFLOW,
+  DTRACEDROP_DBLERROR
+} dtrace_dropkind_t;
+
+typedef struct dtrace_dropdata {
+  dtrace_hdl_t *dtdda_handle;
+  processorid_t dtdda_cpu;
+  dtrace_dropkind_t dtdda_kind;
+  uint64_t dtdda_drops;
+  uint64_t dtdda_total;
+  const char *dtdda_msg;
+} dtrace_dropdata_t;
+
+typedef struct dtrace_errdata {
+  dtrace_hdl_t *dteda_handle;
+  dtrace_eprobedesc_t *dteda_edesc;
+  dtrace_probedesc_t *dteda_pdesc;
+  processorid_t dteda_cpu;
+  int dteda_action;
+  int dteda_offset;
+  int dteda_fault;
+  uint64_t dteda_addr;
+  const char *dteda_msg;
+} dtrace_errdata_t;
+
+typedef struct dtrace_proginfo {
+  uint32_t dpi_descattr;
+  uint32_t dpi_stmtattr;
+  uint_t dpi_aggregates;
+  uint_t dpi_recgens;
+  uint_t dpi_matches;
+  uint_t dpi_speculations;
+} dtrace_proginfo_t;
+
+#define DTRACE_CONSUME_ERROR -1
+#define DTRACE_CONSUME_THIS 0
+#define DTRACE_CONSUME_NEXT 1
+#define DTRACE_CONSUME_ABORT 2
+
+#define DTRACE_HANDLE_ABORT -1
+#define DTRACE_HANDLE_OK 0
+
+#define DTRACE_AGGWALK_ERROR -1
+#define DTRACE_AGGWALK_NEXT 0
+#define DTRACE_AGGWALK_ABORT 1
+#define DTRACE_AGGWALK_CLEAR 2
+#define DTRACE_AGGWALK_NORMALIZE 3
+#define DTRACE_AGGWALK_DENORMALIZE 4
+#define DTRACE_AGGWALK_REMOVE 5
+
+typedef enum {
+  DTRACE_WORKSTATUS_ERROR = -1,
+  DTRACE_WORKSTATUS_OKAY,
+  DTRACE_WORKSTATUS_DONE
+} dtrace_workstatus_t;
+
+#define DTRACE_STATUS_NONE 0
+#define DTRACE_STATUS_OKAY 1
+#define DTRACE_STATUS_EXITED 2
+#define DTRACE_STATUS_FILLED 3
+#define DTRACE_STATUS_STOPPED 4
+
+typedef int dtrace_consume_probe_f(const dtrace_probedata_t *, void *);
+typedef int dtrace_consume_rec_f(const dtrace_probedata_t *,
+    const dtrace_recdesc_t *, void *);
+typedef int dtrace_aggregate_f(const dtrace_aggdata_t *, void *);
+typedef int dtrace_handle_buffered_f(const dtrace_bufdata_t *, void *);
+typedef int dtrace_handle_drop_f(const dtrace_dropdata_t *, void *);
+typedef int dtrace_handle_err_f(const dtrace_errdata_t *, void *);
+
+extern const char _dtrace_version[];
+
+extern dtrace_hdl_t *dtrace_open(int, int, int *);
+extern void dtrace_close(dtrace_hdl_t *);
+extern int dtrace_errno(dtrace_hdl_t *);
+extern const char *dtrace_errmsg(dtrace_hdl_t *, int);
+
+extern int dtrace_setopt(dtrace_hdl_t *, const char *, const char *);
+extern int dtrace_getopt(dtrace_hdl_t *, const char *, dtrace_optval_t *);
+
+extern dtrace_prog_t *dtrace_program_strcompile(dtrace_hdl_t *,
+    const char *, dtrace_probespec_t, uint_t, int, char *const []);
+extern int dtrace_program_exec(dtrace_hdl_t *, dtrace_prog_t *,
+    dtrace_proginfo_t *);
+
+extern int dtrace_go(dtrace_hdl_t *);
+extern int dtrace_stop(dtrace_hdl_t *);
+extern void dtrace_sleep(dtrace_hdl_t *);
+extern int dtrace_status(dtrace_hdl_t *);
+extern dtrace_workstatus_t dtrace_work(dtrace_hdl_t *, FILE *,
+    dtrace_consume_probe_f *, dtrace_consume_rec_f *, void *);
+
+extern int dtrace_handle_buffered(dtrace_hdl_t *,
+    dtrace_handle_buffered_f *, void *);
+extern int dtrace_handle_drop(dtrace_hdl_t *, dtrace_handle_drop_f *, void *);
+extern int dtrace_handle_err(dtrace_hdl_t *, dtrace_handle_err_f *, void *);
+
+extern int dtrace_aggregate_snap(dtrace_hdl_t *);
+extern int dtrace_aggregate_walk(dtrace_hdl_t *, dtrace_aggregate_f *, void *);
+extern int dtrace_aggregate_walk_valsorted(dtrace_hdl_t *,
+    dtrace_aggregate_f *, void *);
+extern int dtrace_aggregate_walk_valrevsorted(dtrace_hdl_t *,
+    dtrace_aggregate_f *, void *);
+extern void dtrace_aggregate_clear(dtrace_hdl_t *);
+
+typedef struct dtrace_stmtdesc {
+  void *dtsd_ecbdesc;
+  void *dtsd_action;
+  void *dtsd_action_last;
+  void *dtsd_aggdata;
+  void *dtsd_fmtdata;
+  void *dtsd_strdata;
+  void *dtsd_callback;
+  void *dtsd_data;
+} dtrace_stmtdesc_t;
+
+extern size_t dtrace_printf_format(dtrace_hdl_t *, void *, char *, size_t);
+extern int dtrace_addr2str(dtrace_hdl_t *, uint64_t, char *, int);
+extern int dtrace_uaddr2str(dtrace_hdl_t *, pid_t, uint64_t, char *, int);
+
+#endif /* _DTRACE_H */
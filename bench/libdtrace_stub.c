@@ -0,0 +1,1185 @@
+/*
+ * Stand-in libdtrace that synthesizes trace data instead of talking to the
+ * kernel.  It implements the subset of the consumer interface used by
+ * pydtrace, with the same callback protocol as the real dt_consume.c and
+ * dt_aggregate.c, so that the binding's hot paths can be exercised on any
+ * host and without privileges.
+ *
+ * The shape and rate of the generated data are controlled through the
+ * environment; firings that don't fit in the principal buffer (bufsize) are
+ * dropped and reported as drops:
+ *
+ *   PYDTRACE_STUB_RECORDS  probe firings per dtrace_work() pass  (10000)
+ *   PYDTRACE_STUB_RATE     probe firings per second, in place of a fixed
+ *                          number per pass                        (0)
+ *   PYDTRACE_STUB_PROBES   distinct plain probes (epids)          (16)
+ *   PYDTRACE_STUB_PRINTF   percent of firings that are printf()s  (10)
+ *   PYDTRACE_STUB_STACKS   percent of firings that trace stacks   (0)
+ *   PYDTRACE_STUB_STACKAGG adds an aggregation keyed by stack()   (0)
+ *   PYDTRACE_STUB_NOSTACK  leave stack records out of profile probes (0)
+ *   PYDTRACE_STUB_AGGPASSES only update aggregations on the first N snaps (0)
+ *   PYDTRACE_STUB_KEYS     keys per aggregation variable          (1000)
+ *   PYDTRACE_STUB_ACTIVE   percent of keys touched per snapshot   (100)
+ *   PYDTRACE_STUB_DROPS    principal drops reported per pass      (0)
+ *   PYDTRACE_STUB_ERRORS   ERROR probe firings reported per pass  (0)
+ *   PYDTRACE_STUB_PASSES   passes before exit() fires, 0 = never  (0)
+ *   PYDTRACE_STUB_SEED     random seed                            (1)
+ *   PYDTRACE_STUB_NOHANDLERS refuse drop and error handlers       (0)
+ */
+#include <errno.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "dtrace.h"
+
+const char _dtrace_version[] = "Sun D 1.6.2 (pydtrace stub)";
+
+#define STUB_STRSIZE 32
+#define STUB_NFRAMES 8
+#define STUB_NVARS 6
+#define STUB_NPCS 64
+
+enum {
+  STUB_PLAIN,
+  STUB_PRINTF,
+  STUB_STACK
+};
+
+typedef struct stub_probe {
+  int sp_kind;
+  dtrace_probedesc_t sp_pdesc;
+  dtrace_eprobedesc_t *sp_edesc;
+} stub_probe_t;
+
+typedef struct stub_agg {
+  dtrace_aggdesc_t *sa_desc;
+  dtrace_aggdata_t *sa_data;    /* one per key */
+  char *sa_present;             /* key has data since last removal */
+  int sa_nbuckets;
+} stub_agg_t;
+
+enum {
+  STUB_OPT_SIZE,
+  STUB_OPT_RATE,
+  STUB_OPT_BOOL
+};
+
+typedef struct stub_opt {
+  const char *so_name;
+  dtrace_optval_t so_val;
+  int so_kind;
+  int so_dynamic;               /* may be set once tracing */
+} stub_opt_t;
+
+struct dtrace_hdl {
+  int dt_errno;
+  int dt_compiled;
+  int dt_active;
+  int dt_stopped;
+  int dt_exited;
+  uint64_t dt_passes;
+  uint64_t dt_snaps;
+  unsigned int dt_seed;
+
+  long dt_records;
+  long dt_rate;
+  struct timespec dt_lastwork;
+  int dt_nprobes;
+  int dt_printf;
+  int dt_stacks;
+  int dt_nkeys;
+  int dt_active_keys;
+  long dt_aggpasses;
+  long dt_drops;
+  uint64_t dt_totaldrops;
+  long dt_errors;
+  long dt_maxpasses;
+  int dt_nohandlers;
+
+  stub_probe_t *dt_probes;      /* indexed by epid - 1 */
+  stub_agg_t dt_aggs[STUB_NVARS];
+  int dt_nvars;
+
+  char *dt_buf;
+  size_t dt_bufsize;
+
+  dtrace_handle_buffered_f *dt_bufhdlr;
+  void *dt_bufarg;
+  dtrace_handle_drop_f *dt_drophdlr;
+  void *dt_droparg;
+  dtrace_handle_err_f *dt_errhdlr;
+  void *dt_errarg;
+
+  stub_opt_t dt_options[8];
+};
+
+struct dtrace_prog {
+  int dp_unused;
+};
+
+static struct dtrace_prog stub_prog;
+
+/*
+ * The formats of the printf()s, by dtrd_format.  The printf probe's clause
+ * is printf("%6d bytes to %s", ...); printf(" via %s", ...); trace(...), so
+ * each printf() owns only some of the records that follow it.
+ */
+static char *stub_formats[] = { NULL, "%6d bytes to %s", " via %s" };
+
+
+static const char *stub_execnames[] = {
+  "sshd", "java", "postgres", "nginx", "python2.7", "sched", "fsflush", "zpool-rpool"
+};
+
+static long
+stub_env(const char *name, long dflt) {
+  const char *val = getenv(name);
+
+  return (val != NULL && *val != '\0' ? strtol(val, NULL, 0) : dflt);
+}
+
+static int
+stub_set_errno(dtrace_hdl_t *dtp, int err) {
+  dtp->dt_errno = err;
+  return (-1);
+}
+
+static unsigned int
+stub_rand(dtrace_hdl_t *dtp) {
+  dtp->dt_seed = dtp->dt_seed * 1103515245 + 12345;
+  return ((dtp->dt_seed >> 16) & 0x7fff);
+}
+
+static uint64_t
+stub_pc(dtrace_hdl_t *dtp, int user) {
+  return ((user ? 0x8050000ULL : 0xfffffffffb800000ULL) +
+      (stub_rand(dtp) % STUB_NPCS) * 0x40 + (stub_rand(dtp) % 4) * 4);
+}
+
+//////////////////////////////////////////////////////////
+//////////////////////////////////////////// Descriptions
+//////////////////////////////////////////////////////////
+
+static dtrace_eprobedesc_t *
+stub_edesc(dtrace_epid_t epid, int nrecs) {
+  dtrace_eprobedesc_t *epd = calloc(1, sizeof (dtrace_eprobedesc_t) +
+      nrecs * sizeof (dtrace_recdesc_t));
+
+  epd->dtepd_epid = epid;
+  epd->dtepd_probeid = epid + 1000;
+  epd->dtepd_nrecs = nrecs;
+  return (epd);
+}
+
+static uint32_t
+stub_rec(dtrace_recdesc_t *rec, dtrace_actkind_t action, uint32_t offset,
+    uint32_t size, uint16_t align) {
+  offset = (offset + align - 1) & ~(uint32_t)(align - 1);
+
+  rec->dtrd_action = action;
+  rec->dtrd_offset = offset;
+  rec->dtrd_size = size;
+  rec->dtrd_alignment = align;
+
+  return (offset + size);
+}
+
+static void
+stub_probes(dtrace_hdl_t *dtp) {
+  int i, n = dtp->dt_nprobes + 2;
+
+  dtp->dt_probes = calloc(n, sizeof (stub_probe_t));
+
+  for (i = 0; i < n; i++) {
+    stub_probe_t *sp = &dtp->dt_probes[i];
+    dtrace_probedesc_t *pd = &sp->sp_pdesc;
+    dtrace_eprobedesc_t *epd;
+    uint32_t off = 16;
+
+    sp->sp_kind = i < dtp->dt_nprobes ? STUB_PLAIN :
+        i == dtp->dt_nprobes ? STUB_PRINTF : STUB_STACK;
+    pd->dtpd_id = i + 1001;
+
+    switch (sp->sp_kind) {
+    case STUB_PLAIN:
+      (void) strcpy(pd->dtpd_provider, "syscall");
+      (void) strcpy(pd->dtpd_mod, "");
+      (void) snprintf(pd->dtpd_func, sizeof (pd->dtpd_func), "call%d", i);
+      (void) strcpy(pd->dtpd_name, i % 2 ? "return" : "entry");
+
+      epd = stub_edesc(i + 1, 3);
+      off = stub_rec(&epd->dtepd_rec[0], DTRACEACT_DIFEXPR, off, 8, 8);
+      off = stub_rec(&epd->dtepd_rec[1], DTRACEACT_DIFEXPR, off, STUB_STRSIZE, 1);
+      off = stub_rec(&epd->dtepd_rec[2], DTRACEACT_DIFEXPR, off, 4, 4);
+      break;
+
+    case STUB_PRINTF:
+      (void) strcpy(pd->dtpd_provider, "ip");
+      (void) strcpy(pd->dtpd_mod, "ip");
+      (void) strcpy(pd->dtpd_func, "ip_output");
+      (void) strcpy(pd->dtpd_name, "send");
+
+      epd = stub_edesc(i + 1, 6);
+      off = stub_rec(&epd->dtepd_rec[0], DTRACEACT_PRINTF, off, 0, 1);
+      epd->dtepd_rec[0].dtrd_format = 1;
+      off = stub_rec(&epd->dtepd_rec[1], DTRACEACT_DIFEXPR, off, 8, 8);
+      off = stub_rec(&epd->dtepd_rec[2], DTRACEACT_DIFEXPR, off, STUB_STRSIZE, 1);
+      off = stub_rec(&epd->dtepd_rec[3], DTRACEACT_PRINTF, off, 0, 1);
+      epd->dtepd_rec[3].dtrd_format = 2;
+      off = stub_rec(&epd->dtepd_rec[4], DTRACEACT_DIFEXPR, off, STUB_STRSIZE, 1);
+      off = stub_rec(&epd->dtepd_rec[5], DTRACEACT_DIFEXPR, off, 4, 4);
+      break;
+
+    default:
+      (void) strcpy(pd->dtpd_provider, "profile");
+      (void) strcpy(pd->dtpd_mod, "");
+      (void) strcpy(pd->dtpd_func, "");
+      (void) strcpy(pd->dtpd_name, "profile-99");
+
+      if (stub_env("PYDTRACE_STUB_NOSTACK", 0)) {
+        epd = stub_edesc(i + 1, 2);
+        off = stub_rec(&epd->dtepd_rec[0], DTRACEACT_SYM, off, 8, 8);
+        off = stub_rec(&epd->dtepd_rec[1], DTRACEACT_USYM, off, 16, 8);
+        break;
+      }
+
+      epd = stub_edesc(i + 1, 4);
+      off = stub_rec(&epd->dtepd_rec[0], DTRACEACT_SYM, off, 8, 8);
+      off = stub_rec(&epd->dtepd_rec[1], DTRACEACT_USYM, off, 16, 8);
+      off = stub_rec(&epd->dtepd_rec[2], DTRACEACT_STACK, off,
+          STUB_NFRAMES * 8, 8);
+      epd->dtepd_rec[2].dtrd_arg = STUB_NFRAMES;
+      off = stub_rec(&epd->dtepd_rec[3], DTRACEACT_USTACK, off,
+          (STUB_NFRAMES + 1) * 8, 8);
+      epd->dtepd_rec[3].dtrd_arg = DTRACE_USTACK_ARG(STUB_NFRAMES, 0);
+      break;
+    }
+
+    epd->dtepd_size = (off + 7) & ~7;
+    sp->sp_edesc = epd;
+  }
+}
+
+static int
+stub_llquantize_nbuckets(uint64_t arg) {
+  uint16_t factor = DTRACE_LLQUANTIZE_FACTOR(arg);
+  uint16_t low = DTRACE_LLQUANTIZE_LOW(arg);
+  uint16_t high = DTRACE_LLQUANTIZE_HIGH(arg);
+  uint16_t nsteps = DTRACE_LLQUANTIZE_NSTEP(arg);
+  int64_t value = 1, next, step;
+  int order, nbuckets = 2;
+
+  for (order = 0; order < low; order++)
+    value *= factor;
+
+  next = value * factor;
+  step = next > nsteps ? next / nsteps : 1;
+
+  while (order <= high) {
+    nbuckets++;
+
+    if ((value += step) != next)
+      continue;
+
+    next = value * factor;
+    step = next > nsteps ? next / nsteps : 1;
+    order++;
+  }
+
+  return (nbuckets);
+}
+
+static void
+stub_aggs(dtrace_hdl_t *dtp) {
+  static const struct {
+    const char *name;
+    dtrace_actkind_t action;
+    uint64_t arg;
+  } vars[STUB_NVARS] = {
+    { "counts", DTRACEAGG_COUNT, 0 },
+    { "latency", DTRACEAGG_QUANTIZE, 0 },
+    { "linear", DTRACEAGG_LQUANTIZE,
+      ((uint64_t)10 << DTRACE_LQUANTIZE_STEPSHIFT) |
+      ((uint64_t)10 << DTRACE_LQUANTIZE_LEVELSHIFT) },
+    { "loglinear", DTRACEAGG_LLQUANTIZE,
+      ((uint64_t)10 << DTRACE_LLQUANTIZE_FACTORSHIFT) |
+      ((uint64_t)0 << DTRACE_LLQUANTIZE_LOWSHIFT) |
+      ((uint64_t)6 << DTRACE_LLQUANTIZE_HIGHSHIFT) | 20 },
+    { "average", DTRACEAGG_AVG, 0 },
+    { "stacks", DTRACEAGG_COUNT, 0 },
+  };
+  int v, k;
+
+  for (v = 0; v < dtp->dt_nvars; v++) {
+    stub_agg_t *sa = &dtp->dt_aggs[v];
+    dtrace_aggdesc_t *agd;
+    uint32_t off = 0, size;
+
+    switch (vars[v].action) {
+    case DTRACEAGG_QUANTIZE:
+      sa->sa_nbuckets = DTRACE_QUANTIZE_NBUCKETS;
+      size = sa->sa_nbuckets * 8;
+      break;
+    case DTRACEAGG_LQUANTIZE:
+      sa->sa_nbuckets = DTRACE_LQUANTIZE_LEVELS(vars[v].arg) + 2;
+      size = (sa->sa_nbuckets + 1) * 8;
+      break;
+    case DTRACEAGG_LLQUANTIZE:
+      sa->sa_nbuckets = stub_llquantize_nbuckets(vars[v].arg);
+      size = (sa->sa_nbuckets + 1) * 8;
+      break;
+    case DTRACEAGG_AVG:
+      size = 16;
+      break;
+    default:
+      size = 8;
+    }
+
+    agd = calloc(1, sizeof (dtrace_aggdesc_t) + 3 * sizeof (dtrace_recdesc_t));
+    agd->dtagd_name = strdup(vars[v].name);
+    agd->dtagd_varid = v + 1;
+    agd->dtagd_id = v + 1;
+    agd->dtagd_epid = dtp->dt_nprobes + 3 + v;
+    agd->dtagd_nrecs = 4;
+
+    off = stub_rec(&agd->dtagd_rec[0], DTRACEACT_DIFEXPR, off, 8, 8);
+    off = stub_rec(&agd->dtagd_rec[1], DTRACEACT_DIFEXPR, off, STUB_STRSIZE, 1);
+    if (v == 5) {
+      off = stub_rec(&agd->dtagd_rec[2], DTRACEACT_STACK, off, STUB_NFRAMES * 8, 8);
+      agd->dtagd_rec[2].dtrd_arg = STUB_NFRAMES;
+    } else {
+      off = stub_rec(&agd->dtagd_rec[2], DTRACEACT_DIFEXPR, off, 8, 8);
+    }
+    off = stub_rec(&agd->dtagd_rec[3], vars[v].action, off, size, 8);
+    agd->dtagd_rec[3].dtrd_arg = vars[v].arg;
+    agd->dtagd_size = off;
+    sa->sa_desc = agd;
+
+    sa->sa_data = calloc(dtp->dt_nkeys, sizeof (dtrace_aggdata_t));
+    sa->sa_present = calloc(dtp->dt_nkeys, 1);
+
+    for (k = 0; k < dtp->dt_nkeys; k++) {
+      dtrace_aggdata_t *agg = &sa->sa_data[k];
+      caddr_t data = calloc(1, agd->dtagd_size);
+
+      *(uint64_t *)(data + agd->dtagd_rec[0].dtrd_offset) = agd->dtagd_id;
+      (void) snprintf(data + agd->dtagd_rec[1].dtrd_offset, STUB_STRSIZE,
+          "%s", stub_execnames[k % 8]);
+      if (v == 5) {
+        int i, depth = 3 + k % (STUB_NFRAMES - 2);
+
+        for (i = 0; i < depth; i++)
+          ((uint64_t *)(data + agd->dtagd_rec[2].dtrd_offset))[i] =
+              0xfffffffffb800000ULL + ((k * 7 + i * 13) % STUB_NPCS) * 0x40 +
+              (k % 4) * 4;
+      } else {
+        *(int64_t *)(data + agd->dtagd_rec[2].dtrd_offset) = 100 + k;
+      }
+
+      if (vars[v].action == DTRACEAGG_LQUANTIZE ||
+          vars[v].action == DTRACEAGG_LLQUANTIZE)
+        *(uint64_t *)(data + agd->dtagd_rec[3].dtrd_offset) = vars[v].arg;
+
+      agg->dtada_handle = dtp;
+      agg->dtada_desc = agd;
+      agg->dtada_data = data;
+      agg->dtada_size = agd->dtagd_size;
+      agg->dtada_normal = 1;
+    }
+  }
+}
+
+//////////////////////////////////////////////////////////
+////////////////////////////////////////////// Options
+//////////////////////////////////////////////////////////
+
+static stub_opt_t *
+stub_option(dtrace_hdl_t *dtp, const char *name) {
+  int i;
+
+  for (i = 0; dtp->dt_options[i].so_name != NULL; i++) {
+    if (strcmp(dtp->dt_options[i].so_name, name) == 0)
+      return (&dtp->dt_options[i]);
+  }
+
+  return (NULL);
+}
+
+/*
+ * Boolean options are set by a NULL or affirmative argument and unset by a
+ * negative one, as in dt_opt_runtime().
+ */
+static int
+stub_parse_bool(const char *arg, dtrace_optval_t *valp) {
+  static const char *yes[] = { "yes", "enable", "true", "on", "set", NULL };
+  static const char *no[] = { "no", "disable", "false", "off", "unset", NULL };
+  int i;
+
+  if (arg == NULL) {
+    *valp = 0;
+    return (0);
+  }
+
+  for (i = 0; yes[i] != NULL; i++) {
+    if (strcasecmp(arg, yes[i]) == 0) {
+      *valp = 1;
+      return (0);
+    }
+
+    if (strcasecmp(arg, no[i]) == 0) {
+      *valp = DTRACEOPT_UNSET;
+      return (0);
+    }
+  }
+
+  return (-1);
+}
+
+static int
+stub_parse(const char *arg, int rate, dtrace_optval_t *valp) {
+  static const struct {
+    const char *name;
+    int64_t mul;
+  } sizes[] = {
+    { "", 1 }, { "k", 1LL << 10 }, { "m", 1LL << 20 }, { "g", 1LL << 30 },
+    { NULL, 0 }
+  }, rates[] = {
+    { "ns", 1 }, { "nsec", 1 }, { "us", 1000 }, { "usec", 1000 },
+    { "ms", 1000000 }, { "msec", 1000000 }, { "s", 1000000000 },
+    { "sec", 1000000000 }, { "hz", 0 }, { "", 0 }, { NULL, 0 }
+  };
+  char *end;
+  int64_t val;
+  int i;
+
+  if (arg == NULL)
+    return (-1);
+
+  errno = 0;
+  val = strtoll(arg, &end, 0);
+
+  if (errno != 0 || end == arg || val < 0)
+    return (-1);
+
+  for (i = 0; (rate ? rates : sizes)[i].name != NULL; i++) {
+    int64_t mul = (rate ? rates : sizes)[i].mul;
+
+    if (strcasecmp((rate ? rates : sizes)[i].name, end) != 0)
+      continue;
+
+    *valp = mul != 0 ? val * mul : val != 0 ? 1000000000LL / val : 0;
+    return (0);
+  }
+
+  return (-1);
+}
+
+int
+dtrace_setopt(dtrace_hdl_t *dtp, const char *name, const char *arg) {
+  stub_opt_t *opt;
+
+  if (name == NULL || (opt = stub_option(dtp, name)) == NULL)
+    return (stub_set_errno(dtp, EINVAL));
+
+  if (dtp->dt_active && !opt->so_dynamic)
+    return (stub_set_errno(dtp, EBUSY));
+
+  if ((opt->so_kind == STUB_OPT_BOOL ? stub_parse_bool(arg, &opt->so_val) :
+      stub_parse(arg, opt->so_kind == STUB_OPT_RATE, &opt->so_val)) != 0)
+    return (stub_set_errno(dtp, EINVAL));
+
+  return (0);
+}
+
+int
+dtrace_getopt(dtrace_hdl_t *dtp, const char *name, dtrace_optval_t *val) {
+  stub_opt_t *opt;
+
+  if (name == NULL || (opt = stub_option(dtp, name)) == NULL)
+    return (stub_set_errno(dtp, EINVAL));
+
+  *val = opt->so_val;
+  return (0);
+}
+
+//////////////////////////////////////////////////////////
+////////////////////////////////////////////// Handles
+//////////////////////////////////////////////////////////
+
+dtrace_hdl_t *
+dtrace_open(int version, int flags, int *errp) {
+  dtrace_hdl_t *dtp;
+  static const stub_opt_t options[] = {
+    { "bufsize", 4 << 20, STUB_OPT_SIZE, 0 },
+    { "aggsize", 4 << 20, STUB_OPT_SIZE, 0 },
+    { "switchrate", 1000000000, STUB_OPT_RATE, 1 },
+    { "aggrate", 1000000000, STUB_OPT_RATE, 0 },
+    { "statusrate", 1000000000, STUB_OPT_RATE, 0 },
+    { "strsize", 256, STUB_OPT_SIZE, 0 },
+    { "quiet", DTRACEOPT_UNSET, STUB_OPT_BOOL, 1 },
+    { NULL, 0, 0, 0 }
+  };
+
+  if (version != DTRACE_VERSION) {
+    *errp = EINVAL;
+    return (NULL);
+  }
+
+  if ((dtp = calloc(1, sizeof (dtrace_hdl_t))) == NULL) {
+    *errp = ENOMEM;
+    return (NULL);
+  }
+
+  (void) memcpy(dtp->dt_options, options, sizeof (options));
+
+  dtp->dt_records = stub_env("PYDTRACE_STUB_RECORDS", 10000);
+  dtp->dt_rate = stub_env("PYDTRACE_STUB_RATE", 0);
+  dtp->dt_nprobes = stub_env("PYDTRACE_STUB_PROBES", 16);
+  dtp->dt_printf = stub_env("PYDTRACE_STUB_PRINTF", 10);
+  dtp->dt_stacks = stub_env("PYDTRACE_STUB_STACKS", 0);
+  dtp->dt_nkeys = stub_env("PYDTRACE_STUB_KEYS", 1000);
+  dtp->dt_active_keys = stub_env("PYDTRACE_STUB_ACTIVE", 100);
+  dtp->dt_drops = stub_env("PYDTRACE_STUB_DROPS", 0);
+  dtp->dt_errors = stub_env("PYDTRACE_STUB_ERRORS", 0);
+  dtp->dt_maxpasses = stub_env("PYDTRACE_STUB_PASSES", 0);
+  dtp->dt_aggpasses = stub_env("PYDTRACE_STUB_AGGPASSES", 0);
+  dtp->dt_seed = stub_env("PYDTRACE_STUB_SEED", 1);
+  dtp->dt_nohandlers = stub_env("PYDTRACE_STUB_NOHANDLERS", 0);
+  dtp->dt_nvars = stub_env("PYDTRACE_STUB_STACKAGG", 0) ? STUB_NVARS : STUB_NVARS - 1;
+
+  if (dtp->dt_nprobes < 1)
+    dtp->dt_nprobes = 1;
+  if (dtp->dt_nkeys < 1)
+    dtp->dt_nkeys = 1;
+
+  stub_probes(dtp);
+  stub_aggs(dtp);
+
+  return (dtp);
+}
+
+void
+dtrace_close(dtrace_hdl_t *dtp) {
+  int i, k;
+
+  for (i = 0; i < dtp->dt_nprobes + 2; i++)
+    free(dtp->dt_probes[i].sp_edesc);
+
+  for (i = 0; i < dtp->dt_nvars; i++) {
+    for (k = 0; k < dtp->dt_nkeys; k++)
+      free(dtp->dt_aggs[i].sa_data[k].dtada_data);
+
+    free(dtp->dt_aggs[i].sa_data);
+    free(dtp->dt_aggs[i].sa_present);
+    free(dtp->dt_aggs[i].sa_desc->dtagd_name);
+    free(dtp->dt_aggs[i].sa_desc);
+  }
+
+  free(dtp->dt_probes);
+  free(dtp->dt_buf);
+  free(dtp);
+}
+
+int
+dtrace_errno(dtrace_hdl_t *dtp) {
+  return (dtp->dt_errno);
+}
+
+const char *
+dtrace_errmsg(dtrace_hdl_t *dtp, int err) {
+  return (strerror(err));
+}
+
+dtrace_prog_t *
+dtrace_program_strcompile(dtrace_hdl_t *dtp, const char *s,
+    dtrace_probespec_t spec, uint_t cflags, int argc, char *const argv[]) {
+  if (dtp->dt_active) {
+    (void) stub_set_errno(dtp, EBUSY);
+    return (NULL);
+  }
+
+  return (&stub_prog);
+}
+
+int
+dtrace_program_exec(dtrace_hdl_t *dtp, dtrace_prog_t *pgp,
+    dtrace_proginfo_t *pip) {
+  (void) memset(pip, 0, sizeof (dtrace_proginfo_t));
+  pip->dpi_aggregates = dtp->dt_nvars;
+  pip->dpi_matches = dtp->dt_nprobes + 2;
+  dtp->dt_compiled = 1;
+
+  return (0);
+}
+
+int
+dtrace_go(dtrace_hdl_t *dtp) {
+  dtrace_optval_t bufsize;
+
+  if (dtp->dt_active)
+    return (stub_set_errno(dtp, EINVAL));
+
+  (void) dtrace_getopt(dtp, "bufsize", &bufsize);
+
+  if ((dtp->dt_buf = malloc(bufsize > 0 ? bufsize : 1)) == NULL)
+    return (stub_set_errno(dtp, ENOMEM));
+
+  dtp->dt_active = 1;
+  dtp->dt_bufsize = bufsize > 0 ? bufsize : 0;
+  (void) clock_gettime(CLOCK_MONOTONIC, &dtp->dt_lastwork);
+
+  return (0);
+}
+
+int
+dtrace_stop(dtrace_hdl_t *dtp) {
+  if (dtp->dt_stopped)
+    return (0);
+
+  dtp->dt_stopped = 1;
+  return (0);
+}
+
+void
+dtrace_sleep(dtrace_hdl_t *dtp) {
+  dtrace_optval_t rate, aggrate;
+  struct timespec ts;
+
+  /*
+   * libdtrace sleeps until the earliest of its switchrate, aggrate and
+   * statusrate deadlines; the shorter of the first two is close enough.
+   */
+  (void) dtrace_getopt(dtp, "switchrate", &rate);
+  (void) dtrace_getopt(dtp, "aggrate", &aggrate);
+
+  if (aggrate > 0 && aggrate < rate)
+    rate = aggrate;
+
+  ts.tv_sec = rate / 1000000000;
+  ts.tv_nsec = rate % 1000000000;
+  (void) nanosleep(&ts, NULL);
+}
+
+int
+dtrace_status(dtrace_hdl_t *dtp) {
+  if (!dtp->dt_active)
+    return (DTRACE_STATUS_NONE);
+
+  if (dtp->dt_maxpasses > 0 && dtp->dt_passes >= (uint64_t)dtp->dt_maxpasses)
+    dtp->dt_exited = 1;
+
+  if (dtp->dt_stopped)
+    return (DTRACE_STATUS_STOPPED);
+
+  return (dtp->dt_exited ? DTRACE_STATUS_EXITED : DTRACE_STATUS_OKAY);
+}
+
+int
+dtrace_handle_buffered(dtrace_hdl_t *dtp, dtrace_handle_buffered_f *hdlr,
+    void *arg) {
+  dtp->dt_bufhdlr = hdlr;
+  dtp->dt_bufarg = arg;
+  return (0);
+}
+
+int
+dtrace_handle_drop(dtrace_hdl_t *dtp, dtrace_handle_drop_f *hdlr, void *arg) {
+  if (dtp->dt_nohandlers)
+    return (stub_set_errno(dtp, ENOTSUP));
+
+  dtp->dt_drophdlr = hdlr;
+  dtp->dt_droparg = arg;
+  return (0);
+}
+
+int
+dtrace_handle_err(dtrace_hdl_t *dtp, dtrace_handle_err_f *hdlr, void *arg) {
+  if (dtp->dt_nohandlers)
+    return (stub_set_errno(dtp, ENOTSUP));
+
+  dtp->dt_errhdlr = hdlr;
+  dtp->dt_errarg = arg;
+  return (0);
+}
+
+//////////////////////////////////////////////////////////
+//////////////////////////////////////////////// Symbols
+//////////////////////////////////////////////////////////
+
+void *
+dt_format_lookup(dtrace_hdl_t *dtp, int format) {
+  if (format <= 0 || format >= (int)(sizeof (stub_formats) / sizeof (stub_formats[0])))
+    return (NULL);
+
+  return (stub_formats[format]);
+}
+
+size_t
+dtrace_printf_format(dtrace_hdl_t *dtp, void *fmtdata, char *s, size_t len) {
+  return (snprintf(s, len, "%s", (char *)fmtdata) + 1);
+}
+
+int
+dtrace_addr2str(dtrace_hdl_t *dtp, uint64_t addr, char *str, int nbytes) {
+  return (snprintf(str, nbytes, "genunix`kfunc_%llx+0x%llx",
+      (unsigned long long)((addr >> 6) & 0xfff),
+      (unsigned long long)(addr & 0x3f)));
+}
+
+int
+dtrace_uaddr2str(dtrace_hdl_t *dtp, pid_t pid, uint64_t addr, char *str,
+    int nbytes) {
+  return (snprintf(str, nbytes, "libc.so.1`ufunc_%llx+0x%llx",
+      (unsigned long long)((addr >> 6) & 0xfff),
+      (unsigned long long)(addr & 0x3f)));
+}
+
+//////////////////////////////////////////////////////////
+////////////////////////////////////////////// Consumption
+//////////////////////////////////////////////////////////
+
+static void
+stub_fill(dtrace_hdl_t *dtp, stub_probe_t *sp, caddr_t buf, long n) {
+  dtrace_eprobedesc_t *epd = sp->sp_edesc;
+  dtrace_recdesc_t *rec = epd->dtepd_rec;
+  int i;
+
+  (void) memset(buf, 0, epd->dtepd_size);
+  *(dtrace_epid_t *)buf = epd->dtepd_epid;
+  *(uint64_t *)(buf + 8) = dtp->dt_passes * 1000000 + n;
+
+  switch (sp->sp_kind) {
+  case STUB_PLAIN:
+    *(int64_t *)(buf + rec[0].dtrd_offset) = 100 + n % dtp->dt_nkeys;
+    (void) snprintf(buf + rec[1].dtrd_offset, STUB_STRSIZE, "%s",
+        stub_execnames[n % 8]);
+    *(int32_t *)(buf + rec[2].dtrd_offset) = (int32_t)(n & 0xffff);
+    break;
+
+  case STUB_PRINTF:
+    *(int64_t *)(buf + rec[1].dtrd_offset) = 1500 - n % 1400;
+    (void) snprintf(buf + rec[2].dtrd_offset, STUB_STRSIZE, "10.0.0.%ld",
+        n % 254 + 1);
+    (void) snprintf(buf + rec[4].dtrd_offset, STUB_STRSIZE, "net%ld", n % 4);
+    *(int32_t *)(buf + rec[5].dtrd_offset) = (int32_t)(n & 0xffff);
+    break;
+
+  default:
+    *(uint64_t *)(buf + rec[0].dtrd_offset) = stub_pc(dtp, 0);
+    *(uint64_t *)(buf + rec[1].dtrd_offset) = 100 + n % dtp->dt_nkeys;
+    *(uint64_t *)(buf + rec[1].dtrd_offset + 8) = stub_pc(dtp, 1);
+
+    if (epd->dtepd_nrecs < 4)
+      break;
+
+    for (i = 0; i < STUB_NFRAMES - (int)(n % 3); i++) {
+      ((uint64_t *)(buf + rec[2].dtrd_offset))[i] = stub_pc(dtp, 0);
+      ((uint64_t *)(buf + rec[3].dtrd_offset))[i + 1] = stub_pc(dtp, 1);
+    }
+
+    ((uint64_t *)(buf + rec[3].dtrd_offset))[0] = 100 + n % dtp->dt_nkeys;
+  }
+}
+
+/*
+ * Formats a printf() from the records that follow it, and sets *nargs to
+ * how many of them it took.
+ */
+static int
+stub_printf(dtrace_hdl_t *dtp, dtrace_probedata_t *data,
+    const dtrace_recdesc_t *rec, caddr_t base, int *nargs) {
+  dtrace_bufdata_t bufdata;
+  char out[128];
+
+  if (rec->dtrd_format == 1) {
+    (void) snprintf(out, sizeof (out), "%6lld bytes to %s",
+        (long long)*(int64_t *)(base + rec[1].dtrd_offset),
+        base + rec[2].dtrd_offset);
+    *nargs = 2;
+  } else {
+    (void) snprintf(out, sizeof (out), " via %s",
+        base + rec[1].dtrd_offset);
+    *nargs = 1;
+  }
+
+  if (dtp->dt_bufhdlr == NULL)
+    return (0);
+
+  bufdata.dtbda_handle = dtp;
+  bufdata.dtbda_buffered = out;
+  bufdata.dtbda_probe = data;
+  bufdata.dtbda_recdesc = rec;
+  bufdata.dtbda_aggdata = NULL;
+  bufdata.dtbda_flags = 0;
+
+  return ((*dtp->dt_bufhdlr)(&bufdata, dtp->dt_bufarg));
+}
+
+/*
+ * The number of firings since the last pass: either a fixed number, or as
+ * many as PYDTRACE_STUB_RATE makes for the time that has passed.
+ */
+static long
+stub_firings(dtrace_hdl_t *dtp) {
+  struct timespec now;
+  double elapsed;
+
+  if (dtp->dt_rate <= 0)
+    return (dtp->dt_records);
+
+  (void) clock_gettime(CLOCK_MONOTONIC, &now);
+  elapsed = (now.tv_sec - dtp->dt_lastwork.tv_sec) +
+      (now.tv_nsec - dtp->dt_lastwork.tv_nsec) / 1e9;
+  dtp->dt_lastwork = now;
+
+  return ((long)(dtp->dt_rate * elapsed));
+}
+
+dtrace_workstatus_t
+dtrace_work(dtrace_hdl_t *dtp, FILE *fp, dtrace_consume_probe_f *pfunc,
+    dtrace_consume_rec_f *rfunc, void *arg) {
+  long n, nfired, nfilled, drops, offs = 0;
+  int status;
+
+  if (!dtp->dt_active) {
+    (void) stub_set_errno(dtp, EINVAL);
+    return (DTRACE_WORKSTATUS_ERROR);
+  }
+
+  if ((status = dtrace_status(dtp)) == DTRACE_STATUS_EXITED ||
+      status == DTRACE_STATUS_STOPPED)
+    return (DTRACE_WORKSTATUS_DONE);
+
+  dtp->dt_passes++;
+
+  /*
+   * Lay the whole pass out in the buffer first, as the kernel would have,
+   * dropping what doesn't fit, and then walk it record by record the way
+   * dt_consume_cpu() does.
+   */
+  nfired = stub_firings(dtp);
+
+  for (nfilled = 0; nfilled < nfired; nfilled++) {
+    unsigned int r = stub_rand(dtp) % 100;
+    stub_probe_t *sp;
+
+    if (r < (unsigned int)dtp->dt_printf)
+      sp = &dtp->dt_probes[dtp->dt_nprobes];
+    else if (r < (unsigned int)(dtp->dt_printf + dtp->dt_stacks))
+      sp = &dtp->dt_probes[dtp->dt_nprobes + 1];
+    else
+      sp = &dtp->dt_probes[stub_rand(dtp) % dtp->dt_nprobes];
+
+    if (offs + sp->sp_edesc->dtepd_size > dtp->dt_bufsize)
+      break;
+
+    stub_fill(dtp, sp, dtp->dt_buf + offs, nfilled);
+    offs += sp->sp_edesc->dtepd_size;
+  }
+
+  drops = dtp->dt_drops + (nfired - nfilled);
+
+  /*
+   * As in dt_handle_cpudrop() and dt_handle_err(), drops and errors abort
+   * the pass unless the consumer has registered a handler for them.
+   */
+  if (drops > 0 && dtp->dt_drophdlr == NULL) {
+    (void) stub_set_errno(dtp, ECANCELED);
+    return (DTRACE_WORKSTATUS_ERROR);
+  }
+
+  if (dtp->dt_errors > 0 && dtp->dt_errhdlr == NULL) {
+    (void) stub_set_errno(dtp, ECANCELED);
+    return (DTRACE_WORKSTATUS_ERROR);
+  }
+
+  if (drops > 0) {
+    dtrace_dropdata_t drop;
+    char msg[64];
+
+    dtp->dt_totaldrops += drops;
+
+    (void) snprintf(msg, sizeof (msg), "%ld drops on CPU 0\n", drops);
+    drop.dtdda_handle = dtp;
+    drop.dtdda_cpu = 0;
+    drop.dtdda_kind = DTRACEDROP_PRINCIPAL;
+    drop.dtdda_drops = drops;
+    drop.dtdda_total = dtp->dt_totaldrops;
+    drop.dtdda_msg = msg;
+
+    if ((*dtp->dt_drophdlr)(&drop, dtp->dt_droparg) == DTRACE_HANDLE_ABORT) {
+      (void) stub_set_errno(dtp, EINTR);
+      return (DTRACE_WORKSTATUS_ERROR);
+    }
+  }
+
+  for (n = 0; n < dtp->dt_errors; n++) {
+    stub_probe_t *sp = &dtp->dt_probes[n % dtp->dt_nprobes];
+    dtrace_errdata_t err;
+
+    (void) memset(&err, 0, sizeof (err));
+    err.dteda_handle = dtp;
+    err.dteda_edesc = sp->sp_edesc;
+    err.dteda_pdesc = &sp->sp_pdesc;
+    err.dteda_action = 1;
+    err.dteda_fault = 1;                /* DTRACEFLT_BADADDR */
+    err.dteda_msg = "error on enabled probe: invalid address (0x0)\n";
+
+    if ((*dtp->dt_errhdlr)(&err, dtp->dt_errarg) == DTRACE_HANDLE_ABORT) {
+      (void) stub_set_errno(dtp, EINTR);
+      return (DTRACE_WORKSTATUS_ERROR);
+    }
+  }
+
+  for (n = 0, offs = 0; n < nfilled; n++) {
+    dtrace_epid_t epid = *(dtrace_epid_t *)(dtp->dt_buf + offs);
+    stub_probe_t *sp = &dtp->dt_probes[epid - 1];
+    dtrace_eprobedesc_t *epd = sp->sp_edesc;
+    caddr_t base = dtp->dt_buf + offs;
+    dtrace_probedata_t data;
+    int i, nargs, rval;
+
+    (void) memset(&data, 0, sizeof (data));
+    data.dtpda_handle = dtp;
+    data.dtpda_edesc = epd;
+    data.dtpda_pdesc = &sp->sp_pdesc;
+    data.dtpda_cpu = 0;
+    data.dtpda_data = base;
+    data.dtpda_flow = DTRACEFLOW_NONE;
+    data.dtpda_prefix = "";
+
+    if (pfunc != NULL && (rval = (*pfunc)(&data, arg)) != DTRACE_CONSUME_THIS) {
+      if (rval == DTRACE_CONSUME_NEXT) {
+        offs += epd->dtepd_size;
+        continue;
+      }
+
+      (void) stub_set_errno(dtp, rval == DTRACE_CONSUME_ABORT ? EINTR : EINVAL);
+      return (DTRACE_WORKSTATUS_ERROR);
+    }
+
+    for (i = 0; i < epd->dtepd_nrecs; i++) {
+      dtrace_recdesc_t *rec = &epd->dtepd_rec[i];
+
+      data.dtpda_data = base + rec->dtrd_offset;
+      rval = (*rfunc)(&data, rec, arg);
+
+      if (rval == DTRACE_CONSUME_NEXT)
+        continue;
+
+      if (rval == DTRACE_CONSUME_ABORT) {
+        (void) stub_set_errno(dtp, EINTR);
+        return (DTRACE_WORKSTATUS_ERROR);
+      }
+
+      if (rval != DTRACE_CONSUME_THIS) {
+        (void) stub_set_errno(dtp, EINVAL);
+        return (DTRACE_WORKSTATUS_ERROR);
+      }
+
+      if (rec->dtrd_action == DTRACEACT_PRINTF) {
+        data.dtpda_data = base;
+
+        if (stub_printf(dtp, &data, rec, base, &nargs) == DTRACE_HANDLE_ABORT) {
+          (void) stub_set_errno(dtp, EINTR);
+          return (DTRACE_WORKSTATUS_ERROR);
+        }
+
+        /* the printf() consumed its arguments */
+        i += nargs;
+      }
+    }
+
+    data.dtpda_data = base + epd->dtepd_size;
+    if ((*rfunc)(&data, NULL, arg) == DTRACE_CONSUME_ABORT) {
+      (void) stub_set_errno(dtp, EINTR);
+      return (DTRACE_WORKSTATUS_ERROR);
+    }
+
+    offs += epd->dtepd_size;
+  }
+
+  return (DTRACE_WORKSTATUS_OKAY);
+}
+
+//////////////////////////////////////////////////////////
+//////////////////////////////////////////// Aggregations
+//////////////////////////////////////////////////////////
+
+static void
+stub_aggupdate(dtrace_hdl_t *dtp, stub_agg_t *sa, int k) {
+  dtrace_aggdesc_t *agd = sa->sa_desc;
+  dtrace_recdesc_t *aggrec = &agd->dtagd_rec[agd->dtagd_nrecs - 1];
+  int64_t *val = (int64_t *)(sa->sa_data[k].dtada_data + aggrec->dtrd_offset);
+  int i, n = 1 + stub_rand(dtp) % 8;
+
+  for (i = 0; i < n; i++) {
+    int64_t v = stub_rand(dtp);
+
+    switch (aggrec->dtrd_action) {
+    case DTRACEAGG_QUANTIZE:
+      val[DTRACE_QUANTIZE_ZEROBUCKET + 1 + (v % 20)]++;
+      break;
+    case DTRACEAGG_LQUANTIZE:
+    case DTRACEAGG_LLQUANTIZE:
+      val[1 + v % sa->sa_nbuckets]++;
+      break;
+    case DTRACEAGG_AVG:
+      val[0]++;
+      val[1] += v % 1000;
+      break;
+    default:
+      val[0]++;
+    }
+  }
+
+  sa->sa_present[k] = 1;
+}
+
+int
+dtrace_aggregate_snap(dtrace_hdl_t *dtp) {
+  int v, k;
+
+  if (!dtp->dt_active)
+    return (stub_set_errno(dtp, EINVAL));
+
+  dtp->dt_snaps++;
+
+  if (dtp->dt_aggpasses > 0 && dtp->dt_snaps > (uint64_t)dtp->dt_aggpasses)
+    return (0);
+
+  for (v = 0; v < dtp->dt_nvars; v++) {
+    for (k = 0; k < dtp->dt_nkeys; k++) {
+      if ((int)(stub_rand(dtp) % 100) < dtp->dt_active_keys)
+        stub_aggupdate(dtp, &dtp->dt_aggs[v], k);
+    }
+  }
+
+  return (0);
+}
+
+static void
+stub_aggremove(dtrace_hdl_t *dtp, stub_agg_t *sa, int k) {
+  dtrace_aggdesc_t *agd = sa->sa_desc;
+  dtrace_recdesc_t *aggrec = &agd->dtagd_rec[agd->dtagd_nrecs - 1];
+  caddr_t data = sa->sa_data[k].dtada_data + aggrec->dtrd_offset;
+  int skip = aggrec->dtrd_action == DTRACEAGG_LQUANTIZE ||
+      aggrec->dtrd_action == DTRACEAGG_LLQUANTIZE ? 8 : 0;
+
+  (void) memset(data + skip, 0, aggrec->dtrd_size - skip);
+  sa->sa_present[k] = 0;
+}
+
+static int
+stub_aggvisit(dtrace_hdl_t *dtp, stub_agg_t *sa, int k,
+    dtrace_aggregate_f *func, void *arg) {
+  switch ((*func)(&sa->sa_data[k], arg)) {
+  case DTRACE_AGGWALK_NEXT:
+    return (0);
+  case DTRACE_AGGWALK_REMOVE:
+    stub_aggremove(dtp, sa, k);
+    return (0);
+  case DTRACE_AGGWALK_CLEAR:
+    stub_aggremove(dtp, sa, k);
+    sa->sa_present[k] = 1;
+    return (0);
+  case DTRACE_AGGWALK_ABORT:
+    return (stub_set_errno(dtp, EINTR));
+  default:
+    return (stub_set_errno(dtp, EINVAL));
+  }
+}
+
+int
+dtrace_aggregate_walk(dtrace_hdl_t *dtp, dtrace_aggregate_f *func, void *arg) {
+  int v, k;
+
+  for (k = 0; k < dtp->dt_nkeys; k++) {
+    for (v = 0; v < dtp->dt_nvars; v++) {
+      stub_agg_t *sa = &dtp->dt_aggs[v];
+
+      if (sa->sa_present[k] && stub_aggvisit(dtp, sa, k, func, arg) != 0)
+        return (-1);
+    }
+  }
+
+  return (0);
+}
+
+typedef struct stub_sortent {
+  stub_agg_t *ss_agg;
+  int ss_key;
+  int64_t ss_val;
+} stub_sortent_t;
+
+static int
+stub_valcmp(const void *l, const void *r) {
+  int64_t lv = ((const stub_sortent_t *)l)->ss_val;
+  int64_t rv = ((const stub_sortent_t *)r)->ss_val;
+
+  return (lv < rv ? -1 : lv > rv ? 1 : 0);
+}
+
+static int
+stub_aggregate_walk_sorted(dtrace_hdl_t *dtp, dtrace_aggregate_f *func,
+    void *arg, int rev) {
+  stub_sortent_t *ents;
+  int v, k, n = 0, i, rval = 0;
+
+  ents = malloc(sizeof (stub_sortent_t) * STUB_NVARS * dtp->dt_nkeys);
+
+  for (v = 0; v < dtp->dt_nvars; v++) {
+    stub_agg_t *sa = &dtp->dt_aggs[v];
+    dtrace_recdesc_t *aggrec = &sa->sa_desc->dtagd_rec[3];
+
+    for (k = 0; k < dtp->dt_nkeys; k++) {
+      if (!sa->sa_present[k])
+        continue;
+
+      ents[n].ss_agg = sa;
+      ents[n].ss_key = k;
+      ents[n].ss_val = *(int64_t *)(sa->sa_data[k].dtada_data +
+          aggrec->dtrd_offset);
+      n++;
+    }
+  }
+
+  qsort(ents, n, sizeof (stub_sortent_t), stub_valcmp);
+
+  for (i = 0; i < n && rval == 0; i++) {
+    stub_sortent_t *ent = &ents[rev ? n - 1 - i : i];
+    rval = stub_aggvisit(dtp, ent->ss_agg, ent->ss_key, func, arg);
+  }
+
+  free(ents);
+  return (rval);
+}
+
+int
+dtrace_aggregate_walk_valsorted(dtrace_hdl_t *dtp, dtrace_aggregate_f *func,
+    void *arg) {
+  return (stub_aggregate_walk_sorted(dtp, func, arg, 0));
+}
+
+int
+dtrace_aggregate_walk_valrevsorted(dtrace_hdl_t *dtp,
+    dtrace_aggregate_f *func, void *arg) {
+  return (stub_aggregate_walk_sorted(dtp, func, arg, 1));
+}
+
+void
+dtrace_aggregate_clear(dtrace_hdl_t *dtp) {
+  int v, k;
+
+  for (v = 0; v < dtp->dt_nvars; v++) {
+    for (k = 0; k < dtp->dt_nkeys; k++) {
+      if (dtp->dt_aggs[v].sa_present[k]) {
+        stub_aggremove(dtp, &dtp->dt_aggs[v], k);
+        dtp->dt_aggs[v].sa_present[k] = 1;
+      }
+    }
+  }
+}
@@ -1,7 +1,6 @@
 #!/usr/bin/python
 
 import dtrace
-import time
 
 a = dtrace.DTraceConsumer()
 
@@ -13,6 +12,4 @@ def walk(probe, record):
   print record
 
 
-while True:
-  time.sleep(1)
-  a.consume(walk)
+a.run(walk)
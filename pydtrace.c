@@ -1,21 +1,652 @@
 #include <Python.h>
 #include <structmember.h>
+#include <structseq.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#ifdef __APPLE__
+#include <mach/mach_time.h>
+#endif
 #include <dtrace.h>
 
 //////////////////////////////////////////////////////////
 ////////////////////////////////////////////// Definitions 
 //////////////////////////////////////////////////////////
 
+typedef struct {
+  dtrace_aggvarid_t dtr_varid;
+  uint64_t dtr_arg;
+  PyObject* dtr_ranges;
+} dtc_ranges_t;
+
+/*
+ * Probe descriptions and aggregation snapshots are handed out as struct
+ * sequences: tuples whose fields can also be read by attribute, or, as when
+ * they used to be dicts, by subscripting with the field name.
+ */
+static PyStructSequence_Field DTraceProbe_fields[] = {
+  { "provider", "the provider of the probe" },
+  { "module", "the module of the probe" },
+  { "function", "the function of the probe" },
+  { "name", "the name of the probe" },
+  { NULL }
+};
+
+static PyStructSequence_Desc DTraceProbe_desc = {
+  "dtrace.Probe", "the description of an enabled probe", DTraceProbe_fields, 4
+};
+
+static PyStructSequence_Field DTraceAggSnapshot_fields[] = {
+  { "name", "the name of the aggregation" },
+  { "action", "the aggregating action, e.g. \"quantize()\"" },
+  { "keys", "one column per key" },
+  { "values", "one value, or row of buckets, per key" },
+  { "ranges", "the ranges of the buckets of a quantizing action, or None" },
+  { NULL }
+};
+
+static PyStructSequence_Desc DTraceAggSnapshot_desc = {
+  "dtrace.AggSnapshot", "the columnar snapshot of an aggregation", DTraceAggSnapshot_fields, 5
+};
+
+static PyTypeObject DTraceProbeType;
+static PyTypeObject DTraceAggSnapshotType;
+
+/*
+ * A growable byte buffer.
+ */
+typedef struct {
+  char* dtb_data;
+  size_t dtb_len;
+  size_t dtb_size;
+} dtc_buf_t;
+
+/*
+ * A record decoded by the background consumer thread.  Records are laid out
+ * back to back in a chunk (one chunk per dtrace_work() pass), each padded to
+ * eight bytes; dtr_str is only present for DTC_REC_STR records, and holds
+ * the format string for DTC_REC_FMT records.
+ */
+#define DTC_REC_INT 1
+#define DTC_REC_STR 2
+#define DTC_REC_FMT 3                /* a printf(); dtr_value records follow */
+#define DTC_REC_STACK 4              /* dtr_value frames, each '\0'-terminated */
+
+typedef struct {
+  const dtrace_probedesc_t* dtr_pdesc;
+  dtrace_epid_t dtr_epid;
+  uint32_t dtr_size;
+  uint32_t dtr_kind;
+  int32_t dtr_route;                 /* as returned by _route() */
+  int64_t dtr_value;
+  char dtr_str[];
+} dtc_rec_t;
+
+typedef struct dtc_chunk {
+  struct dtc_chunk* dtch_next;
+  size_t dtch_nrecs;
+  dtc_buf_t dtch_buf;
+} dtc_chunk_t;
+
+typedef struct {
+  pthread_t dtbg_thread;
+  pthread_mutex_t dtbg_lock;        /* protects the queue below */
+  volatile int dtbg_active;
+  volatile int dtbg_stop;
+  int dtbg_done;
+  dtc_chunk_t* dtbg_head;
+  dtc_chunk_t* dtbg_tail;
+  dtc_chunk_t* dtbg_chunk;          /* chunk being filled by the thread */
+  dtc_buf_t dtbg_scratch;           /* frames of the stack being decoded */
+  size_t dtbg_queued;
+  size_t dtbg_maxqueued;
+  uint64_t dtbg_drops;
+  int dtbg_route;                   /* route of the record being decoded */
+  int dtbg_wakeup[2];               /* pipe made readable by new data */
+  int dtbg_signaled;                /* a byte is pending in dtbg_wakeup */
+  char dtbg_error[1024];
+} dtc_background_t;
+
+/*
+ * What we know about an enabled probe: the probe description handed to the
+ * callbacks and, once raw consumption has seen it, its record layout; for a
+ * structured printf(), its format string.
+ */
+typedef struct {
+  PyObject* dte_probe;
+  PyObject* dte_layout;
+  PyObject* dte_format;
+} dtc_epid_t;
+
+/*
+ * A route set up by route(): a probe description, any part of which may be
+ * empty or a glob pattern, and the callback its records go to.  Once there
+ * are routes, records of the probes that match none are skipped before
+ * they're decoded.  What an EPID resolves to is cached in dtrt_byepid, which
+ * is only touched with the handle lock held, as the background thread reads
+ * it too.
+ */
+typedef struct {
+  char* dtro_desc[4];               /* provider, module, function, name */
+  PyObject* dtro_callback;          /* NULL for consume()'s callback */
+  int dtro_id;                      /* never reused, unlike the index */
+} dtc_route_t;
+
+typedef struct {
+  dtc_route_t* dtrt_routes;
+  int dtrt_nroutes;
+  int dtrt_lastid;
+  int* dtrt_byepid;                 /* 0 if not yet resolved, else _route() + 2 */
+  dtrace_epid_t dtrt_nepids;
+} dtc_routes_t;
+
+/*
+ * The header in front of every entry of a raw buffer; the entry's data
+ * follows and is padded so that the next header is 8-byte aligned.
+ */
+typedef struct {
+  uint32_t dtrh_id;
+  uint32_t dtrh_size;
+} dtc_rawhdr_t;
+
+typedef struct {
+  PyObject_HEAD
+  char* dtbf_data;
+  Py_ssize_t dtbf_len;
+  const char* dtbf_format;
+  Py_ssize_t dtbf_itemsize;
+  int dtbf_ndim;
+  Py_ssize_t dtbf_shape[2];
+  Py_ssize_t dtbf_strides[2];
+} DTraceBuffer;
+
+/*
+ * A histogram: the non-empty buckets of a quantize(), lquantize() or
+ * llquantize() value, in order.  Two histograms can be merged if each
+ * bucket of one is either a bucket of the other or overlaps none of them.
+ */
+typedef struct {
+  int64_t dthb_min;
+  int64_t dthb_max;
+  int64_t dthb_count;
+} dtc_hbucket_t;
+
+typedef struct {
+  PyObject_HEAD
+  dtc_hbucket_t* dthg_buckets;
+  Py_ssize_t dthg_nbuckets;
+} DTraceHistogram;
+
+static PyTypeObject DTraceHistogramType;
+
+/*
+ * An open-addressing hash table keyed by byte strings.  The keys are
+ * copied; the value is up to the caller, with 0 meaning "not yet set".
+ */
+typedef struct {
+  uint64_t dthe_hash;
+  char* dthe_key;                   /* NULL if the slot is free */
+  size_t dthe_len;
+  uintptr_t dthe_value;
+} dtc_hashent_t;
+
+typedef struct {
+  dtc_hashent_t* dth_ents;
+  size_t dth_size;                  /* always a power of two */
+  size_t dth_count;
+} dtc_hash_t;
+
+/*
+ * A rollup set up by rollup(): the firings of the probes matching its
+ * description are aggregated into dtru_table instead of being handed to
+ * python, keyed by the records at dtru_keys and folding in the record at
+ * dtru_value.  Keys are encoded field by field, 'i' and an int64 or 's' and
+ * a '\0'-terminated string; values are malloc()ed int64s, one or, for
+ * quantize, DTRACE_QUANTIZE_NBUCKETS of them.  Like routes, the rollups are
+ * only touched with the handle lock held; dtrl_byepid caches, per EPID, the
+ * mask of the rollups a firing goes to.  An enabled probe whose records
+ * can't make up the key or value is left alone, and the problem reported by
+ * rollup_snapshot().
+ */
+#define DTC_ROLLUP_COUNT 0
+#define DTC_ROLLUP_SUM 1
+#define DTC_ROLLUP_MIN 2
+#define DTC_ROLLUP_MAX 3
+#define DTC_ROLLUP_QUANTIZE 4
+
+#define DTC_ROLLUP_MAXKEYS 8
+#define DTC_ROLLUP_MAXROLLUPS 63      /* the masks of dtrl_byepid are 64 bits */
+#define DTC_ROLLUP_RESOLVED (1ULL << 63)
+
+typedef struct {
+  char* dtru_name;
+  char* dtru_desc[4];               /* provider, module, function, name */
+  int dtru_keys[DTC_ROLLUP_MAXKEYS];
+  int dtru_nkeys;
+  int dtru_value;                   /* -1 for count */
+  int dtru_op;
+  dtc_hash_t dtru_table;
+  char dtru_error[1024];
+} dtc_rollup_t;
+
+typedef struct {
+  dtc_rollup_t* dtrl_rollups;
+  int dtrl_nrollups;
+  uint64_t* dtrl_byepid;            /* 0 if not yet resolved */
+  dtrace_epid_t dtrl_nepids;
+  dtc_buf_t dtrl_key;               /* the key being encoded */
+} dtc_rollups_t;
+
+/*
+ * The variables an aggwalk() was asked to walk, and their callbacks, both
+ * given by variable ID or name.  What a variable ID resolves to is cached
+ * for the duration of the walk in dtas_byvarid.
+ */
+typedef struct {
+  PyObject* dtas_callbacks;         /* NULL if there are none */
+  PyObject* dtas_vars;              /* NULL for all variables */
+  PyObject** dtas_byvarid;          /* NULL if not yet resolved, Py_None if skipped */
+  dtrace_aggvarid_t dtas_nvarids;
+} dtc_aggsel_t;
+
+/*
+ * The columns of one aggregation variable, as gathered by aggsnapshot().
+ * Integer keys are stored as int64, everything else is dictionary encoded
+ * into int32 codes; each row has dts_width values.
+ */
+#define DTC_COL_INT 1
+#define DTC_COL_STR 2
+
+typedef struct {
+  int dtk_kind;
+  dtc_buf_t dtk_data;
+  dtc_hash_t dtk_codes;
+  PyObject* dtk_values;
+} dtc_keycol_t;
+
+typedef struct {
+  dtrace_aggvarid_t dts_varid;
+  const dtrace_aggdesc_t* dts_desc;
+  dtrace_actkind_t dts_action;
+  uint64_t dts_arg;
+  int dts_width;
+  Py_ssize_t dts_nrows;
+  int dts_nkeys;
+  dtc_keycol_t* dts_keys;
+  dtc_buf_t dts_values;
+} dtc_snapvar_t;
+
+/*
+ * A resolved sym()/mod()/usym()/umod()/uaddr() record.  Entries are kept
+ * in a hash table (chained through dtsy_hnext) and on an LRU list.
+ */
+typedef struct dtc_sym {
+  struct dtc_sym* dtsy_hnext;
+  struct dtc_sym* dtsy_prev;
+  struct dtc_sym* dtsy_next;
+  uint64_t dtsy_hash;
+  uint64_t dtsy_pid;
+  uint64_t dtsy_pc;
+  dtrace_actkind_t dtsy_action;
+  PyObject* dtsy_object;            /* interned, created on first use */
+  char dtsy_name[];
+} dtc_sym_t;
+
+typedef struct {
+  dtc_sym_t** dtsc_buckets;
+  size_t dtsc_nbuckets;             /* always a power of two */
+  size_t dtsc_count;
+  Py_ssize_t dtsc_max;
+  dtc_sym_t* dtsc_head;             /* most recently used */
+  dtc_sym_t* dtsc_tail;
+  unsigned long long dtsc_hits;
+  unsigned long long dtsc_misses;
+  time_t dtsc_swept;
+  PyObject** dtsc_grave;            /* evicted without the GIL */
+  size_t dtsc_ngrave;
+  size_t dtsc_maxgrave;
+} dtc_symcache_t;
+
+/*
+ * A capture file is an 8-byte magic followed by entries, each a
+ * dtc_rawhdr_t (the entry kind and payload size) and the payload, padded to
+ * eight bytes.  Everything is in native byte order and layout.  An enabled
+ * probe or aggregation is described once, before its first datum:
+ *
+ *   DTC_CAP_PROBE      dtc_capdesc_t, the records, the dtrace_probedesc_t
+ *                      and, for each record, the format string of its
+ *                      printf() (or "")
+ *   DTC_CAP_AGG        dtc_capdesc_t, the records and the name
+ *   DTC_CAP_FIRING     dtc_capdatum_t (EPID and CPU) and the firing
+ *   DTC_CAP_AGGDATA    dtc_capdatum_t (aggregation ID) and the record
+ *   DTC_CAP_CONSUME    end of a dtrace_work() pass (no payload)
+ *   DTC_CAP_AGGREGATE  end of an aggregation snapshot (no payload)
+ */
+#define DTC_CAP_MAGIC "PYDTCAP2"
+#define DTC_CAP_PROBE 1
+#define DTC_CAP_AGG 2
+#define DTC_CAP_FIRING 3
+#define DTC_CAP_AGGDATA 4
+#define DTC_CAP_CONSUME 5
+#define DTC_CAP_AGGREGATE 6
+
+typedef struct {
+  uint32_t dtcd_id;                 /* EPID or aggregation ID */
+  int32_t dtcd_varid;               /* aggregation variable; 0 for probes */
+  uint32_t dtcd_size;               /* size of a firing or record */
+  int32_t dtcd_nrecs;
+} dtc_capdesc_t;
+
+typedef struct {
+  uint32_t dtcd_id;
+  int32_t dtcd_cpu;
+} dtc_capdatum_t;
+
+/*
+ * A capture file being written.  Entries are gathered in dtcp_buf and
+ * written with a single write() at the end of each pass.
+ */
+typedef struct {
+  int dtcp_fd;                      /* -1 if not capturing */
+  int dtcp_errno;                   /* set if an append or write failed */
+  dtc_buf_t dtcp_buf;
+  dtc_hash_t dtcp_known;            /* probes and aggregations described */
+} dtc_capture_t;
+
+/*
+ * A capture file being replayed, and the descriptions read from it so far.
+ * consume() and the aggregation walks each have their own cursor, so they
+ * replay their passes independently of each other.
+ */
+typedef struct {
+  const char* dtrpp_src;            /* the entry it was read from */
+  dtrace_probedesc_t dtrpp_pdesc;
+  dtrace_eprobedesc_t dtrpp_edesc;  /* must be last; its records follow */
+} dtc_repprobe_t;
+
+typedef struct {
+  const char* dtrpa_src;
+  dtrace_aggdesc_t dtrpa_desc;      /* must be last; its records follow */
+} dtc_repagg_t;
+
+typedef struct {
+  char* dtrp_base;                  /* the mapped file; NULL if not replaying */
+  size_t dtrp_size;
+  size_t dtrp_consume;
+  size_t dtrp_aggregate;
+  dtc_repprobe_t** dtrp_probes;     /* indexed by EPID */
+  dtrace_epid_t dtrp_nprobes;
+  dtc_repagg_t** dtrp_aggs;         /* indexed by aggregation ID */
+  dtrace_aggid_t dtrp_naggs;
+  char dtrp_eof;                    /* consume() has replayed every pass */
+} dtc_replay_t;
+
+/*
+ * A snapshot file, which publish() maps into memory and writes every
+ * aggregation snapshot to, for dtrace.SnapshotReader to read from other
+ * processes.  It holds a dtc_pubhdr_t and two buffers; each snapshot is
+ * written to the buffer that isn't current, which is then made current.
+ * The header is guarded by a sequence lock: dtph_seq is odd while it's
+ * being changed, so a reader that saw the same even dtph_seq before and
+ * after reading the current buffer knows that it wasn't written to in the
+ * meantime.  Everything is in native byte order, and 8-byte aligned.
+ *
+ * A snapshot is a uint32 count of variables (then 4 bytes of padding), and
+ * for each variable, in the columnar form of aggsnapshot():
+ *
+ *   dtc_pubvar_t       the variable ID, number of keys and rows and so on
+ *   name, action       NUL-terminated, padded to 8 bytes
+ *   ranges             if DTC_PUB_RANGES: dtpv_width (min, max) int64 pairs
+ *   keys               for each key, a dtc_pubkey_t and then either the
+ *                      int64 column, or the int32 column of codes, padded,
+ *                      and dtpk_nstrings uint32 lengths, padded, and the
+ *                      strings, padded
+ *   values             dtpv_nrows * dtpv_width int64 (or double) values
+ */
+#define DTC_PUB_MAGIC "PYDTPUB1"
+#define DTC_PUB_VERSION 1
+#define DTC_PUB_RANGES 0x1          /* a quantizing action */
+#define DTC_PUB_DOUBLE 0x2          /* the values are doubles */
+
+typedef struct {
+  char dtph_magic[8];
+  uint32_t dtph_version;
+  uint32_t dtph_hdrsize;            /* sizeof (dtc_pubhdr_t) */
+  volatile uint64_t dtph_seq;
+  uint64_t dtph_size;               /* of the file, which only grows */
+  uint64_t dtph_generation;         /* snapshots published so far */
+  uint64_t dtph_time;               /* when the current one was, in ns since the epoch */
+  uint64_t dtph_offset;             /* of the current snapshot */
+  uint64_t dtph_len;
+} dtc_pubhdr_t;
+
+typedef struct {
+  int32_t dtpv_varid;
+  uint32_t dtpv_nkeys;
+  uint32_t dtpv_width;              /* values per row */
+  uint32_t dtpv_flags;
+  uint64_t dtpv_nrows;
+  uint32_t dtpv_namelen;            /* without the NUL */
+  uint32_t dtpv_actionlen;
+} dtc_pubvar_t;
+
+typedef struct {
+  uint32_t dtpk_kind;               /* DTC_COL_INT or DTC_COL_STR */
+  uint32_t dtpk_nstrings;
+} dtc_pubkey_t;
+
+/*
+ * The snapshot file being published to.  A buffer that's too small for a
+ * snapshot moves to the end of the file, which grows.
+ */
+typedef struct {
+  int dtpb_fd;
+  char* dtpb_base;                  /* the mapped file; NULL if not publishing */
+  size_t dtpb_size;
+  uint64_t dtpb_bufs[2][2];         /* offset and size of each buffer */
+  int dtpb_next;                    /* the buffer the next snapshot goes to */
+  dtc_buf_t dtpb_data;              /* the snapshot being encoded */
+  PyObject* dtpb_error;             /* why the last snapshot wasn't published */
+} dtc_publish_t;
+
+/*
+ * Readers give up on a snapshot that keeps changing under them after this
+ * many tries.
+ */
+#define DTC_PUB_TRIES 1000
+
+typedef struct {
+  PyObject_HEAD
+  int dtsr_fd;
+  char* dtsr_base;                  /* the mapped file; NULL if not open */
+  size_t dtsr_size;
+  uint64_t dtsr_generation;         /* of the snapshot last read */
+  uint64_t dtsr_time;
+} DTraceSnapshotReader;
+
+/*
+ * The counters behind stats(), kept whether or not anyone asks for them.
+ * Times are in nanoseconds; dts_switches is a histogram of the intervals
+ * between buffer switches, bucket i counting those of [2^(i-1), 2^i)
+ * microseconds (bucket 0: less than one).
+ */
+#define DTC_DROP_PRINCIPAL 0
+#define DTC_DROP_AGGREGATION 1
+#define DTC_DROP_SPECULATION 2
+#define DTC_DROP_DYNVAR 3
+#define DTC_DROP_OTHER 4
+#define DTC_DROP_NKINDS 5
+
+#define DTC_STATS_NBUCKETS 40
+
+/*
+ * Per-record callbacks are too frequent to read the clock around each one;
+ * one in DTC_STATS_SAMPLE is timed, and stands for the others.
+ */
+#define DTC_STATS_SAMPLE 32
+
+typedef struct {
+  uint64_t dts_drops[DTC_DROP_NKINDS];
+  uint64_t dts_errors;              /* ERROR probe firings */
+  uint64_t dts_firings;
+  uint64_t dts_records;
+  uint64_t dts_bytes;
+  uint64_t dts_passes;              /* dtrace_work() calls */
+  uint64_t dts_work;                /* time in dtrace_work(), less callbacks */
+  uint64_t dts_callback;            /* time in python callbacks */
+  uint64_t dts_ncallbacks;          /* per-record callbacks, for sampling */
+  uint64_t dts_lastswitch;
+  uint64_t dts_nswitches;
+  uint64_t dts_switches[DTC_STATS_NBUCKETS];
+} dtc_stats_t;
+
+/*
+ * The state of autotune(): the drops seen since it last looked, and the
+ * options it recommends for the next run.  Sizes are in bytes and rates are
+ * intervals in nanoseconds, as libdtrace keeps them.
+ */
+#define DTC_TUNE_QUIET 64           /* drop-free switches before relaxing */
+
+typedef struct {
+  int dtt_enabled;
+  dtrace_optval_t dtt_maxbufsize;
+  dtrace_optval_t dtt_maxaggsize;
+  dtrace_optval_t dtt_minrate;      /* shortest switchrate and aggrate */
+  dtrace_optval_t dtt_switchrate;   /* as configured, to relax back to */
+  dtrace_optval_t dtt_bufsize;
+  dtrace_optval_t dtt_aggsize;
+  dtrace_optval_t dtt_aggrate;
+  uint64_t dtt_drops;               /* principal drops not yet acted on */
+  uint64_t dtt_aggdrops;
+  uint64_t dtt_quiet;
+} dtc_tune_t;
+
+/*
+ * What aggwalk() does with the data it walks.
+ */
+#define DTC_AGGWALK_REMOVE 0
+#define DTC_AGGWALK_SNAPSHOT 1
+#define DTC_AGGWALK_DELTA 2
+
 typedef struct {
   PyObject_HEAD
   dtrace_hdl_t* dtc_handle;
+  pthread_mutex_t dtc_lock;         /* serializes use of dtc_handle */
   PyObject* dtc_callback;
   PyObject* dtc_arguments;
+  PyObject* dtc_callargs[4];        /* reusable argument tuples, by arity */
   PyObject* dtc_error;
-  dtrace_aggvarid_t dtc_ranges_varid;
-  PyObject** dtc_ranges;  
+  PyObject* dtc_batch;
+  Py_ssize_t dtc_batch_len;
+  Py_ssize_t dtc_batch_max;
+  dtc_epid_t* dtc_probes;
+  dtrace_epid_t dtc_nprobes;
+  dtc_routes_t dtc_routes;
+  dtc_rollups_t dtc_rollups;
+  dtc_buf_t dtc_raw;
+  PyObject* dtc_layouts;
+  PyObject* dtc_agglayouts;
+  dtc_ranges_t* dtc_ranges;
+  int dtc_nranges;
+  int dtc_aggmode;
+  dtc_aggsel_t dtc_aggsel;          /* the selection of the aggwalk() in progress */
+  char dtc_structured;              /* structured printf() records */
+  char dtc_histograms;              /* quantized values as Histograms */
+  char dtc_strict;                  /* drops and errors fail the pass */
+  char dtc_native;                  /* records go to dtbg_chunk, as for the background thread */
+  char dtc_working;                 /* a _work() pass is calling back into python */
+  int dtc_skip;                     /* printf() arguments left to skip */
+  dtc_hash_t dtc_aggprev;           /* last values seen by a delta aggwalk() */
+  uint64_t dtc_aggpass;             /* delta walk that stamps dtc_aggprev */
+  dtc_buf_t dtc_scratch;
+  dtc_symcache_t dtc_syms;
+  dtc_capture_t dtc_cap;
+  dtc_replay_t dtc_replay;
+  dtc_publish_t dtc_pub;
+  dtc_stats_t dtc_stats;
+  dtc_tune_t dtc_tune;
+  dtc_background_t dtc_bg;
 } DTraceConsumer;
 
+/*
+ * The iterator returned by consume_iter(): the chunks of decoded records of
+ * a pass, converted to (probe, rec) tuples only as they're asked for.
+ */
+typedef struct {
+  PyObject_HEAD
+  DTraceConsumer* dtri_consumer;
+  dtc_chunk_t* dtri_head;
+  dtc_chunk_t* dtri_chunk;
+  char* dtri_cur;
+  int dtri_background;              /* the chunks came from the background thread */
+} DTraceRecords;
+
+/*
+ * A consumer driven by a ConsumerGroup, with the callbacks it dispatches to
+ * and the _now() of its next buffer switch and aggregation walk.  Members
+ * removed while the group is running are only flagged, and dropped once the
+ * pass is over.
+ */
+typedef struct {
+  DTraceConsumer* dtgm_consumer;
+  PyObject* dtgm_callback;
+  PyObject* dtgm_aggcallback;       /* NULL if aggregations aren't walked */
+  int dtgm_aggmode;
+  int dtgm_removed;
+  uint64_t dtgm_nextwork;
+  uint64_t dtgm_nextagg;
+} dtc_member_t;
+
+typedef struct {
+  PyObject_HEAD
+  dtc_member_t* dtg_members;
+  int dtg_nmembers;
+  int dtg_maxmembers;
+  int dtg_running;
+} DTraceConsumerGroup;
+
+typedef struct {
+  DTraceConsumer* dtss_consumer;
+  dtrace_aggvarid_t dtss_varid;     /* DTRACE_AGGVARIDNONE for all */
+  dtc_snapvar_t* dtss_vars;
+  int dtss_nvars;
+} dtc_snapshot_t;
+
+/*
+ * The state of an aggfolded() walk: the count of every distinct folded
+ * line, and the line being put together.
+ */
+typedef struct {
+  DTraceConsumer* dtf_consumer;
+  dtrace_aggvarid_t dtf_varid;      /* DTRACE_AGGVARIDNONE for all */
+  dtc_hash_t dtf_lines;             /* line -> count */
+  dtc_buf_t dtf_line;
+} dtc_folded_t;
+
+/*
+ * The state of an aggtop() walk: a heap of copies of the data of the best
+ * dtt_n records of the variable seen so far.
+ */
+typedef struct {
+  DTraceConsumer* dtt_consumer;
+  dtrace_aggvarid_t dtt_varid;
+  const dtrace_aggdesc_t* dtt_desc; /* of the first record seen */
+  int dtt_bykey;
+  int dtt_descending;
+  size_t dtt_n;
+  size_t dtt_count;
+  caddr_t* dtt_heap;
+} dtc_top_t;
+
 
 //////////////////////////////////////////////////////////
 ////////////////////////////////////////////// Helpers 
@@ -33,6 +664,9 @@ _action_valid(const dtrace_recdesc_t *rec) {
   case DTRACEACT_USYM:
   case DTRACEACT_UMOD:
   case DTRACEACT_UADDR:
+  case DTRACEACT_STACK:
+  case DTRACEACT_USTACK:
+  case DTRACEACT_JSTACK:
     return 1;
 
   default:
@@ -100,6 +734,9 @@ _valid(const dtrace_recdesc_t *rec) {
   case DTRACEACT_USYM:
   case DTRACEACT_UMOD:
   case DTRACEACT_UADDR:
+  case DTRACEACT_STACK:
+  case DTRACEACT_USTACK:
+  case DTRACEACT_JSTACK:
     return (1);
 
   default:
@@ -130,663 +767,9433 @@ _error(const char *fmt, ...) {
   return Py_BuildValue("s", err);
 }
 
-/*
- * Caching the quantized ranges improves performance substantially if the
- * aggregations have many disjoing keys.  Note that we only cache a single
- * aggregation variable; programs that have more than one aggregation variable
- * may see significant degradations in performance.  (If this is a common
- * case, this cache should clearly be expanded.)
- */
-static PyObject**
-_ranges_cached(DTraceConsumer *dtc, dtrace_aggvarid_t varid) {
-  if (varid == dtc->dtc_ranges_varid) {
-    return (dtc->dtc_ranges);
+static char*
+_buf_reserve(dtc_buf_t *buf, size_t len) {
+  if (buf->dtb_len + len > buf->dtb_size) {
+    size_t size = buf->dtb_size ? buf->dtb_size : 4096;
+    char *data;
+
+    while (size < buf->dtb_len + len) {
+      size <<= 1;
+    }
+
+    if ((data = realloc(buf->dtb_data, size)) == NULL) {
+      return NULL;
+    }
+
+    buf->dtb_data = data;
+    buf->dtb_size = size;
   }
 
-  return NULL;
+  buf->dtb_len += len;
+  return buf->dtb_data + buf->dtb_len - len;
 }
 
-static PyObject**
-_ranges_cache(DTraceConsumer *dtc, dtrace_aggvarid_t varid, PyObject** ranges) {
-  if (dtc->dtc_ranges != NULL) {
-    free(dtc->dtc_ranges);
+/*
+ * A monotonic clock, in nanoseconds.
+ */
+static uint64_t
+_now(void) {
+#ifdef __APPLE__
+  static mach_timebase_info_data_t tb;
+
+  if (tb.denom == 0) {
+    mach_timebase_info(&tb);
   }
 
-  dtc->dtc_ranges = ranges;
-  dtc->dtc_ranges_varid = varid;
+  return mach_absolute_time() * tb.numer / tb.denom;
+#else
+  struct timespec ts;
 
-  return (ranges);
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
 }
 
-static PyObject**
-_ranges_quantize(DTraceConsumer *dtc, dtrace_aggvarid_t varid) {
-  
-  PyObject** ranges;
-  if ((ranges = _ranges_cached(dtc, varid)) != NULL) {
-    return (ranges);
-  }  
-
-  ranges = malloc(DTRACE_QUANTIZE_NBUCKETS*sizeof(PyObject*));
-
-  int64_t min, max;
-  int i;
-  for (i = 0; i < DTRACE_QUANTIZE_NBUCKETS; i++) {
-    ranges[i] = PyList_New(2);
+/*
+ * Brackets a per-record callback: returns the time to pass to
+ * _callback_end() if this callback is one to time, and 0 otherwise.
+ */
+static uint64_t
+_callback_start(dtc_stats_t *st) {
+  return (++st->dts_ncallbacks & (DTC_STATS_SAMPLE - 1)) == 0 ? _now() : 0;
+}
 
-    if (i < DTRACE_QUANTIZE_ZEROBUCKET) {
-      /*
-       * If we're less than the zero bucket, our range
-       * extends from negative infinity through to the
-       * beginning of our zeroth bucket.
-       */
-      min = i > 0 ? DTRACE_QUANTIZE_BUCKETVAL(i - 1) + 1 :
-          INT64_MIN;
-      max = DTRACE_QUANTIZE_BUCKETVAL(i);
-    } else if (i == DTRACE_QUANTIZE_ZEROBUCKET) {
-      min = max = 0;
-    } else {
-      min = DTRACE_QUANTIZE_BUCKETVAL(i);
-      max = i < DTRACE_QUANTIZE_NBUCKETS - 1 ?
-          DTRACE_QUANTIZE_BUCKETVAL(i + 1) - 1 :
-          INT64_MAX;
-    }
+static void
+_callback_end(dtc_stats_t *st, uint64_t start) {
+  if (start != 0) {
+    st->dts_callback += (_now() - start) * DTC_STATS_SAMPLE;
+  }
+}
 
-    PyList_SetItem(ranges[i], 0, Py_BuildValue("i", min));
-    PyList_SetItem(ranges[i], 1, Py_BuildValue("i", max));
+/*
+ * FNV-1a, which is plenty for the short keys we hash.
+ */
+static uint64_t
+_hash_bytes(const void *key, size_t len) {
+  const unsigned char *p = key;
+  uint64_t hash = 14695981039346656037ULL;
+
+  while (len-- > 0) {
+    hash ^= *p++;
+    hash *= 1099511628211ULL;
   }
 
-  return (_ranges_cache(dtc, varid, ranges));
+  return hash;
 }
 
-static PyObject**
-_ranges_lquantize(DTraceConsumer *dtc, dtrace_aggvarid_t varid, const uint64_t arg) {
-  
-  PyObject** ranges;
-  if ((ranges = _ranges_cached(dtc, varid)) != NULL)
-    return (ranges);
-
-  int64_t min, max;  
-  int32_t base;
-  uint16_t step, levels;
-  int i;
+static dtc_hashent_t*
+_hash_slot(dtc_hashent_t *ents, size_t size, uint64_t hash, const void *key, size_t len) {
+  size_t i = hash & (size - 1);
 
-  base = DTRACE_LQUANTIZE_BASE(arg);
-  step = DTRACE_LQUANTIZE_STEP(arg);
-  levels = DTRACE_LQUANTIZE_LEVELS(arg);
+  while (ents[i].dthe_key != NULL) {
+    if (ents[i].dthe_hash == hash && ents[i].dthe_len == len &&
+        memcmp(ents[i].dthe_key, key, len) == 0) {
+      break;
+    }
 
-  ranges = malloc((levels + 2) * sizeof(PyObject*));
+    i = (i + 1) & (size - 1);
+  }
 
-  for (i = 0; i <= levels + 1; i++) {
-    ranges[i] = PyList_New(2);
+  return &ents[i];
+}
 
-    min = i == 0 ? INT64_MIN : base + ((i - 1) * step);
-    max = i > levels ? INT64_MAX : base + (i * step) - 1;
+/*
+ * Finds the free slot a key with the given hash goes into when the table is
+ * rebuilt, where every key is known to be distinct.
+ */
+static dtc_hashent_t*
+_hash_free_slot(dtc_hashent_t *ents, size_t size, uint64_t hash) {
+  size_t i = hash & (size - 1);
 
-    PyList_SetItem(ranges[i], 0, Py_BuildValue("i", min));
-    PyList_SetItem(ranges[i], 1, Py_BuildValue("i", max));
+  while (ents[i].dthe_key != NULL) {
+    i = (i + 1) & (size - 1);
   }
 
-  return (_ranges_cache(dtc, varid, ranges));
+  return &ents[i];
 }
 
-static PyObject**
-_ranges_llquantize(DTraceConsumer *dtc, dtrace_aggvarid_t varid, const uint64_t arg, int nbuckets) {
+/*
+ * Looks up key, adding it (with a value of 0) if create is set.  Returns
+ * NULL if the key isn't there, or if we ran out of memory adding it.
+ */
+static dtc_hashent_t*
+_hash_lookup(dtc_hash_t *h, const void *key, size_t len, int create) {
+  uint64_t hash = _hash_bytes(key, len);
+  dtc_hashent_t *ent;
 
-  int64_t value = 1, next, step;  
-  int bucket = 0, order;
-  uint16_t factor, low, high, nsteps;
+  if (h->dth_ents != NULL) {
+    ent = _hash_slot(h->dth_ents, h->dth_size, hash, key, len);
 
-  PyObject** ranges;
-  if ((ranges = _ranges_cached(dtc, varid)) != NULL) {
-    return (ranges);
+    if (ent->dthe_key != NULL || !create) {
+      return ent->dthe_key != NULL ? ent : NULL;
+    }
+  } else if (!create) {
+    return NULL;
   }
 
-  factor = DTRACE_LLQUANTIZE_FACTOR(arg);
-  low = DTRACE_LLQUANTIZE_LOW(arg);
-  high = DTRACE_LLQUANTIZE_HIGH(arg);
-  nsteps = DTRACE_LLQUANTIZE_NSTEP(arg);
-
-  ranges = malloc(nbuckets * sizeof(PyObject*));
-
-  for (order = 0; order < low; order++)
-    value *= factor;
+  if ((h->dth_count + 1) * 2 > h->dth_size) {
+    size_t size = h->dth_size ? h->dth_size << 1 : 64;
+    dtc_hashent_t *ents;
+    size_t i;
 
-  ranges[bucket] = PyList_New(2);
-  PyList_SetItem(ranges[bucket], 0, Py_BuildValue("i", 0));
-  PyList_SetItem(ranges[bucket], 1, Py_BuildValue("i", value - 2));
-  bucket++;
+    if ((ents = calloc(size, sizeof (dtc_hashent_t))) == NULL) {
+      return NULL;
+    }
 
-  next = value * factor;
-  step = next > nsteps ? next / nsteps : 1;
+    for (i = 0; i < h->dth_size; i++) {
+      if (h->dth_ents[i].dthe_key != NULL) {
+        *_hash_free_slot(ents, size, h->dth_ents[i].dthe_hash) = h->dth_ents[i];
+      }
+    }
 
-  while (order <= high) {
-    ranges[bucket] = PyList_New(2);
-    PyList_SetItem(ranges[bucket], 0, Py_BuildValue("i", value));
-    PyList_SetItem(ranges[bucket], 1, Py_BuildValue("i", value + step - 1));
-    bucket++;
+    free(h->dth_ents);
+    h->dth_ents = ents;
+    h->dth_size = size;
+  }
 
-    if ((value += step) != next)
-      continue;
+  ent = _hash_slot(h->dth_ents, h->dth_size, hash, key, len);
 
-    next = value * factor;
-    step = next > nsteps ? next / nsteps : 1;
-    order++;
+  if ((ent->dthe_key = malloc(len ? len : 1)) == NULL) {
+    return NULL;
   }
 
-  ranges[bucket] = PyList_New(2);
-  PyList_SetItem(ranges[bucket], 0, Py_BuildValue("i", value));
-  PyList_SetItem(ranges[bucket], 1, Py_BuildValue("i", INT64_MAX));
+  memcpy(ent->dthe_key, key, len);
+  ent->dthe_hash = hash;
+  ent->dthe_len = len;
+  ent->dthe_value = 0;
+  h->dth_count++;
 
-  assert(bucket + 1 == nbuckets);
+  return ent;
+}
+
+/*
+ * Frees the table and its keys -- and, if values is set, the values, which
+ * are then taken to be pointers to memory from malloc().
+ */
+static void
+_hash_free(dtc_hash_t *h, int values) {
+  size_t i;
+
+  for (i = 0; i < h->dth_size; i++) {
+    free(h->dth_ents[i].dthe_key);
+
+    if (values) {
+      free((void *)h->dth_ents[i].dthe_value);
+    }
+  }
 
-  return (_ranges_cache(dtc, varid, ranges));
+  free(h->dth_ents);
+  memset(h, 0, sizeof (dtc_hash_t));
 }
 
-static PyObject* 
-_make_probedesc(const dtrace_probedesc_t *pd) {
-  PyObject *dict = PyDict_New();
-  PyDict_SetItemString(dict, "provider", Py_BuildValue("s", pd->dtpd_provider));
-  PyDict_SetItemString(dict, "module", Py_BuildValue("s", pd->dtpd_mod));
-  PyDict_SetItemString(dict, "function", Py_BuildValue("s", pd->dtpd_func));
-  PyDict_SetItemString(dict, "name", Py_BuildValue("s", pd->dtpd_name));
+/*
+ * Caching the quantized ranges improves performance substantially if the
+ * aggregations have many disjoint keys.  The ranges only depend on the
+ * aggregating action and its encoding (the lquantize()/llquantize() argument),
+ * so an entry is kept per (varid, encoding) and survives across aggwalk()
+ * calls until the program changes.  Each entry is an immutable tuple of
+ * (min, max) tuples that can be shared by every value that refers to it.
+ */
+static PyObject*
+_ranges_cached(DTraceConsumer *dtc, dtrace_aggvarid_t varid, uint64_t arg) {
+  int i;
 
-  return dict;
+  for (i = 0; i < dtc->dtc_nranges; i++) {
+    if (dtc->dtc_ranges[i].dtr_varid == varid && dtc->dtc_ranges[i].dtr_arg == arg) {
+      return (dtc->dtc_ranges[i].dtr_ranges);
+    }
+  }
+
+  return NULL;
 }
 
-static PyObject* 
-_make_record(DTraceConsumer* self, const dtrace_recdesc_t *rec, caddr_t addr) {
+static PyObject*
+_ranges_cache(DTraceConsumer *dtc, dtrace_aggvarid_t varid, uint64_t arg, PyObject* ranges) {
+  dtc_ranges_t *entries;
 
-  switch (rec->dtrd_action) {
-  case DTRACEACT_DIFEXPR:
-    switch (rec->dtrd_size) {
-      case sizeof (uint64_t):
-      case sizeof (uint32_t):
-      case sizeof (uint16_t):
-      case sizeof (uint8_t):
-        return Py_BuildValue("l", *(int64_t *)addr);
-      default:
-        return Py_BuildValue("s", (const char *)addr);
+  if (ranges == NULL) {
+    return NULL;
+  }
+
+  if ((entries = realloc(dtc->dtc_ranges, (dtc->dtc_nranges + 1) * sizeof(dtc_ranges_t))) == NULL) {
+    Py_DECREF(ranges);
+    return PyErr_NoMemory();
+  }
+
+  entries[dtc->dtc_nranges].dtr_varid = varid;
+  entries[dtc->dtc_nranges].dtr_arg = arg;
+  entries[dtc->dtc_nranges].dtr_ranges = ranges;
+  dtc->dtc_ranges = entries;
+  dtc->dtc_nranges++;
+
+  return (ranges);
+}
+
+static void
+_ranges_flush(DTraceConsumer *dtc) {
+  int i;
+
+  for (i = 0; i < dtc->dtc_nranges; i++) {
+    Py_DECREF(dtc->dtc_ranges[i].dtr_ranges);
+  }
+
+  free(dtc->dtc_ranges);
+  dtc->dtc_ranges = NULL;
+  dtc->dtc_nranges = 0;
+}
+
+static int
+_range_set(PyObject* ranges, int i, int64_t min, int64_t max) {
+  PyObject* range = Py_BuildValue("(LL)", (PY_LONG_LONG)min, (PY_LONG_LONG)max);
+
+  if (range == NULL) {
+    return -1;
+  }
+
+  PyTuple_SET_ITEM(ranges, i, range);
+  return 0;
+}
+
+static PyObject*
+_ranges_quantize(DTraceConsumer *dtc, dtrace_aggvarid_t varid) {
+  
+  PyObject* ranges;
+  if ((ranges = _ranges_cached(dtc, varid, 0)) != NULL) {
+    return (ranges);
+  }  
+
+  if ((ranges = PyTuple_New(DTRACE_QUANTIZE_NBUCKETS)) == NULL) {
+    return NULL;
+  }
+
+  int64_t min, max;
+  int i;
+  for (i = 0; i < DTRACE_QUANTIZE_NBUCKETS; i++) {
+
+    if (i < DTRACE_QUANTIZE_ZEROBUCKET) {
+      /*
+       * If we're less than the zero bucket, our range
+       * extends from negative infinity through to the
+       * beginning of our zeroth bucket.
+       */
+      min = i > 0 ? DTRACE_QUANTIZE_BUCKETVAL(i - 1) + 1 :
+          INT64_MIN;
+      max = DTRACE_QUANTIZE_BUCKETVAL(i);
+    } else if (i == DTRACE_QUANTIZE_ZEROBUCKET) {
+      min = max = 0;
+    } else {
+      min = DTRACE_QUANTIZE_BUCKETVAL(i);
+      max = i < DTRACE_QUANTIZE_NBUCKETS - 1 ?
+          DTRACE_QUANTIZE_BUCKETVAL(i + 1) - 1 :
+          INT64_MAX;
     }
-  case DTRACEACT_SYM:
-  case DTRACEACT_MOD:
-  case DTRACEACT_USYM:
-  case DTRACEACT_UMOD:
-  case DTRACEACT_UADDR:
-    {
-      dtrace_hdl_t* dtp = self->dtc_handle;
-      char buf[2048], *tick, *plus;
 
-      buf[0] = '\0';
+    if (_range_set(ranges, i, min, max) == -1) {
+      Py_DECREF(ranges);
+      return NULL;
+    }
+  }
 
-      if (DTRACEACT_CLASS(rec->dtrd_action) == DTRACEACT_KERNEL) {
-        uint64_t pc = ((uint64_t *)addr)[0];
-        dtrace_addr2str(dtp, pc, buf, sizeof (buf) - 1);
-      } else {
-        uint64_t pid = ((uint64_t *)addr)[0];
-        uint64_t pc = ((uint64_t *)addr)[1];
-        dtrace_uaddr2str(dtp, pid, pc, buf, sizeof (buf) - 1);
-      }
+  return (_ranges_cache(dtc, varid, 0, ranges));
+}
 
-      if (rec->dtrd_action == DTRACEACT_MOD ||
-          rec->dtrd_action == DTRACEACT_UMOD) {
-        /*
-         * If we're looking for the module name, we'll
-         * return everything to the left of the left-most
-         * tick -- or "<undefined>" if there is none.
-         */
-        if ((tick = strchr(buf, '`')) == NULL)
-          return Py_BuildValue("s", "<unknown>");
+/*
+ * The quantize() bucket a value falls into, worked out as the kernel does.
+ */
+static int
+_quantize_bucket(int64_t val) {
+  int i;
 
-        *tick = '\0';
-      } else if (rec->dtrd_action == DTRACEACT_SYM ||
-          rec->dtrd_action == DTRACEACT_USYM) {
-        /*
-         * If we're looking for the symbol name, we'll
-         * return everything to the left of the right-most
-         * plus sign (if there is one).
-         */
-        if ((plus = strrchr(buf, '+')) != NULL)
-          *plus = '\0';
+  if (val < 0) {
+    for (i = 0; i < DTRACE_QUANTIZE_ZEROBUCKET; i++) {
+      if (val <= DTRACE_QUANTIZE_BUCKETVAL(i)) {
+        return i;
       }
-      return Py_BuildValue("s", buf);
     }
   }
 
-  assert(0);
-  return Py_BuildValue("l", -1);
+  for (i = DTRACE_QUANTIZE_ZEROBUCKET + 1; i < DTRACE_QUANTIZE_NBUCKETS; i++) {
+    if (val < DTRACE_QUANTIZE_BUCKETVAL(i)) {
+      return i - 1;
+    }
+  }
+
+  return DTRACE_QUANTIZE_NBUCKETS - 1;
 }
 
-static int 
-_aggwalk(const dtrace_aggdata_t *agg, void *arg) {
+static PyObject*
+_ranges_lquantize(DTraceConsumer *dtc, dtrace_aggvarid_t varid, const uint64_t arg) {
+  
+  PyObject* ranges;
+  if ((ranges = _ranges_cached(dtc, varid, arg)) != NULL)
+    return (ranges);
 
-  DTraceConsumer *dtc = (DTraceConsumer *)arg;
-  const dtrace_aggdesc_t *aggdesc = agg->dtada_desc;
-  const dtrace_recdesc_t *aggrec;
+  int64_t min, max;  
+  int32_t base;
+  uint16_t step, levels;
+  int i;
 
+  base = DTRACE_LQUANTIZE_BASE(arg);
+  step = DTRACE_LQUANTIZE_STEP(arg);
+  levels = DTRACE_LQUANTIZE_LEVELS(arg);
 
-  /*
-   * We expect to have both a variable ID and an aggregation value here;
-   * if we have fewer than two records, something is deeply wrong.
-   */
-  assert(aggdesc->dtagd_nrecs >= 2);
+  if ((ranges = PyTuple_New(levels + 2)) == NULL) {
+    return NULL;
+  }
 
+  for (i = 0; i <= levels + 1; i++) {
+    min = i == 0 ? INT64_MIN : base + ((i - 1) * step);
+    max = i > levels ? INT64_MAX : base + (i * step) - 1;
 
-  PyObject* keys = PyList_New(aggdesc->dtagd_nrecs - 2);
-  PyObject* id = Py_BuildValue("i", aggdesc->dtagd_varid);
-  PyObject* val = NULL;
+    if (_range_set(ranges, i, min, max) == -1) {
+      Py_DECREF(ranges);
+      return NULL;
+    }
+  }
 
-  char errbuf[256];
-  int i;
+  return (_ranges_cache(dtc, varid, arg, ranges));
+}
 
+static PyObject*
+_ranges_llquantize(DTraceConsumer *dtc, dtrace_aggvarid_t varid, const uint64_t arg, int nbuckets) {
 
-  for (i = 1; i < aggdesc->dtagd_nrecs - 1; i++) {
-    const dtrace_recdesc_t *rec = &aggdesc->dtagd_rec[i];
-    caddr_t addr = agg->dtada_data + rec->dtrd_offset;    
+  int64_t value = 1, next, step;  
+  int bucket = 0, order;
+  uint16_t factor, low, high, nsteps;
 
-    if (!_valid(rec)) {
-      dtc->dtc_error = _error("unsupported action %s as key #%d in aggregation \"%s\"\n", _action(rec, errbuf, sizeof (errbuf)), i, aggdesc->dtagd_name);
-      return (DTRACE_AGGWALK_ERROR);
-    }
+  PyObject* ranges;
+  if ((ranges = _ranges_cached(dtc, varid, arg)) != NULL) {
+    return (ranges);
+  }
+
+  factor = DTRACE_LLQUANTIZE_FACTOR(arg);
+  low = DTRACE_LLQUANTIZE_LOW(arg);
+  high = DTRACE_LLQUANTIZE_HIGH(arg);
+  nsteps = DTRACE_LLQUANTIZE_NSTEP(arg);
 
-    PyList_SetItem(keys, i - 1, _make_record(dtc, rec, addr));
+  if ((ranges = PyTuple_New(nbuckets)) == NULL) {
+    return NULL;
   }
 
-  aggrec = &aggdesc->dtagd_rec[aggdesc->dtagd_nrecs - 1];
+  for (order = 0; order < low; order++)
+    value *= factor;
 
-  switch (aggrec->dtrd_action) {
-  case DTRACEAGG_COUNT:
-  case DTRACEAGG_MIN:
-  case DTRACEAGG_MAX:
-  case DTRACEAGG_SUM: {
-    caddr_t addr = agg->dtada_data + aggrec->dtrd_offset;
+  if (_range_set(ranges, bucket++, 0, value - 1) == -1)
+    goto err;
 
-    assert(aggrec->dtrd_size == sizeof (uint64_t));
-    val = Py_BuildValue("l", *((int64_t *)addr));
-    break;
+  next = value * factor;
+  step = next > nsteps ? next / nsteps : 1;
+
+  while (order <= high) {
+    if (bucket >= nbuckets - 1) {
+      PyErr_SetString(PyExc_RuntimeError, "llquantize() encoding does not match its bucket count");
+      goto err;
+    }
+
+    if (_range_set(ranges, bucket++, value, value + step - 1) == -1)
+      goto err;
+
+    if ((value += step) != next)
+      continue;
+
+    next = value * factor;
+    step = next > nsteps ? next / nsteps : 1;
+    order++;
   }
 
-  case DTRACEAGG_AVG: {
-    const int64_t *data = (int64_t *)(agg->dtada_data + aggrec->dtrd_offset);
+  if (_range_set(ranges, bucket, value, INT64_MAX) == -1)
+    goto err;
 
-    assert(aggrec->dtrd_size == sizeof (uint64_t) * 2);
+  assert(bucket + 1 == nbuckets);
 
-    val = Py_BuildValue("l", data[1] / (double)data[0]);
-    break;
+  return (_ranges_cache(dtc, varid, arg, ranges));
+
+err:
+  Py_DECREF(ranges);
+  return NULL;
+}
+
+static PyObject* 
+_make_probedesc(const dtrace_probedesc_t *pd) {
+  const char *fields[] = { pd->dtpd_provider, pd->dtpd_mod, pd->dtpd_func, pd->dtpd_name };
+  PyObject *probe = PyStructSequence_New(&DTraceProbeType);
+  PyObject *val;
+  int i;
+
+  if (probe == NULL) {
+    return NULL;
   }
 
-  case DTRACEAGG_QUANTIZE: {
-    PyObject* quantize = PyList_New(0);
+  /*
+   * The same probe object is handed out for every record of an enabled
+   * probe, which is fine as it is immutable.
+   */
+  for (i = 0; i < 4; i++) {
+    if ((val = PyString_FromString(fields[i])) == NULL) {
+      Py_DECREF(probe);
+      return NULL;
+    }
+
+    PyStructSequence_SET_ITEM(probe, i, val);
+  }
 
-    const int64_t *data = (int64_t *)(agg->dtada_data + aggrec->dtrd_offset);
-    
-    PyObject* datum;
-    PyObject** ranges = _ranges_quantize(dtc, aggdesc->dtagd_varid); 
-    int i;
-    for (i = 0; i < DTRACE_QUANTIZE_NBUCKETS; i++) {
+  return probe;
+}
+
+static binaryfunc _structseq_getitem;
 
-      if (!data[i]) continue;
+/*
+ * Subscripting a struct sequence with a field name reads that field, so
+ * code that only subscripted the dicts these types replaced keeps working.
+ * The rest of the dict interface (get(), keys(), items(), "in") is not
+ * there: these are tuples.
+ */
+static PyObject*
+_structseq_subscript(PyObject *self, PyObject *key) {
+  PyMemberDef *m;
 
-      datum = PyList_New(2);
-      PyList_SetItem(datum, 0, ranges[i]);
-      PyList_SetItem(datum, 1, Py_BuildValue("i", data[i]));
+  if (!PyString_Check(key)) {
+    return _structseq_getitem(self, key);
+  }
 
-      PyList_Append(quantize, datum);
+  for (m = Py_TYPE(self)->tp_members; m != NULL && m->name != NULL; m++) {
+    if (strcmp(m->name, PyString_AS_STRING(key)) == 0) {
+      return PyMember_GetOne((char *)self, m);
     }
+  }
 
-    val = quantize;
-    break;
+  PyErr_SetObject(PyExc_KeyError, key);
+  return NULL;
+}
+
+static int
+_structseq_init(PyTypeObject *type, PyStructSequence_Desc *desc) {
+  static PyMappingMethods mapping;
+
+  PyStructSequence_InitType(type, desc);
+
+  if (PyErr_Occurred()) {
+    return -1;
   }
 
-  case DTRACEAGG_LQUANTIZE:
-  case DTRACEAGG_LLQUANTIZE: {
+  if (_structseq_getitem == NULL) {
+    mapping = *type->tp_as_mapping;
+    _structseq_getitem = mapping.mp_subscript;
+    mapping.mp_subscript = _structseq_subscript;
+  }
 
-    const int64_t *data = (int64_t *)(agg->dtada_data + aggrec->dtrd_offset);
+  type->tp_as_mapping = &mapping;
+  return 0;
+}
 
-    PyObject* lquantize = PyList_New(0);
-    PyObject** ranges;
-    PyObject* datum;
+/*
+ * Calls callback with nargs borrowed arguments.  Rather than building an
+ * argument tuple per call, the tuple of the last call is refilled if the
+ * callback didn't keep it, as enumerate() and zip() do.  We hold a
+ * reference to the tuple for the duration of the call, so that a callback
+ * that calls back into us (by consuming or walking from the callback) finds
+ * it in use and gets a tuple of its own.
+ */
+static PyObject*
+_call(DTraceConsumer *dtc, PyObject *callback, int nargs, PyObject **argv) {
+  PyObject **argsp = &dtc->dtc_callargs[nargs];
+  PyObject *args = *argsp;
+  PyObject *result;
+  int i;
 
-    int i;
+  if (args == NULL || Py_REFCNT(args) > 1) {
+    Py_XDECREF(args);
 
-    uint64_t arg = *data++;
-    int levels = (aggrec->dtrd_size / sizeof (uint64_t)) - 1;
+    if ((args = *argsp = PyTuple_New(nargs)) == NULL) {
+      return NULL;
+    }
+  }
 
-    ranges = (aggrec->dtrd_action == DTRACEAGG_LQUANTIZE ?
-        _ranges_lquantize(dtc, aggdesc->dtagd_varid, arg) :
-        _ranges_llquantize(dtc, aggdesc->dtagd_varid, arg, levels));
+  for (i = 0; i < nargs; i++) {
+    Py_INCREF(argv[i]);
+    PyTuple_SET_ITEM(args, i, argv[i]);
+  }
+
+  Py_INCREF(args);
+  result = PyObject_Call(callback, args, NULL);
 
-    for (i = 0; i < levels; i++) {
+  if (*argsp == args && Py_REFCNT(args) == 2) {
+    for (i = 0; i < nargs; i++) {
+      PyObject *arg = PyTuple_GET_ITEM(args, i);
 
-      if (!data[i]) continue;
+      PyTuple_SET_ITEM(args, i, NULL);
+      Py_DECREF(arg);
+    }
+  }
 
-      datum = PyList_New(2);
-      PyList_SetItem(datum, 0, ranges[i]);
-      PyList_SetItem(datum, 1, Py_BuildValue("i", data[i]));
+  Py_DECREF(args);
+  return result;
+}
 
-      PyList_Append(lquantize, datum);
+/*
+ * The set of enabled probes is fixed once the program has been compiled, so
+ * we build the probe description for an enabled probe ID the first time we
+ * see it and hand out the same object for every later record.  The cache is
+ * indexed by EPID (which libdtrace allocates densely, starting at 1) and is
+ * flushed whenever the program changes or tracing is stopped.
+ */
+static dtc_epid_t*
+_epid_entry(DTraceConsumer *dtc, dtrace_epid_t epid) {
+  if (epid >= dtc->dtc_nprobes) {
+    dtrace_epid_t nprobes = dtc->dtc_nprobes ? dtc->dtc_nprobes : 64;
+    dtc_epid_t* probes;
+
+    while (nprobes <= epid) {
+      nprobes <<= 1;
     }
 
-    val = lquantize;
-    break;
+    if ((probes = realloc(dtc->dtc_probes, nprobes * sizeof(dtc_epid_t))) == NULL) {
+      PyErr_NoMemory();
+      return NULL;
+    }
+
+    memset(probes + dtc->dtc_nprobes, 0, (nprobes - dtc->dtc_nprobes) * sizeof(dtc_epid_t));
+    dtc->dtc_probes = probes;
+    dtc->dtc_nprobes = nprobes;
   }
 
-  default:
-    dtc->dtc_error = _error("unsupported aggregating action %s in aggregation \"%s\"\n", _action(aggrec, errbuf, sizeof (errbuf)), aggdesc->dtagd_name);
-    return (DTRACE_AGGWALK_ERROR);
+  return &dtc->dtc_probes[epid];
+}
+
+static PyObject*
+_probe_cached(DTraceConsumer *dtc, dtrace_epid_t epid, const dtrace_probedesc_t *pd) {
+  dtc_epid_t* entry;
+  PyObject* probe;
+
+  if ((entry = _epid_entry(dtc, epid)) == NULL) {
+    return NULL;
   }
 
-  PyObject_CallFunction(dtc->dtc_callback, "iOO", id, keys, val);
+  if ((probe = entry->dte_probe) == NULL) {
+    if ((probe = _make_probedesc(pd)) == NULL) {
+      return NULL;
+    }
 
-  return (DTRACE_AGGWALK_REMOVE);
+    entry->dte_probe = probe;
+  }
+
+  Py_INCREF(probe);
+  return probe;
 }
 
-static int 
-_bufhandler(const dtrace_bufdata_t *bufdata, void *arg) {
+/*
+ * Splits a probe description into its four parts, as D does: the parts that
+ * are given are the last ones, so "read:entry" is any provider and module,
+ * function read and name entry.
+ */
+static int
+_route_parse(const char *desc, char *parts[4]) {
+  const char *fields[4] = { "", "", "", "" };
+  char *copy, *cur, *colon;
+  int n = 0, i;
+
+  if ((copy = cur = strdup(desc)) == NULL) {
+    PyErr_NoMemory();
+    return -1;
+  }
+
+  for (;;) {
+    char *end = (colon = strchr(cur, ':')) != NULL ? colon : cur + strlen(cur);
+
+    if (n == 4) {
+      free(copy);
+      PyErr_Format(PyExc_ValueError, "invalid probe description \"%s\"", desc);
+      return -1;
+    }
+
+    *end = '\0';
+    fields[n++] = cur;
+
+    if (colon == NULL) {
+      break;
+    }
+
+    cur = colon + 1;
+  }
+
+  for (i = 0; i < 4; i++) {
+    parts[i] = strdup(i < 4 - n ? "" : fields[i - (4 - n)]);
+  }
+
+  free(copy);
+
+  for (i = 0; i < 4; i++) {
+    if (parts[i] == NULL) {
+      for (i = 0; i < 4; i++) {
+        free(parts[i]);
+      }
+
+      PyErr_NoMemory();
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Whether an enabled probe matches a description split by _route_parse();
+ * an empty part matches anything.
+ */
+static int
+_desc_match(char *const desc[4], const dtrace_probedesc_t *pd) {
+  const char *fields[4];
+  int i;
+
+  fields[0] = pd->dtpd_provider;
+  fields[1] = pd->dtpd_mod;
+  fields[2] = pd->dtpd_func;
+  fields[3] = pd->dtpd_name;
+
+  for (i = 0; i < 4; i++) {
+    if (desc[i][0] != '\0' && fnmatch(desc[i], fields[i], 0) != 0) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+static void
+_route_free(dtc_route_t *route) {
+  int i;
+
+  for (i = 0; i < 4; i++) {
+    free(route->dtro_desc[i]);
+  }
+
+  Py_XDECREF(route->dtro_callback);
+}
+
+/*
+ * Forgets what the EPIDs resolved to; the routes or the probes changed.
+ */
+static void
+_routes_flush(dtc_routes_t *rt) {
+  free(rt->dtrt_byepid);
+  rt->dtrt_byepid = NULL;
+  rt->dtrt_nepids = 0;
+}
+
+/*
+ * Returns where the records of an enabled probe go: 0 to consume()'s
+ * callback, the ID of the route whose callback they go to, or -1 nowhere,
+ * as there are routes and none of them matches.  Records decoded ahead of
+ * python (by the background thread or consume_iter()) carry this with
+ * them, and a route may be removed before they reach python, which is why
+ * it's an ID rather than an index.  Must be called with the handle lock
+ * held; doesn't need the GIL.
+ */
+static int
+_route(DTraceConsumer *dtc, dtrace_epid_t epid, const dtrace_probedesc_t *pd) {
+  dtc_routes_t *rt = &dtc->dtc_routes;
+  int i, route = -1;
+
+  if (rt->dtrt_nroutes == 0) {
+    return 0;
+  }
+
+  if (epid < rt->dtrt_nepids && rt->dtrt_byepid[epid] != 0) {
+    return rt->dtrt_byepid[epid] - 2;
+  }
+
+  for (i = 0; i < rt->dtrt_nroutes && route == -1; i++) {
+    dtc_route_t *r = &rt->dtrt_routes[i];
+
+    if (_desc_match(r->dtro_desc, pd)) {
+      route = r->dtro_callback != NULL ? r->dtro_id : 0;
+    }
+  }
+
+  if (epid >= rt->dtrt_nepids) {
+    dtrace_epid_t nepids = rt->dtrt_nepids ? rt->dtrt_nepids : 64;
+    int *byepid;
+
+    while (nepids <= epid) {
+      nepids <<= 1;
+    }
+
+    /*
+     * Without the memory to cache it, the route is simply worked out again
+     * next time.
+     */
+    if ((byepid = realloc(rt->dtrt_byepid, nepids * sizeof (int))) == NULL) {
+      return route;
+    }
+
+    memset(byepid + rt->dtrt_nepids, 0, (nepids - rt->dtrt_nepids) * sizeof (int));
+    rt->dtrt_byepid = byepid;
+    rt->dtrt_nepids = nepids;
+  }
+
+  rt->dtrt_byepid[epid] = route + 2;
+  return route;
+}
+
+/*
+ * Returns the callback of the route with the given ID (a borrowed
+ * reference), or NULL if records of that route go to consume()'s callback:
+ * route is 0, or the route has been removed since the records were
+ * decoded.
+ */
+static PyObject*
+_route_callback(DTraceConsumer *dtc, int route) {
+  dtc_routes_t *rt = &dtc->dtc_routes;
+  int i;
+
+  for (i = 0; route > 0 && i < rt->dtrt_nroutes; i++) {
+    if (rt->dtrt_routes[i].dtro_id == route) {
+      return rt->dtrt_routes[i].dtro_callback;
+    }
+  }
+
+  return NULL;
+}
+
+static void
+_rollup_free(dtc_rollup_t *ru) {
+  int i;
+
+  for (i = 0; i < 4; i++) {
+    free(ru->dtru_desc[i]);
+  }
+
+  free(ru->dtru_name);
+  _hash_free(&ru->dtru_table, 1);
+}
+
+/*
+ * Forgets which rollups the EPIDs go to; the rollups or the probes changed.
+ */
+static void
+_rollups_flush(dtc_rollups_t *rl) {
+  free(rl->dtrl_byepid);
+  rl->dtrl_byepid = NULL;
+  rl->dtrl_nepids = 0;
+}
+
+static void
+_probes_flush(DTraceConsumer *dtc) {
+  dtrace_epid_t i;
+
+  for (i = 0; i < dtc->dtc_nprobes; i++) {
+    Py_CLEAR(dtc->dtc_probes[i].dte_probe);
+    Py_CLEAR(dtc->dtc_probes[i].dte_layout);
+    Py_CLEAR(dtc->dtc_probes[i].dte_format);
+  }
+
+  free(dtc->dtc_probes);
+  dtc->dtc_probes = NULL;
+  dtc->dtc_nprobes = 0;
+  _routes_flush(&dtc->dtc_routes);
+  _rollups_flush(&dtc->dtc_rollups);
+
+  Py_CLEAR(dtc->dtc_layouts);
+  Py_CLEAR(dtc->dtc_agglayouts);
+}
+
+
+static int64_t
+_make_int(const dtrace_recdesc_t *rec, caddr_t addr) {
+  switch (rec->dtrd_size) {
+  case sizeof (uint64_t):
+    return *((int64_t *)addr);
+  case sizeof (uint32_t):
+    return *((int32_t *)addr);
+  case sizeof (uint16_t):
+    return *((int16_t *)addr);
+  default:
+    return *((int8_t *)addr);
+  }
+}
+
+/*
+ * Resolves an address for a sym()/mod()/usym()/umod()/uaddr() record (or a
+ * stack frame) into buf, returning the string to be used for it.  This
+ * doesn't touch any python state, so it may be called by the background
+ * consumer thread.
+ */
+static const char*
+_make_sym_pc(dtrace_hdl_t *dtp, dtrace_actkind_t action, uint64_t pid, uint64_t pc, char *buf, int size) {
+  char *tick, *plus;
+
+  buf[0] = '\0';
+
+  if (dtp == NULL) {
+    /*
+     * We're replaying a capture, and have nothing to resolve it with.
+     */
+    snprintf(buf, size, "0x%llx", (unsigned long long)pc);
+  } else if (DTRACEACT_CLASS(action) == DTRACEACT_KERNEL) {
+    dtrace_addr2str(dtp, pc, buf, size - 1);
+  } else {
+    dtrace_uaddr2str(dtp, pid, pc, buf, size - 1);
+  }
+
+  if (action == DTRACEACT_MOD ||
+      action == DTRACEACT_UMOD) {
+    /*
+     * If we're looking for the module name, we'll
+     * return everything to the left of the left-most
+     * tick -- or "<undefined>" if there is none.
+     */
+    if ((tick = strchr(buf, '`')) == NULL)
+      return "<unknown>";
+
+    *tick = '\0';
+  } else if (action == DTRACEACT_SYM ||
+      action == DTRACEACT_USYM) {
+    /*
+     * If we're looking for the symbol name, we'll
+     * return everything to the left of the right-most
+     * plus sign (if there is one).
+     */
+    if ((plus = strrchr(buf, '+')) != NULL)
+      *plus = '\0';
+  }
+
+  return buf;
+}
+
+static const char*
+_make_sym(dtrace_hdl_t *dtp, const dtrace_recdesc_t *rec, caddr_t addr, char *buf, int size) {
+  if (DTRACEACT_CLASS(rec->dtrd_action) == DTRACEACT_KERNEL) {
+    return _make_sym_pc(dtp, rec->dtrd_action, 0, ((uint64_t *)addr)[0], buf, size);
+  }
+
+  return _make_sym_pc(dtp, rec->dtrd_action, ((uint64_t *)addr)[0], ((uint64_t *)addr)[1], buf, size);
+}
+
+/*
+ * Symbol lookups go through the symbol tables and, for user addresses,
+ * process grabs, so we cache the resolved strings by (pid, pc, action).
+ * The cache is only used with the handle lock held.  Whoever holds the GIL
+ * may create and free the python strings of the entries; the background
+ * thread leaves the strings of the entries it evicts to be freed later.
+ */
+static void
+_sym_unlink(dtc_symcache_t *sc, dtc_sym_t *sym) {
+  if (sym->dtsy_prev != NULL) {
+    sym->dtsy_prev->dtsy_next = sym->dtsy_next;
+  } else {
+    sc->dtsc_head = sym->dtsy_next;
+  }
+
+  if (sym->dtsy_next != NULL) {
+    sym->dtsy_next->dtsy_prev = sym->dtsy_prev;
+  } else {
+    sc->dtsc_tail = sym->dtsy_prev;
+  }
+}
+
+static void
+_sym_link(dtc_symcache_t *sc, dtc_sym_t *sym) {
+  sym->dtsy_prev = NULL;
+  sym->dtsy_next = sc->dtsc_head;
+
+  if (sc->dtsc_head != NULL) {
+    sc->dtsc_head->dtsy_prev = sym;
+  } else {
+    sc->dtsc_tail = sym;
+  }
+
+  sc->dtsc_head = sym;
+}
+
+static void
+_sym_remove(dtc_symcache_t *sc, dtc_sym_t *sym, int gil) {
+  dtc_sym_t **sp = &sc->dtsc_buckets[sym->dtsy_hash & (sc->dtsc_nbuckets - 1)];
+
+  while (*sp != sym) {
+    sp = &(*sp)->dtsy_hnext;
+  }
+
+  *sp = sym->dtsy_hnext;
+  _sym_unlink(sc, sym);
+  sc->dtsc_count--;
+
+  if (sym->dtsy_object != NULL) {
+    if (gil) {
+      Py_DECREF(sym->dtsy_object);
+    } else {
+      if (sc->dtsc_ngrave == sc->dtsc_maxgrave) {
+        size_t max = sc->dtsc_maxgrave ? sc->dtsc_maxgrave << 1 : 64;
+        PyObject **grave = realloc(sc->dtsc_grave, max * sizeof (PyObject*));
+
+        if (grave != NULL) {
+          sc->dtsc_grave = grave;
+          sc->dtsc_maxgrave = max;
+        }
+      }
+
+      /*
+       * If that failed, all we can do is leak the string.
+       */
+      if (sc->dtsc_ngrave < sc->dtsc_maxgrave) {
+        sc->dtsc_grave[sc->dtsc_ngrave++] = sym->dtsy_object;
+      }
+    }
+  }
+
+  free(sym);
+}
+
+/*
+ * Frees the strings of the entries evicted by the background thread; must
+ * be called with the GIL and the handle lock held.
+ */
+static void
+_sym_reap(dtc_symcache_t *sc) {
+  while (sc->dtsc_ngrave > 0) {
+    PyObject* object = sc->dtsc_grave[--sc->dtsc_ngrave];
+
+    Py_DECREF(object);
+  }
+}
+
+/*
+ * Drops the user-level entries of pid -- or, if pid is -1, all entries.
+ */
+static void
+_sym_invalidate(dtc_symcache_t *sc, int64_t pid, int gil) {
+  dtc_sym_t *sym = sc->dtsc_head, *next;
+
+  for (; sym != NULL; sym = next) {
+    next = sym->dtsy_next;
+
+    if (pid == -1 || (DTRACEACT_CLASS(sym->dtsy_action) != DTRACEACT_KERNEL && sym->dtsy_pid == (uint64_t)pid)) {
+      _sym_remove(sc, sym, gil);
+    }
+  }
+}
+
+/*
+ * Drops the entries of processes that have exited, whose pids may be
+ * reused.  Checking each pid is a system call, so this is done at most
+ * once a second.
+ */
+static void
+_sym_sweep(dtc_symcache_t *sc, int gil) {
+  time_t now = time(NULL);
+  dtc_hash_t pids;
+  dtc_hashent_t *ent;
+  dtc_sym_t *sym, *next;
+
+  if (now == sc->dtsc_swept) {
+    return;
+  }
+
+  sc->dtsc_swept = now;
+  memset(&pids, 0, sizeof (pids));
+
+  for (sym = sc->dtsc_head; sym != NULL; sym = next) {
+    next = sym->dtsy_next;
+
+    if (DTRACEACT_CLASS(sym->dtsy_action) == DTRACEACT_KERNEL) {
+      continue;
+    }
+
+    if ((ent = _hash_lookup(&pids, &sym->dtsy_pid, sizeof (uint64_t), 1)) == NULL) {
+      break;
+    }
+
+    if (ent->dthe_value == 0) {
+      ent->dthe_value = (kill((pid_t)sym->dtsy_pid, 0) == -1 && errno == ESRCH) ? 2 : 1;
+    }
+
+    if (ent->dthe_value == 2) {
+      _sym_remove(sc, sym, gil);
+    }
+  }
+
+  _hash_free(&pids, 0);
+}
+
+static int
+_sym_grow(dtc_symcache_t *sc) {
+  size_t nbuckets = sc->dtsc_nbuckets ? sc->dtsc_nbuckets << 1 : 256;
+  dtc_sym_t **buckets;
+  dtc_sym_t *sym;
+
+  if ((buckets = calloc(nbuckets, sizeof (dtc_sym_t*))) == NULL) {
+    return -1;
+  }
+
+  for (sym = sc->dtsc_head; sym != NULL; sym = sym->dtsy_next) {
+    sym->dtsy_hnext = buckets[sym->dtsy_hash & (nbuckets - 1)];
+    buckets[sym->dtsy_hash & (nbuckets - 1)] = sym;
+  }
+
+  free(sc->dtsc_buckets);
+  sc->dtsc_buckets = buckets;
+  sc->dtsc_nbuckets = nbuckets;
+
+  return 0;
+}
+
+/*
+ * Returns the cached entry for an address, resolving it if need be, or NULL
+ * if the cache is disabled (or we're out of memory), in which case the
+ * caller resolves the address itself.
+ */
+static dtc_sym_t*
+_sym_lookup_pc(DTraceConsumer *dtc, dtrace_actkind_t action, uint64_t pid, uint64_t pc, int gil) {
+  dtc_symcache_t *sc = &dtc->dtc_syms;
+  struct { uint64_t pid, pc, action; } key;
+  dtc_sym_t *sym;
+  char buf[2048];
+  const char *name;
+
+  if (sc->dtsc_max <= 0) {
+    return NULL;
+  }
+
+  key.pid = pid;
+  key.pc = pc;
+  key.action = action;
+
+  _sym_sweep(sc, gil);
+
+  uint64_t hash = _hash_bytes(&key, sizeof (key));
+
+  if (sc->dtsc_buckets != NULL) {
+    for (sym = sc->dtsc_buckets[hash & (sc->dtsc_nbuckets - 1)]; sym != NULL; sym = sym->dtsy_hnext) {
+      if (sym->dtsy_hash == hash && sym->dtsy_pid == pid && sym->dtsy_pc == pc &&
+          sym->dtsy_action == action) {
+        sc->dtsc_hits++;
+        _sym_unlink(sc, sym);
+        _sym_link(sc, sym);
+        return sym;
+      }
+    }
+  }
+
+  sc->dtsc_misses++;
+  name = _make_sym_pc(dtc->dtc_handle, action, pid, pc, buf, sizeof (buf));
+
+  if (sc->dtsc_count >= sc->dtsc_nbuckets && _sym_grow(sc) == -1) {
+    return NULL;
+  }
+
+  if ((sym = malloc(sizeof (dtc_sym_t) + strlen(name) + 1)) == NULL) {
+    return NULL;
+  }
+
+  sym->dtsy_hash = hash;
+  sym->dtsy_pid = pid;
+  sym->dtsy_pc = pc;
+  sym->dtsy_action = action;
+  sym->dtsy_object = NULL;
+  strcpy(sym->dtsy_name, name);
+
+  sym->dtsy_hnext = sc->dtsc_buckets[hash & (sc->dtsc_nbuckets - 1)];
+  sc->dtsc_buckets[hash & (sc->dtsc_nbuckets - 1)] = sym;
+  _sym_link(sc, sym);
+  sc->dtsc_count++;
+
+  while ((Py_ssize_t)sc->dtsc_count > sc->dtsc_max) {
+    _sym_remove(sc, sc->dtsc_tail, gil);
+  }
+
+  return sym;
+}
+
+static dtc_sym_t*
+_sym_lookup(DTraceConsumer *dtc, const dtrace_recdesc_t *rec, caddr_t addr, int gil) {
+  if (DTRACEACT_CLASS(rec->dtrd_action) == DTRACEACT_KERNEL) {
+    return _sym_lookup_pc(dtc, rec->dtrd_action, 0, ((uint64_t *)addr)[0], gil);
+  }
+
+  return _sym_lookup_pc(dtc, rec->dtrd_action, ((uint64_t *)addr)[0], ((uint64_t *)addr)[1], gil);
+}
+
+static PyObject*
+_sym_object(dtc_sym_t *sym) {
+  if (sym->dtsy_object == NULL) {
+    if ((sym->dtsy_object = PyString_InternFromString(sym->dtsy_name)) == NULL) {
+      return NULL;
+    }
+  }
+
+  Py_INCREF(sym->dtsy_object);
+  return sym->dtsy_object;
+}
+
+static void
+_symcache_free(dtc_symcache_t *sc) {
+  _sym_invalidate(sc, -1, 1);
+  _sym_reap(sc);
+
+  free(sc->dtsc_buckets);
+  free(sc->dtsc_grave);
+  sc->dtsc_buckets = NULL;
+  sc->dtsc_nbuckets = 0;
+  sc->dtsc_grave = NULL;
+  sc->dtsc_maxgrave = 0;
+}
+
+static int
+_is_int(const dtrace_recdesc_t *rec) {
+  switch (rec->dtrd_size) {
+  case sizeof (uint64_t):
+  case sizeof (uint32_t):
+  case sizeof (uint16_t):
+  case sizeof (uint8_t):
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+/*
+ * Finds the frames of a stack()/ustack()/jstack() record, returning its
+ * depth.  A user stack leads with the pid; the frames past the depth of the
+ * stack that was actually taken are zero.
+ */
+static int
+_stack_frames(const dtrace_recdesc_t *rec, caddr_t addr, uint64_t *pid, const uint64_t **pcs) {
+  const uint64_t *pc = (const uint64_t *)addr;
+  int nframes, i;
+
+  if (rec->dtrd_action == DTRACEACT_STACK) {
+    *pid = 0;
+    nframes = rec->dtrd_arg;
+  } else {
+    *pid = *pc++;
+    nframes = DTRACE_USTACK_NFRAMES(rec->dtrd_arg);
+  }
+
+  if (nframes > (int)(rec->dtrd_size / sizeof (uint64_t))) {
+    nframes = rec->dtrd_size / sizeof (uint64_t);
+  }
+
+  for (i = 0; i < nframes && pc[i] != 0; i++) {
+    continue;
+  }
+
+  *pcs = pc;
+  return i;
+}
+
+/*
+ * Resolves a stack frame.  Frames are cached like sym() records, under the
+ * action of the stack (which keeps the offset) or, with short set, of the
+ * corresponding sym()/usym() (which doesn't).
+ */
+static const char*
+_frame_name(DTraceConsumer *dtc, const dtrace_recdesc_t *rec, uint64_t pid, uint64_t pc, int shortname, char *buf, int size, int gil) {
+  dtrace_actkind_t action = rec->dtrd_action;
+  dtc_sym_t *sym;
+
+  if (shortname) {
+    action = action == DTRACEACT_STACK ? DTRACEACT_SYM : DTRACEACT_USYM;
+  } else if (action == DTRACEACT_JSTACK) {
+    action = DTRACEACT_USTACK;
+  }
+
+  if ((sym = _sym_lookup_pc(dtc, action, pid, pc, gil)) != NULL) {
+    return sym->dtsy_name;
+  }
+
+  return _make_sym_pc(dtc->dtc_handle, action, pid, pc, buf, size);
+}
+
+/*
+ * Turns a stack record into a tuple of frames, innermost first.  Each
+ * distinct frame is a single interned string, shared by every stack (and
+ * every call) it appears in.
+ */
+static PyObject*
+_make_stack(DTraceConsumer *dtc, const dtrace_recdesc_t *rec, caddr_t addr) {
+  dtrace_actkind_t action = rec->dtrd_action == DTRACEACT_JSTACK ? DTRACEACT_USTACK : rec->dtrd_action;
+  const uint64_t *pcs;
+  uint64_t pid;
+  int depth = _stack_frames(rec, addr, &pid, &pcs), i;
+  PyObject* stack;
+  PyObject* frame;
+  char buf[2048];
+
+  if ((stack = PyTuple_New(depth)) == NULL) {
+    return NULL;
+  }
+
+  for (i = 0; i < depth; i++) {
+    dtc_sym_t *sym = _sym_lookup_pc(dtc, action, pid, pcs[i], 1);
+
+    frame = sym != NULL ? _sym_object(sym) :
+        PyString_InternFromString(_make_sym_pc(dtc->dtc_handle, action, pid, pcs[i], buf, sizeof (buf)));
+
+    if (frame == NULL) {
+      Py_DECREF(stack);
+      return NULL;
+    }
+
+    PyTuple_SET_ITEM(stack, i, frame);
+  }
+
+  return stack;
+}
+
+/*
+ * Appends a stack to out in folded form: outermost frame first, the frames
+ * separated by ';' and without offsets, as flame graph tools expect.
+ */
+static int
+_fold_stack(DTraceConsumer *dtc, const dtrace_recdesc_t *rec, caddr_t addr, dtc_buf_t *out, int gil) {
+  const uint64_t *pcs;
+  uint64_t pid;
+  int depth = _stack_frames(rec, addr, &pid, &pcs), i;
+  char buf[2048];
+
+  for (i = depth - 1; i >= 0; i--) {
+    const char *name = _frame_name(dtc, rec, pid, pcs[i], 1, buf, sizeof (buf), gil);
+    size_t len = strlen(name);
+    char *dst;
+
+    if ((dst = _buf_reserve(out, len + (i != depth - 1))) == NULL) {
+      return -1;
+    }
+
+    if (i != depth - 1) {
+      *dst++ = ';';
+    }
+
+    memcpy(dst, name, len);
+  }
+
+  return 0;
+}
+
+static PyObject* 
+_make_record(DTraceConsumer* self, const dtrace_recdesc_t *rec, caddr_t addr) {
+
+  switch (rec->dtrd_action) {
+  case DTRACEACT_DIFEXPR:
+    if (_is_int(rec)) {
+      return PyLong_FromLongLong(_make_int(rec, addr));
+    }
+    return Py_BuildValue("s", (const char *)addr);
+  case DTRACEACT_SYM:
+  case DTRACEACT_MOD:
+  case DTRACEACT_USYM:
+  case DTRACEACT_UMOD:
+  case DTRACEACT_UADDR:
+    {
+      dtc_sym_t *sym = _sym_lookup(self, rec, addr, 1);
+      char buf[2048];
+
+      if (sym != NULL) {
+        return _sym_object(sym);
+      }
+
+      return Py_BuildValue("s", _make_sym(self->dtc_handle, rec, addr, buf, sizeof (buf)));
+    }
+  case DTRACEACT_STACK:
+  case DTRACEACT_USTACK:
+  case DTRACEACT_JSTACK:
+    return _make_stack(self, rec, addr);
+  }
+
+  assert(0);
+  return Py_BuildValue("l", -1);
+}
+
+/*
+ * The format data of a printf() record is found by its dtrd_format, which is
+ * how dt_consume.c itself formats it.  libdtrace doesn't declare the lookup
+ * in <dtrace.h>, but it's what the printf() of every consumer goes through.
+ */
+extern void *dt_format_lookup(dtrace_hdl_t *, int);
+
+static const char*
+_printf_format(dtrace_hdl_t *dtp, const dtrace_recdesc_t *rec, char *buf, size_t size) {
+  void *fmtdata;
+
+  if (dtp == NULL || rec->dtrd_format == 0 || (fmtdata = dt_format_lookup(dtp, rec->dtrd_format)) == NULL) {
+    return NULL;
+  }
+
+  (void) dtrace_printf_format(dtp, fmtdata, buf, size);
+  return buf;
+}
+
+/*
+ * Counts the arguments a printf() format takes: one per conversion, and
+ * one more for each '*' width or precision.  A clause can hold several
+ * printf()s and other actions, so this is how many of the records after a
+ * printf() record are its own.
+ */
+static int
+_printf_nargs(const char *fmt) {
+  int nargs = 0;
+
+  while ((fmt = strchr(fmt, '%')) != NULL) {
+    if (*++fmt == '%') {
+      fmt++;
+      continue;
+    }
+
+    for (; *fmt != '\0' && strchr("-+ #0?'123456789.*hlLqjztw", *fmt) != NULL; fmt++) {
+      if (*fmt == '*') {
+        nargs++;
+      }
+    }
+
+    if (*fmt == '\0') {
+      break;
+    }
+
+    nargs++;
+    fmt++;
+  }
+
+  return nargs;
+}
+
+/*
+ * Returns the format of the printf() at record index of an EPID, cached by
+ * index in a dictionary (None if it has no format).  A format that isn't
+ * cached yet is looked up for rec if given, or else taken from fmt.
+ */
+static PyObject*
+_format_cached(DTraceConsumer *dtc, dtrace_epid_t epid, int index, const dtrace_recdesc_t *rec, const char *fmt) {
+  dtc_epid_t *entry = _epid_entry(dtc, epid);
+  PyObject* key;
+  PyObject* format;
+  char buf[2048];
+
+  if (entry == NULL) {
+    return NULL;
+  }
+
+  if (entry->dte_format == NULL && (entry->dte_format = PyDict_New()) == NULL) {
+    return NULL;
+  }
+
+  if ((key = PyInt_FromLong(index)) == NULL) {
+    return NULL;
+  }
+
+  if ((format = PyDict_GetItem(entry->dte_format, key)) != NULL) {
+    Py_DECREF(key);
+    Py_INCREF(format);
+    return format;
+  }
+
+  if (rec != NULL) {
+    fmt = _printf_format(dtc->dtc_handle, rec, buf, sizeof (buf));
+  }
+
+  if (fmt != NULL) {
+    format = PyString_FromString(fmt);
+  } else {
+    Py_INCREF(Py_None);
+    format = Py_None;
+  }
+
+  if (format == NULL || PyDict_SetItem(entry->dte_format, key, format) == -1) {
+    Py_DECREF(key);
+    Py_XDECREF(format);
+    return NULL;
+  }
+
+  Py_DECREF(key);
+  return format;
+}
+
+/*
+ * Decodes a printf() and its arguments into a (format, args) tuple instead
+ * of having libdtrace format it, and arranges for the argument records to
+ * be skipped as libdtrace hands them to us.
+ */
+static PyObject*
+_make_printf(DTraceConsumer *dtc, const dtrace_probedata_t *data, const dtrace_recdesc_t *rec) {
+  const dtrace_eprobedesc_t *epd = data->dtpda_edesc;
+  caddr_t base = data->dtpda_data - rec->dtrd_offset;
+  int first = (rec - epd->dtepd_rec) + 1, nargs = 0, i;
+  PyObject* format;
+  PyObject* args;
+  PyObject* arg;
+  char errbuf[256];
+
+  if ((format = _format_cached(dtc, epd->dtepd_epid, first - 1, rec, NULL)) == NULL) {
+    return NULL;
+  }
+
+  if (format != Py_None && (nargs = _printf_nargs(PyString_AS_STRING(format))) > epd->dtepd_nrecs - first) {
+    nargs = epd->dtepd_nrecs - first;
+  }
+
+  if ((args = PyTuple_New(nargs)) == NULL) {
+    Py_DECREF(format);
+    return NULL;
+  }
+
+  for (i = 0; i < nargs; i++) {
+    const dtrace_recdesc_t *arec = &epd->dtepd_rec[first + i];
+
+    if (!_valid(arec)) {
+      dtc->dtc_error = _error("unsupported action %s as argument #%d of printf()\n", _action(arec, errbuf, sizeof (errbuf)), i + 1);
+      goto err;
+    }
+
+    if ((arg = _make_record(dtc, arec, base + arec->dtrd_offset)) == NULL) {
+      goto err;
+    }
+
+    PyTuple_SET_ITEM(args, i, arg);
+  }
+
+  dtc->dtc_skip = nargs;
+
+  return Py_BuildValue("(NN)", format, args);
+
+err:
+  Py_DECREF(format);
+  Py_DECREF(args);
+  return NULL;
+}
+
+/*
+ * Hands the records gathered so far by consume_batch() to the callback in a
+ * single call, and (if refill is set) starts a fresh batch for the rest of
+ * the pass.
+ */
+static int
+_batch_flush(DTraceConsumer *dtc, int refill) {
+  PyObject* batch = dtc->dtc_batch;
+  PyObject* result;
+  uint64_t start;
+
+  if (batch == NULL || dtc->dtc_batch_len == 0) {
+    return 0;
+  }
+
+  if (dtc->dtc_batch_max > 0 && dtc->dtc_batch_len < dtc->dtc_batch_max) {
+    /*
+     * The list was preallocated to max_batch; drop the unused slots.
+     */
+    if (PyList_SetSlice(batch, dtc->dtc_batch_len, dtc->dtc_batch_max, NULL) == -1) {
+      return -1;
+    }
+  }
+
+  dtc->dtc_batch = refill ? PyList_New(dtc->dtc_batch_max) : NULL;
+  dtc->dtc_batch_len = 0;
+
+  start = _now();
+  result = PyObject_CallFunctionObjArgs(dtc->dtc_callback, batch, NULL);
+  dtc->dtc_stats.dts_callback += _now() - start;
+  Py_DECREF(batch);
+
+  if (result == NULL || (refill && dtc->dtc_batch == NULL)) {
+    Py_XDECREF(result);
+    return -1;
+  }
+
+  Py_DECREF(result);
+  return 0;
+}
+
+/*
+ * Calls callback with a (probe, record) pair, stealing both references.
+ * The callback is held for the duration of the call, as the callback of a
+ * route may unroute() itself.
+ */
+static int
+_dispatch(DTraceConsumer *dtc, PyObject *callback, PyObject *probe, PyObject *record) {
+  PyObject* argv[] = { probe, record };
+  PyObject* result;
+  uint64_t start;
+
+  Py_INCREF(callback);
+  start = _callback_start(&dtc->dtc_stats);
+  result = _call(dtc, callback, 2, argv);
+  _callback_end(&dtc->dtc_stats, start);
+  Py_DECREF(callback);
+  Py_DECREF(probe);
+  Py_DECREF(record);
+
+  if (result == NULL) {
+    return -1;
+  }
+
+  Py_DECREF(result);
+  return 0;
+}
+
+/*
+ * Hands a (probe, record) pair to python, stealing both references, calling
+ * the callback of route (see _route()).  When consume_batch() is driving
+ * dtrace_work(), a pair that isn't routed to a callback of its own is
+ * appended to the current batch instead of being dispatched, so that the
+ * per-record cost is a tuple and a list slot rather than a call into the
+ * interpreter.
+ */
+static int
+_emit(DTraceConsumer *dtc, int route, PyObject *probe, PyObject *record) {
+  PyObject* callback;
+
+  if (probe == NULL || record == NULL) {
+    Py_XDECREF(probe);
+    Py_XDECREF(record);
+    return -1;
+  }
+
+  if ((callback = _route_callback(dtc, route)) != NULL) {
+    return _dispatch(dtc, callback, probe, record);
+  }
+
+  if (dtc->dtc_batch != NULL) {
+    PyObject* pair = PyTuple_New(2);
+
+    if (pair == NULL) {
+      Py_DECREF(probe);
+      Py_DECREF(record);
+      return -1;
+    }
+
+    PyTuple_SET_ITEM(pair, 0, probe);
+    PyTuple_SET_ITEM(pair, 1, record);
+
+    if (dtc->dtc_batch_max > 0) {
+      PyList_SET_ITEM(dtc->dtc_batch, dtc->dtc_batch_len, pair);
+    } else if (PyList_Append(dtc->dtc_batch, pair) == -1) {
+      Py_DECREF(pair);
+      return -1;
+    } else {
+      Py_DECREF(pair);
+    }
+
+    if (++dtc->dtc_batch_len == dtc->dtc_batch_max) {
+      return _batch_flush(dtc, 1);
+    }
+
+    return 0;
+  }
+
+  return _dispatch(dtc, dtc->dtc_callback, probe, record);
+}
+
+static DTraceHistogram*
+_histogram_new(PyTypeObject *type, Py_ssize_t nbuckets) {
+  DTraceHistogram* hist;
+
+  if ((hist = (DTraceHistogram *)type->tp_alloc(type, 0)) == NULL) {
+    return NULL;
+  }
+
+  if (nbuckets > 0 && (hist->dthg_buckets = malloc(nbuckets * sizeof (dtc_hbucket_t))) == NULL) {
+    Py_DECREF(hist);
+    PyErr_NoMemory();
+    return NULL;
+  }
+
+  hist->dthg_nbuckets = 0;
+  return hist;
+}
+
+/*
+ * Builds a Histogram from the non-empty buckets of a quantized value, taking
+ * their bounds from the cached ranges.
+ */
+static PyObject*
+_make_histogram(PyObject* ranges, const int64_t *data, int nbuckets) {
+  DTraceHistogram* hist;
+  int i, n = 0;
+
+  if (ranges == NULL) {
+    return NULL;
+  }
+
+  for (i = 0; i < nbuckets; i++) {
+    n += data[i] != 0;
+  }
+
+  if ((hist = _histogram_new(&DTraceHistogramType, n)) == NULL) {
+    return NULL;
+  }
+
+  for (i = 0; i < nbuckets; i++) {
+    dtc_hbucket_t *b = &hist->dthg_buckets[hist->dthg_nbuckets];
+    PyObject* range = PyTuple_GET_ITEM(ranges, i);
+
+    if (!data[i]) continue;
+
+    b->dthb_min = PyLong_AsLongLong(PyTuple_GET_ITEM(range, 0));
+    b->dthb_max = PyLong_AsLongLong(PyTuple_GET_ITEM(range, 1));
+    b->dthb_count = data[i];
+    hist->dthg_nbuckets++;
+  }
+
+  return (PyObject *)hist;
+}
+
+/*
+ * Builds the [[min, max], count] pairs for the non-empty buckets of a
+ * quantized aggregation; the range tuples are shared with the cache.  With
+ * histograms set, builds a Histogram instead.
+ */
+static PyObject*
+_make_buckets(DTraceConsumer *dtc, PyObject* ranges, const int64_t *data, int nbuckets) {
+  PyObject* buckets;
+  PyObject* datum;
+  int i;
+
+  if (dtc->dtc_histograms) {
+    return _make_histogram(ranges, data, nbuckets);
+  }
+
+  if ((buckets = PyList_New(0)) == NULL || ranges == NULL) {
+    Py_XDECREF(buckets);
+    return NULL;
+  }
+
+  for (i = 0; i < nbuckets; i++) {
+
+    if (!data[i]) continue;
+
+    if ((datum = PyList_New(2)) == NULL) {
+      Py_DECREF(buckets);
+      return NULL;
+    }
+
+    Py_INCREF(PyTuple_GET_ITEM(ranges, i));
+    PyList_SET_ITEM(datum, 0, PyTuple_GET_ITEM(ranges, i));
+    PyList_SET_ITEM(datum, 1, PyLong_FromLongLong(data[i]));
+
+    if (PyList_GET_ITEM(datum, 1) == NULL || PyList_Append(buckets, datum) == -1) {
+      Py_DECREF(datum);
+      Py_DECREF(buckets);
+      return NULL;
+    }
+
+    Py_DECREF(datum);
+  }
+
+  return buckets;
+}
+
+/*
+ * Builds the key of an aggregation record in the previous values of delta
+ * walks -- its variable ID and key bytes -- in dtc_scratch, with room for a
+ * delta after it.  _aggdelta() puts the delta at the next eight-byte boundary
+ * past the key, hence the 7 bytes of padding.
+ */
+static char*
+_aggdelta_key(DTraceConsumer *dtc, const dtrace_aggdata_t *agg) {
+  const dtrace_aggdesc_t *aggdesc = agg->dtada_desc;
+  const dtrace_recdesc_t *aggrec = &aggdesc->dtagd_rec[aggdesc->dtagd_nrecs - 1];
+  size_t keylen = aggrec->dtrd_offset - aggdesc->dtagd_rec[1].dtrd_offset;
+  char *key;
+
+  dtc->dtc_scratch.dtb_len = 0;
+
+  if (_buf_reserve(&dtc->dtc_scratch, sizeof (dtrace_aggvarid_t) + keylen + 7 + aggrec->dtrd_size) == NULL) {
+    PyErr_NoMemory();
+    return NULL;
+  }
+
+  key = dtc->dtc_scratch.dtb_data;
+  memcpy(key, &aggdesc->dtagd_varid, sizeof (dtrace_aggvarid_t));
+  memcpy(key + sizeof (dtrace_aggvarid_t), agg->dtada_data + aggdesc->dtagd_rec[1].dtrd_offset, keylen);
+
+  return key;
+}
+
+/*
+ * For a delta aggwalk(), compares the value of an aggregation record with
+ * the one seen by the previous walk, keyed by the variable ID and the key
+ * bytes.  Returns 0 if it hasn't changed; otherwise points *datap at the
+ * difference (or, for min() and max(), at the new value) and returns 1.
+ * Each previous value is preceded by the dtc_aggpass of the last walk that
+ * saw it, for _aggdelta_prune().
+ */
+static int
+_aggdelta(DTraceConsumer *dtc, const dtrace_aggdata_t *agg, const int64_t **datap) {
+  const dtrace_aggdesc_t *aggdesc = agg->dtada_desc;
+  const dtrace_recdesc_t *aggrec = &aggdesc->dtagd_rec[aggdesc->dtagd_nrecs - 1];
+  const int64_t *cur = (int64_t *)(agg->dtada_data + aggrec->dtrd_offset);
+  size_t keylen = aggrec->dtrd_offset - aggdesc->dtagd_rec[1].dtrd_offset;
+  size_t n = aggrec->dtrd_size / sizeof (int64_t), i;
+  dtc_hashent_t *ent;
+  int64_t *prev, *delta;
+  char *key;
+
+  if ((key = _aggdelta_key(dtc, agg)) == NULL) {
+    return -1;
+  }
+
+  delta = (int64_t *)(key + ((sizeof (dtrace_aggvarid_t) + keylen + 7) & ~7));
+
+  if ((ent = _hash_lookup(&dtc->dtc_aggprev, key, sizeof (dtrace_aggvarid_t) + keylen, 1)) == NULL) {
+    PyErr_NoMemory();
+    return -1;
+  }
+
+  if (ent->dthe_value == 0 && (ent->dthe_value = (uintptr_t)calloc(n + 1, sizeof (int64_t))) == 0) {
+    PyErr_NoMemory();
+    return -1;
+  }
+
+  *(uint64_t *)ent->dthe_value = dtc->dtc_aggpass;
+  prev = (int64_t *)ent->dthe_value + 1;
+
+  if (memcmp(prev, cur, aggrec->dtrd_size) == 0) {
+    return 0;
+  }
+
+  switch (aggrec->dtrd_action) {
+  case DTRACEAGG_MIN:
+  case DTRACEAGG_MAX:
+    memcpy(delta, cur, aggrec->dtrd_size);
+    break;
+
+  default:
+    for (i = 0; i < n; i++) {
+      delta[i] = cur[i] - prev[i];
+    }
+
+    /*
+     * The first word of an lquantize()/llquantize() value is its encoding.
+     */
+    if (aggrec->dtrd_action == DTRACEAGG_LQUANTIZE ||
+        aggrec->dtrd_action == DTRACEAGG_LLQUANTIZE) {
+      delta[0] = cur[0];
+    }
+  }
+
+  memcpy(prev, cur, aggrec->dtrd_size);
+  *datap = delta;
+
+  return 1;
+}
+
+/*
+ * Forgets what delta walks saw of an aggregation record that a selective
+ * "remove" walk is removing, as if it had been zero.
+ */
+static int
+_aggdelta_clear(DTraceConsumer *dtc, const dtrace_aggdata_t *agg) {
+  const dtrace_aggdesc_t *aggdesc = agg->dtada_desc;
+  const dtrace_recdesc_t *aggrec = &aggdesc->dtagd_rec[aggdesc->dtagd_nrecs - 1];
+  size_t keylen = aggrec->dtrd_offset - aggdesc->dtagd_rec[1].dtrd_offset;
+  dtc_hashent_t *ent;
+  char *key;
+
+  if ((key = _aggdelta_key(dtc, agg)) == NULL) {
+    return -1;
+  }
+
+  if ((ent = _hash_lookup(&dtc->dtc_aggprev, key, sizeof (dtrace_aggvarid_t) + keylen, 0)) != NULL &&
+      ent->dthe_value != 0) {
+    memset((int64_t *)ent->dthe_value + 1, 0, aggrec->dtrd_size);
+  }
+
+  return 0;
+}
+
+/*
+ * Ends a delta walk by dropping what delta walks saw of the records it
+ * didn't come across, which are gone from the aggregations (by trunc(), or
+ * a "remove" walk of another consumer) -- of every variable if the walk was
+ * of them all, and otherwise of the variables it saw records of.  Without
+ * this, dtc_aggprev would grow with every key an aggregation ever had.
+ */
+static int
+_aggdelta_prune(DTraceConsumer *dtc, int all) {
+  dtc_hash_t *h = &dtc->dtc_aggprev;
+  dtrace_aggvarid_t *seen = NULL, varid;
+  dtc_hashent_t *ents;
+  size_t nseen = 0, i, j;
+
+  if (h->dth_ents == NULL) {
+    dtc->dtc_aggpass++;
+    return 0;
+  }
+
+  if (!all) {
+    if ((seen = malloc(h->dth_count * sizeof (dtrace_aggvarid_t))) == NULL) {
+      PyErr_NoMemory();
+      return -1;
+    }
+
+    for (i = 0; i < h->dth_size; i++) {
+      if (h->dth_ents[i].dthe_key == NULL || h->dth_ents[i].dthe_value == 0 ||
+          *(uint64_t *)h->dth_ents[i].dthe_value != dtc->dtc_aggpass) {
+        continue;
+      }
+
+      memcpy(&varid, h->dth_ents[i].dthe_key, sizeof (varid));
+
+      for (j = 0; j < nseen && seen[j] != varid; j++) {
+        continue;
+      }
+
+      if (j == nseen) {
+        seen[nseen++] = varid;
+      }
+    }
+  }
+
+  if ((ents = calloc(h->dth_size, sizeof (dtc_hashent_t))) == NULL) {
+    free(seen);
+    PyErr_NoMemory();
+    return -1;
+  }
+
+  for (i = 0; i < h->dth_size; i++) {
+    dtc_hashent_t *ent = &h->dth_ents[i];
+
+    if (ent->dthe_key == NULL) {
+      continue;
+    }
+
+    if (ent->dthe_value == 0 || *(uint64_t *)ent->dthe_value != dtc->dtc_aggpass) {
+      memcpy(&varid, ent->dthe_key, sizeof (varid));
+
+      for (j = 0; j < nseen && seen[j] != varid; j++) {
+        continue;
+      }
+
+      if (all || j < nseen) {
+        free(ent->dthe_key);
+        free((void *)ent->dthe_value);
+        h->dth_count--;
+        continue;
+      }
+    }
+
+    *_hash_free_slot(ents, h->dth_size, ent->dthe_hash) = *ent;
+  }
+
+  free(seen);
+  free(h->dth_ents);
+  h->dth_ents = ents;
+  dtc->dtc_aggpass++;
+
+  return 0;
+}
+
+/*
+ * Builds the list of keys and the value of an aggregation record, data
+ * pointing at its value.  Returns DTRACE_AGGWALK_NEXT, or what the walk is
+ * to return if that failed: DTRACE_AGGWALK_ERROR with dtc_error set, or
+ * DTRACE_AGGWALK_ABORT with a python exception.
+ */
+static int
+_make_aggrec(DTraceConsumer *dtc, const dtrace_aggdata_t *agg, const int64_t *data, PyObject **keysp, PyObject **valp) {
+  const dtrace_aggdesc_t *aggdesc = agg->dtada_desc;
+  const dtrace_recdesc_t *aggrec = &aggdesc->dtagd_rec[aggdesc->dtagd_nrecs - 1];
+  PyObject* keys = PyList_New(aggdesc->dtagd_nrecs - 2);
+  PyObject* val = NULL;
+
+  char errbuf[256];
+  int i;
+
+  if (keys == NULL) {
+    return (DTRACE_AGGWALK_ABORT);
+  }
+
+  for (i = 1; i < aggdesc->dtagd_nrecs - 1; i++) {
+    const dtrace_recdesc_t *rec = &aggdesc->dtagd_rec[i];
+    caddr_t addr = agg->dtada_data + rec->dtrd_offset;    
+    PyObject* key;
+
+    if (!_valid(rec)) {
+      dtc->dtc_error = _error("unsupported action %s as key #%d in aggregation \"%s\"\n", _action(rec, errbuf, sizeof (errbuf)), i, aggdesc->dtagd_name);
+      Py_DECREF(keys);
+      return (DTRACE_AGGWALK_ERROR);
+    }
+
+    if ((key = _make_record(dtc, rec, addr)) == NULL) {
+      Py_DECREF(keys);
+      return (DTRACE_AGGWALK_ABORT);
+    }
+
+    PyList_SET_ITEM(keys, i - 1, key);
+  }
+
+  switch (aggrec->dtrd_action) {
+  case DTRACEAGG_COUNT:
+  case DTRACEAGG_MIN:
+  case DTRACEAGG_MAX:
+  case DTRACEAGG_SUM: {
+    assert(aggrec->dtrd_size == sizeof (uint64_t));
+    val = Py_BuildValue("l", data[0]);
+    break;
+  }
+
+  case DTRACEAGG_AVG: {
+    assert(aggrec->dtrd_size == sizeof (uint64_t) * 2);
+
+    val = Py_BuildValue("d", data[1] / (double)data[0]);
+    break;
+  }
+
+  case DTRACEAGG_QUANTIZE: {
+    val = _make_buckets(dtc, _ranges_quantize(dtc, aggdesc->dtagd_varid), data, DTRACE_QUANTIZE_NBUCKETS);
+    break;
+  }
+
+  case DTRACEAGG_LQUANTIZE:
+  case DTRACEAGG_LLQUANTIZE: {
+    PyObject* ranges;
+
+    uint64_t arg = *data++;
+    int levels = (aggrec->dtrd_size / sizeof (uint64_t)) - 1;
+
+    ranges = (aggrec->dtrd_action == DTRACEAGG_LQUANTIZE ?
+        _ranges_lquantize(dtc, aggdesc->dtagd_varid, arg) :
+        _ranges_llquantize(dtc, aggdesc->dtagd_varid, arg, levels));
+
+    val = _make_buckets(dtc, ranges, data, levels);
+    break;
+  }
+
+  default:
+    dtc->dtc_error = _error("unsupported aggregating action %s in aggregation \"%s\"\n", _action(aggrec, errbuf, sizeof (errbuf)), aggdesc->dtagd_name);
+    Py_DECREF(keys);
+    return (DTRACE_AGGWALK_ERROR);
+  }
+
+  if (val == NULL) {
+    Py_DECREF(keys);
+    return (DTRACE_AGGWALK_ABORT);
+  }
+
+  *keysp = keys;
+  *valp = val;
+  return (DTRACE_AGGWALK_NEXT);
+}
+
+/*
+ * Resolves what the aggwalk() in progress does with the records of an
+ * aggregation variable: returns the callback they go to, Py_None if the
+ * variable isn't walked, or NULL with an exception.  Callbacks and
+ * variables are looked up by variable ID, then by name, with or without
+ * its "@".
+ */
+static PyObject*
+_aggsel(DTraceConsumer *dtc, const dtrace_aggdesc_t *aggdesc) {
+  dtc_aggsel_t *sel = &dtc->dtc_aggsel;
+  dtrace_aggvarid_t varid = aggdesc->dtagd_varid;
+  const char *name = aggdesc->dtagd_name != NULL ? aggdesc->dtagd_name : "";
+  PyObject *callback = NULL;
+  PyObject *names[3];
+  int i, selected;
+
+  if (sel->dtas_callbacks == NULL && sel->dtas_vars == NULL) {
+    return dtc->dtc_callback;
+  }
+
+  if (varid < sel->dtas_nvarids && sel->dtas_byvarid[varid] != NULL) {
+    return sel->dtas_byvarid[varid];
+  }
+
+  if (varid >= sel->dtas_nvarids) {
+    dtrace_aggvarid_t n = sel->dtas_nvarids ? sel->dtas_nvarids : 16;
+    PyObject **byvarid;
+
+    while (n <= varid) {
+      n <<= 1;
+    }
+
+    if ((byvarid = realloc(sel->dtas_byvarid, n * sizeof (PyObject *))) == NULL) {
+      PyErr_NoMemory();
+      return NULL;
+    }
+
+    memset(byvarid + sel->dtas_nvarids, 0, (n - sel->dtas_nvarids) * sizeof (PyObject *));
+    sel->dtas_byvarid = byvarid;
+    sel->dtas_nvarids = n;
+  }
+
+  names[0] = PyInt_FromLong(varid);
+  names[1] = PyString_FromString(name);
+  names[2] = PyString_FromFormat("@%s", name);
+  selected = (sel->dtas_vars == NULL);
+
+  for (i = 0; i < 3; i++) {
+    if (names[i] == NULL) {
+      selected = -1;
+      break;
+    }
+
+    if (sel->dtas_callbacks != NULL && callback == NULL) {
+      callback = PyDict_GetItem(sel->dtas_callbacks, names[i]);
+    }
+
+    if (sel->dtas_vars != NULL && selected == 0) {
+      selected = PySequence_Contains(sel->dtas_vars, names[i]);
+    }
+
+    if (selected == -1) {
+      break;
+    }
+  }
+
+  for (i = 0; i < 3; i++) {
+    Py_XDECREF(names[i]);
+  }
+
+  if (selected == -1) {
+    return NULL;
+  }
+
+  /*
+   * Without a list of variables, the callbacks select them.
+   */
+  if (sel->dtas_vars == NULL && sel->dtas_callbacks != NULL && callback == NULL) {
+    selected = 0;
+  }
+
+  if (!selected) {
+    callback = Py_None;
+  } else if (callback == NULL && (callback = dtc->dtc_callback) == NULL) {
+    PyErr_Format(PyExc_ValueError, "no callback for aggregation \"%s\" (variable %d)", name, (int)varid);
+    return NULL;
+  }
+
+  sel->dtas_byvarid[varid] = callback;
+  return callback;
+}
+
+static int 
+_aggwalk(const dtrace_aggdata_t *agg, void *arg) {
+
+  DTraceConsumer *dtc = (DTraceConsumer *)arg;
+  const dtrace_aggdesc_t *aggdesc = agg->dtada_desc;
+  const dtrace_recdesc_t *aggrec;
+  PyObject* id;
+  PyObject* keys;
+  PyObject* val;
+  PyObject* callback;
+  PyObject* result;
+  uint64_t start;
+  int rval;
+
+
+  /*
+   * We expect to have both a variable ID and an aggregation value here;
+   * if we have fewer than two records, something is deeply wrong.
+   */
+  assert(aggdesc->dtagd_nrecs >= 2);
+
+  if ((callback = _aggsel(dtc, aggdesc)) == NULL) {
+    return (DTRACE_AGGWALK_ABORT);
+  }
+
+  /*
+   * The variables that aren't walked are left as they are, even by a
+   * "remove" walk.
+   */
+  if (callback == Py_None) {
+    return (DTRACE_AGGWALK_NEXT);
+  }
+
+  aggrec = &aggdesc->dtagd_rec[aggdesc->dtagd_nrecs - 1];
+
+  const int64_t *data = (int64_t *)(agg->dtada_data + aggrec->dtrd_offset);
+
+  if (dtc->dtc_aggmode == DTC_AGGWALK_DELTA) {
+    switch (_aggdelta(dtc, agg, &data)) {
+    case -1:
+      return (DTRACE_AGGWALK_ABORT);
+    case 0:
+      return (DTRACE_AGGWALK_NEXT);
+    }
+  }
+
+  if ((rval = _make_aggrec(dtc, agg, data, &keys, &val)) != DTRACE_AGGWALK_NEXT) {
+    return (rval);
+  }
+
+  if ((id = PyInt_FromLong(aggdesc->dtagd_varid)) == NULL) {
+    Py_DECREF(keys);
+    Py_DECREF(val);
+    return (DTRACE_AGGWALK_ABORT);
+  }
+
+  PyObject* argv[] = { id, keys, val };
+
+  start = _callback_start(&dtc->dtc_stats);
+  result = _call(dtc, callback, 3, argv);
+  _callback_end(&dtc->dtc_stats, start);
+  Py_DECREF(id);
+  Py_DECREF(keys);
+  Py_DECREF(val);
+
+  if (result == NULL) {
+    return (DTRACE_AGGWALK_ABORT);
+  }
+
+  Py_DECREF(result);
+
+  if (dtc->dtc_aggmode != DTC_AGGWALK_REMOVE) {
+    return (DTRACE_AGGWALK_NEXT);
+  }
+
+  /*
+   * A walk of all the variables forgets what delta walks saw of them all
+   * at once; one of some of them only forgets what it removes.
+   */
+  if (dtc->dtc_aggsel.dtas_callbacks != NULL || dtc->dtc_aggsel.dtas_vars != NULL) {
+    if (_aggdelta_clear(dtc, agg) == -1) {
+      return (DTRACE_AGGWALK_ABORT);
+    }
+  }
+
+  return (DTRACE_AGGWALK_REMOVE);
+}
+
+static void
+_chunk_free(dtc_chunk_t *chunk) {
+  while (chunk != NULL) {
+    dtc_chunk_t *next = chunk->dtch_next;
+
+    free(chunk->dtch_buf.dtb_data);
+    free(chunk);
+    chunk = next;
+  }
+}
+
+/*
+ * Appends a decoded record to the chunk that the background thread is
+ * filling; called without the GIL.
+ */
+static int
+_rec_append_bytes(dtc_background_t *bg, const dtrace_probedata_t *data, uint32_t kind, int64_t value, const char *str, size_t len) {
+  size_t size = (sizeof (dtc_rec_t) + len + 7) & ~(size_t)7;
+  dtc_rec_t *rec;
+
+  if (bg->dtbg_chunk == NULL && (bg->dtbg_chunk = calloc(1, sizeof (dtc_chunk_t))) == NULL) {
+    return -1;
+  }
+
+  if ((rec = (dtc_rec_t *)_buf_reserve(&bg->dtbg_chunk->dtch_buf, size)) == NULL) {
+    return -1;
+  }
+
+  rec->dtr_pdesc = data->dtpda_pdesc;
+  rec->dtr_epid = data->dtpda_edesc->dtepd_epid;
+  rec->dtr_size = size;
+  rec->dtr_kind = kind;
+  rec->dtr_route = bg->dtbg_route;
+  rec->dtr_value = value;
+
+  if (str != NULL) {
+    memcpy(rec->dtr_str, str, len);
+  }
+
+  bg->dtbg_chunk->dtch_nrecs++;
+  return 0;
+}
+
+static int
+_rec_append(dtc_background_t *bg, const dtrace_probedata_t *data, uint32_t kind, int64_t value, const char *str) {
+  return _rec_append_bytes(bg, data, kind, value, str, str != NULL ? strlen(str) + 1 : 0);
+}
+
+static int 
+_bufhandler(const dtrace_bufdata_t *bufdata, void *arg) {
+
+  dtrace_probedata_t *data = bufdata->dtbda_probe;
+  const dtrace_recdesc_t *rec = bufdata->dtbda_recdesc;
+  DTraceConsumer *dtc = (DTraceConsumer *)arg;
+
+  if (rec == NULL || rec->dtrd_action != DTRACEACT_PRINTF)
+    return (DTRACE_HANDLE_OK);
+
+  if (dtc->dtc_bg.dtbg_active || dtc->dtc_native) {
+    /*
+     * We're being called from the background thread, without the GIL, or
+     * from a consume_iter() pass, which decodes the same way.
+     */
+    if (_rec_append(&dtc->dtc_bg, data, DTC_REC_STR, 0, bufdata->dtbda_buffered) == -1) {
+      return (DTRACE_HANDLE_ABORT);
+    }
+
+    return (DTRACE_HANDLE_OK);
+  }
+
+  int route = _route(dtc, data->dtpda_edesc->dtepd_epid, data->dtpda_pdesc);
+  PyObject* probe = _probe_cached(dtc, data->dtpda_edesc->dtepd_epid, data->dtpda_pdesc);
+  PyObject* record = Py_BuildValue("s", bufdata->dtbda_buffered);
+
+  if (_emit(dtc, route, probe, record) == -1) {
+    return (DTRACE_HANDLE_ABORT);
+  }
+
+  return (DTRACE_HANDLE_OK);
+}
+
+/*
+ * Fails the pass a drop or error handler was called from, with libdtrace's
+ * message about it (less its new-line) as the error, unless there already
+ * is one.
+ */
+static int
+_handler_abort(DTraceConsumer *dtc, const char *msg) {
+  dtc_background_t *bg = &dtc->dtc_bg;
+  int len = strcspn(msg, "\n");
+
+  if (bg->dtbg_active || dtc->dtc_native) {
+    if (bg->dtbg_error[0] == '\0') {
+      snprintf(bg->dtbg_error, sizeof (bg->dtbg_error), "%.*s", len, msg);
+    }
+  } else if (dtc->dtc_error == Py_None) {
+    dtc->dtc_error = _error("%.*s\n", len, msg);
+  }
+
+  return (DTRACE_HANDLE_ABORT);
+}
+
+/*
+ * Without a drop handler, libdtrace fails the pass on the first drop; we
+ * count drops instead, by kind, and carry on -- unless the consumer is
+ * strict, in which case the drops are counted and then fail the pass as
+ * they would have.
+ */
+static int
+_drophandler(const dtrace_dropdata_t *drop, void *arg) {
+  DTraceConsumer *dtc = (DTraceConsumer *)arg;
+  int kind;
+
+  switch (drop->dtdda_kind) {
+  case DTRACEDROP_PRINCIPAL:
+    kind = DTC_DROP_PRINCIPAL;
+    break;
+  case DTRACEDROP_AGGREGATION:
+    kind = DTC_DROP_AGGREGATION;
+    break;
+  case DTRACEDROP_SPEC:
+  case DTRACEDROP_SPECBUSY:
+  case DTRACEDROP_SPECUNAVAIL:
+    kind = DTC_DROP_SPECULATION;
+    break;
+  case DTRACEDROP_DYNAMIC:
+  case DTRACEDROP_DYNRINSE:
+  case DTRACEDROP_DYNDIRTY:
+    kind = DTC_DROP_DYNVAR;
+    break;
+  default:
+    kind = DTC_DROP_OTHER;
+    break;
+  }
+
+  dtc->dtc_stats.dts_drops[kind] += drop->dtdda_drops;
+
+  if (kind == DTC_DROP_PRINCIPAL) {
+    dtc->dtc_tune.dtt_drops += drop->dtdda_drops;
+  } else if (kind == DTC_DROP_AGGREGATION) {
+    dtc->dtc_tune.dtt_aggdrops += drop->dtdda_drops;
+  }
+
+  if (dtc->dtc_strict) {
+    return _handler_abort(dtc, drop->dtdda_msg);
+  }
+
+  return (DTRACE_HANDLE_OK);
+}
+
+/*
+ * Likewise for firings of the ERROR probe.
+ */
+static int
+_errhandler(const dtrace_errdata_t *err, void *arg) {
+  DTraceConsumer *dtc = (DTraceConsumer *)arg;
+
+  dtc->dtc_stats.dts_errors++;
+
+  if (dtc->dtc_strict) {
+    return _handler_abort(dtc, err->dteda_msg);
+  }
+
+  return (DTRACE_HANDLE_OK);
+}
+
+/*
+ * Doubles the size option name for the next run, up to max.
+ */
+static void
+_tune_grow(dtrace_hdl_t *dtp, const char *name, dtrace_optval_t *next, dtrace_optval_t max) {
+  dtrace_optval_t cur;
+
+  if (dtrace_getopt(dtp, name, &cur) == -1 || cur < *next) {
+    cur = *next;
+  }
+
+  if (cur > 0 && cur < max) {
+    *next = cur * 2 < max ? cur * 2 : max;
+  }
+}
+
+static int
+_tune_setrate(dtrace_hdl_t *dtp, const char *name, dtrace_optval_t rate) {
+  char buf[64];
+
+  snprintf(buf, sizeof (buf), "%lldns", (long long)rate);
+  return dtrace_setopt(dtp, name, buf);
+}
+
+/*
+ * Looks at the drops since the last buffer switch, interval nanoseconds
+ * ago (0 if there was none).  Drops call for a larger bufsize on the next
+ * run, as the buffers can't be resized while tracing; if we're switching as
+ * often as switchrate lets us, switching more often relieves them in the
+ * meantime, whereas if python is calling late, it wouldn't.  Once there
+ * have been no drops for a while, switchrate is relaxed back towards what
+ * was configured.
+ */
+static void
+_tune(DTraceConsumer *dtc, uint64_t interval) {
+  dtc_tune_t *tn = &dtc->dtc_tune;
+  dtrace_hdl_t *dtp = dtc->dtc_handle;
+  dtrace_optval_t rate;
+
+  if (!tn->dtt_enabled || dtp == NULL || dtrace_getopt(dtp, "switchrate", &rate) == -1 || rate <= 0) {
+    return;
+  }
+
+  if (tn->dtt_switchrate == 0) {
+    tn->dtt_switchrate = rate;
+  }
+
+  if (tn->dtt_drops > 0) {
+    tn->dtt_drops = 0;
+    tn->dtt_quiet = 0;
+    _tune_grow(dtp, "bufsize", &tn->dtt_bufsize, tn->dtt_maxbufsize);
+
+    if (interval != 0 && interval < (uint64_t)rate * 2 && rate / 2 >= tn->dtt_minrate) {
+      (void) _tune_setrate(dtp, "switchrate", rate / 2);
+    }
+  } else if (++tn->dtt_quiet >= DTC_TUNE_QUIET && rate < tn->dtt_switchrate) {
+    tn->dtt_quiet = 0;
+    (void) _tune_setrate(dtp, "switchrate", rate * 2 < tn->dtt_switchrate ? rate * 2 : tn->dtt_switchrate);
+  }
+}
+
+/*
+ * Looks at the aggregation drops since the last snapshot: the next run gets
+ * a larger aggsize, and a faster aggrate (which can't be changed while
+ * tracing either).
+ */
+static void
+_tune_agg(DTraceConsumer *dtc) {
+  dtc_tune_t *tn = &dtc->dtc_tune;
+  dtrace_hdl_t *dtp = dtc->dtc_handle;
+  dtrace_optval_t rate;
+
+  if (!tn->dtt_enabled || dtp == NULL || tn->dtt_aggdrops == 0) {
+    return;
+  }
+
+  tn->dtt_aggdrops = 0;
+  _tune_grow(dtp, "aggsize", &tn->dtt_aggsize, tn->dtt_maxaggsize);
+
+  if (dtrace_getopt(dtp, "aggrate", &rate) == -1 || (tn->dtt_aggrate > 0 && tn->dtt_aggrate < rate)) {
+    rate = tn->dtt_aggrate;
+  }
+
+  if (rate / 2 >= tn->dtt_minrate) {
+    tn->dtt_aggrate = rate / 2;
+  }
+}
+
+/*
+ * Accounts for a dtrace_work() pass that began at start, when the callback
+ * time stood at callback: its own time, and, if it switched buffers, the
+ * interval since the previous switch.  libdtrace only switches once
+ * switchrate has passed since the last switch; a replay has no switchrate,
+ * so every pass counts.
+ */
+static void
+_stats_work(DTraceConsumer *dtc, uint64_t start, uint64_t callback) {
+  dtc_stats_t *st = &dtc->dtc_stats;
+  dtrace_optval_t rate = 0;
+  uint64_t elapsed = _now() - start;
+  uint64_t interval;
+  int i;
+
+  /*
+   * The callback time may be an estimate (see DTC_STATS_SAMPLE), and so may
+   * exceed the time of the pass.
+   */
+  callback = st->dts_callback - callback;
+
+  st->dts_passes++;
+  st->dts_work += elapsed > callback ? elapsed - callback : 0;
+
+  if (dtc->dtc_handle != NULL && dtrace_getopt(dtc->dtc_handle, "switchrate", &rate) == -1) {
+    rate = 0;
+  }
+
+  interval = st->dts_lastswitch != 0 ? start - st->dts_lastswitch : 0;
+
+  if (interval != 0) {
+    uint64_t us = interval / 1000;
+
+    if (rate > 0 && interval < (uint64_t)rate) {
+      return;
+    }
+
+    for (i = 0; us != 0 && i < DTC_STATS_NBUCKETS - 1; i++) {
+      us >>= 1;
+    }
+
+    st->dts_switches[i]++;
+  }
+
+  st->dts_nswitches++;
+  st->dts_lastswitch = start;
+
+  _tune(dtc, interval);
+}
+
+static int 
+_consume(const dtrace_probedata_t *data, const dtrace_recdesc_t *rec, void *arg) {
+  DTraceConsumer *dtc = (DTraceConsumer *)arg;
+  dtrace_probedesc_t *pd = data->dtpda_pdesc;
+  int route;
+
+  if (rec == NULL) {
+    //PyObject* result = PyObject_CallFunction((PyObject*)dtc->dtc_callback, "OO", probe, Py_None);
+    //Py_XDECREF(result);
+
+    dtc->dtc_stats.dts_firings++;
+    dtc->dtc_stats.dts_bytes += data->dtpda_edesc->dtepd_size;
+    dtc->dtc_skip = 0;
+    return (DTRACE_CONSUME_NEXT);
+  }
+
+  dtc->dtc_stats.dts_records++;
+
+  if ((route = _route(dtc, data->dtpda_edesc->dtepd_epid, pd)) == -1) {
+    return (DTRACE_CONSUME_NEXT);
+  }
+
+  if (dtc->dtc_skip > 0) {
+
+    /*
+     * An argument of a structured printf() that we've already decoded.
+     */
+    dtc->dtc_skip--;
+    return (DTRACE_CONSUME_NEXT);
+
+  } else if (!_action_valid(rec)) {
+
+    /*
+     * If this is a printf(), we'll defer to the bufhandler -- unless we're
+     * asked for its arguments rather than its output.
+     */     
+    if (rec->dtrd_action == DTRACEACT_PRINTF) {
+      if (!dtc->dtc_structured) {
+        return (DTRACE_CONSUME_THIS);
+      }
+
+      PyObject* probe = _probe_cached(dtc, data->dtpda_edesc->dtepd_epid, pd);
+      PyObject* record = _make_printf(dtc, data, rec);
+
+      if (_emit(dtc, route, probe, record) == -1) {
+        return (DTRACE_CONSUME_ABORT);
+      }
+
+      return (DTRACE_CONSUME_NEXT);
+    }
+
+
+    char errbuf[256];
+    dtc->dtc_error = _error("unsupported action %s in record for %s:%s:%s:%s\n",
+                              _action(rec, errbuf, sizeof (errbuf)),
+                              pd->dtpd_provider, 
+                              pd->dtpd_mod,
+                              pd->dtpd_func, 
+                              pd->dtpd_name); 
+
+    return (DTRACE_CONSUME_ABORT);
+  }
+
+  PyObject* probe = _probe_cached(dtc, data->dtpda_edesc->dtepd_epid, pd);
+  PyObject* record = _make_record(dtc, rec, data->dtpda_data);
+
+  if (_emit(dtc, route, probe, record) == -1) {
+    return (DTRACE_CONSUME_ABORT);
+  }
+
+  return (DTRACE_CONSUME_NEXT);
+}
+
+//////////////////////////////////////////////////////////
+////////////////////////////////////////////////// Rollups 
+//////////////////////////////////////////////////////////
+
+/*
+ * Checks that the records of an enabled probe can make up the key and the
+ * value of a rollup, noting why not in dtru_error if they can't.  Keys may
+ * be integers, strings or symbols; the value must be an integer.
+ */
+static int
+_rollup_valid(dtc_rollup_t *ru, const dtrace_eprobedesc_t *epd, const dtrace_probedesc_t *pd) {
+  const dtrace_recdesc_t *rec;
+  char buf[256];
+  int i, n;
+
+  for (i = 0; i <= ru->dtru_nkeys; i++) {
+    if ((n = i < ru->dtru_nkeys ? ru->dtru_keys[i] : ru->dtru_value) == -1) {
+      break;
+    }
+
+    if (n >= epd->dtepd_nrecs) {
+      snprintf(ru->dtru_error, sizeof (ru->dtru_error), "%s:%s:%s:%s has no record %d",
+          pd->dtpd_provider, pd->dtpd_mod, pd->dtpd_func, pd->dtpd_name, n);
+      return 0;
+    }
+
+    rec = &epd->dtepd_rec[n];
+
+    switch (rec->dtrd_action) {
+    case DTRACEACT_DIFEXPR:
+      if (i < ru->dtru_nkeys || _is_int(rec)) {
+        continue;
+      }
+      break;
+    case DTRACEACT_SYM:
+    case DTRACEACT_MOD:
+    case DTRACEACT_USYM:
+    case DTRACEACT_UMOD:
+    case DTRACEACT_UADDR:
+      if (i < ru->dtru_nkeys) {
+        continue;
+      }
+      break;
+    }
+
+    snprintf(ru->dtru_error, sizeof (ru->dtru_error), "record %d of %s:%s:%s:%s (%s) can't be rolled up as a %s",
+        n, pd->dtpd_provider, pd->dtpd_mod, pd->dtpd_func, pd->dtpd_name,
+        _action(rec, buf, sizeof (buf)), i < ru->dtru_nkeys ? "key" : "value");
+    return 0;
+  }
+
+  return 1;
+}
+
+/*
+ * Returns the mask of the rollups the firings of an enabled probe go to,
+ * with DTC_ROLLUP_RESOLVED set.  Must be called with the handle lock held.
+ */
+static uint64_t
+_rollup_mask(dtc_rollups_t *rl, const dtrace_eprobedesc_t *epd, const dtrace_probedesc_t *pd) {
+  dtrace_epid_t epid = epd->dtepd_epid;
+  uint64_t mask = DTC_ROLLUP_RESOLVED;
+  int i;
+
+  if (epid < rl->dtrl_nepids && rl->dtrl_byepid[epid] != 0) {
+    return rl->dtrl_byepid[epid];
+  }
+
+  for (i = 0; i < rl->dtrl_nrollups; i++) {
+    dtc_rollup_t *ru = &rl->dtrl_rollups[i];
+
+    if (_desc_match(ru->dtru_desc, pd) && _rollup_valid(ru, epd, pd)) {
+      mask |= 1ULL << i;
+    }
+  }
+
+  if (epid >= rl->dtrl_nepids) {
+    dtrace_epid_t nepids = rl->dtrl_nepids ? rl->dtrl_nepids : 64;
+    uint64_t *byepid;
+
+    while (nepids <= epid) {
+      nepids <<= 1;
+    }
+
+    if ((byepid = realloc(rl->dtrl_byepid, nepids * sizeof (uint64_t))) == NULL) {
+      return mask;
+    }
+
+    memset(byepid + rl->dtrl_nepids, 0, (nepids - rl->dtrl_nepids) * sizeof (uint64_t));
+    rl->dtrl_byepid = byepid;
+    rl->dtrl_nepids = nepids;
+  }
+
+  rl->dtrl_byepid[epid] = mask;
+  return mask;
+}
+
+/*
+ * Appends a record to the key being encoded.
+ */
+static int
+_rollup_key(DTraceConsumer *dtc, const dtrace_recdesc_t *rec, caddr_t base) {
+  dtc_buf_t *key = &dtc->dtc_rollups.dtrl_key;
+  caddr_t addr = base + rec->dtrd_offset;
+  const char *str;
+  char buf[2048], *p;
+  size_t len;
+
+  if (rec->dtrd_action == DTRACEACT_DIFEXPR && _is_int(rec)) {
+    int64_t val = _make_int(rec, addr);
+
+    if ((p = _buf_reserve(key, 1 + sizeof (val))) == NULL) {
+      return -1;
+    }
+
+    p[0] = 'i';
+    memcpy(p + 1, &val, sizeof (val));
+    return 0;
+  }
+
+  if (rec->dtrd_action == DTRACEACT_DIFEXPR) {
+    str = (const char *)addr;
+    len = strnlen(str, rec->dtrd_size);
+  } else {
+    str = _make_sym(dtc->dtc_handle, rec, addr, buf, sizeof (buf));
+    len = strlen(str);
+  }
+
+  if ((p = _buf_reserve(key, len + 2)) == NULL) {
+    return -1;
+  }
+
+  p[0] = 's';
+  memcpy(p + 1, str, len);
+  p[len + 1] = '\0';
+  return 0;
+}
+
+/*
+ * Folds a firing (data->dtpda_data pointing at its start) into the rollups
+ * it goes to.  Returns 1 if there were any, and its records are then to be
+ * skipped, or 0 if the firing is left to the record callback.  Must be
+ * called with the handle lock held; doesn't need the GIL.
+ */
+static int
+_rollup_firing(DTraceConsumer *dtc, const dtrace_probedata_t *data) {
+  dtc_rollups_t *rl = &dtc->dtc_rollups;
+  const dtrace_eprobedesc_t *epd = data->dtpda_edesc;
+  caddr_t base = data->dtpda_data;
+  uint64_t mask;
+  int i, j;
+
+  if ((mask = _rollup_mask(rl, epd, data->dtpda_pdesc) & ~DTC_ROLLUP_RESOLVED) == 0) {
+    return 0;
+  }
+
+  for (i = 0; i < rl->dtrl_nrollups; i++) {
+    dtc_rollup_t *ru = &rl->dtrl_rollups[i];
+    const dtrace_recdesc_t *rec;
+    dtc_hashent_t *ent;
+    int64_t *vals, val = 0;
+    int created = 0;
+
+    if (!(mask & (1ULL << i))) {
+      continue;
+    }
+
+    rl->dtrl_key.dtb_len = 0;
+
+    for (j = 0; j < ru->dtru_nkeys; j++) {
+      if (_rollup_key(dtc, &epd->dtepd_rec[ru->dtru_keys[j]], base) == -1) {
+        break;
+      }
+    }
+
+    if (j < ru->dtru_nkeys ||
+        (ent = _hash_lookup(&ru->dtru_table, rl->dtrl_key.dtb_data, rl->dtrl_key.dtb_len, 1)) == NULL) {
+      snprintf(ru->dtru_error, sizeof (ru->dtru_error), "couldn't add a key: %s", strerror(ENOMEM));
+      continue;
+    }
+
+    if (ent->dthe_value == 0) {
+      /*
+       * A key whose values we couldn't allocate has a value of 0, and is
+       * skipped by rollup_snapshot().
+       */
+      size_t n = ru->dtru_op == DTC_ROLLUP_QUANTIZE ? DTRACE_QUANTIZE_NBUCKETS : 1;
+
+      if ((vals = calloc(n, sizeof (int64_t))) == NULL) {
+        snprintf(ru->dtru_error, sizeof (ru->dtru_error), "couldn't add a key: %s", strerror(ENOMEM));
+        continue;
+      }
+
+      ent->dthe_value = (uintptr_t)vals;
+      created = 1;
+    }
+
+    vals = (int64_t *)ent->dthe_value;
+
+    if (ru->dtru_value != -1) {
+      rec = &epd->dtepd_rec[ru->dtru_value];
+      val = _make_int(rec, base + rec->dtrd_offset);
+    }
+
+    switch (ru->dtru_op) {
+    case DTC_ROLLUP_COUNT:
+      vals[0]++;
+      break;
+    case DTC_ROLLUP_SUM:
+      vals[0] += val;
+      break;
+    case DTC_ROLLUP_MIN:
+      if (created || val < vals[0]) {
+        vals[0] = val;
+      }
+      break;
+    case DTC_ROLLUP_MAX:
+      if (created || val > vals[0]) {
+        vals[0] = val;
+      }
+      break;
+    case DTC_ROLLUP_QUANTIZE:
+      vals[_quantize_bucket(val)]++;
+      break;
+    }
+  }
+
+  dtc->dtc_stats.dts_firings++;
+  dtc->dtc_stats.dts_records += epd->dtepd_nrecs;
+  dtc->dtc_stats.dts_bytes += epd->dtepd_size;
+
+  return 1;
+}
+
+/*
+ * Decodes a key encoded by _rollup_key() into a tuple.
+ */
+static PyObject*
+_rollup_keytuple(const char *key, size_t len) {
+  const char *end = key + len;
+  PyObject* fields = PyList_New(0);
+  PyObject* field;
+  PyObject* tuple;
+  int64_t val;
+
+  if (fields == NULL) {
+    return NULL;
+  }
+
+  while (key < end) {
+    if (*key == 'i') {
+      memcpy(&val, key + 1, sizeof (val));
+      field = PyLong_FromLongLong(val);
+      key += 1 + sizeof (val);
+    } else {
+      field = PyString_FromString(key + 1);
+      key += strlen(key + 1) + 2;
+    }
+
+    if (field == NULL || PyList_Append(fields, field) == -1) {
+      Py_XDECREF(field);
+      Py_DECREF(fields);
+      return NULL;
+    }
+
+    Py_DECREF(field);
+  }
+
+  tuple = PyList_AsTuple(fields);
+  Py_DECREF(fields);
+  return tuple;
+}
+
+/*
+ * Returns the result of a rollup as a dict of key tuples to values, and
+ * starts it over if reset is set.  An error noted since the last call is
+ * raised instead, once: the probe it was about is left out of the rollup
+ * from then on (its EPID's mask is cached), and the rest of the rollup is
+ * still good.  Must be called with the handle lock held.
+ */
+static PyObject*
+_rollup_result(DTraceConsumer *dtc, dtc_rollup_t *ru, int reset) {
+  dtc_hash_t *h = &ru->dtru_table;
+  PyObject* result;
+  PyObject* ranges = NULL;
+  size_t i;
+
+  if (ru->dtru_error[0] != '\0') {
+    PyErr_Format(PyExc_RuntimeError, "rollup \"%s\": %s", ru->dtru_name, ru->dtru_error);
+    ru->dtru_error[0] = '\0';
+    return NULL;
+  }
+
+  if (ru->dtru_op == DTC_ROLLUP_QUANTIZE &&
+      (ranges = _ranges_quantize(dtc, DTRACE_AGGVARIDNONE)) == NULL) {
+    return NULL;
+  }
+
+  if ((result = PyDict_New()) == NULL) {
+    return NULL;
+  }
+
+  for (i = 0; i < h->dth_size; i++) {
+    dtc_hashent_t *ent = &h->dth_ents[i];
+    const int64_t *vals = (const int64_t *)ent->dthe_value;
+    PyObject* key;
+    PyObject* value;
+
+    if (ent->dthe_key == NULL || vals == NULL) {
+      continue;
+    }
+
+    if ((key = _rollup_keytuple(ent->dthe_key, ent->dthe_len)) == NULL) {
+      Py_DECREF(result);
+      return NULL;
+    }
+
+    value = ranges != NULL ? _make_buckets(dtc, ranges, vals, DTRACE_QUANTIZE_NBUCKETS) :
+        PyLong_FromLongLong(vals[0]);
+
+    if (value == NULL || PyDict_SetItem(result, key, value) == -1) {
+      Py_DECREF(key);
+      Py_XDECREF(value);
+      Py_DECREF(result);
+      return NULL;
+    }
+
+    Py_DECREF(key);
+    Py_DECREF(value);
+  }
+
+  if (reset) {
+    _hash_free(h, 1);
+  }
+
+  return result;
+}
+
+//////////////////////////////////////////////////////////
+/////////////////////////////////////// Capture and replay 
+//////////////////////////////////////////////////////////
+
+/*
+ * Appends an entry of the given kind to the pass being captured, returning
+ * its (zeroed) payload.  None of the capture code needs the GIL, as it's
+ * also run by the background consumer thread; failures are noted in
+ * dtcp_errno, and the rest of the pass is then dropped.
+ */
+static char*
+_cap_entry(dtc_capture_t *cap, uint32_t kind, size_t size) {
+  size_t padded = (size + 7) & ~(size_t)7;
+  dtc_rawhdr_t *hdr;
+
+  if ((hdr = (dtc_rawhdr_t *)_buf_reserve(&cap->dtcp_buf, sizeof (dtc_rawhdr_t) + padded)) == NULL) {
+    cap->dtcp_errno = ENOMEM;
+    return NULL;
+  }
+
+  hdr->dtrh_id = kind;
+  hdr->dtrh_size = size;
+  memset(hdr + 1, 0, padded);
+
+  return (char *)(hdr + 1);
+}
+
+/*
+ * Returns 1 the first time it's asked about a probe or aggregation (which
+ * is then to be described), 0 after that, and -1 if we ran out of memory.
+ */
+static int
+_cap_first(dtc_capture_t *cap, uint32_t kind, uint32_t id) {
+  uint32_t key[2];
+  dtc_hashent_t *ent;
+
+  key[0] = kind;
+  key[1] = id;
+
+  if ((ent = _hash_lookup(&cap->dtcp_known, key, sizeof (key), 1)) == NULL) {
+    cap->dtcp_errno = ENOMEM;
+    return -1;
+  }
+
+  if (ent->dthe_value != 0) {
+    return 0;
+  }
+
+  ent->dthe_value = 1;
+  return 1;
+}
+
+static void
+_cap_firing(DTraceConsumer *dtc, const dtrace_probedata_t *data) {
+  dtc_capture_t *cap = &dtc->dtc_cap;
+  const dtrace_eprobedesc_t *epd = data->dtpda_edesc;
+  dtc_capdatum_t *datum;
+  char *p;
+
+  if (cap->dtcp_errno != 0) {
+    return;
+  }
+
+  switch (_cap_first(cap, DTC_CAP_PROBE, epd->dtepd_epid)) {
+  case -1:
+    return;
+
+  case 1:
+    {
+      size_t recsize = epd->dtepd_nrecs * sizeof (dtrace_recdesc_t), fmtsize = 0;
+      char buf[2048];
+      dtc_capdesc_t *desc;
+      int i;
+
+      for (i = 0; i < epd->dtepd_nrecs; i++) {
+        const char *fmt = _printf_format(dtc->dtc_handle, &epd->dtepd_rec[i], buf, sizeof (buf));
+
+        fmtsize += (fmt != NULL ? strlen(fmt) : 0) + 1;
+      }
+
+      if ((p = _cap_entry(cap, DTC_CAP_PROBE, sizeof (dtc_capdesc_t) + recsize + sizeof (dtrace_probedesc_t) + fmtsize)) == NULL) {
+        return;
+      }
+
+      desc = (dtc_capdesc_t *)p;
+      desc->dtcd_id = epd->dtepd_epid;
+      desc->dtcd_size = epd->dtepd_size;
+      desc->dtcd_nrecs = epd->dtepd_nrecs;
+      p += sizeof (dtc_capdesc_t);
+
+      memcpy(p, epd->dtepd_rec, recsize);
+      p += recsize;
+      memcpy(p, data->dtpda_pdesc, sizeof (dtrace_probedesc_t));
+      p += sizeof (dtrace_probedesc_t);
+
+      for (i = 0; i < epd->dtepd_nrecs; i++) {
+        const char *fmt = _printf_format(dtc->dtc_handle, &epd->dtepd_rec[i], buf, sizeof (buf));
+
+        strcpy(p, fmt != NULL ? fmt : "");
+        p += strlen(p) + 1;
+      }
+    }
+  }
+
+  if ((p = _cap_entry(cap, DTC_CAP_FIRING, sizeof (dtc_capdatum_t) + epd->dtepd_size)) == NULL) {
+    return;
+  }
+
+  datum = (dtc_capdatum_t *)p;
+  datum->dtcd_id = epd->dtepd_epid;
+  datum->dtcd_cpu = data->dtpda_cpu;
+  memcpy(p + sizeof (dtc_capdatum_t), data->dtpda_data, epd->dtepd_size);
+}
+
+/*
+ * The probe callback of a dtrace_work() pass that is being captured or
+ * rolled up: the firing is captured, and its records are then consumed as
+ * usual unless it went to a rollup.
+ */
+static int
+_consume_probe(const dtrace_probedata_t *data, void *arg) {
+  DTraceConsumer *dtc = (DTraceConsumer *)arg;
+
+  if (dtc->dtc_cap.dtcp_fd != -1) {
+    _cap_firing(dtc, data);
+  }
+
+  if (dtc->dtc_rollups.dtrl_nrollups > 0 && _rollup_firing(dtc, data)) {
+    return (DTRACE_CONSUME_NEXT);
+  }
+
+  return (DTRACE_CONSUME_THIS);
+}
+
+static dtrace_consume_probe_f*
+_probe_func(DTraceConsumer *dtc) {
+  return dtc->dtc_cap.dtcp_fd != -1 || dtc->dtc_rollups.dtrl_nrollups > 0 ? _consume_probe : NULL;
+}
+
+static int
+_aggwalk_capture(const dtrace_aggdata_t *agg, void *arg) {
+  DTraceConsumer *dtc = (DTraceConsumer *)arg;
+  dtc_capture_t *cap = &dtc->dtc_cap;
+  const dtrace_aggdesc_t *aggdesc = agg->dtada_desc;
+  dtc_capdatum_t *datum;
+  char *p;
+
+  switch (_cap_first(cap, DTC_CAP_AGG, aggdesc->dtagd_id)) {
+  case -1:
+    return (DTRACE_AGGWALK_ABORT);
+
+  case 1:
+    {
+      size_t recsize = aggdesc->dtagd_nrecs * sizeof (dtrace_recdesc_t);
+      dtc_capdesc_t *desc;
+
+      if ((p = _cap_entry(cap, DTC_CAP_AGG, sizeof (dtc_capdesc_t) + recsize + strlen(aggdesc->dtagd_name) + 1)) == NULL) {
+        return (DTRACE_AGGWALK_ABORT);
+      }
+
+      desc = (dtc_capdesc_t *)p;
+      desc->dtcd_id = aggdesc->dtagd_id;
+      desc->dtcd_varid = aggdesc->dtagd_varid;
+      desc->dtcd_size = aggdesc->dtagd_size;
+      desc->dtcd_nrecs = aggdesc->dtagd_nrecs;
+      p += sizeof (dtc_capdesc_t);
+
+      memcpy(p, aggdesc->dtagd_rec, recsize);
+      strcpy(p + recsize, aggdesc->dtagd_name);
+    }
+  }
+
+  if ((p = _cap_entry(cap, DTC_CAP_AGGDATA, sizeof (dtc_capdatum_t) + aggdesc->dtagd_size)) == NULL) {
+    return (DTRACE_AGGWALK_ABORT);
+  }
+
+  datum = (dtc_capdatum_t *)p;
+  datum->dtcd_id = aggdesc->dtagd_id;
+  memcpy(p + sizeof (dtc_capdatum_t), agg->dtada_data, aggdesc->dtagd_size);
+
+  return (DTRACE_AGGWALK_NEXT);
+}
+
+/*
+ * Ends the pass being captured with a marker of the given kind, and writes
+ * it out.
+ */
+static void
+_cap_flush(dtc_capture_t *cap, uint32_t kind) {
+  size_t off = 0;
+  ssize_t n;
+
+  if (cap->dtcp_errno == 0) {
+    _cap_entry(cap, kind, 0);
+  }
+
+  while (cap->dtcp_errno == 0 && off < cap->dtcp_buf.dtb_len) {
+    if ((n = write(cap->dtcp_fd, cap->dtcp_buf.dtb_data + off, cap->dtcp_buf.dtb_len - off)) == -1) {
+      if (errno != EINTR) {
+        cap->dtcp_errno = errno;
+      }
+      continue;
+    }
+
+    off += n;
+  }
+
+  cap->dtcp_buf.dtb_len = 0;
+}
+
+static void
+_cap_close(dtc_capture_t *cap) {
+  if (cap->dtcp_fd != -1) {
+    close(cap->dtcp_fd);
+  }
+
+  free(cap->dtcp_buf.dtb_data);
+  _hash_free(&cap->dtcp_known, 0);
+  memset(cap, 0, sizeof (dtc_capture_t));
+  cap->dtcp_fd = -1;
+}
+
+/*
+ * Raises the error that interrupted capturing, if any; the capture file is
+ * then closed.
+ */
+static int
+_cap_check(DTraceConsumer *dtc) {
+  if (dtc->dtc_cap.dtcp_errno == 0) {
+    return 0;
+  }
+
+  errno = dtc->dtc_cap.dtcp_errno;
+  PyErr_SetFromErrno(PyExc_IOError);
+  _cap_close(&dtc->dtc_cap);
+
+  return -1;
+}
+
+static int
+_replay_open(dtc_replay_t *rp, const char *path) {
+  struct stat st;
+  void *base;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY)) == -1 || fstat(fd, &st) == -1) {
+    PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *)path);
+
+    if (fd != -1) {
+      close(fd);
+    }
+    return -1;
+  }
+
+  if (st.st_size < (off_t)strlen(DTC_CAP_MAGIC)) {
+    close(fd);
+    PyErr_Format(PyExc_ValueError, "%s is not a capture file", path);
+    return -1;
+  }
+
+  base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (base == MAP_FAILED) {
+    PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *)path);
+    return -1;
+  }
+
+  if (memcmp(base, DTC_CAP_MAGIC, strlen(DTC_CAP_MAGIC)) != 0) {
+    munmap(base, st.st_size);
+    PyErr_Format(PyExc_ValueError, "%s is not a capture file", path);
+    return -1;
+  }
+
+  rp->dtrp_base = base;
+  rp->dtrp_size = st.st_size;
+  rp->dtrp_consume = rp->dtrp_aggregate = strlen(DTC_CAP_MAGIC);
+
+  return 0;
+}
+
+static void
+_replay_close(dtc_replay_t *rp) {
+  dtrace_epid_t i;
+  dtrace_aggid_t j;
+
+  if (rp->dtrp_base != NULL) {
+    munmap(rp->dtrp_base, rp->dtrp_size);
+  }
+
+  for (i = 0; i < rp->dtrp_nprobes; i++) {
+    free(rp->dtrp_probes[i]);
+  }
+
+  for (j = 0; j < rp->dtrp_naggs; j++) {
+    free(rp->dtrp_aggs[j]);
+  }
+
+  free(rp->dtrp_probes);
+  free(rp->dtrp_aggs);
+  memset(rp, 0, sizeof (dtc_replay_t));
+}
+
+static int
+_replay_corrupt(void) {
+  PyErr_SetString(PyExc_RuntimeError, "corrupt capture file");
+  return -1;
+}
+
+/*
+ * Checks that the records of a captured description lie within the firing
+ * or aggregation record it describes, of the given size.
+ */
+static int
+_replay_recs(const dtrace_recdesc_t *recs, int nrecs, uint32_t size) {
+  int i;
+
+  for (i = 0; i < nrecs; i++) {
+    if ((uint64_t)recs[i].dtrd_offset + recs[i].dtrd_size > size) {
+      return _replay_corrupt();
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Checks that the string records of a captured firing or aggregation record
+ * end within their size, as everything that decodes them takes for granted.
+ */
+static int
+_replay_strings(const dtrace_recdesc_t *recs, int nrecs, const char *base) {
+  int i;
+
+  for (i = 0; i < nrecs; i++) {
+    if (recs[i].dtrd_action == DTRACEACT_DIFEXPR && !_is_int(&recs[i]) &&
+        memchr(base + recs[i].dtrd_offset, '\0', recs[i].dtrd_size) == NULL) {
+      return _replay_corrupt();
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Grows a table indexed by EPID or aggregation ID to hold id.  No EPID or
+ * aggregation ID is UINT32_MAX, and the table couldn't hold it anyway.
+ */
+static int
+_replay_grow(void ***table, uint32_t *size, uint32_t id) {
+  void **grown;
+
+  if (id < *size) {
+    return 0;
+  }
+
+  if (id == UINT32_MAX) {
+    return _replay_corrupt();
+  }
+
+  if ((grown = realloc(*table, (id + 1) * sizeof (void *))) == NULL) {
+    PyErr_NoMemory();
+    return -1;
+  }
+
+  memset(grown + *size, 0, (id + 1 - *size) * sizeof (void *));
+  *table = grown;
+  *size = id + 1;
+
+  return 0;
+}
+
+/*
+ * Takes in the description of an enabled probe.  Both cursors come across
+ * it, but it's only set up again (dropping what we cached for the EPID) if
+ * the EPID has since been described anew -- as happens when a program is
+ * recompiled while capturing.
+ */
+static int
+_replay_probe(DTraceConsumer *dtc, const char *payload, uint32_t size) {
+  dtc_replay_t *rp = &dtc->dtc_replay;
+  dtc_capdesc_t desc;
+  dtc_repprobe_t *probe;
+  dtc_epid_t *entry;
+  size_t recsize;
+  const char *fmt;
+  int i;
+
+  if (size < sizeof (desc)) {
+    return _replay_corrupt();
+  }
+
+  memcpy(&desc, payload, sizeof (desc));
+  recsize = (size_t)desc.dtcd_nrecs * sizeof (dtrace_recdesc_t);
+
+  if (desc.dtcd_nrecs < 0 || size < sizeof (desc) + recsize + sizeof (dtrace_probedesc_t) + desc.dtcd_nrecs ||
+      (desc.dtcd_nrecs > 0 && payload[size - 1] != '\0')) {
+    return _replay_corrupt();
+  }
+
+  if (_replay_grow((void ***)&rp->dtrp_probes, &rp->dtrp_nprobes, desc.dtcd_id) == -1) {
+    return -1;
+  }
+
+  if (rp->dtrp_probes[desc.dtcd_id] != NULL && rp->dtrp_probes[desc.dtcd_id]->dtrpp_src == payload) {
+    return 0;
+  }
+
+  if ((probe = calloc(1, offsetof(dtc_repprobe_t, dtrpp_edesc.dtepd_rec) + (recsize ? recsize : sizeof (dtrace_recdesc_t)))) == NULL) {
+    PyErr_NoMemory();
+    return -1;
+  }
+
+  probe->dtrpp_src = payload;
+  probe->dtrpp_edesc.dtepd_epid = desc.dtcd_id;
+  probe->dtrpp_edesc.dtepd_size = desc.dtcd_size;
+  probe->dtrpp_edesc.dtepd_nrecs = desc.dtcd_nrecs;
+  memcpy(probe->dtrpp_edesc.dtepd_rec, payload + sizeof (desc), recsize);
+  memcpy(&probe->dtrpp_pdesc, payload + sizeof (desc) + recsize, sizeof (dtrace_probedesc_t));
+  fmt = payload + sizeof (desc) + recsize + sizeof (dtrace_probedesc_t);
+
+  if (_replay_recs(probe->dtrpp_edesc.dtepd_rec, desc.dtcd_nrecs, desc.dtcd_size) == -1) {
+    free(probe);
+    return -1;
+  }
+
+  free(rp->dtrp_probes[desc.dtcd_id]);
+  rp->dtrp_probes[desc.dtcd_id] = probe;
+
+  if ((entry = _epid_entry(dtc, desc.dtcd_id)) == NULL) {
+    return -1;
+  }
+
+  Py_CLEAR(entry->dte_probe);
+  Py_CLEAR(entry->dte_layout);
+  Py_CLEAR(entry->dte_format);
+
+  /*
+   * There's no libdtrace to ask for the formats of printf()s, so we prime
+   * the cache with the ones that were captured.
+   */
+  for (i = 0; i < desc.dtcd_nrecs; i++) {
+    if (fmt >= payload + size) {
+      return _replay_corrupt();
+    }
+
+    if (fmt[0] != '\0') {
+      PyObject* format = _format_cached(dtc, desc.dtcd_id, i, NULL, fmt);
+
+      if (format == NULL) {
+        return -1;
+      }
+
+      Py_DECREF(format);
+    }
+
+    fmt += strlen(fmt) + 1;
+  }
+
+  return 0;
+}
+
+static int
+_replay_agg(DTraceConsumer *dtc, const char *payload, uint32_t size) {
+  dtc_replay_t *rp = &dtc->dtc_replay;
+  dtc_capdesc_t desc;
+  dtc_repagg_t *agg;
+  size_t recsize;
+
+  if (size < sizeof (desc)) {
+    return _replay_corrupt();
+  }
+
+  memcpy(&desc, payload, sizeof (desc));
+  recsize = (size_t)desc.dtcd_nrecs * sizeof (dtrace_recdesc_t);
+
+  if (desc.dtcd_nrecs < 2 || size < sizeof (desc) + recsize + 1 || payload[size - 1] != '\0') {
+    return _replay_corrupt();
+  }
+
+  if (_replay_grow((void ***)&rp->dtrp_aggs, &rp->dtrp_naggs, desc.dtcd_id) == -1) {
+    return -1;
+  }
+
+  if (rp->dtrp_aggs[desc.dtcd_id] != NULL && rp->dtrp_aggs[desc.dtcd_id]->dtrpa_src == payload) {
+    return 0;
+  }
+
+  if ((agg = calloc(1, offsetof(dtc_repagg_t, dtrpa_desc.dtagd_rec) + recsize)) == NULL) {
+    PyErr_NoMemory();
+    return -1;
+  }
+
+  agg->dtrpa_src = payload;
+  agg->dtrpa_desc.dtagd_name = (char *)payload + sizeof (desc) + recsize;
+  agg->dtrpa_desc.dtagd_varid = desc.dtcd_varid;
+  agg->dtrpa_desc.dtagd_id = desc.dtcd_id;
+  agg->dtrpa_desc.dtagd_size = desc.dtcd_size;
+  agg->dtrpa_desc.dtagd_nrecs = desc.dtcd_nrecs;
+  memcpy(agg->dtrpa_desc.dtagd_rec, payload + sizeof (desc), recsize);
+
+  if (_replay_recs(agg->dtrpa_desc.dtagd_rec, desc.dtcd_nrecs, desc.dtcd_size) == -1) {
+    free(agg);
+    return -1;
+  }
+
+  free(rp->dtrp_aggs[desc.dtcd_id]);
+  rp->dtrp_aggs[desc.dtcd_id] = agg;
+  _ranges_flush(dtc);
+
+  return 0;
+}
+
+/*
+ * Reads the entry at *cursor, taking in any description it holds.  Returns
+ * 1 if there was an entry, 0 at the end of the file, and -1 on error.
+ */
+static int
+_replay_next(DTraceConsumer *dtc, size_t *cursor, dtc_rawhdr_t *hdr, const char **payload) {
+  dtc_replay_t *rp = &dtc->dtc_replay;
+
+  if (*cursor + sizeof (dtc_rawhdr_t) > rp->dtrp_size) {
+    /*
+     * A pass that was being written as the file was opened is left alone.
+     */
+    return 0;
+  }
+
+  memcpy(hdr, rp->dtrp_base + *cursor, sizeof (dtc_rawhdr_t));
+
+  if (*cursor + sizeof (dtc_rawhdr_t) + hdr->dtrh_size > rp->dtrp_size) {
+    return 0;
+  }
+
+  *payload = rp->dtrp_base + *cursor + sizeof (dtc_rawhdr_t);
+  *cursor += sizeof (dtc_rawhdr_t) + ((hdr->dtrh_size + 7) & ~(size_t)7);
+
+  switch (hdr->dtrh_id) {
+  case DTC_CAP_PROBE:
+    return _replay_probe(dtc, *payload, hdr->dtrh_size) == -1 ? -1 : 1;
+  case DTC_CAP_AGG:
+    return _replay_agg(dtc, *payload, hdr->dtrh_size) == -1 ? -1 : 1;
+  }
+
+  return 1;
+}
+
+/*
+ * Replays the next dtrace_work() pass of the capture through _consume(),
+ * the way dtrace_consume() hands out a firing: each of its records, and
+ * then a NULL record.
+ */
+static int
+_replay_consume(DTraceConsumer *dtc) {
+  dtc_replay_t *rp = &dtc->dtc_replay;
+  dtrace_probedata_t data;
+  dtc_capdatum_t datum;
+  dtc_repprobe_t *probe;
+  dtc_rawhdr_t hdr;
+  const char *payload;
+  caddr_t base;
+  int rval, i;
+
+  while ((rval = _replay_next(dtc, &rp->dtrp_consume, &hdr, &payload)) == 1) {
+    if (hdr.dtrh_id == DTC_CAP_CONSUME) {
+      return 0;
+    }
+
+    if (hdr.dtrh_id != DTC_CAP_FIRING) {
+      continue;
+    }
+
+    if (hdr.dtrh_size < sizeof (datum)) {
+      return _replay_corrupt();
+    }
+
+    memcpy(&datum, payload, sizeof (datum));
+
+    if (datum.dtcd_id >= rp->dtrp_nprobes || (probe = rp->dtrp_probes[datum.dtcd_id]) == NULL ||
+        hdr.dtrh_size != sizeof (datum) + probe->dtrpp_edesc.dtepd_size) {
+      return _replay_corrupt();
+    }
+
+    if (_replay_strings(probe->dtrpp_edesc.dtepd_rec, probe->dtrpp_edesc.dtepd_nrecs, payload + sizeof (datum)) == -1) {
+      return -1;
+    }
+
+    memset(&data, 0, sizeof (data));
+    data.dtpda_edesc = &probe->dtrpp_edesc;
+    data.dtpda_pdesc = &probe->dtrpp_pdesc;
+    data.dtpda_cpu = datum.dtcd_cpu;
+    base = (caddr_t)payload + sizeof (datum);
+    data.dtpda_data = base;
+
+    if (dtc->dtc_rollups.dtrl_nrollups > 0 && _rollup_firing(dtc, &data)) {
+      continue;
+    }
+
+    for (i = 0; i < probe->dtrpp_edesc.dtepd_nrecs; i++) {
+      const dtrace_recdesc_t *rec = &probe->dtrpp_edesc.dtepd_rec[i];
+
+      data.dtpda_data = base + rec->dtrd_offset;
+
+      if (_consume(&data, rec, dtc) == DTRACE_CONSUME_ABORT) {
+        return -1;
+      }
+    }
+
+    data.dtpda_data = base;
+    (void) _consume(&data, NULL, dtc);
+  }
+
+  if (rval == 0) {
+    rp->dtrp_eof = 1;
+  }
+
+  return rval;
+}
+
+/*
+ * Replays the next aggregation snapshot of the capture through func, as
+ * dtrace_aggregate_walk() would; what func returns for a record is moot,
+ * save for aborting the walk.
+ */
+static int
+_replay_aggregate(DTraceConsumer *dtc, dtrace_aggregate_f *func, void *arg) {
+  dtc_replay_t *rp = &dtc->dtc_replay;
+  dtrace_aggdata_t agg;
+  dtc_capdatum_t datum;
+  dtc_repagg_t *desc;
+  dtc_rawhdr_t hdr;
+  const char *payload;
+  int rval;
+
+  while ((rval = _replay_next(dtc, &rp->dtrp_aggregate, &hdr, &payload)) == 1) {
+    if (hdr.dtrh_id == DTC_CAP_AGGREGATE) {
+      return 0;
+    }
+
+    if (hdr.dtrh_id != DTC_CAP_AGGDATA) {
+      continue;
+    }
+
+    if (hdr.dtrh_size < sizeof (datum)) {
+      return _replay_corrupt();
+    }
+
+    memcpy(&datum, payload, sizeof (datum));
+
+    if (datum.dtcd_id >= rp->dtrp_naggs || (desc = rp->dtrp_aggs[datum.dtcd_id]) == NULL ||
+        hdr.dtrh_size != sizeof (datum) + desc->dtrpa_desc.dtagd_size) {
+      return _replay_corrupt();
+    }
+
+    if (_replay_strings(desc->dtrpa_desc.dtagd_rec, desc->dtrpa_desc.dtagd_nrecs, payload + sizeof (datum)) == -1) {
+      return -1;
+    }
+
+    memset(&agg, 0, sizeof (agg));
+    agg.dtada_desc = &desc->dtrpa_desc;
+    agg.dtada_data = (caddr_t)payload + sizeof (datum);
+    agg.dtada_size = desc->dtrpa_desc.dtagd_size;
+
+    switch (func(&agg, arg)) {
+    case DTRACE_AGGWALK_ERROR:
+    case DTRACE_AGGWALK_ABORT:
+      return -1;
+    }
+  }
+
+  return rval == -1 ? -1 : 0;
+}
+
+/*
+ * Walks the aggregations for aggwalk() and friends: either the snapshot
+ * just taken (adding it to the capture file first, if we're capturing) or,
+ * when replaying, the next snapshot of the capture.
+ */
+static int
+_aggregate_walk(DTraceConsumer *dtc, dtrace_aggregate_f *func, void *arg) {
+  if (dtc->dtc_replay.dtrp_base != NULL) {
+    return _replay_aggregate(dtc, func, arg);
+  }
+
+  if (dtc->dtc_cap.dtcp_fd != -1) {
+    (void) dtrace_aggregate_walk(dtc->dtc_handle, _aggwalk_capture, dtc);
+    _cap_flush(&dtc->dtc_cap, DTC_CAP_AGGREGATE);
+
+    if (_cap_check(dtc) == -1) {
+      return -1;
+    }
+  }
+
+  return dtrace_aggregate_walk(dtc->dtc_handle, func, arg);
+}
+
+/*
+ * Fails the methods that need libdtrace when we're replaying a capture.
+ */
+static int
+_need_handle(DTraceConsumer *dtc) {
+  if (dtc->dtc_handle == NULL) {
+    PyErr_SetString(PyExc_RuntimeError, "not available when replaying a capture");
+    return -1;
+  }
+
+  return 0;
+}
+
+//////////////////////////////////////////////////////////
+/////////////////////////////////////////////// Bulk output 
+//////////////////////////////////////////////////////////
+
+/*
+ * Builds the ((action, offset, size), ...) descriptor for a set of records,
+ * which is all that's needed to pick the fields out of a raw entry.
+ */
+static PyObject*
+_make_layout(const dtrace_recdesc_t *recs, int nrecs) {
+  PyObject* layout = PyTuple_New(nrecs);
+  PyObject* rec;
+  int i;
+
+  if (layout == NULL) {
+    return NULL;
+  }
+
+  for (i = 0; i < nrecs; i++) {
+    if ((rec = Py_BuildValue("(iII)", (int)recs[i].dtrd_action, recs[i].dtrd_offset, recs[i].dtrd_size)) == NULL) {
+      Py_DECREF(layout);
+      return NULL;
+    }
+
+    PyTuple_SET_ITEM(layout, i, rec);
+  }
+
+  return layout;
+}
+
+/*
+ * Records the layout of an enabled probe the first time raw consumption
+ * sees it, both in the EPID table and in the dict handed to the callback.
+ */
+static int
+_layout_epid(DTraceConsumer *dtc, dtc_epid_t *entry, const dtrace_probedata_t *data) {
+  const dtrace_eprobedesc_t *epd = data->dtpda_edesc;
+  PyObject* probe;
+  PyObject* recs;
+  PyObject* key;
+  int rval;
+
+  if (dtc->dtc_layouts == NULL && (dtc->dtc_layouts = PyDict_New()) == NULL) {
+    return -1;
+  }
+
+  probe = _probe_cached(dtc, epd->dtepd_epid, data->dtpda_pdesc);
+  recs = _make_layout(epd->dtepd_rec, epd->dtepd_nrecs);
+
+  if (probe == NULL || recs == NULL) {
+    Py_XDECREF(probe);
+    Py_XDECREF(recs);
+    return -1;
+  }
+
+  entry->dte_layout = Py_BuildValue("(NN)", probe, recs);
+  key = PyInt_FromLong(epd->dtepd_epid);
+
+  if (entry->dte_layout == NULL || key == NULL) {
+    Py_XDECREF(key);
+    return -1;
+  }
+
+  rval = PyDict_SetItem(dtc->dtc_layouts, key, entry->dte_layout);
+  Py_DECREF(key);
+
+  return rval;
+}
+
+static int
+_raw_append(dtc_buf_t *buf, uint32_t id, const void *data, uint32_t size) {
+  dtc_rawhdr_t *hdr;
+
+  if ((hdr = (dtc_rawhdr_t *)_buf_reserve(buf, sizeof (dtc_rawhdr_t) + ((size + 7) & ~7))) == NULL) {
+    return -1;
+  }
+
+  hdr->dtrh_id = id;
+  hdr->dtrh_size = size;
+  memcpy(hdr + 1, data, size);
+  memset((char *)(hdr + 1) + size, 0, ((size + 7) & ~7) - size);
+
+  return 0;
+}
+
+/*
+ * Copies a whole probe firing, as laid out by the kernel, into the raw
+ * buffer and skips its records: nothing is decoded.  The record offsets of
+ * the enabled probe description are relative to the start of the firing.
+ */
+static int
+_consume_raw(const dtrace_probedata_t *data, void *arg) {
+  DTraceConsumer *dtc = (DTraceConsumer *)arg;
+  const dtrace_eprobedesc_t *epd = data->dtpda_edesc;
+  dtc_epid_t *entry;
+
+  if ((entry = _epid_entry(dtc, epd->dtepd_epid)) == NULL) {
+    return (DTRACE_CONSUME_ABORT);
+  }
+
+  if (entry->dte_layout == NULL && _layout_epid(dtc, entry, data) == -1) {
+    return (DTRACE_CONSUME_ABORT);
+  }
+
+  if (dtc->dtc_cap.dtcp_fd != -1) {
+    _cap_firing(dtc, data);
+  }
+
+  if (_raw_append(&dtc->dtc_raw, epd->dtepd_epid, data->dtpda_data, epd->dtepd_size) == -1) {
+    PyErr_NoMemory();
+    return (DTRACE_CONSUME_ABORT);
+  }
+
+  dtc->dtc_stats.dts_firings++;
+  dtc->dtc_stats.dts_records += epd->dtepd_nrecs;
+  dtc->dtc_stats.dts_bytes += epd->dtepd_size;
+
+  return (DTRACE_CONSUME_NEXT);
+}
+
+static int
+_aggwalk_raw(const dtrace_aggdata_t *agg, void *arg) {
+  DTraceConsumer *dtc = (DTraceConsumer *)arg;
+  const dtrace_aggdesc_t *aggdesc = agg->dtada_desc;
+  PyObject* key;
+  PyObject* layout;
+
+  if (dtc->dtc_agglayouts == NULL && (dtc->dtc_agglayouts = PyDict_New()) == NULL) {
+    return (DTRACE_AGGWALK_ABORT);
+  }
+
+  if ((key = PyInt_FromLong(aggdesc->dtagd_id)) == NULL) {
+    return (DTRACE_AGGWALK_ABORT);
+  }
+
+  if (PyDict_GetItem(dtc->dtc_agglayouts, key) == NULL) {
+    layout = Py_BuildValue("(isN)", (int)aggdesc->dtagd_varid, aggdesc->dtagd_name,
+                           _make_layout(aggdesc->dtagd_rec, aggdesc->dtagd_nrecs));
+
+    if (layout == NULL || PyDict_SetItem(dtc->dtc_agglayouts, key, layout) == -1) {
+      Py_XDECREF(layout);
+      Py_DECREF(key);
+      return (DTRACE_AGGWALK_ABORT);
+    }
+
+    Py_DECREF(layout);
+  }
+
+  Py_DECREF(key);
+
+  if (_raw_append(&dtc->dtc_raw, aggdesc->dtagd_id, agg->dtada_data, aggdesc->dtagd_size) == -1) {
+    PyErr_NoMemory();
+    return (DTRACE_AGGWALK_ABORT);
+  }
+
+  return (DTRACE_AGGWALK_REMOVE);
+}
+
+static void
+_snapvar_free(dtc_snapvar_t *var) {
+  int i;
+
+  for (i = 0; i < var->dts_nkeys; i++) {
+    free(var->dts_keys[i].dtk_data.dtb_data);
+    _hash_free(&var->dts_keys[i].dtk_codes, 0);
+    Py_XDECREF(var->dts_keys[i].dtk_values);
+  }
+
+  free(var->dts_keys);
+  free(var->dts_values.dtb_data);
+}
+
+static void
+_snapshot_free(dtc_snapshot_t *snap) {
+  int i;
+
+  for (i = 0; i < snap->dtss_nvars; i++) {
+    _snapvar_free(&snap->dtss_vars[i]);
+  }
+
+  free(snap->dtss_vars);
+  snap->dtss_vars = NULL;
+  snap->dtss_nvars = 0;
+}
+
+/*
+ * Finds the columns for the variable of an aggregation record, setting
+ * them up from its description the first time the variable is seen.
+ */
+static dtc_snapvar_t*
+_snapvar(dtc_snapshot_t *snap, const dtrace_aggdata_t *agg) {
+  DTraceConsumer *dtc = snap->dtss_consumer;
+  const dtrace_aggdesc_t *aggdesc = agg->dtada_desc;
+  const dtrace_recdesc_t *aggrec = &aggdesc->dtagd_rec[aggdesc->dtagd_nrecs - 1];
+  dtc_snapvar_t *var;
+  char errbuf[256];
+  int i;
+
+  for (i = 0; i < snap->dtss_nvars; i++) {
+    if (snap->dtss_vars[i].dts_varid == aggdesc->dtagd_varid) {
+      return &snap->dtss_vars[i];
+    }
+  }
+
+  if ((var = realloc(snap->dtss_vars, (snap->dtss_nvars + 1) * sizeof (dtc_snapvar_t))) == NULL) {
+    PyErr_NoMemory();
+    return NULL;
+  }
+
+  snap->dtss_vars = var;
+  var = &snap->dtss_vars[snap->dtss_nvars];
+  memset(var, 0, sizeof (dtc_snapvar_t));
+
+  var->dts_varid = aggdesc->dtagd_varid;
+  var->dts_desc = aggdesc;
+  var->dts_action = aggrec->dtrd_action;
+
+  switch (aggrec->dtrd_action) {
+  case DTRACEAGG_COUNT:
+  case DTRACEAGG_MIN:
+  case DTRACEAGG_MAX:
+  case DTRACEAGG_SUM:
+  case DTRACEAGG_AVG:
+    var->dts_width = 1;
+    break;
+
+  case DTRACEAGG_QUANTIZE:
+    var->dts_width = DTRACE_QUANTIZE_NBUCKETS;
+    break;
+
+  case DTRACEAGG_LQUANTIZE:
+  case DTRACEAGG_LLQUANTIZE:
+    var->dts_arg = *(uint64_t *)(agg->dtada_data + aggrec->dtrd_offset);
+    var->dts_width = (aggrec->dtrd_size / sizeof (uint64_t)) - 1;
+    break;
+
+  default:
+    dtc->dtc_error = _error("unsupported aggregating action %s in aggregation \"%s\"\n", _action(aggrec, errbuf, sizeof (errbuf)), aggdesc->dtagd_name);
+    return NULL;
+  }
+
+  if ((var->dts_keys = calloc(aggdesc->dtagd_nrecs, sizeof (dtc_keycol_t))) == NULL) {
+    PyErr_NoMemory();
+    return NULL;
+  }
+
+  snap->dtss_nvars++;
+  var->dts_nkeys = aggdesc->dtagd_nrecs - 2;
+
+  for (i = 0; i < var->dts_nkeys; i++) {
+    const dtrace_recdesc_t *rec = &aggdesc->dtagd_rec[i + 1];
+
+    if (!_valid(rec)) {
+      dtc->dtc_error = _error("unsupported action %s as key #%d in aggregation \"%s\"\n", _action(rec, errbuf, sizeof (errbuf)), i + 1, aggdesc->dtagd_name);
+      return NULL;
+    }
+
+    if (rec->dtrd_action == DTRACEACT_DIFEXPR && _is_int(rec)) {
+      var->dts_keys[i].dtk_kind = DTC_COL_INT;
+    } else {
+      var->dts_keys[i].dtk_kind = DTC_COL_STR;
+
+      if ((var->dts_keys[i].dtk_values = PyList_New(0)) == NULL) {
+        return NULL;
+      }
+    }
+  }
+
+  return var;
+}
+
+/*
+ * Appends the dictionary code of a string key, adding the string to the
+ * column's dictionary if we haven't seen it before.
+ */
+static int
+_snapkey_str(dtc_keycol_t *col, const char *str, size_t len) {
+  dtc_hashent_t *ent;
+  int32_t *code;
+
+  if ((ent = _hash_lookup(&col->dtk_codes, str, len, 1)) == NULL) {
+    PyErr_NoMemory();
+    return -1;
+  }
+
+  if (ent->dthe_value == 0) {
+    PyObject* value = PyString_FromStringAndSize(str, len);
+
+    if (value == NULL || PyList_Append(col->dtk_values, value) == -1) {
+      Py_XDECREF(value);
+      return -1;
+    }
+
+    Py_DECREF(value);
+    ent->dthe_value = PyList_GET_SIZE(col->dtk_values);
+  }
+
+  if ((code = (int32_t *)_buf_reserve(&col->dtk_data, sizeof (int32_t))) == NULL) {
+    PyErr_NoMemory();
+    return -1;
+  }
+
+  *code = ent->dthe_value - 1;
+  return 0;
+}
+
+static int
+_aggwalk_snapshot(const dtrace_aggdata_t *agg, void *arg) {
+  dtc_snapshot_t *snap = (dtc_snapshot_t *)arg;
+  DTraceConsumer *dtc = snap->dtss_consumer;
+  const dtrace_aggdesc_t *aggdesc = agg->dtada_desc;
+  const dtrace_recdesc_t *aggrec = &aggdesc->dtagd_rec[aggdesc->dtagd_nrecs - 1];
+  const int64_t *data = (int64_t *)(agg->dtada_data + aggrec->dtrd_offset);
+  dtc_snapvar_t *var;
+  char *value;
+  int i;
+
+  if (snap->dtss_varid != DTRACE_AGGVARIDNONE && aggdesc->dtagd_varid != snap->dtss_varid) {
+    return (DTRACE_AGGWALK_NEXT);
+  }
+
+  if ((var = _snapvar(snap, agg)) == NULL) {
+    return (DTRACE_AGGWALK_ERROR);
+  }
+
+  for (i = 0; i < var->dts_nkeys; i++) {
+    const dtrace_recdesc_t *rec = &aggdesc->dtagd_rec[i + 1];
+    caddr_t addr = agg->dtada_data + rec->dtrd_offset;
+    dtc_keycol_t *col = &var->dts_keys[i];
+    int64_t *key;
+
+    if (col->dtk_kind == DTC_COL_INT) {
+      if ((key = (int64_t *)_buf_reserve(&col->dtk_data, sizeof (int64_t))) == NULL) {
+        PyErr_NoMemory();
+        return (DTRACE_AGGWALK_ERROR);
+      }
+
+      *key = _make_int(rec, addr);
+    } else if (rec->dtrd_action == DTRACEACT_DIFEXPR) {
+      if (_snapkey_str(col, (const char *)addr, strnlen((const char *)addr, rec->dtrd_size)) == -1) {
+        return (DTRACE_AGGWALK_ERROR);
+      }
+    } else if (rec->dtrd_action == DTRACEACT_STACK ||
+        rec->dtrd_action == DTRACEACT_USTACK ||
+        rec->dtrd_action == DTRACEACT_JSTACK) {
+      dtc->dtc_scratch.dtb_len = 0;
+
+      if (_fold_stack(dtc, rec, addr, &dtc->dtc_scratch, 1) == -1) {
+        PyErr_NoMemory();
+        return (DTRACE_AGGWALK_ERROR);
+      }
+
+      if (_snapkey_str(col, dtc->dtc_scratch.dtb_data, dtc->dtc_scratch.dtb_len) == -1) {
+        return (DTRACE_AGGWALK_ERROR);
+      }
+    } else {
+      dtc_sym_t *sym = _sym_lookup(dtc, rec, addr, 1);
+      char buf[2048];
+      const char *name = sym != NULL ? sym->dtsy_name : _make_sym(dtc->dtc_handle, rec, addr, buf, sizeof (buf));
+
+      if (_snapkey_str(col, name, strlen(name)) == -1) {
+        return (DTRACE_AGGWALK_ERROR);
+      }
+    }
+  }
+
+  if ((value = _buf_reserve(&var->dts_values, var->dts_width * sizeof (int64_t))) == NULL) {
+    PyErr_NoMemory();
+    return (DTRACE_AGGWALK_ERROR);
+  }
+
+  switch (var->dts_action) {
+  case DTRACEAGG_AVG: {
+    double avg = data[1] / (double)data[0];
+
+    memcpy(value, &avg, sizeof (double));
+    break;
+  }
+
+  case DTRACEAGG_LQUANTIZE:
+  case DTRACEAGG_LLQUANTIZE:
+    if ((uint64_t)data[0] != var->dts_arg || aggrec->dtrd_size != (var->dts_width + 1) * sizeof (uint64_t)) {
+      dtc->dtc_error = _error("inconsistent encoding in aggregation \"%s\"\n", aggdesc->dtagd_name);
+      return (DTRACE_AGGWALK_ERROR);
+    }
+
+    memcpy(value, data + 1, var->dts_width * sizeof (int64_t));
+    break;
+
+  default:
+    memcpy(value, data, var->dts_width * sizeof (int64_t));
+    break;
+  }
+
+  var->dts_nrows++;
+  return (DTRACE_AGGWALK_NEXT);
+}
+
+/*
+ * Folds an aggregation record into a line of the keys, joined by ';', with
+ * stacks outermost frame first.  Records that fold into the same line (say,
+ * stacks that only differ in offsets) are merged.
+ */
+static int
+_aggwalk_folded(const dtrace_aggdata_t *agg, void *arg) {
+  dtc_folded_t *fold = (dtc_folded_t *)arg;
+  DTraceConsumer *dtc = fold->dtf_consumer;
+  const dtrace_aggdesc_t *aggdesc = agg->dtada_desc;
+  const dtrace_recdesc_t *aggrec = &aggdesc->dtagd_rec[aggdesc->dtagd_nrecs - 1];
+  const int64_t *data = (int64_t *)(agg->dtada_data + aggrec->dtrd_offset);
+  dtc_hashent_t *ent;
+  char errbuf[256];
+  char buf[2048];
+  int i;
+
+  if (fold->dtf_varid != DTRACE_AGGVARIDNONE && aggdesc->dtagd_varid != fold->dtf_varid) {
+    return (DTRACE_AGGWALK_NEXT);
+  }
+
+  if (aggrec->dtrd_action != DTRACEAGG_COUNT && aggrec->dtrd_action != DTRACEAGG_SUM) {
+    if (fold->dtf_varid == DTRACE_AGGVARIDNONE) {
+      return (DTRACE_AGGWALK_NEXT);
+    }
+
+    dtc->dtc_error = _error("can't fold %s in aggregation \"%s\"; only count() and sum() can be folded\n", _action(aggrec, errbuf, sizeof (errbuf)), aggdesc->dtagd_name);
+    return (DTRACE_AGGWALK_ERROR);
+  }
+
+  if (dtc->dtc_aggmode == DTC_AGGWALK_DELTA) {
+    switch (_aggdelta(dtc, agg, &data)) {
+    case -1:
+      return (DTRACE_AGGWALK_ABORT);
+    case 0:
+      return (DTRACE_AGGWALK_NEXT);
+    }
+  }
+
+  fold->dtf_line.dtb_len = 0;
+
+  for (i = 1; i < aggdesc->dtagd_nrecs - 1; i++) {
+    const dtrace_recdesc_t *rec = &aggdesc->dtagd_rec[i];
+    caddr_t addr = agg->dtada_data + rec->dtrd_offset;
+    const char *str = buf;
+    size_t len;
+    char *dst;
+
+    if (!_valid(rec)) {
+      dtc->dtc_error = _error("unsupported action %s as key #%d in aggregation \"%s\"\n", _action(rec, errbuf, sizeof (errbuf)), i, aggdesc->dtagd_name);
+      return (DTRACE_AGGWALK_ERROR);
+    }
+
+    if (i > 1) {
+      if ((dst = _buf_reserve(&fold->dtf_line, 1)) == NULL) {
+        PyErr_NoMemory();
+        return (DTRACE_AGGWALK_ERROR);
+      }
+
+      *dst = ';';
+    }
+
+    switch (rec->dtrd_action) {
+    case DTRACEACT_STACK:
+    case DTRACEACT_USTACK:
+    case DTRACEACT_JSTACK:
+      if (_fold_stack(dtc, rec, addr, &fold->dtf_line, 1) == -1) {
+        PyErr_NoMemory();
+        return (DTRACE_AGGWALK_ERROR);
+      }
+      continue;
+
+    case DTRACEACT_DIFEXPR:
+      if (_is_int(rec)) {
+        snprintf(buf, sizeof (buf), "%lld", (long long)_make_int(rec, addr));
+      } else {
+        str = (const char *)addr;
+      }
+      break;
+
+    default:
+      {
+        dtc_sym_t *sym = _sym_lookup(dtc, rec, addr, 1);
+
+        str = sym != NULL ? sym->dtsy_name : _make_sym(dtc->dtc_handle, rec, addr, buf, sizeof (buf));
+      }
+    }
+
+    len = strnlen(str, str == (const char *)addr ? rec->dtrd_size : sizeof (buf));
+
+    if ((dst = _buf_reserve(&fold->dtf_line, len)) == NULL) {
+      PyErr_NoMemory();
+      return (DTRACE_AGGWALK_ERROR);
+    }
+
+    memcpy(dst, str, len);
+  }
+
+  if ((ent = _hash_lookup(&fold->dtf_lines, fold->dtf_line.dtb_data, fold->dtf_line.dtb_len, 1)) == NULL) {
+    PyErr_NoMemory();
+    return (DTRACE_AGGWALK_ERROR);
+  }
+
+  ent->dthe_value += data[0];
+
+  return dtc->dtc_aggmode == DTC_AGGWALK_REMOVE ? (DTRACE_AGGWALK_REMOVE) : (DTRACE_AGGWALK_NEXT);
+}
+
+/*
+ * The value an aggtop() walk ranks a record by: the value of count(),
+ * sum(), min() and max(), and the number of values of the quantizing
+ * actions.  avg() is ranked by *avgp instead.  Other actions (stddev())
+ * never get here; _aggwalk_top() turns them away, as _make_aggrec() can't
+ * convert them.
+ */
+static int64_t
+_top_value(const dtrace_recdesc_t *aggrec, caddr_t data, double *avgp) {
+  const int64_t *val = (const int64_t *)(data + aggrec->dtrd_offset);
+  int64_t total = 0;
+  size_t i, n = aggrec->dtrd_size / sizeof (int64_t);
+
+  switch (aggrec->dtrd_action) {
+  case DTRACEAGG_AVG:
+    *avgp = val[0] ? val[1] / (double)val[0] : 0;
+    return 0;
+
+  case DTRACEAGG_QUANTIZE:
+    i = 0;
+    break;
+
+  case DTRACEAGG_LQUANTIZE:
+  case DTRACEAGG_LLQUANTIZE:
+    /*
+     * The first word is the encoding.
+     */
+    i = 1;
+    break;
+
+  default:
+    return val[0];
+  }
+
+  for (; i < n; i++) {
+    total += val[i];
+  }
+
+  return total;
+}
+
+/*
+ * Whether the records of two aggregations are laid out alike: the same
+ * keys, at the same offsets, and the same aggregating action with the same
+ * encoding, so that one's data can be compared with and stand in for the
+ * other's.
+ */
+static int
+_top_same_layout(const dtrace_aggdesc_t *a, const dtrace_aggdesc_t *b) {
+  int i;
+
+  if (a == b) {
+    return 1;
+  }
+
+  if (a->dtagd_size != b->dtagd_size || a->dtagd_nrecs != b->dtagd_nrecs) {
+    return 0;
+  }
+
+  for (i = 1; i < a->dtagd_nrecs; i++) {
+    const dtrace_recdesc_t *x = &a->dtagd_rec[i], *y = &b->dtagd_rec[i];
+
+    if (x->dtrd_action != y->dtrd_action || x->dtrd_size != y->dtrd_size ||
+        x->dtrd_offset != y->dtrd_offset || x->dtrd_arg != y->dtrd_arg) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/*
+ * Compares the keys of two records of the same aggregation: integers by
+ * value, strings as strings and anything else (stacks, symbols) by its
+ * bytes.
+ */
+static int
+_top_keycmp(const dtrace_aggdesc_t *aggdesc, caddr_t a, caddr_t b) {
+  int i, cmp;
+
+  for (i = 1; i < aggdesc->dtagd_nrecs - 1; i++) {
+    const dtrace_recdesc_t *rec = &aggdesc->dtagd_rec[i];
+    caddr_t x = a + rec->dtrd_offset, y = b + rec->dtrd_offset;
+
+    if (rec->dtrd_action == DTRACEACT_DIFEXPR && _is_int(rec)) {
+      int64_t u = _make_int(rec, x), v = _make_int(rec, y);
+
+      cmp = u < v ? -1 : u > v;
+    } else if (rec->dtrd_action == DTRACEACT_DIFEXPR) {
+      cmp = strncmp(x, y, rec->dtrd_size);
+    } else {
+      cmp = memcmp(x, y, rec->dtrd_size);
+    }
+
+    if (cmp != 0) {
+      return cmp;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Compares two records in the order aggtop() hands them out: a negative
+ * result if a goes first.  Ties on the value are broken by the keys.
+ */
+static int
+_top_cmp(const dtc_top_t *top, caddr_t a, caddr_t b) {
+  const dtrace_aggdesc_t *aggdesc = top->dtt_desc;
+  const dtrace_recdesc_t *aggrec = &aggdesc->dtagd_rec[aggdesc->dtagd_nrecs - 1];
+  int cmp = 0;
+
+  if (!top->dtt_bykey) {
+    double x = 0, y = 0;
+    int64_t u = _top_value(aggrec, a, &x), v = _top_value(aggrec, b, &y);
+
+    cmp = u != v ? (u < v ? -1 : 1) : (x < y ? -1 : x > y);
+  }
+
+  if (cmp == 0) {
+    cmp = _top_keycmp(aggdesc, a, b);
+  }
+
+  return top->dtt_descending ? -cmp : cmp;
+}
+
+/*
+ * The heap keeps the worst of the records kept at its root, so that a
+ * record that doesn't make it is turned away with a single comparison.
+ */
+static void
+_top_siftdown(dtc_top_t *top, size_t i) {
+  caddr_t *heap = top->dtt_heap;
+
+  for (;;) {
+    size_t worst = i, l = 2 * i + 1, r = l + 1;
+
+    if (l < top->dtt_count && _top_cmp(top, heap[l], heap[worst]) > 0) {
+      worst = l;
+    }
+
+    if (r < top->dtt_count && _top_cmp(top, heap[r], heap[worst]) > 0) {
+      worst = r;
+    }
+
+    if (worst == i) {
+      return;
+    }
+
+    caddr_t tmp = heap[i];
+    heap[i] = heap[worst];
+    heap[worst] = tmp;
+    i = worst;
+  }
+}
+
+static void
+_top_siftup(dtc_top_t *top, size_t i) {
+  caddr_t *heap = top->dtt_heap;
+
+  while (i > 0 && _top_cmp(top, heap[i], heap[(i - 1) / 2]) > 0) {
+    caddr_t tmp = heap[i];
+    heap[i] = heap[(i - 1) / 2];
+    heap[(i - 1) / 2] = tmp;
+    i = (i - 1) / 2;
+  }
+}
+
+/*
+ * Offers an aggregation record to the heap of an aggtop() walk.  Only the
+ * records that make it are copied, and nothing is converted to python
+ * until the walk is over.
+ */
+static int
+_aggwalk_top(const dtrace_aggdata_t *agg, void *arg) {
+  dtc_top_t *top = (dtc_top_t *)arg;
+  DTraceConsumer *dtc = top->dtt_consumer;
+  const dtrace_aggdesc_t *aggdesc = agg->dtada_desc;
+  caddr_t slot;
+
+  if (aggdesc->dtagd_varid != top->dtt_varid || top->dtt_n == 0) {
+    return (DTRACE_AGGWALK_NEXT);
+  }
+
+  if (top->dtt_desc == NULL) {
+    const dtrace_recdesc_t *aggrec = &aggdesc->dtagd_rec[aggdesc->dtagd_nrecs - 1];
+    char errbuf[256];
+
+    switch (aggrec->dtrd_action) {
+    case DTRACEAGG_COUNT:
+    case DTRACEAGG_MIN:
+    case DTRACEAGG_MAX:
+    case DTRACEAGG_SUM:
+    case DTRACEAGG_AVG:
+    case DTRACEAGG_QUANTIZE:
+    case DTRACEAGG_LQUANTIZE:
+    case DTRACEAGG_LLQUANTIZE:
+      break;
+
+    default:
+      dtc->dtc_error = _error("unsupported aggregating action %s in aggregation \"%s\"\n", _action(aggrec, errbuf, sizeof (errbuf)), aggdesc->dtagd_name);
+      return (DTRACE_AGGWALK_ERROR);
+    }
+
+    top->dtt_desc = aggdesc;
+  } else if (!_top_same_layout(aggdesc, top->dtt_desc)) {
+    dtc->dtc_error = _error("aggregation \"%s\" has records of different layouts\n", aggdesc->dtagd_name);
+    return (DTRACE_AGGWALK_ERROR);
+  }
+
+  if (top->dtt_count == top->dtt_n) {
+    if (_top_cmp(top, agg->dtada_data, top->dtt_heap[0]) >= 0) {
+      return (DTRACE_AGGWALK_NEXT);
+    }
+
+    memcpy(top->dtt_heap[0], agg->dtada_data, aggdesc->dtagd_size);
+    _top_siftdown(top, 0);
+    return (DTRACE_AGGWALK_NEXT);
+  }
+
+  if ((slot = malloc(aggdesc->dtagd_size)) == NULL) {
+    PyErr_NoMemory();
+    return (DTRACE_AGGWALK_ABORT);
+  }
+
+  memcpy(slot, agg->dtada_data, aggdesc->dtagd_size);
+  top->dtt_heap[top->dtt_count++] = slot;
+  _top_siftup(top, top->dtt_count - 1);
+
+  return (DTRACE_AGGWALK_NEXT);
+}
+
+//////////////////////////////////////////////////////////
+/////////////////////////////////////// Background consumer 
+//////////////////////////////////////////////////////////
+
+/*
+ * Decodes a record into the chunk being filled, without the GIL.
+ */
+static int
+_append_native(DTraceConsumer *dtc, const dtrace_probedata_t *data, const dtrace_recdesc_t *rec, caddr_t addr) {
+  dtc_background_t *bg = &dtc->dtc_bg;
+  char buf[2048];
+
+  if (rec->dtrd_action == DTRACEACT_DIFEXPR) {
+    return _is_int(rec) ?
+        _rec_append(bg, data, DTC_REC_INT, _make_int(rec, addr), NULL) :
+        _rec_append(bg, data, DTC_REC_STR, 0, (const char *)addr);
+  } else if (rec->dtrd_action == DTRACEACT_STACK ||
+      rec->dtrd_action == DTRACEACT_USTACK ||
+      rec->dtrd_action == DTRACEACT_JSTACK) {
+    const uint64_t *pcs;
+    uint64_t pid;
+    int depth = _stack_frames(rec, addr, &pid, &pcs), i;
+
+    bg->dtbg_scratch.dtb_len = 0;
+
+    for (i = 0; i < depth; i++) {
+      const char *name = _frame_name(dtc, rec, pid, pcs[i], 0, buf, sizeof (buf), 0);
+      size_t len = strlen(name) + 1;
+      char *dst;
+
+      if ((dst = _buf_reserve(&bg->dtbg_scratch, len)) == NULL) {
+        return -1;
+      }
+
+      memcpy(dst, name, len);
+    }
+
+    return _rec_append_bytes(bg, data, DTC_REC_STACK, depth, bg->dtbg_scratch.dtb_data, bg->dtbg_scratch.dtb_len);
+  } else {
+    dtc_sym_t *sym = _sym_lookup(dtc, rec, addr, 0);
+
+    return _rec_append(bg, data, DTC_REC_STR, 0, sym != NULL ? sym->dtsy_name :
+                       _make_sym(dtc->dtc_handle, rec, addr, buf, sizeof (buf)));
+  }
+}
+
+/*
+ * The native counterpart of _make_printf(): queues the format string, with
+ * the index of the printf() record and the number of arguments packed into
+ * the value, followed by the arguments themselves.
+ */
+static int
+_append_printf(DTraceConsumer *dtc, const dtrace_probedata_t *data, const dtrace_recdesc_t *rec) {
+  dtc_background_t *bg = &dtc->dtc_bg;
+  const dtrace_eprobedesc_t *epd = data->dtpda_edesc;
+  caddr_t base = data->dtpda_data - rec->dtrd_offset;
+  int first = (rec - epd->dtepd_rec) + 1, nargs = 0, i;
+  char buf[2048], errbuf[256];
+  const char *fmt;
+
+  if ((fmt = _printf_format(dtc->dtc_handle, rec, buf, sizeof (buf))) != NULL &&
+      (nargs = _printf_nargs(fmt)) > epd->dtepd_nrecs - first) {
+    nargs = epd->dtepd_nrecs - first;
+  }
+
+  for (i = 0; i < nargs; i++) {
+    if (!_valid(&epd->dtepd_rec[first + i])) {
+      snprintf(bg->dtbg_error, sizeof (bg->dtbg_error), "unsupported action %s as argument #%d of printf()",
+               _action(&epd->dtepd_rec[first + i], errbuf, sizeof (errbuf)), i + 1);
+      return -1;
+    }
+  }
+
+  if (_rec_append(bg, data, DTC_REC_FMT, ((int64_t)(first - 1) << 32) | nargs, fmt != NULL ? fmt : "") == -1) {
+    return -1;
+  }
+
+  for (i = 0; i < nargs; i++) {
+    const dtrace_recdesc_t *arec = &epd->dtepd_rec[first + i];
+
+    if (_append_native(dtc, data, arec, base + arec->dtrd_offset) == -1) {
+      return -1;
+    }
+  }
+
+  dtc->dtc_skip = nargs;
+  return 0;
+}
+
+static int
+_consume_native(const dtrace_probedata_t *data, const dtrace_recdesc_t *rec, void *arg) {
+  DTraceConsumer *dtc = (DTraceConsumer *)arg;
+  dtc_background_t *bg = &dtc->dtc_bg;
+  dtrace_probedesc_t *pd = data->dtpda_pdesc;
+  char errbuf[256];
+  int rval;
+
+  if (rec == NULL) {
+    dtc->dtc_stats.dts_firings++;
+    dtc->dtc_stats.dts_bytes += data->dtpda_edesc->dtepd_size;
+    dtc->dtc_skip = 0;
+    return (DTRACE_CONSUME_NEXT);
+  }
+
+  dtc->dtc_stats.dts_records++;
+
+  if ((bg->dtbg_route = _route(dtc, data->dtpda_edesc->dtepd_epid, pd)) == -1) {
+    return (DTRACE_CONSUME_NEXT);
+  }
+
+  if (dtc->dtc_skip > 0) {
+    dtc->dtc_skip--;
+    return (DTRACE_CONSUME_NEXT);
+  }
+
+  if (!_action_valid(rec)) {
+    if (rec->dtrd_action == DTRACEACT_PRINTF) {
+      if (!dtc->dtc_structured) {
+        return (DTRACE_CONSUME_THIS);
+      }
+
+      rval = _append_printf(dtc, data, rec);
+    } else {
+      snprintf(bg->dtbg_error, sizeof (bg->dtbg_error), "unsupported action %s in record for %s:%s:%s:%s",
+               _action(rec, errbuf, sizeof (errbuf)), pd->dtpd_provider, pd->dtpd_mod, pd->dtpd_func, pd->dtpd_name);
+      return (DTRACE_CONSUME_ABORT);
+    }
+  } else {
+    rval = _append_native(dtc, data, rec, data->dtpda_data);
+  }
+
+  if (rval == -1) {
+    if (bg->dtbg_error[0] == '\0') {
+      snprintf(bg->dtbg_error, sizeof (bg->dtbg_error), "couldn't queue record: %s", strerror(errno));
+    }
+    return (DTRACE_CONSUME_ABORT);
+  }
+
+  return (DTRACE_CONSUME_NEXT);
+}
+
+/*
+ * Makes the wakeup pipe readable, if anyone asked for it through fileno() and
+ * it isn't already.  Must be called with dtbg_lock held.
+ */
+static void
+_wakeup(dtc_background_t *bg) {
+  if (bg->dtbg_wakeup[1] != -1 && !bg->dtbg_signaled) {
+    (void) write(bg->dtbg_wakeup[1], "", 1);
+    bg->dtbg_signaled = 1;
+  }
+}
+
+/*
+ * Hands the chunk filled by the last pass over to python.  If python isn't
+ * keeping up, whole passes are dropped (and counted) rather than letting
+ * the queue grow without bounds.
+ */
+static void
+_queue_chunk(dtc_background_t *bg) {
+  dtc_chunk_t *chunk = bg->dtbg_chunk;
+
+  bg->dtbg_chunk = NULL;
+
+  if (chunk == NULL) {
+    return;
+  }
+
+  if (chunk->dtch_nrecs == 0) {
+    _chunk_free(chunk);
+    return;
+  }
+
+  pthread_mutex_lock(&bg->dtbg_lock);
+
+  if (bg->dtbg_maxqueued > 0 && bg->dtbg_queued + chunk->dtch_buf.dtb_len > bg->dtbg_maxqueued) {
+    bg->dtbg_drops += chunk->dtch_nrecs;
+    pthread_mutex_unlock(&bg->dtbg_lock);
+    _chunk_free(chunk);
+    return;
+  }
+
+  if (bg->dtbg_tail != NULL) {
+    bg->dtbg_tail->dtch_next = chunk;
+  } else {
+    bg->dtbg_head = chunk;
+  }
+
+  bg->dtbg_tail = chunk;
+  bg->dtbg_queued += chunk->dtch_buf.dtb_len;
+  _wakeup(bg);
+
+  pthread_mutex_unlock(&bg->dtbg_lock);
+}
+
+static void*
+_background(void *arg) {
+  DTraceConsumer *dtc = (DTraceConsumer *)arg;
+  dtc_background_t *bg = &dtc->dtc_bg;
+  dtrace_hdl_t *dtp = dtc->dtc_handle;
+  dtrace_workstatus_t status = DTRACE_WORKSTATUS_OKAY;
+  uint64_t start;
+
+  while (!bg->dtbg_stop && status == DTRACE_WORKSTATUS_OKAY) {
+    dtrace_sleep(dtp);
+
+    pthread_mutex_lock(&dtc->dtc_lock);
+    start = _now();
+    status = dtrace_work(dtp, NULL, _probe_func(dtc), _consume_native, dtc);
+    _stats_work(dtc, start, dtc->dtc_stats.dts_callback);
+
+    if (status == DTRACE_WORKSTATUS_ERROR && bg->dtbg_error[0] == '\0') {
+      snprintf(bg->dtbg_error, sizeof (bg->dtbg_error), "couldn't consume: %s", dtrace_errmsg(dtp, dtrace_errno(dtp)));
+    }
+
+    if (dtc->dtc_cap.dtcp_fd != -1) {
+      _cap_flush(&dtc->dtc_cap, DTC_CAP_CONSUME);
+
+      if (dtc->dtc_cap.dtcp_errno != 0 && bg->dtbg_error[0] == '\0') {
+        snprintf(bg->dtbg_error, sizeof (bg->dtbg_error), "couldn't write capture file: %s", strerror(dtc->dtc_cap.dtcp_errno));
+        status = DTRACE_WORKSTATUS_ERROR;
+      }
+    }
+
+    pthread_mutex_unlock(&dtc->dtc_lock);
+
+    _queue_chunk(bg);
+  }
+
+  pthread_mutex_lock(&bg->dtbg_lock);
+  bg->dtbg_done = 1;
+  _wakeup(bg);
+  pthread_mutex_unlock(&bg->dtbg_lock);
+
+  return NULL;
+}
+
+static void
+_background_stop(DTraceConsumer *dtc) {
+  dtc_background_t *bg = &dtc->dtc_bg;
+
+  if (!bg->dtbg_active) {
+    return;
+  }
+
+  bg->dtbg_stop = 1;
+
+  Py_BEGIN_ALLOW_THREADS
+  pthread_join(bg->dtbg_thread, NULL);
+  Py_END_ALLOW_THREADS
+
+  bg->dtbg_active = 0;
+  _chunk_free(bg->dtbg_chunk);
+  bg->dtbg_chunk = NULL;
+  free(bg->dtbg_scratch.dtb_data);
+  memset(&bg->dtbg_scratch, 0, sizeof (dtc_buf_t));
+}
+
+/*
+ * Takes the python side of the handle lock: libdtrace isn't thread safe, so
+ * anything that touches the handle while the background thread may be
+ * running must hold dtc_lock, and we must not hold the GIL while waiting
+ * for it.
+ */
+static void
+_handle_lock(DTraceConsumer *dtc) {
+  if (pthread_mutex_trylock(&dtc->dtc_lock) != 0) {
+    Py_BEGIN_ALLOW_THREADS
+    pthread_mutex_lock(&dtc->dtc_lock);
+    Py_END_ALLOW_THREADS
+  }
+
+  _sym_reap(&dtc->dtc_syms);
+}
+
+static void
+_handle_unlock(DTraceConsumer *dtc) {
+  pthread_mutex_unlock(&dtc->dtc_lock);
+}
+
+static PyObject*
+_rec_stack(const dtc_rec_t *rec) {
+  const char *name = rec->dtr_str;
+  PyObject* stack;
+  PyObject* frame;
+  int64_t i;
+
+  if ((stack = PyTuple_New(rec->dtr_value)) == NULL) {
+    return NULL;
+  }
+
+  for (i = 0; i < rec->dtr_value; i++) {
+    if ((frame = PyString_InternFromString(name)) == NULL) {
+      Py_DECREF(stack);
+      return NULL;
+    }
+
+    PyTuple_SET_ITEM(stack, i, frame);
+    name += strlen(name) + 1;
+  }
+
+  return stack;
+}
+
+static PyObject*
+_rec_object(const dtc_rec_t *rec) {
+  switch (rec->dtr_kind) {
+  case DTC_REC_INT:
+    return PyLong_FromLongLong(rec->dtr_value);
+  case DTC_REC_STACK:
+    return _rec_stack(rec);
+  default:
+    return PyString_FromString(rec->dtr_str);
+  }
+}
+
+/*
+ * Rebuilds the (format, args) tuple of a structured printf() from a
+ * DTC_REC_FMT record and the argument records that follow it.
+ */
+static PyObject*
+_drain_printf(DTraceConsumer *dtc, const dtc_rec_t *rec, char **curp) {
+  int64_t nargs = rec->dtr_value & 0xffffffff, i;
+  PyObject* format = _format_cached(dtc, rec->dtr_epid, (int)(rec->dtr_value >> 32), NULL,
+                                    rec->dtr_str[0] != '\0' ? rec->dtr_str : NULL);
+  PyObject* args;
+  PyObject* arg;
+
+  if (format == NULL || (args = PyTuple_New(nargs)) == NULL) {
+    Py_XDECREF(format);
+    return NULL;
+  }
+
+  for (i = 0; i < nargs; i++) {
+    const dtc_rec_t *arec = (const dtc_rec_t *)*curp;
+
+    if ((arg = _rec_object(arec)) == NULL) {
+      Py_DECREF(format);
+      Py_DECREF(args);
+      return NULL;
+    }
+
+    PyTuple_SET_ITEM(args, i, arg);
+    *curp += arec->dtr_size;
+  }
+
+  return Py_BuildValue("(NN)", format, args);
+}
+
+/*
+ * Takes everything the background thread has queued so far.
+ */
+static dtc_chunk_t*
+_dequeue(dtc_background_t *bg) {
+  dtc_chunk_t *head;
+
+  pthread_mutex_lock(&bg->dtbg_lock);
+  head = bg->dtbg_head;
+  bg->dtbg_head = bg->dtbg_tail = NULL;
+  bg->dtbg_queued = 0;
+
+  if (bg->dtbg_signaled) {
+    char byte;
+
+    (void) read(bg->dtbg_wakeup[0], &byte, 1);
+    bg->dtbg_signaled = 0;
+  }
+
+  pthread_mutex_unlock(&bg->dtbg_lock);
+
+  return head;
+}
+
+/*
+ * Converts everything the background thread has queued since the last call
+ * into python objects and dispatches it, exactly as a dtrace_work() pass in
+ * the foreground would have.
+ */
+static int
+_drain(DTraceConsumer *dtc) {
+  dtc_background_t *bg = &dtc->dtc_bg;
+  dtc_chunk_t *chunk, *head = _dequeue(bg);
+  int rval = 0;
+
+  for (chunk = head; chunk != NULL && rval == 0; chunk = chunk->dtch_next) {
+    char *cur = chunk->dtch_buf.dtb_data;
+    char *end = cur + chunk->dtch_buf.dtb_len;
+
+    while (cur < end) {
+      dtc_rec_t *rec = (dtc_rec_t *)cur;
+      PyObject* probe = _probe_cached(dtc, rec->dtr_epid, rec->dtr_pdesc);
+      PyObject* record;
+
+      cur += rec->dtr_size;
+      record = rec->dtr_kind == DTC_REC_FMT ? _drain_printf(dtc, rec, &cur) : _rec_object(rec);
+
+      if ((rval = _emit(dtc, rec->dtr_route, probe, record)) == -1) {
+        break;
+      }
+    }
+  }
+
+  _chunk_free(head);
+
+  if (rval == 0 && bg->dtbg_done && bg->dtbg_error[0] != '\0') {
+    PyErr_SetString(PyExc_RuntimeError, bg->dtbg_error);
+    bg->dtbg_error[0] = '\0';
+    return -1;
+  }
+
+  return rval;
+}
+
+/*
+ * Fails a buffer switch from a callback of a _work() pass: the records being
+ * handed out live in the buffers the switch would reuse.
+ */
+static int
+_work_check(DTraceConsumer *dtc) {
+  if (dtc->dtc_working) {
+    PyErr_SetString(PyExc_RuntimeError, "can't consume from the callback of a consume()");
+    return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * Runs a dtrace_work() pass in the foreground that decodes records into
+ * chunks rather than python objects, exactly as the background thread does,
+ * and returns the chunk.  The chunk is NULL, without an exception set, if the
+ * pass had no data.
+ */
+static int
+_work_native(DTraceConsumer *dtc, dtc_chunk_t **chunkp) {
+  dtc_background_t *bg = &dtc->dtc_bg;
+  dtrace_hdl_t *dtp = dtc->dtc_handle;
+  dtrace_workstatus_t status;
+  uint64_t start;
+
+  if (_work_check(dtc) == -1) {
+    return -1;
+  }
+
+  _handle_lock(dtc);
+  dtc->dtc_native = 1;
+  bg->dtbg_error[0] = '\0';
+  start = _now();
+  status = dtrace_work(dtp, NULL, _probe_func(dtc), _consume_native, dtc);
+  _stats_work(dtc, start, dtc->dtc_stats.dts_callback);
+  dtc->dtc_native = 0;
+
+  if (dtc->dtc_cap.dtcp_fd != -1) {
+    _cap_flush(&dtc->dtc_cap, DTC_CAP_CONSUME);
+  }
+
+  *chunkp = bg->dtbg_chunk;
+  bg->dtbg_chunk = NULL;
+  _handle_unlock(dtc);
+
+  if (status == DTRACE_WORKSTATUS_ERROR) {
+    if (bg->dtbg_error[0] != '\0') {
+      PyErr_SetString(PyExc_RuntimeError, bg->dtbg_error);
+      bg->dtbg_error[0] = '\0';
+    } else {
+      PyErr_SetObject(PyExc_RuntimeError, _error("couldn't consume: %s\n", dtrace_errmsg(dtp, dtrace_errno(dtp))));
+    }
+  }
+
+  if (PyErr_Occurred() || _cap_check(dtc) == -1) {
+    _chunk_free(*chunkp);
+    *chunkp = NULL;
+    return -1;
+  }
+
+  return 0;
+}
+
+static void
+DTraceRecords_dealloc(DTraceRecords* self) {
+  _chunk_free(self->dtri_head);
+  Py_XDECREF(self->dtri_consumer);
+  self->ob_type->tp_free((PyObject*)self);
+}
+
+static PyObject*
+DTraceRecords_iternext(DTraceRecords* self) {
+  DTraceConsumer *dtc = self->dtri_consumer;
+  dtc_background_t *bg = &dtc->dtc_bg;
+  dtc_chunk_t *chunk;
+  dtc_rec_t *rec;
+  PyObject *probe, *record, *pair, *callback;
+
+  /*
+   * Records routed to a callback of their own go to it as the iterator
+   * comes across them; only the rest are handed out.
+   */
+  for (;;) {
+    while ((chunk = self->dtri_chunk) != NULL && self->dtri_cur == chunk->dtch_buf.dtb_data + chunk->dtch_buf.dtb_len) {
+      self->dtri_chunk = chunk->dtch_next;
+      self->dtri_cur = self->dtri_chunk != NULL ? self->dtri_chunk->dtch_buf.dtb_data : NULL;
+    }
+
+    if (chunk == NULL) {
+      /*
+       * As for consume(), a failure of the background thread is raised once
+       * everything it gathered before has been handed out.
+       */
+      if (self->dtri_background && bg->dtbg_done && bg->dtbg_error[0] != '\0') {
+        PyErr_SetString(PyExc_RuntimeError, bg->dtbg_error);
+        bg->dtbg_error[0] = '\0';
+      }
+
+      return NULL;
+    }
+
+    rec = (dtc_rec_t *)self->dtri_cur;
+    self->dtri_cur += rec->dtr_size;
+
+    probe = _probe_cached(dtc, rec->dtr_epid, rec->dtr_pdesc);
+    record = rec->dtr_kind == DTC_REC_FMT ? _drain_printf(dtc, rec, &self->dtri_cur) : _rec_object(rec);
+
+    if (probe == NULL || record == NULL) {
+      Py_XDECREF(probe);
+      Py_XDECREF(record);
+      return NULL;
+    }
+
+    if ((callback = _route_callback(dtc, rec->dtr_route)) == NULL) {
+      break;
+    }
+
+    if (_dispatch(dtc, callback, probe, record) == -1) {
+      return NULL;
+    }
+  }
+
+  if ((pair = PyTuple_New(2)) == NULL) {
+    Py_DECREF(probe);
+    Py_DECREF(record);
+    return NULL;
+  }
+
+  PyTuple_SET_ITEM(pair, 0, probe);
+  PyTuple_SET_ITEM(pair, 1, record);
+
+  return pair;
+}
+
+static PyTypeObject DTraceRecordsType = {
+  PyObject_HEAD_INIT(NULL)
+  0,                         /*ob_size*/
+  "dtrace.Records",          /*tp_name*/
+  sizeof(DTraceRecords),     /*tp_basicsize*/
+  0,                         /*tp_itemsize*/
+  (destructor)DTraceRecords_dealloc, /*tp_dealloc*/
+  0,                         /*tp_print*/
+  0,                         /*tp_getattr*/
+  0,                         /*tp_setattr*/
+  0,                         /*tp_compare*/
+  0,                         /*tp_repr*/
+  0,                         /*tp_as_number*/
+  0,                         /*tp_as_sequence*/
+  0,                         /*tp_as_mapping*/
+  0,                         /*tp_hash */
+  0,                         /*tp_call*/
+  0,                         /*tp_str*/
+  0,                         /*tp_getattro*/
+  0,                         /*tp_setattro*/
+  0,                         /*tp_as_buffer*/
+  Py_TPFLAGS_DEFAULT,        /*tp_flags*/
+  "iterator over the (probe, rec) pairs of a consumption pass", /* tp_doc */
+  0,                     /* tp_traverse */
+  0,                     /* tp_clear */
+  0,                     /* tp_richcompare */
+  0,                     /* tp_weaklistoffset */
+  PyObject_SelfIter,         /* tp_iter */
+  (iternextfunc)DTraceRecords_iternext, /* tp_iternext */
+};
+
+static PyObject*
+_records_new(DTraceConsumer *dtc, dtc_chunk_t *head, int background) {
+  DTraceRecords *it;
+
+  if ((it = PyObject_New(DTraceRecords, &DTraceRecordsType)) == NULL) {
+    _chunk_free(head);
+    return NULL;
+  }
+
+  Py_INCREF(dtc);
+  it->dtri_consumer = dtc;
+  it->dtri_head = it->dtri_chunk = head;
+  it->dtri_cur = head != NULL ? head->dtch_buf.dtb_data : NULL;
+  it->dtri_background = background;
+
+  return (PyObject *)it;
+}
+
+//////////////////////////////////////////////////////////
+/////////////////////////////////////////////////// Buffer 
+//////////////////////////////////////////////////////////
+
+/*
+ * A read-only block of raw trace data.  It takes over the bytes gathered by
+ * a raw consumption pass, so handing them to python doesn't copy them, and
+ * exposes them through both the old and the new buffer protocol.
+ */
+static void
+DTraceBuffer_dealloc(DTraceBuffer* self) {
+  free(self->dtbf_data);
+  self->ob_type->tp_free((PyObject*)self);
+}
+
+static Py_ssize_t
+DTraceBuffer_length(DTraceBuffer* self) {
+  return self->dtbf_len;
+}
+
+static Py_ssize_t
+DTraceBuffer_getreadbuf(DTraceBuffer* self, Py_ssize_t segment, void **ptr) {
+  if (segment != 0) {
+    PyErr_SetString(PyExc_SystemError, "accessing non-existent buffer segment");
+    return -1;
+  }
+
+  *ptr = self->dtbf_data;
+  return self->dtbf_len;
+}
+
+static Py_ssize_t
+DTraceBuffer_getsegcount(DTraceBuffer* self, Py_ssize_t *lenp) {
+  if (lenp != NULL) {
+    *lenp = self->dtbf_len;
+  }
+
+  return 1;
+}
+
+static int
+DTraceBuffer_getbuffer(DTraceBuffer* self, Py_buffer *view, int flags) {
+  if (flags & PyBUF_WRITABLE) {
+    PyErr_SetString(PyExc_BufferError, "trace data is read-only");
+    return -1;
+  }
+
+  Py_INCREF(self);
+  view->obj = (PyObject*)self;
+  view->buf = self->dtbf_data;
+  view->len = self->dtbf_len;
+  view->readonly = 1;
+  view->itemsize = self->dtbf_itemsize;
+  view->format = (flags & PyBUF_FORMAT) ? (char *)self->dtbf_format : NULL;
+  view->ndim = self->dtbf_ndim;
+  view->shape = (flags & PyBUF_ND) ? self->dtbf_shape : NULL;
+  view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? self->dtbf_strides : NULL;
+  view->suboffsets = NULL;
+  view->internal = NULL;
+
+  return 0;
+}
+
+static PySequenceMethods DTraceBuffer_as_sequence = {
+  (lenfunc)DTraceBuffer_length,      /* sq_length */
+};
+
+static PyBufferProcs DTraceBuffer_as_buffer = {
+  (readbufferproc)DTraceBuffer_getreadbuf,  /* bf_getreadbuffer */
+  0,                                        /* bf_getwritebuffer */
+  (segcountproc)DTraceBuffer_getsegcount,   /* bf_getsegcount */
+  (charbufferproc)DTraceBuffer_getreadbuf,  /* bf_getcharbuffer */
+  (getbufferproc)DTraceBuffer_getbuffer,    /* bf_getbuffer */
+  0,                                        /* bf_releasebuffer */
+};
+
+static PyTypeObject DTraceBufferType = {
+  PyObject_HEAD_INIT(NULL)
+  0,                         /*ob_size*/
+  "dtrace.Buffer",           /*tp_name*/
+  sizeof(DTraceBuffer),      /*tp_basicsize*/
+  0,                         /*tp_itemsize*/
+  (destructor)DTraceBuffer_dealloc, /*tp_dealloc*/
+  0,                         /*tp_print*/
+  0,                         /*tp_getattr*/
+  0,                         /*tp_setattr*/
+  0,                         /*tp_compare*/
+  0,                         /*tp_repr*/
+  0,                         /*tp_as_number*/
+  &DTraceBuffer_as_sequence, /*tp_as_sequence*/
+  0,                         /*tp_as_mapping*/
+  0,                         /*tp_hash */
+  0,                         /*tp_call*/
+  0,                         /*tp_str*/
+  0,                         /*tp_getattro*/
+  0,                         /*tp_setattro*/
+  &DTraceBuffer_as_buffer,   /*tp_as_buffer*/
+  Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_NEWBUFFER, /*tp_flags*/
+  "raw trace data",          /* tp_doc */
+};
+
+/*
+ * Wraps the contents of buf, which the new buffer takes over, as an array of
+ * rows items of the given struct format -- or, if cols is non-zero, as a
+ * C-contiguous rows x cols matrix.
+ */
+static PyObject*
+_buffer_new(dtc_buf_t *buf, const char *format, Py_ssize_t itemsize, Py_ssize_t rows, Py_ssize_t cols) {
+  DTraceBuffer* buffer;
+
+  if ((buffer = PyObject_New(DTraceBuffer, &DTraceBufferType)) == NULL) {
+    return NULL;
+  }
+
+  buffer->dtbf_data = buf->dtb_data;
+  buffer->dtbf_len = buf->dtb_len;
+  buffer->dtbf_format = format;
+  buffer->dtbf_itemsize = itemsize;
+  buffer->dtbf_ndim = cols ? 2 : 1;
+  buffer->dtbf_shape[0] = rows;
+  buffer->dtbf_shape[1] = cols;
+  buffer->dtbf_strides[0] = cols ? cols * itemsize : itemsize;
+  buffer->dtbf_strides[1] = itemsize;
+  memset(buf, 0, sizeof (dtc_buf_t));
+
+  return (PyObject*)buffer;
+}
+
+/*
+ * Hands the raw buffer gathered by the last pass to the callback as a
+ * memoryview, together with the layouts needed to interpret it.
+ */
+static int
+_raw_flush(DTraceConsumer *dtc, PyObject *layouts) {
+  PyObject* buffer;
+  PyObject* view;
+  PyObject* result;
+  uint64_t start;
+
+  if (dtc->dtc_raw.dtb_len == 0) {
+    return 0;
+  }
+
+  if ((buffer = _buffer_new(&dtc->dtc_raw, "B", 1, dtc->dtc_raw.dtb_len, 0)) == NULL) {
+    dtc->dtc_raw.dtb_len = 0;
+    return -1;
+  }
+
+  view = PyMemoryView_FromObject(buffer);
+  Py_DECREF(buffer);
+
+  if (view == NULL) {
+    return -1;
+  }
+
+  start = _now();
+  result = PyObject_CallFunctionObjArgs(dtc->dtc_callback, view, layouts, NULL);
+  dtc->dtc_stats.dts_callback += _now() - start;
+  Py_DECREF(view);
+
+  if (result == NULL) {
+    return -1;
+  }
+
+  Py_DECREF(result);
+  return 0;
+}
+
+/*
+ * Builds a dtrace.AggSnapshot, taking over the references to its fields,
+ * any of which may be NULL if creating it failed.
+ */
+static PyObject*
+_aggsnapshot_new(PyObject* name, PyObject* action, PyObject* keys, PyObject* values, PyObject* ranges) {
+  PyObject* snap = NULL;
+
+  if (name != NULL && action != NULL && keys != NULL && values != NULL && ranges != NULL) {
+    snap = PyStructSequence_New(&DTraceAggSnapshotType);
+  }
+
+  if (snap == NULL) {
+    Py_XDECREF(name);
+    Py_XDECREF(action);
+    Py_XDECREF(keys);
+    Py_XDECREF(values);
+    Py_XDECREF(ranges);
+    return NULL;
+  }
+
+  PyStructSequence_SET_ITEM(snap, 0, name);
+  PyStructSequence_SET_ITEM(snap, 1, action);
+  PyStructSequence_SET_ITEM(snap, 2, keys);
+  PyStructSequence_SET_ITEM(snap, 3, values);
+  PyStructSequence_SET_ITEM(snap, 4, ranges);
+
+  return snap;
+}
+
+/*
+ * The ranges of the buckets of a variable with a quantizing action, or
+ * Py_None; the reference is borrowed from the ranges cache.
+ */
+static PyObject*
+_snapvar_ranges(DTraceConsumer *dtc, dtc_snapvar_t *var) {
+  switch (var->dts_action) {
+  case DTRACEAGG_QUANTIZE:
+    return _ranges_quantize(dtc, var->dts_varid);
+
+  case DTRACEAGG_LQUANTIZE:
+    return _ranges_lquantize(dtc, var->dts_varid, var->dts_arg);
+
+  case DTRACEAGG_LLQUANTIZE:
+    return _ranges_llquantize(dtc, var->dts_varid, var->dts_arg, var->dts_width);
+
+  default:
+    return Py_None;
+  }
+}
+
+/*
+ * Turns the columns gathered for a variable into the dtrace.AggSnapshot
+ * returned by aggsnapshot().
+ */
+static PyObject*
+_snapvar_object(DTraceConsumer *dtc, dtc_snapvar_t *var) {
+  PyObject* keys = PyTuple_New(var->dts_nkeys);
+  PyObject* values = NULL;
+  PyObject* ranges;
+  PyObject* key;
+  char errbuf[256];
+  int i;
+
+  if (keys == NULL) {
+    return NULL;
+  }
+
+  for (i = 0; i < var->dts_nkeys; i++) {
+    dtc_keycol_t *col = &var->dts_keys[i];
+
+    if (col->dtk_kind == DTC_COL_INT) {
+      key = _buffer_new(&col->dtk_data, "q", sizeof (int64_t), var->dts_nrows, 0);
+    } else {
+      key = Py_BuildValue("(NO)", _buffer_new(&col->dtk_data, "i", sizeof (int32_t), var->dts_nrows, 0), col->dtk_values);
+    }
+
+    if (key == NULL) {
+      Py_DECREF(keys);
+      return NULL;
+    }
+
+    PyTuple_SET_ITEM(keys, i, key);
+  }
+
+  if ((ranges = _snapvar_ranges(dtc, var)) == NULL) {
+    Py_DECREF(keys);
+    return NULL;
+  }
+
+  if (var->dts_action == DTRACEAGG_AVG) {
+    values = _buffer_new(&var->dts_values, "d", sizeof (double), var->dts_nrows, 0);
+  } else {
+    values = _buffer_new(&var->dts_values, "q", sizeof (int64_t), var->dts_nrows, ranges != Py_None ? var->dts_width : 0);
+  }
+
+  Py_INCREF(ranges);
+
+  return _aggsnapshot_new(PyString_FromString(var->dts_desc->dtagd_name),
+      PyString_FromString(_action(&var->dts_desc->dtagd_rec[var->dts_desc->dtagd_nrecs - 1], errbuf, sizeof (errbuf))),
+      keys, values, ranges);
+}
+
+//////////////////////////////////////////////////////////
+//////////////////////////////////////////////// Histogram 
+//////////////////////////////////////////////////////////
+
+static void
+DTraceHistogram_dealloc(DTraceHistogram* self) {
+  free(self->dthg_buckets);
+  self->ob_type->tp_free((PyObject*)self);
+}
+
+static int
+_hbucket_cmp(const void *a, const void *b) {
+  const dtc_hbucket_t *x = a, *y = b;
+
+  if (x->dthb_min != y->dthb_min) {
+    return x->dthb_min < y->dthb_min ? -1 : 1;
+  }
+
+  return x->dthb_max < y->dthb_max ? -1 : x->dthb_max > y->dthb_max;
+}
+
+/*
+ * Sorts the buckets of a histogram built from python, adding up the counts
+ * of buckets that are given more than once and dropping empty ones.
+ */
+static int
+_histogram_normalize(DTraceHistogram *hist) {
+  dtc_hbucket_t *b = hist->dthg_buckets;
+  Py_ssize_t i, n = 0;
+
+  qsort(b, hist->dthg_nbuckets, sizeof (dtc_hbucket_t), _hbucket_cmp);
+
+  for (i = 0; i < hist->dthg_nbuckets; i++) {
+    if (b[i].dthb_min > b[i].dthb_max) {
+      PyErr_SetString(PyExc_ValueError, "a bucket's minimum can't be above its maximum");
+      return -1;
+    }
+
+    if (n > 0 && b[i].dthb_min == b[n - 1].dthb_min && b[i].dthb_max == b[n - 1].dthb_max) {
+      b[n - 1].dthb_count += b[i].dthb_count;
+    } else if (n > 0 && b[i].dthb_min <= b[n - 1].dthb_max) {
+      PyErr_SetString(PyExc_ValueError, "a histogram's buckets can't overlap");
+      return -1;
+    } else {
+      b[n++] = b[i];
+    }
+  }
+
+  for (hist->dthg_nbuckets = 0, i = 0; i < n; i++) {
+    if (b[i].dthb_count != 0) {
+      b[hist->dthg_nbuckets++] = b[i];
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Creates a histogram from an iterable of ((min, max), count) buckets, as
+ * handed out without histograms set.
+ */
+static PyObject*
+DTraceHistogram_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
+  static char *kwlist[] = {"buckets", NULL};
+  PyObject* pyBuckets = NULL;
+
+  if ( !PyArg_ParseTupleAndKeywords(args, kwds, "|O", kwlist, &pyBuckets) ) {
+    PyErr_SetString(PyExc_AttributeError, "Invalid parameters: Histogram accepts an optional iterable of ((min, max), count) buckets");
+    return NULL;
+  }
+
+  DTraceHistogram* hist;
+  PyObject* seq;
+  Py_ssize_t i, n;
+
+  if (pyBuckets == NULL) {
+    return (PyObject *)_histogram_new(type, 0);
+  }
+
+  if ((seq = PySequence_Fast(pyBuckets, "buckets must be an iterable of ((min, max), count) pairs")) == NULL) {
+    return NULL;
+  }
+
+  n = PySequence_Fast_GET_SIZE(seq);
+
+  if ((hist = _histogram_new(type, n)) == NULL) {
+    Py_DECREF(seq);
+    return NULL;
+  }
+
+  for (i = 0; i < n; i++) {
+    dtc_hbucket_t *b = &hist->dthg_buckets[i];
+    PY_LONG_LONG min, max, count;
+
+    if (!PyArg_Parse(PySequence_Fast_GET_ITEM(seq, i), "((LL)L)", &min, &max, &count)) {
+      Py_DECREF(seq);
+      Py_DECREF(hist);
+      return NULL;
+    }
+
+    b->dthb_min = min;
+    b->dthb_max = max;
+    b->dthb_count = count;
+    hist->dthg_nbuckets++;
+  }
+
+  Py_DECREF(seq);
+
+  if (_histogram_normalize(hist) == -1) {
+    Py_DECREF(hist);
+    return NULL;
+  }
+
+  return (PyObject *)hist;
+}
+
+static Py_ssize_t
+DTraceHistogram_length(DTraceHistogram* self) {
+  return self->dthg_nbuckets;
+}
+
+static PyObject*
+DTraceHistogram_item(DTraceHistogram* self, Py_ssize_t i) {
+  dtc_hbucket_t *b;
+
+  if (i < 0 || i >= self->dthg_nbuckets) {
+    PyErr_SetString(PyExc_IndexError, "histogram index out of range");
+    return NULL;
+  }
+
+  b = &self->dthg_buckets[i];
+  return Py_BuildValue("((LL)L)", (PY_LONG_LONG)b->dthb_min, (PY_LONG_LONG)b->dthb_max, (PY_LONG_LONG)b->dthb_count);
+}
+
+static int64_t
+_histogram_count(DTraceHistogram *hist) {
+  int64_t count = 0;
+  Py_ssize_t i;
+
+  for (i = 0; i < hist->dthg_nbuckets; i++) {
+    count += hist->dthg_buckets[i].dthb_count;
+  }
+
+  return count;
+}
+
+/*
+ * A value frac of the way through a bucket.  The buckets that reach out to
+ * INT64_MIN or INT64_MAX are taken to hold only their finite bound.
+ */
+static double
+_hbucket_value(const dtc_hbucket_t *b, double frac) {
+  if (b->dthb_min == INT64_MIN) {
+    return (double)b->dthb_max;
+  }
+
+  if (b->dthb_max == INT64_MAX) {
+    return (double)b->dthb_min;
+  }
+
+  return (double)b->dthb_min + frac * ((double)b->dthb_max - (double)b->dthb_min);
+}
+
+/*
+ * Estimates the p-th percentile, interpolating linearly within the bucket
+ * it falls into.  Returns 0 if the histogram is empty.
+ */
+static int
+_histogram_percentile(DTraceHistogram *hist, double p, double *valp) {
+  int64_t count = _histogram_count(hist);
+  double rank = p / 100.0 * (double)count, cum = 0;
+  Py_ssize_t i;
+
+  if (count <= 0) {
+    return 0;
+  }
+
+  for (i = 0; i < hist->dthg_nbuckets; i++) {
+    const dtc_hbucket_t *b = &hist->dthg_buckets[i];
+
+    if (b->dthb_count > 0 && cum + (double)b->dthb_count >= rank) {
+      *valp = _hbucket_value(b, (rank - cum) / (double)b->dthb_count);
+      return 1;
+    }
+
+    cum += (double)b->dthb_count;
+  }
+
+  *valp = _hbucket_value(&hist->dthg_buckets[hist->dthg_nbuckets - 1], 1.0);
+  return 1;
+}
+
+static int
+_percentile_arg(PyObject *obj, double *p) {
+  if ((*p = PyFloat_AsDouble(obj)) == -1.0 && PyErr_Occurred()) {
+    return -1;
+  }
+
+  if (!(*p >= 0.0 && *p <= 100.0)) {
+    PyErr_SetString(PyExc_ValueError, "percentiles must be between 0 and 100");
+    return -1;
+  }
+
+  return 0;
+}
+
+static PyObject*
+DTraceHistogram_percentile(DTraceHistogram* self, PyObject *args, PyObject *kwds) {
+  static char *kwlist[] = {"p", NULL};
+  PyObject* pyP = NULL;
+
+  if ( !PyArg_ParseTupleAndKeywords(args, kwds, "O", kwlist, &pyP) ) {
+    PyErr_SetString(PyExc_AttributeError, "Invalid parameters: percentile accepts a percentile between 0 and 100");
+    return NULL;
+  }
+
+  double p, val;
+
+  if (_percentile_arg(pyP, &p) == -1) {
+    return NULL;
+  }
+
+  if (!_histogram_percentile(self, p, &val)) {
+    Py_RETURN_NONE;
+  }
+
+  return PyFloat_FromDouble(val);
+}
+
+static PyObject*
+DTraceHistogram_percentiles(DTraceHistogram* self, PyObject *args, PyObject *kwds) {
+  static char *kwlist[] = {"ps", NULL};
+  PyObject* pyPs = NULL;
+
+  if ( !PyArg_ParseTupleAndKeywords(args, kwds, "O", kwlist, &pyPs) ) {
+    PyErr_SetString(PyExc_AttributeError, "Invalid parameters: percentiles accepts a sequence of percentiles between 0 and 100");
+    return NULL;
+  }
+
+  PyObject* seq;
+  PyObject* result;
+  Py_ssize_t i;
+  double p, val;
+
+  if ((seq = PySequence_Fast(pyPs, "percentiles must be a sequence of numbers")) == NULL) {
+    return NULL;
+  }
+
+  if ((result = PyList_New(PySequence_Fast_GET_SIZE(seq))) == NULL) {
+    Py_DECREF(seq);
+    return NULL;
+  }
+
+  for (i = 0; i < PySequence_Fast_GET_SIZE(seq); i++) {
+    PyObject* item;
+
+    if (_percentile_arg(PySequence_Fast_GET_ITEM(seq, i), &p) == -1) {
+      Py_DECREF(seq);
+      Py_DECREF(result);
+      return NULL;
+    }
+
+    if (_histogram_percentile(self, p, &val)) {
+      item = PyFloat_FromDouble(val);
+    } else {
+      Py_INCREF(Py_None);
+      item = Py_None;
+    }
+
+    if (item == NULL) {
+      Py_DECREF(seq);
+      Py_DECREF(result);
+      return NULL;
+    }
+
+    PyList_SET_ITEM(result, i, item);
+  }
+
+  Py_DECREF(seq);
+  return result;
+}
+
+/*
+ * Estimates the mean, and if varp isn't NULL the variance, taking every
+ * value to be at the middle of its bucket.  Returns 0 if the histogram is
+ * empty.
+ */
+static int
+_histogram_moments(DTraceHistogram *hist, double *meanp, double *varp) {
+  int64_t count = _histogram_count(hist);
+  double sum = 0, mean, var = 0;
+  Py_ssize_t i;
+
+  if (count <= 0) {
+    return 0;
+  }
+
+  for (i = 0; i < hist->dthg_nbuckets; i++) {
+    sum += _hbucket_value(&hist->dthg_buckets[i], 0.5) * (double)hist->dthg_buckets[i].dthb_count;
+  }
+
+  *meanp = mean = sum / (double)count;
+
+  if (varp != NULL) {
+    for (i = 0; i < hist->dthg_nbuckets; i++) {
+      double d = _hbucket_value(&hist->dthg_buckets[i], 0.5) - mean;
+
+      var += d * d * (double)hist->dthg_buckets[i].dthb_count;
+    }
+
+    *varp = var / (double)count;
+  }
+
+  return 1;
+}
+
+static PyObject*
+DTraceHistogram_mean(DTraceHistogram* self, PyObject *args, PyObject *kwds) {
+  static char *kwlist[] = {NULL};
+  double mean;
+
+  if ( !PyArg_ParseTupleAndKeywords(args, kwds, "", kwlist) ) {
+    PyErr_SetString(PyExc_AttributeError, "Invalid parameters: mean takes no arguments");
+    return NULL;
+  }
+
+  if (!_histogram_moments(self, &mean, NULL)) {
+    Py_RETURN_NONE;
+  }
+
+  return PyFloat_FromDouble(mean);
+}
+
+static PyObject*
+DTraceHistogram_stddev(DTraceHistogram* self, PyObject *args, PyObject *kwds) {
+  static char *kwlist[] = {NULL};
+  double mean, var;
+
+  if ( !PyArg_ParseTupleAndKeywords(args, kwds, "", kwlist) ) {
+    PyErr_SetString(PyExc_AttributeError, "Invalid parameters: stddev takes no arguments");
+    return NULL;
+  }
+
+  if (!_histogram_moments(self, &mean, &var)) {
+    Py_RETURN_NONE;
+  }
+
+  return PyFloat_FromDouble(sqrt(var));
+}
+
+/*
+ * Merges the buckets of two histograms into a new one, failing if a bucket
+ * of one partially overlaps a bucket of the other.
+ */
+static DTraceHistogram*
+_histogram_merge(DTraceHistogram *a, DTraceHistogram *b) {
+  DTraceHistogram* hist;
+  Py_ssize_t i = 0, j = 0;
+
+  if ((hist = _histogram_new(&DTraceHistogramType, a->dthg_nbuckets + b->dthg_nbuckets)) == NULL) {
+    return NULL;
+  }
+
+  while (i < a->dthg_nbuckets || j < b->dthg_nbuckets) {
+    const dtc_hbucket_t *x = i < a->dthg_nbuckets ? &a->dthg_buckets[i] : NULL;
+    const dtc_hbucket_t *y = j < b->dthg_nbuckets ? &b->dthg_buckets[j] : NULL;
+    dtc_hbucket_t *out = &hist->dthg_buckets[hist->dthg_nbuckets];
+
+    if (x != NULL && y != NULL && x->dthb_min == y->dthb_min && x->dthb_max == y->dthb_max) {
+      *out = *x;
+      out->dthb_count += y->dthb_count;
+      i++, j++;
+    } else if (y == NULL || (x != NULL && x->dthb_max < y->dthb_min)) {
+      *out = *x;
+      i++;
+    } else if (x == NULL || y->dthb_max < x->dthb_min) {
+      *out = *y;
+      j++;
+    } else {
+      Py_DECREF(hist);
+      PyErr_SetString(PyExc_ValueError, "histograms with overlapping buckets can't be merged");
+      return NULL;
+    }
+
+    if (out->dthb_count != 0) {
+      hist->dthg_nbuckets++;
+    }
+  }
+
+  return hist;
+}
+
+static PyObject*
+DTraceHistogram_add(PyObject *a, PyObject *b) {
+  if (!PyObject_TypeCheck(a, &DTraceHistogramType) || !PyObject_TypeCheck(b, &DTraceHistogramType)) {
+    Py_INCREF(Py_NotImplemented);
+    return Py_NotImplemented;
+  }
+
+  return (PyObject *)_histogram_merge((DTraceHistogram *)a, (DTraceHistogram *)b);
+}
+
+static PyObject*
+DTraceHistogram_inplace_add(PyObject *a, PyObject *b) {
+  DTraceHistogram* self = (DTraceHistogram *)a;
+  DTraceHistogram* merged;
+  dtc_hbucket_t *buckets;
+
+  if (!PyObject_TypeCheck(b, &DTraceHistogramType)) {
+    Py_INCREF(Py_NotImplemented);
+    return Py_NotImplemented;
+  }
+
+  if ((merged = _histogram_merge(self, (DTraceHistogram *)b)) == NULL) {
+    return NULL;
+  }
+
+  buckets = self->dthg_buckets;
+  self->dthg_buckets = merged->dthg_buckets;
+  self->dthg_nbuckets = merged->dthg_nbuckets;
+  merged->dthg_buckets = buckets;
+  Py_DECREF(merged);
+
+  Py_INCREF(self);
+  return (PyObject *)self;
+}
+
+/*
+ * The serialized form is a version byte followed by varints: the number of
+ * buckets, then per bucket the zigzag-encoded distance of its minimum from
+ * the previous maximum, its width and its zigzag-encoded count.
+ */
+#define DTC_HIST_VERSION 1
+
+static int
+_varint_put(dtc_buf_t *buf, uint64_t val) {
+  char *p;
+
+  do {
+    if ((p = _buf_reserve(buf, 1)) == NULL) {
+      return -1;
+    }
+
+    *p = (char)((val & 0x7f) | (val > 0x7f ? 0x80 : 0));
+    val >>= 7;
+  } while (val != 0);
+
+  return 0;
+}
+
+static int
+_varint_get(const unsigned char **pp, const unsigned char *end, uint64_t *valp) {
+  uint64_t val = 0;
+  int shift;
+
+  for (shift = 0; *pp < end && shift < 64; shift += 7) {
+    unsigned char c = *(*pp)++;
+
+    val |= (uint64_t)(c & 0x7f) << shift;
+
+    if (!(c & 0x80)) {
+      *valp = val;
+      return 0;
+    }
+  }
+
+  return -1;
+}
+
+#define DTC_ZIGZAG(v) (((uint64_t)(v) << 1) ^ (uint64_t)((int64_t)(v) >> 63))
+#define DTC_UNZIGZAG(u) ((int64_t)(((u) >> 1) ^ -((u) & 1)))
+
+static PyObject*
+_histogram_tobytes(DTraceHistogram *self) {
+  dtc_buf_t buf = { NULL, 0, 0 };
+  uint64_t prev = 0;
+  PyObject* result;
+  Py_ssize_t i;
+  char *p;
+  int rval;
+
+  rval = (p = _buf_reserve(&buf, 1)) == NULL ? -1 : 0;
+
+  if (p != NULL) {
+    *p = DTC_HIST_VERSION;
+  }
+
+  rval = rval ? rval : _varint_put(&buf, self->dthg_nbuckets);
+
+  for (i = 0; i < self->dthg_nbuckets && rval == 0; i++) {
+    const dtc_hbucket_t *b = &self->dthg_buckets[i];
+
+    rval = _varint_put(&buf, DTC_ZIGZAG((uint64_t)b->dthb_min - prev));
+    rval = rval ? rval : _varint_put(&buf, (uint64_t)b->dthb_max - (uint64_t)b->dthb_min);
+    rval = rval ? rval : _varint_put(&buf, DTC_ZIGZAG(b->dthb_count));
+    prev = b->dthb_max;
+  }
+
+  if (rval == -1) {
+    free(buf.dtb_data);
+    return PyErr_NoMemory();
+  }
+
+  result = PyString_FromStringAndSize(buf.dtb_data, buf.dtb_len);
+  free(buf.dtb_data);
+  return result;
+}
+
+static PyObject*
+DTraceHistogram_tobytes(DTraceHistogram* self, PyObject *args, PyObject *kwds) {
+  static char *kwlist[] = {NULL};
+
+  if ( !PyArg_ParseTupleAndKeywords(args, kwds, "", kwlist) ) {
+    PyErr_SetString(PyExc_AttributeError, "Invalid parameters: tobytes takes no arguments");
+    return NULL;
+  }
+
+  return _histogram_tobytes(self);
+}
+
+static DTraceHistogram*
+_histogram_frombytes(PyTypeObject *type, const char *data, Py_ssize_t len) {
+  const unsigned char *p = (const unsigned char *)data, *end = p + len;
+  DTraceHistogram* hist;
+  uint64_t n, min, width, count, prev = 0;
+
+  if (p == end || *p++ != DTC_HIST_VERSION || _varint_get(&p, end, &n) == -1 || n > (uint64_t)(end - p)) {
+    PyErr_SetString(PyExc_ValueError, "invalid histogram data");
+    return NULL;
+  }
+
+  if ((hist = _histogram_new(type, (Py_ssize_t)n)) == NULL) {
+    return NULL;
+  }
+
+  while (hist->dthg_nbuckets < (Py_ssize_t)n) {
+    dtc_hbucket_t *b = &hist->dthg_buckets[hist->dthg_nbuckets++];
+
+    if (_varint_get(&p, end, &min) == -1 || _varint_get(&p, end, &width) == -1 ||
+        _varint_get(&p, end, &count) == -1) {
+      Py_DECREF(hist);
+      PyErr_SetString(PyExc_ValueError, "invalid histogram data");
+      return NULL;
+    }
+
+    b->dthb_min = (int64_t)(prev + (uint64_t)DTC_UNZIGZAG(min));
+    b->dthb_max = (int64_t)((uint64_t)b->dthb_min + width);
+    b->dthb_count = DTC_UNZIGZAG(count);
+    prev = b->dthb_max;
+  }
+
+  if (p != end || _histogram_normalize(hist) == -1) {
+    if (!PyErr_Occurred()) {
+      PyErr_SetString(PyExc_ValueError, "invalid histogram data");
+    }
+    Py_DECREF(hist);
+    return NULL;
+  }
+
+  return hist;
+}
+
+static PyObject*
+DTraceHistogram_frombytes(PyTypeObject* type, PyObject *args, PyObject *kwds) {
+  static char *kwlist[] = {"data", NULL};
+  const char* data = NULL;
+  int len = 0;
+
+  if ( !PyArg_ParseTupleAndKeywords(args, kwds, "s#", kwlist, &data, &len) ) {
+    PyErr_SetString(PyExc_AttributeError, "Invalid parameters: frombytes accepts the string returned by tobytes()");
+    return NULL;
+  }
+
+  return (PyObject *)_histogram_frombytes(type, data, len);
+}
+
+/*
+ * Histograms pickle as their serialized form.
+ */
+static PyObject*
+DTraceHistogram_reduce(DTraceHistogram* self) {
+  return Py_BuildValue("O()N", (PyObject *)Py_TYPE(self), _histogram_tobytes(self));
+}
+
+static PyObject*
+DTraceHistogram_setstate(DTraceHistogram* self, PyObject *state) {
+  DTraceHistogram* hist;
+  dtc_hbucket_t *buckets;
+
+  if (!PyString_Check(state)) {
+    PyErr_SetString(PyExc_TypeError, "invalid histogram state");
+    return NULL;
+  }
+
+  if ((hist = _histogram_frombytes(Py_TYPE(self), PyString_AS_STRING(state), PyString_GET_SIZE(state))) == NULL) {
+    return NULL;
+  }
+
+  buckets = self->dthg_buckets;
+  self->dthg_buckets = hist->dthg_buckets;
+  self->dthg_nbuckets = hist->dthg_nbuckets;
+  hist->dthg_buckets = buckets;
+  Py_DECREF(hist);
+
+  Py_RETURN_NONE;
+}
+
+static PyObject*
+DTraceHistogram_richcompare(PyObject *a, PyObject *b, int op) {
+  DTraceHistogram *x = (DTraceHistogram *)a, *y = (DTraceHistogram *)b;
+  int equal;
+
+  if ((op != Py_EQ && op != Py_NE) || !PyObject_TypeCheck(b, &DTraceHistogramType)) {
+    Py_INCREF(Py_NotImplemented);
+    return Py_NotImplemented;
+  }
+
+  equal = x->dthg_nbuckets == y->dthg_nbuckets &&
+      memcmp(x->dthg_buckets, y->dthg_buckets, x->dthg_nbuckets * sizeof (dtc_hbucket_t)) == 0;
+
+  if (equal == (op == Py_EQ)) {
+    Py_RETURN_TRUE;
+  }
+
+  Py_RETURN_FALSE;
+}
+
+static PyObject*
+DTraceHistogram_repr(DTraceHistogram* self) {
+  PyObject* buckets;
+  PyObject* repr;
+  PyObject* result;
+
+  if ((buckets = PySequence_List((PyObject *)self)) == NULL) {
+    return NULL;
+  }
+
+  repr = PyObject_Repr(buckets);
+  Py_DECREF(buckets);
+
+  if (repr == NULL) {
+    return NULL;
+  }
+
+  result = PyString_FromFormat("dtrace.Histogram(%s)", PyString_AS_STRING(repr));
+  Py_DECREF(repr);
+  return result;
+}
+
+static PyObject*
+DTraceHistogram_getcount(DTraceHistogram* self, void *closure) {
+  return PyLong_FromLongLong(_histogram_count(self));
+}
+
+static PyGetSetDef DTraceHistogram_getset[] = {
+  {"count", (getter)DTraceHistogram_getcount, NULL, "the number of values in the histogram", NULL},
+  {NULL}  /* Sentinel */
+};
+
+static PyMethodDef DTraceHistogram_methods[] = {
+  {"percentile", (PyCFunction)DTraceHistogram_percentile, METH_VARARGS | METH_KEYWORDS, "estimate a percentile, interpolating within its bucket" },
+  {"percentiles", (PyCFunction)DTraceHistogram_percentiles, METH_VARARGS | METH_KEYWORDS, "estimate a list of percentiles" },
+  {"mean", (PyCFunction)DTraceHistogram_mean, METH_VARARGS | METH_KEYWORDS, "estimate the mean from the middles of the buckets" },
+  {"stddev", (PyCFunction)DTraceHistogram_stddev, METH_VARARGS | METH_KEYWORDS, "estimate the standard deviation from the middles of the buckets" },
+  {"tobytes", (PyCFunction)DTraceHistogram_tobytes, METH_VARARGS | METH_KEYWORDS, "serialize the histogram compactly" },
+  {"frombytes", (PyCFunction)DTraceHistogram_frombytes, METH_VARARGS | METH_KEYWORDS | METH_CLASS, "create a histogram from the string returned by tobytes()" },
+  {"__reduce__", (PyCFunction)DTraceHistogram_reduce, METH_NOARGS, "support for pickle" },
+  {"__setstate__", (PyCFunction)DTraceHistogram_setstate, METH_O, "support for pickle" },
+  {NULL}  /* Sentinel */
+};
+
+static PyNumberMethods DTraceHistogram_as_number = {
+  (binaryfunc)DTraceHistogram_add,  /* nb_add */
+  0,                                /* nb_subtract */
+  0,                                /* nb_multiply */
+  0,                                /* nb_divide */
+  0,                                /* nb_remainder */
+  0,                                /* nb_divmod */
+  0,                                /* nb_power */
+  0,                                /* nb_negative */
+  0,                                /* nb_positive */
+  0,                                /* nb_absolute */
+  0,                                /* nb_nonzero */
+  0,                                /* nb_invert */
+  0,                                /* nb_lshift */
+  0,                                /* nb_rshift */
+  0,                                /* nb_and */
+  0,                                /* nb_xor */
+  0,                                /* nb_or */
+  0,                                /* nb_coerce */
+  0,                                /* nb_int */
+  0,                                /* nb_long */
+  0,                                /* nb_float */
+  0,                                /* nb_oct */
+  0,                                /* nb_hex */
+  (binaryfunc)DTraceHistogram_inplace_add, /* nb_inplace_add */
+};
+
+static PySequenceMethods DTraceHistogram_as_sequence = {
+  (lenfunc)DTraceHistogram_length,  /* sq_length */
+  0,                                /* sq_concat */
+  0,                                /* sq_repeat */
+  (ssizeargfunc)DTraceHistogram_item, /* sq_item */
+};
+
+static PyTypeObject DTraceHistogramType = {
+  PyObject_HEAD_INIT(NULL)
+  0,                         /*ob_size*/
+  "dtrace.Histogram",        /*tp_name*/
+  sizeof(DTraceHistogram),   /*tp_basicsize*/
+  0,                         /*tp_itemsize*/
+  (destructor)DTraceHistogram_dealloc, /*tp_dealloc*/
+  0,                         /*tp_print*/
+  0,                         /*tp_getattr*/
+  0,                         /*tp_setattr*/
+  0,                         /*tp_compare*/
+  (reprfunc)DTraceHistogram_repr, /*tp_repr*/
+  &DTraceHistogram_as_number, /*tp_as_number*/
+  &DTraceHistogram_as_sequence, /*tp_as_sequence*/
+  0,                         /*tp_as_mapping*/
+  PyObject_HashNotImplemented, /*tp_hash */
+  0,                         /*tp_call*/
+  0,                         /*tp_str*/
+  0,                         /*tp_getattro*/
+  0,                         /*tp_setattro*/
+  0,                         /*tp_as_buffer*/
+  Py_TPFLAGS_DEFAULT | Py_TPFLAGS_CHECKTYPES, /*tp_flags*/
+  "the non-empty ((min, max), count) buckets of a quantized value", /* tp_doc */
+  0,                     /* tp_traverse */
+  0,                     /* tp_clear */
+  DTraceHistogram_richcompare, /* tp_richcompare */
+  0,                     /* tp_weaklistoffset */
+  0,                     /* tp_iter */
+  0,                     /* tp_iternext */
+  DTraceHistogram_methods,  /* tp_methods */
+  0,                         /* tp_members */
+  DTraceHistogram_getset,    /* tp_getset */
+  0,                         /* tp_base */
+  0,                         /* tp_dict */
+  0,                         /* tp_descr_get */
+  0,                         /* tp_descr_set */
+  0,                         /* tp_dictoffset */
+  0,                         /* tp_init */
+  0,                         /* tp_alloc */
+  DTraceHistogram_new,       /* tp_new */
+};
+
+//////////////////////////////////////////////////////////
+//////////////////////////////////// Snapshot publication 
+//////////////////////////////////////////////////////////
+
+/*
+ * The time of day, in ns since the epoch.
+ */
+static uint64_t
+_walltime(void) {
+  struct timeval tv;
+
+  (void) gettimeofday(&tv, NULL);
+  return (uint64_t)tv.tv_sec * 1000000000 + (uint64_t)tv.tv_usec * 1000;
+}
+
+/*
+ * Pads a snapshot being encoded to 8 bytes.
+ */
+static int
+_pub_pad(dtc_buf_t *buf) {
+  size_t pad = ((buf->dtb_len + 7) & ~(size_t)7) - buf->dtb_len;
+  char *p;
+
+  if ((p = _buf_reserve(buf, pad)) == NULL) {
+    PyErr_NoMemory();
+    return -1;
+  }
+
+  memset(p, 0, pad);
+  return 0;
+}
+
+/*
+ * Appends len bytes to a snapshot being encoded, padded to 8 bytes.
+ */
+static int
+_pub_put(dtc_buf_t *buf, const void *data, size_t len) {
+  char *p;
+
+  if ((p = _buf_reserve(buf, len)) == NULL) {
+    PyErr_NoMemory();
+    return -1;
+  }
+
+  if (len > 0) {
+    memcpy(p, data, len);
+  }
+
+  return _pub_pad(buf);
+}
+
+/*
+ * Encodes the columns of an aggregation snapshot in the layout described
+ * with dtc_pubhdr_t.
+ */
+static int
+_pub_encode(DTraceConsumer *dtc, dtc_snapshot_t *snap, dtc_buf_t *out) {
+  uint32_t nvars[2] = { snap->dtss_nvars, 0 };
+  char errbuf[256];
+  int i, j;
+
+  out->dtb_len = 0;
+
+  if (_pub_put(out, nvars, sizeof (nvars)) == -1) {
+    return -1;
+  }
+
+  for (i = 0; i < snap->dtss_nvars; i++) {
+    dtc_snapvar_t *var = &snap->dtss_vars[i];
+    const dtrace_aggdesc_t *desc = var->dts_desc;
+    const char *action = _action(&desc->dtagd_rec[desc->dtagd_nrecs - 1], errbuf, sizeof (errbuf));
+    PyObject* ranges;
+    dtc_pubvar_t pv;
+
+    if ((ranges = _snapvar_ranges(dtc, var)) == NULL) {
+      return -1;
+    }
+
+    memset(&pv, 0, sizeof (pv));
+    pv.dtpv_varid = var->dts_varid;
+    pv.dtpv_nkeys = var->dts_nkeys;
+    pv.dtpv_width = var->dts_width;
+    pv.dtpv_flags = (ranges != Py_None ? DTC_PUB_RANGES : 0) | (var->dts_action == DTRACEAGG_AVG ? DTC_PUB_DOUBLE : 0);
+    pv.dtpv_nrows = var->dts_nrows;
+    pv.dtpv_namelen = strlen(desc->dtagd_name);
+    pv.dtpv_actionlen = strlen(action);
+
+    if (_pub_put(out, &pv, sizeof (pv)) == -1 ||
+        _pub_put(out, desc->dtagd_name, pv.dtpv_namelen + 1) == -1 ||
+        _pub_put(out, action, pv.dtpv_actionlen + 1) == -1) {
+      return -1;
+    }
+
+    for (j = 0; ranges != Py_None && j < var->dts_width; j++) {
+      PyObject* range = PyTuple_GET_ITEM(ranges, j);
+      int64_t minmax[2];
+
+      minmax[0] = PyLong_AsLongLong(PyTuple_GET_ITEM(range, 0));
+      minmax[1] = PyLong_AsLongLong(PyTuple_GET_ITEM(range, 1));
+
+      if (PyErr_Occurred() || _pub_put(out, minmax, sizeof (minmax)) == -1) {
+        return -1;
+      }
+    }
+
+    for (j = 0; j < var->dts_nkeys; j++) {
+      dtc_keycol_t *col = &var->dts_keys[j];
+      Py_ssize_t k, nstrings = col->dtk_kind == DTC_COL_STR ? PyList_GET_SIZE(col->dtk_values) : 0;
+      dtc_pubkey_t pk;
+      uint32_t *lens;
+
+      pk.dtpk_kind = col->dtk_kind;
+      pk.dtpk_nstrings = nstrings;
+
+      if (_pub_put(out, &pk, sizeof (pk)) == -1 ||
+          _pub_put(out, col->dtk_data.dtb_data, col->dtk_data.dtb_len) == -1) {
+        return -1;
+      }
+
+      if (col->dtk_kind != DTC_COL_STR) {
+        continue;
+      }
+
+      if ((lens = (uint32_t *)_buf_reserve(out, (nstrings * sizeof (uint32_t) + 7) & ~(size_t)7)) == NULL) {
+        PyErr_NoMemory();
+        return -1;
+      }
+
+      memset(lens, 0, (nstrings * sizeof (uint32_t) + 7) & ~(size_t)7);
+
+      for (k = 0; k < nstrings; k++) {
+        lens[k] = PyString_GET_SIZE(PyList_GET_ITEM(col->dtk_values, k));
+      }
+
+      for (k = 0; k < nstrings; k++) {
+        PyObject* str = PyList_GET_ITEM(col->dtk_values, k);
+
+        if (_buf_reserve(out, PyString_GET_SIZE(str)) == NULL) {
+          PyErr_NoMemory();
+          return -1;
+        }
+
+        memcpy(out->dtb_data + out->dtb_len - PyString_GET_SIZE(str), PyString_AS_STRING(str), PyString_GET_SIZE(str));
+      }
+
+      if (_pub_pad(out) == -1) {
+        return -1;
+      }
+    }
+
+    if (_pub_put(out, var->dts_values.dtb_data, var->dts_values.dtb_len) == -1) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Grows the snapshot file to size bytes, and maps it again.
+ */
+static int
+_pub_map(dtc_publish_t *pub, size_t size) {
+  char *base;
+
+  if (ftruncate(pub->dtpb_fd, size) == -1 ||
+      (base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, pub->dtpb_fd, 0)) == MAP_FAILED) {
+    PyErr_SetFromErrno(PyExc_IOError);
+    return -1;
+  }
+
+  if (pub->dtpb_base != NULL) {
+    munmap(pub->dtpb_base, pub->dtpb_size);
+  }
+
+  pub->dtpb_base = base;
+  pub->dtpb_size = size;
+
+  return 0;
+}
+
+/*
+ * Writes the encoded snapshot to the buffer that isn't current, and makes
+ * it current.
+ */
+static int
+_pub_write(dtc_publish_t *pub) {
+  size_t len = pub->dtpb_data.dtb_len;
+  uint64_t *buf = pub->dtpb_bufs[pub->dtpb_next];
+  dtc_pubhdr_t *hdr;
+
+  if (buf[1] < len) {
+    uint64_t size = buf[1] * 2 > len ? buf[1] * 2 : len;
+    uint64_t offset = pub->dtpb_size;
+
+    if (_pub_map(pub, offset + size) == -1) {
+      return -1;
+    }
+
+    buf[0] = offset;
+    buf[1] = size;
+  }
+
+  /*
+   * Readers of this buffer have all seen dtph_seq change since it was
+   * current, so they'll retry.
+   */
+  hdr = (dtc_pubhdr_t *)pub->dtpb_base;
+  __sync_synchronize();
+  memcpy(pub->dtpb_base + buf[0], pub->dtpb_data.dtb_data, len);
+
+  hdr->dtph_seq++;
+  __sync_synchronize();
+  hdr->dtph_size = pub->dtpb_size;
+  hdr->dtph_generation++;
+  hdr->dtph_time = _walltime();
+  hdr->dtph_offset = buf[0];
+  hdr->dtph_len = len;
+  __sync_synchronize();
+  hdr->dtph_seq++;
+
+  pub->dtpb_next ^= 1;
+  return 0;
+}
+
+/*
+ * Publishes the aggregations just snapped, if publish() was called.  Must
+ * be called with the handle lock held.  Publishing is a side effect of the
+ * walk that snapped, which it never fails: the error, if any, is kept for
+ * publish_error instead, and cleared by the next snapshot published.
+ */
+static void
+_publish(DTraceConsumer *dtc) {
+  dtrace_hdl_t *dtp = dtc->dtc_handle;
+  dtc_publish_t *pub = &dtc->dtc_pub;
+  PyObject *type, *value, *tb;
+  dtc_snapshot_t snap;
+  int rval;
+
+  if (pub->dtpb_base == NULL) {
+    return;
+  }
+
+  memset(&snap, 0, sizeof (snap));
+  snap.dtss_consumer = dtc;
+  snap.dtss_varid = DTRACE_AGGVARIDNONE;
+  dtc->dtc_error = Py_None;
+
+  /*
+   * Not _aggregate_walk(), which would capture the aggregations twice.
+   */
+  rval = dtrace_aggregate_walk(dtp, _aggwalk_snapshot, &snap);
+
+  if (!PyErr_Occurred() && rval == -1) {
+    if (dtc->dtc_error != Py_None) {
+      PyErr_SetObject(PyExc_RuntimeError, dtc->dtc_error);
+    } else {
+      PyErr_SetObject(PyExc_RuntimeError, _error("couldn't walk aggregate: %s\n", dtrace_errmsg(dtp, dtrace_errno(dtp))));
+    }
+  }
+
+  if (!PyErr_Occurred() && _pub_encode(dtc, &snap, &pub->dtpb_data) == 0) {
+    (void) _pub_write(pub);
+  }
+
+  _snapshot_free(&snap);
+  dtc->dtc_error = Py_None;
+  Py_CLEAR(pub->dtpb_error);
+
+  if (PyErr_Occurred()) {
+    PyErr_Fetch(&type, &value, &tb);
+    PyErr_NormalizeException(&type, &value, &tb);
+
+    if ((pub->dtpb_error = PyObject_Str(value != NULL ? value : type)) == NULL) {
+      PyErr_Clear();
+    }
+
+    Py_XDECREF(type);
+    Py_XDECREF(value);
+    Py_XDECREF(tb);
+  }
+}
+
+static void
+_pub_close(dtc_publish_t *pub) {
+  if (pub->dtpb_base != NULL) {
+    munmap(pub->dtpb_base, pub->dtpb_size);
+    close(pub->dtpb_fd);
+  }
+
+  free(pub->dtpb_data.dtb_data);
+  Py_XDECREF(pub->dtpb_error);
+  memset(pub, 0, sizeof (dtc_publish_t));
+}
+
+/*
+ * Creates the snapshot file, with buffers of size bytes, under a temporary
+ * name that is then renamed to path: readers of the file it replaces keep
+ * what they have mapped.
+ */
+static int
+_pub_open(dtc_publish_t *pub, const char *path, size_t size) {
+  size_t hdrsize = (sizeof (dtc_pubhdr_t) + 63) & ~(size_t)63;
+  char *tmp = malloc(strlen(path) + sizeof (".XXXXXX"));
+  dtc_pubhdr_t *hdr;
+
+  if (tmp == NULL) {
+    PyErr_NoMemory();
+    return -1;
+  }
+
+  sprintf(tmp, "%s.XXXXXX", path);
+
+  if ((pub->dtpb_fd = mkstemp(tmp)) == -1) {
+    PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *)path);
+    free(tmp);
+    return -1;
+  }
+
+  if (fchmod(pub->dtpb_fd, 0644) == -1 || _pub_map(pub, hdrsize + 2 * size) == -1) {
+    if (!PyErr_Occurred()) {
+      PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *)path);
+    }
+    goto fail;
+  }
+
+  hdr = (dtc_pubhdr_t *)pub->dtpb_base;
+  memcpy(hdr->dtph_magic, DTC_PUB_MAGIC, sizeof (hdr->dtph_magic));
+  hdr->dtph_version = DTC_PUB_VERSION;
+  hdr->dtph_hdrsize = sizeof (dtc_pubhdr_t);
+  hdr->dtph_size = pub->dtpb_size;
+  pub->dtpb_bufs[0][0] = hdrsize;
+  pub->dtpb_bufs[0][1] = size;
+  pub->dtpb_bufs[1][0] = hdrsize + size;
+  pub->dtpb_bufs[1][1] = size;
+
+  if (rename(tmp, path) == -1) {
+    PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *)path);
+    goto fail;
+  }
+
+  free(tmp);
+  return 0;
+
+fail:
+  unlink(tmp);
+  free(tmp);
+
+  if (pub->dtpb_base == NULL) {
+    close(pub->dtpb_fd);
+  }
+
+  _pub_close(pub);
+  return -1;
+}
+
+/*
+ * The reader of a snapshot file, which may run in any process that can
+ * read the file.
+ */
+static void
+DTraceSnapshotReader_dealloc(DTraceSnapshotReader* self) {
+  if (self->dtsr_base != NULL) {
+    munmap(self->dtsr_base, self->dtsr_size);
+    close(self->dtsr_fd);
+  }
+
+  self->ob_type->tp_free((PyObject*)self);
+}
+
+/*
+ * Maps the whole snapshot file, which may have grown since it was last
+ * mapped.
+ */
+static int
+_reader_map(DTraceSnapshotReader *r) {
+  struct stat st;
+  char *base;
+
+  if (fstat(r->dtsr_fd, &st) == -1 ||
+      (base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, r->dtsr_fd, 0)) == MAP_FAILED) {
+    PyErr_SetFromErrno(PyExc_IOError);
+    return -1;
+  }
+
+  if (r->dtsr_base != NULL) {
+    munmap(r->dtsr_base, r->dtsr_size);
+  }
+
+  r->dtsr_base = base;
+  r->dtsr_size = st.st_size;
+
+  return 0;
+}
+
+static int
+DTraceSnapshotReader_init(DTraceSnapshotReader *self, PyObject *args, PyObject *kwds) {
+  static char *kwlist[] = {"path", NULL};
+  char* path = NULL;
+  dtc_pubhdr_t *hdr;
+
+  if ( !PyArg_ParseTupleAndKeywords(args, kwds, "s", kwlist, &path) ) {
+    PyErr_SetString(PyExc_AttributeError, "Invalid parameters: SnapshotReader accepts the path of a snapshot file");
+    return -1;
+  }
+
+  if (self->dtsr_base != NULL) {
+    return 0;
+  }
+
+  if ((self->dtsr_fd = open(path, O_RDONLY)) == -1) {
+    PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+    return -1;
+  }
+
+  if (_reader_map(self) == -1) {
+    close(self->dtsr_fd);
+    return -1;
+  }
+
+  hdr = (dtc_pubhdr_t *)self->dtsr_base;
+
+  if (self->dtsr_size < sizeof (dtc_pubhdr_t) || memcmp(hdr->dtph_magic, DTC_PUB_MAGIC, sizeof (hdr->dtph_magic)) != 0 ||
+      hdr->dtph_version != DTC_PUB_VERSION || hdr->dtph_hdrsize < sizeof (dtc_pubhdr_t)) {
+    PyErr_Format(PyExc_ValueError, "%s is not a snapshot file", path);
+    munmap(self->dtsr_base, self->dtsr_size);
+    close(self->dtsr_fd);
+    self->dtsr_base = NULL;
+    return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * A cursor over the snapshot being read, which another process may be
+ * overwriting: every length is checked before it's used.
+ */
+typedef struct {
+  const char* dtpc_ptr;
+  size_t dtpc_left;
+} dtc_pubcursor_t;
+
+static const char*
+_pub_take(dtc_pubcursor_t *cur, uint64_t len) {
+  uint64_t padded = (len + 7) & ~(uint64_t)7;
+  const char *p = cur->dtpc_ptr;
+
+  if (len > cur->dtpc_left || padded > cur->dtpc_left) {
+    return NULL;
+  }
+
+  cur->dtpc_ptr += padded;
+  cur->dtpc_left -= padded;
+  return p;
+}
+
+/*
+ * Copies len bytes out of the snapshot into a new dtrace.Buffer.
+ */
+static PyObject*
+_pub_buffer(const char *data, size_t len, const char *format, Py_ssize_t itemsize, Py_ssize_t rows, Py_ssize_t cols) {
+  dtc_buf_t buf;
+
+  memset(&buf, 0, sizeof (buf));
+
+  if (_buf_reserve(&buf, len ? len : 1) == NULL) {
+    return PyErr_NoMemory();
+  }
+
+  memcpy(buf.dtb_data, data, len);
+  buf.dtb_len = len;
+
+  return _buffer_new(&buf, format, itemsize, rows, cols);
+}
+
+/*
+ * Decodes the key columns of a variable into the tuple of aggsnapshot().
+ * Returns NULL with *corrupt set if the snapshot doesn't hold together.
+ * Like pv, the column descriptions are copied out of the file before
+ * they're checked, and every count is bounded by what's left of the
+ * snapshot before anything is allocated for it.
+ */
+static PyObject*
+_pub_keys(dtc_pubcursor_t *cur, const dtc_pubvar_t *pv, int *corrupt) {
+  PyObject* keys;
+  PyObject* key = NULL;
+  dtc_pubkey_t pk;
+  const char *col, *str, *p;
+  uint64_t total, len;
+  uint32_t i, j;
+
+  if (pv->dtpv_nkeys > cur->dtpc_left / sizeof (dtc_pubkey_t)) {
+    *corrupt = 1;
+    return NULL;
+  }
+
+  if ((keys = PyTuple_New(pv->dtpv_nkeys)) == NULL) {
+    return NULL;
+  }
+
+  for (i = 0; i < pv->dtpv_nkeys; i++) {
+    if ((p = _pub_take(cur, sizeof (dtc_pubkey_t))) == NULL) {
+      goto corrupt;
+    }
+
+    memcpy(&pk, p, sizeof (pk));
+
+    if (pk.dtpk_kind == DTC_COL_INT) {
+      if ((col = _pub_take(cur, pv->dtpv_nrows * sizeof (int64_t))) == NULL) {
+        goto corrupt;
+      }
+
+      key = _pub_buffer(col, pv->dtpv_nrows * sizeof (int64_t), "q", sizeof (int64_t), pv->dtpv_nrows, 0);
+    } else if (pk.dtpk_kind == DTC_COL_STR) {
+      PyObject* values;
+
+      if ((col = _pub_take(cur, pv->dtpv_nrows * sizeof (int32_t))) == NULL ||
+          (p = _pub_take(cur, (uint64_t)pk.dtpk_nstrings * sizeof (uint32_t))) == NULL) {
+        goto corrupt;
+      }
+
+      for (j = 0, total = 0; j < pk.dtpk_nstrings; j++) {
+        total += ((const uint32_t *)p)[j];
+      }
+
+      if ((str = _pub_take(cur, total)) == NULL) {
+        goto corrupt;
+      }
+
+      if ((values = PyList_New(pk.dtpk_nstrings)) == NULL) {
+        Py_DECREF(keys);
+        return NULL;
+      }
+
+      /*
+       * The lengths are read again, and may have been rewritten since they
+       * were added up, so they're checked against the total once more.
+       */
+      for (j = 0; j < pk.dtpk_nstrings; str += len, total -= len, j++) {
+        PyObject* value;
+
+        if ((len = ((const uint32_t *)p)[j]) > total) {
+          Py_DECREF(values);
+          goto corrupt;
+        }
+
+        if ((value = PyString_FromStringAndSize(str, len)) == NULL) {
+          Py_DECREF(values);
+          Py_DECREF(keys);
+          return NULL;
+        }
+
+        PyList_SET_ITEM(values, j, value);
+      }
+
+      key = Py_BuildValue("(NN)", _pub_buffer(col, pv->dtpv_nrows * sizeof (int32_t), "i", sizeof (int32_t), pv->dtpv_nrows, 0), values);
+    } else {
+      goto corrupt;
+    }
+
+    if (key == NULL) {
+      Py_DECREF(keys);
+      return NULL;
+    }
+
+    PyTuple_SET_ITEM(keys, i, key);
+  }
+
+  return keys;
+
+corrupt:
+  *corrupt = 1;
+  Py_DECREF(keys);
+  return NULL;
+}
+
+/*
+ * Decodes one variable of a snapshot into a dtrace.AggSnapshot, storing
+ * its variable ID in *varid.  Returns NULL with *corrupt set if the
+ * snapshot doesn't hold together.
+ */
+static PyObject*
+_pub_var(dtc_pubcursor_t *cur, dtrace_aggvarid_t *varid, int *corrupt) {
+  dtc_pubvar_t var, *pv = &var;
+  const char *name, *action, *data, *p;
+  PyObject* ranges = Py_None;
+  PyObject* keys;
+  uint64_t nvalues;
+  uint32_t i;
+
+  if ((p = _pub_take(cur, sizeof (dtc_pubvar_t))) == NULL) {
+    *corrupt = 1;
+    return NULL;
+  }
+
+  /*
+   * The publisher may be rewriting the file under us, so the description
+   * is copied out before it's checked.
+   */
+  memcpy(&var, p, sizeof (var));
+
+  if ((name = _pub_take(cur, (uint64_t)pv->dtpv_namelen + 1)) == NULL ||
+      (action = _pub_take(cur, (uint64_t)pv->dtpv_actionlen + 1)) == NULL ||
+      pv->dtpv_width == 0 || pv->dtpv_nrows > cur->dtpc_left / sizeof (int64_t)) {
+    *corrupt = 1;
+    return NULL;
+  }
+
+  *varid = pv->dtpv_varid;
+
+  if (pv->dtpv_flags & DTC_PUB_RANGES) {
+    const int64_t *minmax;
+
+    if ((minmax = (const int64_t *)_pub_take(cur, (uint64_t)pv->dtpv_width * 2 * sizeof (int64_t))) == NULL) {
+      *corrupt = 1;
+      return NULL;
+    }
+
+    if ((ranges = PyTuple_New(pv->dtpv_width)) == NULL) {
+      return NULL;
+    }
+
+    for (i = 0; i < pv->dtpv_width; i++) {
+      PyObject* range = Py_BuildValue("(LL)", (PY_LONG_LONG)minmax[2 * i], (PY_LONG_LONG)minmax[2 * i + 1]);
+
+      if (range == NULL) {
+        Py_DECREF(ranges);
+        return NULL;
+      }
+
+      PyTuple_SET_ITEM(ranges, i, range);
+    }
+  } else {
+    Py_INCREF(ranges);
+  }
+
+  if ((keys = _pub_keys(cur, pv, corrupt)) == NULL) {
+    Py_DECREF(ranges);
+    return NULL;
+  }
+
+  nvalues = pv->dtpv_nrows * pv->dtpv_width;
+
+  if ((pv->dtpv_nrows != 0 && pv->dtpv_width > cur->dtpc_left / sizeof (int64_t) / pv->dtpv_nrows) ||
+      (data = _pub_take(cur, nvalues * sizeof (int64_t))) == NULL) {
+    *corrupt = 1;
+    Py_DECREF(ranges);
+    Py_DECREF(keys);
+    return NULL;
+  }
+
+  return _aggsnapshot_new(PyString_FromStringAndSize(name, pv->dtpv_namelen),
+      PyString_FromStringAndSize(action, pv->dtpv_actionlen), keys,
+      (pv->dtpv_flags & DTC_PUB_DOUBLE) ?
+        _pub_buffer(data, nvalues * sizeof (double), "d", sizeof (double), pv->dtpv_nrows, 0) :
+        _pub_buffer(data, nvalues * sizeof (int64_t), "q", sizeof (int64_t), pv->dtpv_nrows, (pv->dtpv_flags & DTC_PUB_RANGES) ? pv->dtpv_width : 0),
+      ranges);
+}
+
+/*
+ * Decodes a snapshot as aggsnapshot() would return it: a dict of every
+ * variable, or the variable varid (or None).
+ */
+static PyObject*
+_pub_decode(const char *data, size_t len, dtrace_aggvarid_t varid, int *corrupt) {
+  dtc_pubcursor_t cur = { data, len };
+  const char *p;
+  PyObject* result;
+  PyObject* var;
+  PyObject* id;
+  uint32_t nvars, i;
+
+  if ((p = _pub_take(&cur, 2 * sizeof (uint32_t))) == NULL) {
+    *corrupt = 1;
+    return NULL;
+  }
+
+  memcpy(&nvars, p, sizeof (nvars));
+
+  if ((result = varid == DTRACE_AGGVARIDNONE ? PyDict_New() : Py_None) == NULL) {
+    return NULL;
+  }
+
+  if (result == Py_None) {
+    Py_INCREF(result);
+  }
+
+  for (i = 0; i < nvars; i++) {
+    dtrace_aggvarid_t vid;
+
+    if ((var = _pub_var(&cur, &vid, corrupt)) == NULL) {
+      Py_DECREF(result);
+      return NULL;
+    }
+
+    if (varid != DTRACE_AGGVARIDNONE) {
+      if (vid == varid) {
+        Py_DECREF(result);
+        return var;
+      }
+
+      Py_DECREF(var);
+      continue;
+    }
+
+    if ((id = PyInt_FromLong(vid)) == NULL || PyDict_SetItem(result, id, var) == -1) {
+      Py_XDECREF(id);
+      Py_DECREF(var);
+      Py_DECREF(result);
+      return NULL;
+    }
+
+    Py_DECREF(id);
+    Py_DECREF(var);
+  }
+
+  return result;
+}
+
+static PyObject* 
+DTraceSnapshotReader_read(DTraceSnapshotReader* self, PyObject *args, PyObject *kwds) {
+  static char *kwlist[] = {"varid", NULL};
+  PyObject* pyVarid = Py_None;
+  dtrace_aggvarid_t varid = DTRACE_AGGVARIDNONE;
+  int tries;
+
+  if ( !PyArg_ParseTupleAndKeywords(args, kwds, "|O", kwlist, &pyVarid) ) {
+    PyErr_SetString(PyExc_AttributeError, "Invalid parameters: read accepts an optional aggregation variable id");
+    return NULL;
+  }
+
+  if (pyVarid != Py_None && (varid = PyInt_AsLong(pyVarid)) == (dtrace_aggvarid_t)-1 && PyErr_Occurred()) {
+    return NULL;
+  }
+
+  if (self->dtsr_base == NULL) {
+    PyErr_SetString(PyExc_RuntimeError, "the snapshot file isn't open");
+    return NULL;
+  }
+
+  /*
+   * The snapshot is decoded straight out of the mapped file, and only kept
+   * if the sequence lock shows that it wasn't rewritten meanwhile.
+   */
+  for (tries = 0; tries < DTC_PUB_TRIES; tries++) {
+    dtc_pubhdr_t *hdr = (dtc_pubhdr_t *)self->dtsr_base;
+    uint64_t seq = hdr->dtph_seq, generation, time, offset, len;
+    PyObject* result = NULL;
+    int corrupt = 0;
+
+    __sync_synchronize();
+
+    if (seq & 1) {
+      sched_yield();
+      continue;
+    }
+
+    generation = hdr->dtph_generation;
+    time = hdr->dtph_time;
+    offset = hdr->dtph_offset;
+    len = hdr->dtph_len;
+
+    if (hdr->dtph_size > self->dtsr_size) {
+      if (_reader_map(self) == -1) {
+        return NULL;
+      }
+      continue;
+    }
+
+    if (generation == 0 && varid != DTRACE_AGGVARIDNONE) {
+      Py_INCREF(Py_None);
+      result = Py_None;
+    } else if (generation == 0) {
+      result = PyDict_New();
+    } else if (offset > self->dtsr_size || len > self->dtsr_size - offset) {
+      corrupt = 1;
+    } else {
+      result = _pub_decode(self->dtsr_base + offset, len, varid, &corrupt);
+    }
+
+    __sync_synchronize();
+
+    /*
+     * Whatever went wrong decoding a snapshot that was being rewritten
+     * (down to running out of memory on a torn count) says nothing about
+     * the next one.
+     */
+    if (hdr->dtph_seq != seq) {
+      Py_XDECREF(result);
+      PyErr_Clear();
+      continue;
+    }
+
+    if (corrupt) {
+      PyErr_SetString(PyExc_RuntimeError, "corrupt snapshot file");
+      return NULL;
+    }
+
+    if (result != NULL) {
+      self->dtsr_generation = generation;
+      self->dtsr_time = time;
+    }
+
+    return result;
+  }
+
+  PyErr_SetString(PyExc_RuntimeError, "couldn't read a consistent snapshot: is the publisher stuck?");
+  return NULL;
+}
+
+static PyObject*
+DTraceSnapshotReader_getpublished(DTraceSnapshotReader* self, void *closure) {
+  if (self->dtsr_base == NULL) {
+    return PyLong_FromUnsignedLongLong(0);
+  }
+
+  return PyLong_FromUnsignedLongLong(((dtc_pubhdr_t *)self->dtsr_base)->dtph_generation);
+}
+
+static PyObject*
+DTraceSnapshotReader_getgeneration(DTraceSnapshotReader* self, void *closure) {
+  return PyLong_FromUnsignedLongLong(self->dtsr_generation);
+}
+
+static PyObject*
+DTraceSnapshotReader_gettime(DTraceSnapshotReader* self, void *closure) {
+  return PyFloat_FromDouble(self->dtsr_time / 1e9);
+}
+
+static PyGetSetDef DTraceSnapshotReader_getset[] = {
+  {"published", (getter)DTraceSnapshotReader_getpublished, NULL, "the number of snapshots published so far", NULL},
+  {"generation", (getter)DTraceSnapshotReader_getgeneration, NULL, "the number of the snapshot last read, 0 if none", NULL},
+  {"time", (getter)DTraceSnapshotReader_gettime, NULL, "when the snapshot last read was published, in seconds since the epoch", NULL},
+  {NULL}  /* Sentinel */
+};
+
+static PyMethodDef DTraceSnapshotReader_methods[] = {
+  {"read", (PyCFunction)DTraceSnapshotReader_read, METH_VARARGS | METH_KEYWORDS, "read the current snapshot, as aggsnapshot() returns it" },
+  {NULL}  /* Sentinel */
+};
+
+static PyTypeObject DTraceSnapshotReaderType = {
+  PyObject_HEAD_INIT(NULL)
+  0,                         /*ob_size*/
+  "dtrace.SnapshotReader",   /*tp_name*/
+  sizeof(DTraceSnapshotReader), /*tp_basicsize*/
+  0,                         /*tp_itemsize*/
+  (destructor)DTraceSnapshotReader_dealloc, /*tp_dealloc*/
+  0,                         /*tp_print*/
+  0,                         /*tp_getattr*/
+  0,                         /*tp_setattr*/
+  0,                         /*tp_compare*/
+  0,                         /*tp_repr*/
+  0,                         /*tp_as_number*/
+  0,                         /*tp_as_sequence*/
+  0,                         /*tp_as_mapping*/
+  0,                         /*tp_hash */
+  0,                         /*tp_call*/
+  0,                         /*tp_str*/
+  0,                         /*tp_getattro*/
+  0,                         /*tp_setattro*/
+  0,                         /*tp_as_buffer*/
+  Py_TPFLAGS_DEFAULT,        /*tp_flags*/
+  "reads the aggregation snapshots a consumer publishes", /* tp_doc */
+  0,                     /* tp_traverse */
+  0,                     /* tp_clear */
+  0,                     /* tp_richcompare */
+  0,                     /* tp_weaklistoffset */
+  0,                     /* tp_iter */
+  0,                     /* tp_iternext */
+  DTraceSnapshotReader_methods,      /* tp_methods */
+  0,                         /* tp_members */
+  DTraceSnapshotReader_getset,       /* tp_getset */
+  0,                         /* tp_base */
+  0,                         /* tp_dict */
+  0,                         /* tp_descr_get */
+  0,                         /* tp_descr_set */
+  0,                         /* tp_dictoffset */
+  (initproc)DTraceSnapshotReader_init, /* tp_init */
+  0,                         /* tp_alloc */
+  PyType_GenericNew,                 /* tp_new */
+};
+
+//////////////////////////////////////////////////////////
+///////////////////////////////////////////////////// API 
+//////////////////////////////////////////////////////////
+
+static int
+DTraceConsumer_init(DTraceConsumer *self, PyObject *args, PyObject *kwds) {  
+  static char *kwlist[] = {"replay", NULL};
+  char* replay = NULL;
+
+  if ( self->dtc_handle || self->dtc_replay.dtrp_base ) {
+    //PyErr_SetString(PyExc_AttributeError, "cannot reinitialize \"DTraceConsumer\"");
+    return 0;
+  }
+
+  if ( !PyArg_ParseTupleAndKeywords(args, kwds, "|z", kwlist, &replay) ) {
+    PyErr_SetString(PyExc_AttributeError, "Invalid parameters: DTraceConsumer accepts an optional capture file to replay");
+    return -1;
+  }
+
+  int err;
+  dtrace_hdl_t *dtp;
+
+  self->dtc_cap.dtcp_fd = -1;
+
+  if (replay != NULL) {
+    /*
+     * A replaying consumer has no libdtrace handle at all; it only reads
+     * the capture file.
+     */
+    if (_replay_open(&self->dtc_replay, replay) == -1) {
+      return -1;
+    }
+
+    /*
+     * Without libdtrace, printf()s can only be handed out structured.
+     */
+    self->dtc_structured = 1;
+  } else if ((dtp = self->dtc_handle = dtrace_open(DTRACE_VERSION, 0, &err)) == NULL) {
+    PyErr_SetString(PyExc_RuntimeError, dtrace_errmsg(NULL, err));
+    return -1;
+  } else {
+    /*
+     * Set our buffer size and aggregation buffer size to the de facto
+     * standard of 4M.
+     */
+    (void) dtrace_setopt(dtp, "bufsize", "4m");
+    (void) dtrace_setopt(dtp, "aggsize", "4m");
+
+    if (dtrace_handle_buffered(dtp, _bufhandler, self) == -1 ||
+        dtrace_handle_drop(dtp, _drophandler, self) == -1 ||
+        dtrace_handle_err(dtp, _errhandler, self) == -1) {
+      /*
+       * Without the handlers, drops and errors would go uncounted (or fail
+       * passes they shouldn't), so the consumer is no good.
+       */
+      PyErr_SetString(PyExc_AttributeError, dtrace_errmsg(dtp, dtrace_errno(dtp)));
+      dtrace_close(dtp);
+      self->dtc_handle = NULL;
+      return -1;
+    }
+  }
+
+  /*
+   * The handle lock is recursive, as callbacks invoked with it held are
+   * free to call back into the consumer.
+   */
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&self->dtc_lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+
+  pthread_mutex_init(&self->dtc_bg.dtbg_lock, NULL);
+  self->dtc_bg.dtbg_wakeup[0] = self->dtc_bg.dtbg_wakeup[1] = -1;
+
+  self->dtc_ranges = NULL;
+  self->dtc_syms.dtsc_max = 8192;
+
+  return 0;
+}
+
+static void
+DTraceConsumer_dealloc(DTraceConsumer* self) {
+  int i;
+
+  if ( self->dtc_handle || self->dtc_replay.dtrp_base ) {
+    _background_stop(self);
+    _chunk_free(self->dtc_bg.dtbg_head);
+
+    if (self->dtc_bg.dtbg_wakeup[0] != -1) {
+      (void) close(self->dtc_bg.dtbg_wakeup[0]);
+      (void) close(self->dtc_bg.dtbg_wakeup[1]);
+    }
+
+    _symcache_free(&self->dtc_syms);
+    _cap_close(&self->dtc_cap);
+    _replay_close(&self->dtc_replay);
+    _pub_close(&self->dtc_pub);
+
+    if ( self->dtc_handle ) {
+      dtrace_close( self->dtc_handle );
+    }
+
+    pthread_mutex_destroy(&self->dtc_lock);
+    pthread_mutex_destroy(&self->dtc_bg.dtbg_lock);
+  }  
+
+  _probes_flush(self);
+  _ranges_flush(self);
+  _hash_free(&self->dtc_aggprev, 1);
+
+  for (i = 0; i < 4; i++) {
+    Py_XDECREF(self->dtc_callargs[i]);
+  }
+
+  for (i = 0; i < self->dtc_routes.dtrt_nroutes; i++) {
+    _route_free(&self->dtc_routes.dtrt_routes[i]);
+  }
+
+  free(self->dtc_routes.dtrt_routes);
+
+  for (i = 0; i < self->dtc_rollups.dtrl_nrollups; i++) {
+    _rollup_free(&self->dtc_rollups.dtrl_rollups[i]);
+  }
+
+  free(self->dtc_rollups.dtrl_rollups);
+  free(self->dtc_rollups.dtrl_byepid);
+  free(self->dtc_rollups.dtrl_key.dtb_data);
+
+  free(self->dtc_raw.dtb_data);
+  free(self->dtc_scratch.dtb_data);
+
+  self->ob_type->tp_free((PyObject*)self);
+}
+
+static PyObject* 
+DTraceConsumer_strcompile(DTraceConsumer* self, PyObject *args, PyObject *kwds) {
+
+  static char *kwlist[] = {"program", NULL};
+  char* program = NULL;
+  
+  if ( !PyArg_ParseTupleAndKeywords(args, kwds, "s", kwlist, &program) ) {
+    PyErr_SetString(PyExc_AttributeError, "strcompile accepts a python string as argument.");
+    return NULL;
+  } 
+
+  if (_need_handle(self) == -1) {
+    return NULL;
+  }
+
+  /*
+   * The background thread works from the probe caches we're about to flush.
+   */
+  if (self->dtc_bg.dtbg_active) {
+    PyErr_SetString(PyExc_RuntimeError, "strcompile is not available while the background consumer is running");
+    return NULL;
+  }
+
+  dtrace_hdl_t *dtp = self->dtc_handle;
+  dtrace_prog_t *dp;
+  dtrace_proginfo_t info;
+
+  _probes_flush(self);
+  _ranges_flush(self);
+  _hash_free(&self->dtc_aggprev, 1);
+
+  /*
+   * The new program may reuse EPIDs and aggregation IDs, so they must be
+   * described again in the capture file.
+   */
+  _handle_lock(self);
+  _hash_free(&self->dtc_cap.dtcp_known, 0);
+  _handle_unlock(self);
+
+  if ((dp = dtrace_program_strcompile(dtp, program, DTRACE_PROBESPEC_NAME, 0, 0, NULL)) == NULL) {
+    PyErr_SetObject(PyExc_AttributeError, _error("couldn't compile '%s': %s\n", program, dtrace_errmsg(dtp, dtrace_errno(dtp))));
+    return NULL;
+  }
+
+  if (dtrace_program_exec(dtp, dp, &info) == -1) {
+    PyErr_SetObject(PyExc_AttributeError, _error("couldn't execute '%s': %s\n", program, dtrace_errmsg(dtp, dtrace_errno(dtp))));
+    return NULL;
+  }
+
+  Py_RETURN_NONE;
+}
+
+/*
+ * Converts a size (in bytes, or a string such as "4m") or a rate (in Hz, or
+ * a string such as "10ms" or "100hz") to bytes or nanoseconds, as libdtrace
+ * parses its options.
+ */
+static int
+_optval(PyObject *obj, int rate, dtrace_optval_t *valp) {
+  static const struct {
+    const char *name;
+    long long mul;
+  } sizes[] = {
+    { "", 1 }, { "k", 1LL << 10 }, { "m", 1LL << 20 }, { "g", 1LL << 30 },
+    { "t", 1LL << 40 }, { NULL, 0 }
+  }, rates[] = {
+    { "ns", 1 }, { "nsec", 1 }, { "us", 1000 }, { "usec", 1000 },
+    { "ms", 1000000 }, { "msec", 1000000 }, { "s", 1000000000 },
+    { "sec", 1000000000 }, { "hz", 0 }, { "", 0 }, { NULL, 0 }
+  };
+  const char *end = "";
+  long long val;
+  int i;
+
+  if (PyInt_Check(obj) || PyLong_Check(obj)) {
+    if ((val = PyLong_AsLongLong(obj)) == -1 && PyErr_Occurred()) {
+      return -1;
+    }
+  } else if (PyString_Check(obj)) {
+    const char *str = PyString_AsString(obj);
+
+    errno = 0;
+    val = strtoll(str, (char **)&end, 0);
+
+    if (errno != 0 || end == str) {
+      val = -1;
+    }
+  } else {
+    PyErr_SetString(PyExc_TypeError, rate ? "a rate must be an integer or a string" : "a size must be an integer or a string");
+    return -1;
+  }
+
+  for (i = 0; val > 0 && (rate ? rates : sizes)[i].name != NULL; i++) {
+    long long mul = (rate ? rates : sizes)[i].mul;
+
+    if (strcasecmp((rate ? rates : sizes)[i].name, end) == 0) {
+      *valp = mul != 0 ? val * mul : 1000000000LL / val;
+      return 0;
+    }
+  }
+
+  if ((obj = PyObject_Repr(obj)) != NULL) {
+    PyErr_Format(PyExc_ValueError, "invalid %s: %s", rate ? "rate" : "size", PyString_AsString(obj));
+    Py_DECREF(obj);
+  }
+
+  return -1;
+}
+
+static PyObject* 
+DTraceConsumer_setopt(DTraceConsumer* self, PyObject *args, PyObject *kwds) {
+  static char *kwlist[] = {"option", "value", NULL};
+  char* option = NULL;
+  PyObject* pyValue = Py_None;
+  const char* value = NULL;
+  char buf[64];
+  int rval;
+
+  if ( !PyArg_ParseTupleAndKeywords(args, kwds, "s|O", kwlist, &option, &pyValue) ) {
+    PyErr_SetString(PyExc_AttributeError, "Invalid parameters: setopt accepts the name of an option and an optional value");
+    return NULL;
+  }
+
+  if (_need_handle(self) == -1) {
+    return NULL;
+  }
+
+  /*
+   * As with "#pragma D option", an option without a value (or true) is
+   * set, and false unsets a boolean option.
+   */
+  if (pyValue == Py_False) {
+    value = "false";
+  } else if (PyInt_Check(pyValue) && pyValue != Py_True) {
+    snprintf(buf, sizeof (buf), "%ld", PyInt_AS_LONG(pyValue));
+    value = buf;
+  } else if (PyLong_Check(pyValue)) {
+    snprintf(buf, sizeof (buf), "%lld", PyLong_AsLongLong(pyValue));
+    value = buf;
+  } else if (PyString_Check(pyValue)) {
+    value = PyString_AS_STRING(pyValue);
+  } else if (pyValue != Py_None && pyValue != Py_True) {
+    PyErr_SetString(PyExc_TypeError, "an option value must be an integer, a boolean or a string");
+    return NULL;
+  }
+
+  if (PyErr_Occurred()) {
+    return NULL;
+  }
+
+  _handle_lock(self);
+  rval = dtrace_setopt(self->dtc_handle, option, value);
+  _handle_unlock(self);
+
+  if (rval == -1) {
+    PyErr_SetObject(PyExc_RuntimeError, _error("couldn't set option '%s': %s\n", option, dtrace_errmsg(self->dtc_handle, dtrace_errno(self->dtc_handle))));
+    return NULL;
+  }
+
+  /*
+   * An explicit switchrate is what autotune() relaxes back to.
+   */
+  if (strcmp(option, "switchrate") == 0) {
+    self->dtc_tune.dtt_switchrate = 0;
+  }
+
+  Py_RETURN_NONE;
+}
+
+static PyObject* 
+DTraceConsumer_getopt(DTraceConsumer* self, PyObject *args, PyObject *kwds) {
+  static char *kwlist[] = {"option", NULL};
+  char* option = NULL;
+  dtrace_optval_t val;
+  int rval;
+
+  if ( !PyArg_ParseTupleAndKeywords(args, kwds, "s", kwlist, &option) ) {
+    PyErr_SetString(PyExc_AttributeError, "Invalid parameters: getopt accepts the name of an option");
+    return NULL;
+  }
+
+  if (_need_handle(self) == -1) {
+    return NULL;
+  }
+
+  _handle_lock(self);
+  rval = dtrace_getopt(self->dtc_handle, option, &val);
+  _handle_unlock(self);
+
+  if (rval == -1) {
+    PyErr_SetObject(PyExc_RuntimeError, _error("couldn't get option '%s': %s\n", option, dtrace_errmsg(self->dtc_handle, dtrace_errno(self->dtc_handle))));
+    return NULL;
+  }
+
+  if (val == DTRACEOPT_UNSET) {
+    Py_RETURN_NONE;
+  }
+
+  return PyLong_FromLongLong(val);
+}
+
+static PyObject* 
+DTraceConsumer_autotune(DTraceConsumer* self, PyObject *args, PyObject *kwds) {
+  static char *kwlist[] = {"enable", "maxbufsize", "maxaggsize", "maxrate", NULL};
+  int enable = 1;
+  PyObject* pyMaxbufsize = NULL;
+  PyObject* pyMaxaggsize = NULL;
+  PyObject* pyMaxrate = NULL;
+  dtc_tune_t tune;
+
+  if ( !PyArg_ParseTupleAndKeywords(args, kwds, "|iOOO", kwlist, &enable, &pyMaxbufsize, &pyMaxaggsize, &pyMaxrate) ) {
+    PyErr_SetString(PyExc_AttributeError, "Invalid parameters: autotune accepts whether to enable it, the largest bufsize and aggsize, and the highest switchrate and aggrate to tune to");
+    return NULL;
+  }
+
+  if (_need_handle(self) == -1) {
+    return NULL;
+  }
+
+  memset(&tune, 0, sizeof (tune));
+  tune.dtt_enabled = enable;
+  tune.dtt_maxbufsize = tune.dtt_maxaggsize = 64 << 20;
+  tune.dtt_minrate = 1000000;
+
+  if ((pyMaxbufsize != NULL && _optval(pyMaxbufsize, 0, &tune.dtt_maxbufsize) == -1) ||
+      (pyMaxaggsize != NULL && _optval(pyMaxaggsize, 0, &tune.dtt_maxaggsize) == -1) ||
+      (pyMaxrate != NULL && _optval(pyMaxrate, 1, &tune.dtt_minrate) == -1)) {
+    return NULL;
+  }
+
+  _handle_lock(self);
+  self->dtc_tune = tune;
+  _handle_unlock(self);
+
+  Py_RETURN_NONE;
+}
+
+static PyObject* 
+DTraceConsumer_tuning(DTraceConsumer* self, PyObject *args, PyObject *kwds) {
+  static const char *sizes[] = { "bufsize", "aggsize" };
+  static const char *rates[] = { "switchrate", "aggrate" };
+  dtc_tune_t *tn = &self->dtc_tune;
+  dtrace_optval_t val[4];
+  PyObject* options;
+  int i;
+
+  if (_need_handle(self) == -1) {
+    return NULL;
+  }
+
+  _handle_lock(self);
+
+  for (i = 0; i < 4; i++) {
+    if (dtrace_getopt(self->dtc_handle, i < 2 ? sizes[i] : rates[i - 2], &val[i]) == -1) {
+      val[i] = DTRACEOPT_UNSET;
+    }
+  }
+
+  if (tn->dtt_bufsize > val[0]) {
+    val[0] = tn->dtt_bufsize;
+  }
+
+  if (tn->dtt_aggsize > val[1]) {
+    val[1] = tn->dtt_aggsize;
+  }
+
+  if (tn->dtt_aggrate > 0 && (val[3] <= 0 || tn->dtt_aggrate < val[3])) {
+    val[3] = tn->dtt_aggrate;
+  }
+
+  _handle_unlock(self);
+
+  if ((options = PyDict_New()) == NULL) {
+    return NULL;
+  }
+
+  for (i = 0; i < 4; i++) {
+    PyObject* value;
+
+    if (val[i] <= 0) {
+      continue;
+    }
+
+    value = i < 2 ? PyLong_FromLongLong(val[i]) : PyString_FromFormat("%lldns", (long long)val[i]);
+
+    if (value == NULL || PyDict_SetItemString(options, i < 2 ? sizes[i] : rates[i - 2], value) == -1) {
+      Py_XDECREF(value);
+      Py_DECREF(options);
+      return NULL;
+    }
+
+    Py_DECREF(value);
+  }
+
+  return options;
+}
+
+static PyObject* 
+DTraceConsumer_go(DTraceConsumer* self, PyObject *args, PyObject *kwds) {
+  if (_need_handle(self) == -1) {
+    return NULL;
+  }
+
+  if (self->dtc_bg.dtbg_active) {
+    PyErr_SetString(PyExc_RuntimeError, "go is not available while the background consumer is running");
+    return NULL;
+  }
+
+  if (dtrace_go(self->dtc_handle) == -1) {
+    PyErr_SetObject(PyExc_AttributeError, _error("couldn't enable tracing: %s\n", dtrace_errmsg(self->dtc_handle, dtrace_errno(self->dtc_handle))));
+    return NULL;
+  }
+
+  Py_RETURN_NONE;
+}
+
+/*
+ * Runs one consumption pass: either a buffer switch through dtrace_work(),
+ * or, if the background thread is doing that for us, a drain of whatever it
+ * has queued.  Records it queued before it was stopped are drained by the
+ * pass after, ahead of any new buffer switch.  The status of the pass is
+ * left in *statusp; a pass that failed raises, whether or not one of our
+ * callbacks said why.
+ */
+static int
+_work(DTraceConsumer *self, dtrace_workstatus_t *statusp) {
+  dtrace_workstatus_t status;
+  uint64_t callback = self->dtc_stats.dts_callback;
+  uint64_t start;
+
+  if (self->dtc_bg.dtbg_active || self->dtc_bg.dtbg_head != NULL) {
+    *statusp = DTRACE_WORKSTATUS_OKAY;
+    return _drain(self);
+  }
+
+  if (_work_check(self) == -1) {
+    return -1;
+  }
+
+  self->dtc_working = 1;
+
+  if (self->dtc_replay.dtrp_base != NULL) {
+    start = _now();
+    status = _replay_consume(self);
+    _stats_work(self, start, callback);
+  } else {
+    _handle_lock(self);
+    start = _now();
+    status = dtrace_work(self->dtc_handle, NULL, _probe_func(self), _consume, self);
+    _stats_work(self, start, callback);
+
+    if (self->dtc_cap.dtcp_fd != -1) {
+      _cap_flush(&self->dtc_cap, DTC_CAP_CONSUME);
+    }
+
+    _handle_unlock(self);
+  }
+
+  self->dtc_working = 0;
+
+  *statusp = status;
+
+  if (PyErr_Occurred()) {
+    return -1;
+  }
+
+  if (status == -1) {
+    if (self->dtc_error != Py_None) {
+      PyErr_SetObject(PyExc_RuntimeError, self->dtc_error);
+    } else if (self->dtc_handle != NULL) {
+      PyErr_Format(PyExc_RuntimeError, "couldn't consume: %s", dtrace_errmsg(self->dtc_handle, dtrace_errno(self->dtc_handle)));
+    } else {
+      PyErr_SetString(PyExc_RuntimeError, "couldn't replay the capture");
+    }
+
+    return -1;
+  }
+
+  return _cap_check(self);
+}
+
+/*
+ * Sends the records of the probes matching a description to a callback of
+ * their own.  Routes are tried in the order they were added.
+ */
+static PyObject* 
+DTraceConsumer_route(DTraceConsumer* self, PyObject *args, PyObject *kwds) {
+  static char *kwlist[] = {"probe", "callback", NULL};
+  char* desc = NULL;
+  PyObject* pyCallback = Py_None;
+  
+  if ( !PyArg_ParseTupleAndKeywords(args, kwds, "s|O", kwlist, &desc, &pyCallback) ) {
+    PyErr_SetString(PyExc_AttributeError, "Invalid parameters: route accepts a probe description and an optional callback function");
+    return NULL;
+  }  
+
+  dtc_routes_t *rt = &self->dtc_routes;
+  dtc_route_t route, *routes;
+
+  if (_route_parse(desc, route.dtro_desc) == -1) {
+    return NULL;
+  }
+
+  route.dtro_callback = pyCallback != Py_None ? pyCallback : NULL;
+  route.dtro_id = ++rt->dtrt_lastid;
+  Py_XINCREF(route.dtro_callback);
+
+  _handle_lock(self);
+
+  if ((routes = realloc(rt->dtrt_routes, (rt->dtrt_nroutes + 1) * sizeof (dtc_route_t))) == NULL) {
+    _handle_unlock(self);
+    _route_free(&route);
+    return PyErr_NoMemory();
+  }
+
+  routes[rt->dtrt_nroutes] = route;
+  rt->dtrt_routes = routes;
+  rt->dtrt_nroutes++;
+  _routes_flush(rt);
+
+  _handle_unlock(self);
+
+  Py_RETURN_NONE;
+}
+
+static PyObject* 
+DTraceConsumer_unroute(DTraceConsumer* self, PyObject *args, PyObject *kwds) {
+  static char *kwlist[] = {"probe", NULL};
+  char* desc = NULL;
+  
+  if ( !PyArg_ParseTupleAndKeywords(args, kwds, "|z", kwlist, &desc) ) {
+    PyErr_SetString(PyExc_AttributeError, "Invalid parameters: unroute accepts an optional probe description");
+    return NULL;
+  }  
+
+  dtc_routes_t *rt = &self->dtc_routes;
+  char *parts[4];
+  int i, j, n = 0;
+
+  if (desc != NULL && _route_parse(desc, parts) == -1) {
+    return NULL;
+  }
+
+  _handle_lock(self);
+
+  for (i = 0; i < rt->dtrt_nroutes; i++) {
+    dtc_route_t *r = &rt->dtrt_routes[i];
+
+    for (j = 0; desc != NULL && j < 4 && strcmp(parts[j], r->dtro_desc[j]) == 0; j++)
+      continue;
+
+    if (desc == NULL || j == 4) {
+      _route_free(r);
+    } else {
+      rt->dtrt_routes[n++] = *r;
+    }
+  }
+
+  rt->dtrt_nroutes = n;
+  _routes_flush(rt);
+
+  _handle_unlock(self);
+
+  if (desc != NULL) {
+    for (j = 0; j < 4; j++) {
+      free(parts[j]);
+    }
+  }
+
+  Py_RETURN_NONE;
+}
+
+/*
+ * Aggregates the firings of the probes matching a description natively:
+ * the records at the indexes in keys make up the key, and the record at
+ * value is counted, summed, kept the minimum or maximum of or quantized.
+ * The firings that are rolled up are skipped by the record callbacks.
+ */
+static PyObject* 
+DTraceConsumer_rollup(DTraceConsumer* self, PyObject *args, PyObject *kwds) {
+  static char *kwlist[] = {"name", "probe", "keys", "value", "op", NULL};
+  static const char *ops[] = { "count", "sum", "min", "max", "quantize", NULL };
+  char* name = NULL;
+  char* desc = NULL;
+  char* op = "count";
+  PyObject* pyKeys = NULL;
+  PyObject* pyValue = Py_None;
+  
+  if ( !PyArg_ParseTupleAndKeywords(args, kwds, "ss|OOs", kwlist, &name, &desc, &pyKeys, &pyValue, &op) ) {
+    PyErr_SetString(PyExc_AttributeError, "Invalid parameters: rollup accepts a name, a probe description, an optional sequence of key record indexes, an optional value record index and an optional operation");
+    return NULL;
+  }  
+
+  dtc_rollups_t *rl = &self->dtc_rollups;
+  dtc_rollup_t rollup, *rollups;
+  PyObject* keys = NULL;
+  Py_ssize_t i;
+
+  memset(&rollup, 0, sizeof (rollup));
+
+  for (rollup.dtru_op = 0; ops[rollup.dtru_op] != NULL && strcmp(ops[rollup.dtru_op], op) != 0; rollup.dtru_op++)
+    continue;
+
+  if (ops[rollup.dtru_op] == NULL) {
+    PyErr_Format(PyExc_ValueError, "invalid rollup operation \"%s\"; must be one of count, sum, min, max or quantize", op);
+    return NULL;
+  }
+
+  if (pyValue == Py_None) {
+    rollup.dtru_value = -1;
+  } else if ((rollup.dtru_value = (int)PyInt_AsLong(pyValue)) < 0) {
+    if (!PyErr_Occurred()) {
+      PyErr_SetString(PyExc_ValueError, "record indexes can't be negative");
+    }
+    return NULL;
+  }
+
+  if ((rollup.dtru_value == -1) != (rollup.dtru_op == DTC_ROLLUP_COUNT)) {
+    PyErr_Format(PyExc_ValueError, rollup.dtru_value == -1 ? "%s needs a value" : "%s takes no value", op);
+    return NULL;
+  }
+
+  if (pyKeys != NULL && pyKeys != Py_None) {
+    if ((keys = PySequence_Fast(pyKeys, "keys must be a sequence of record indexes")) == NULL) {
+      return NULL;
+    }
+
+    if (PySequence_Fast_GET_SIZE(keys) > DTC_ROLLUP_MAXKEYS) {
+      Py_DECREF(keys);
+      PyErr_Format(PyExc_ValueError, "a rollup can have at most %d keys", DTC_ROLLUP_MAXKEYS);
+      return NULL;
+    }
+
+    for (i = 0; i < PySequence_Fast_GET_SIZE(keys); i++) {
+      if ((rollup.dtru_keys[i] = (int)PyInt_AsLong(PySequence_Fast_GET_ITEM(keys, i))) < 0) {
+        Py_DECREF(keys);
+        if (!PyErr_Occurred()) {
+          PyErr_SetString(PyExc_ValueError, "record indexes can't be negative");
+        }
+        return NULL;
+      }
+    }
+
+    rollup.dtru_nkeys = (int)i;
+    Py_DECREF(keys);
+  }
+
+  for (i = 0; i < rl->dtrl_nrollups; i++) {
+    if (strcmp(rl->dtrl_rollups[i].dtru_name, name) == 0) {
+      PyErr_Format(PyExc_ValueError, "there already is a rollup \"%s\"", name);
+      return NULL;
+    }
+  }
+
+  if (rl->dtrl_nrollups == DTC_ROLLUP_MAXROLLUPS) {
+    PyErr_Format(PyExc_ValueError, "a consumer can have at most %d rollups", DTC_ROLLUP_MAXROLLUPS);
+    return NULL;
+  }
+
+  if (_route_parse(desc, rollup.dtru_desc) == -1) {
+    return NULL;
+  }
+
+  if ((rollup.dtru_name = strdup(name)) == NULL) {
+    _rollup_free(&rollup);
+    return PyErr_NoMemory();
+  }
+
+  _handle_lock(self);
+
+  if ((rollups = realloc(rl->dtrl_rollups, (rl->dtrl_nrollups + 1) * sizeof (dtc_rollup_t))) == NULL) {
+    _handle_unlock(self);
+    _rollup_free(&rollup);
+    return PyErr_NoMemory();
+  }
+
+  rollups[rl->dtrl_nrollups] = rollup;
+  rl->dtrl_rollups = rollups;
+  rl->dtrl_nrollups++;
+  _rollups_flush(rl);
+
+  _handle_unlock(self);
+
+  Py_RETURN_NONE;
+}
+
+/*
+ * Returns the result of a rollup, or a dict of the results of all of them,
+ * optionally starting them over.
+ */
+static PyObject* 
+DTraceConsumer_rollup_snapshot(DTraceConsumer* self, PyObject *args, PyObject *kwds) {
+  static char *kwlist[] = {"name", "reset", NULL};
+  char* name = NULL;
+  int reset = 0;
+  
+  if ( !PyArg_ParseTupleAndKeywords(args, kwds, "|zi", kwlist, &name, &reset) ) {
+    PyErr_SetString(PyExc_AttributeError, "Invalid parameters: rollup_snapshot accepts an optional rollup name and an optional flag to reset the rollups");
+    return NULL;
+  }  
+
+  dtc_rollups_t *rl = &self->dtc_rollups;
+  PyObject* results = NULL;
+  PyObject* result;
+  int i;
+
+  _handle_lock(self);
+
+  if (name == NULL && (results = PyDict_New()) == NULL) {
+    _handle_unlock(self);
+    return NULL;
+  }
+
+  for (i = 0; i < rl->dtrl_nrollups; i++) {
+    dtc_rollup_t *ru = &rl->dtrl_rollups[i];
+
+    if (name != NULL && strcmp(ru->dtru_name, name) != 0) {
+      continue;
+    }
+
+    if ((result = _rollup_result(self, ru, reset)) == NULL) {
+      _handle_unlock(self);
+      Py_XDECREF(results);
+      return NULL;
+    }
+
+    if (name != NULL) {
+      _handle_unlock(self);
+      return result;
+    }
+
+    if (PyDict_SetItemString(results, ru->dtru_name, result) == -1) {
+      _handle_unlock(self);
+      Py_DECREF(result);
+      Py_DECREF(results);
+      return NULL;
+    }
+
+    Py_DECREF(result);
+  }
+
+  _handle_unlock(self);
+
+  if (name != NULL) {
+    PyErr_Format(PyExc_KeyError, "no rollup \"%s\"", name);
+    return NULL;
+  }
+
+  return results;
+}
+
+static PyObject* 
+DTraceConsumer_unrollup(DTraceConsumer* self, PyObject *args, PyObject *kwds) {
+  static char *kwlist[] = {"name", NULL};
+  char* name = NULL;
+  
+  if ( !PyArg_ParseTupleAndKeywords(args, kwds, "|z", kwlist, &name) ) {
+    PyErr_SetString(PyExc_AttributeError, "Invalid parameters: unrollup accepts an optional rollup name");
+    return NULL;
+  }  
+
+  dtc_rollups_t *rl = &self->dtc_rollups;
+  int i, n = 0;
+
+  _handle_lock(self);
+
+  for (i = 0; i < rl->dtrl_nrollups; i++) {
+    dtc_rollup_t *ru = &rl->dtrl_rollups[i];
+
+    if (name == NULL || strcmp(ru->dtru_name, name) == 0) {
+      _rollup_free(ru);
+    } else {
+      rl->dtrl_rollups[n++] = *ru;
+    }
+  }
+
+  rl->dtrl_nrollups = n;
+  _rollups_flush(rl);
+
+  _handle_unlock(self);
+
+  Py_RETURN_NONE;
+}
+
+static PyObject* 
+DTraceConsumer_consume(DTraceConsumer* self, PyObject *args, PyObject *kwds) {
+  static char *kwlist[] = {"callback", NULL};
+  PyObject* pyCallback = NULL;
+  
+  if ( !PyArg_ParseTupleAndKeywords(args, kwds, "O", kwlist, &pyCallback) ) {
+    PyErr_SetString(PyExc_AttributeError, "Invalid parameters: consume accepts a callback function and a nullable array of objects that act as additional arguments to the callback as inputs");
+    return NULL;
+  }  
+
+  dtrace_workstatus_t status;
+  PyObject* callback = self->dtc_callback;
+  PyObject* batch = self->dtc_batch;
+  int rval;
+
+  /*
+   * We may be called from a callback of another pass, whose callback (and
+   * batch) are put back once this pass is done.
+   */
+  self->dtc_callback = pyCallback;
+  self->dtc_batch = NULL;
+  self->dtc_error = Py_None;
+
+  rval = _work(self, &status);
+  self->dtc_callback = callback;
+  self->dtc_batch = batch;
+
+  if (rval == -1) {
+    return NULL;
+  }
+
+  Py_RETURN_NONE;
+}
+
+static PyObject* 
+DTraceConsumer_consume_batch(DTraceConsumer* self, PyObject *args, PyObject *kwds) {
+  static char *kwlist[] = {"callback", "max_batch", NULL};
+  PyObject* pyCallback = NULL;
+  Py_ssize_t max_batch = 0;
+  
+  if ( !PyArg_ParseTupleAndKeywords(args, kwds, "O|n", kwlist, &pyCallback, &max_batch) ) {
+    PyErr_SetString(PyExc_AttributeError, "Invalid parameters: consume_batch accepts a callback function and an optional maximum batch size");
+    return NULL;
+  }  
+
+  if (max_batch < 0) {
+    PyErr_SetString(PyExc_ValueError, "max_batch must not be negative");
+    return NULL;
+  }
+
+  dtrace_workstatus_t status;
+  PyObject* callback = self->dtc_callback;
+  PyObject* batch = self->dtc_batch;
+  Py_ssize_t batch_max = self->dtc_batch_max, batch_len = self->dtc_batch_len;
+  int rval;
+
+  /*
+   * As for consume(), the pass we may be called from is put back after.
+   */
+  self->dtc_callback = pyCallback;
+  self->dtc_error = Py_None;
+  self->dtc_batch_max = max_batch;
+  self->dtc_batch_len = 0;
+
+  if ((self->dtc_batch = PyList_New(max_batch)) == NULL) {
+    rval = -1;
+  } else if ((rval = _work(self, &status)) == 0) {
+    rval = _batch_flush(self, 0);
+  }
+
+  Py_CLEAR(self->dtc_batch);
+  self->dtc_callback = callback;
+  self->dtc_batch = batch;
+  self->dtc_batch_max = batch_max;
+  self->dtc_batch_len = batch_len;
+
+  if (rval == -1) {
+    return NULL;
+  }
+
+  Py_RETURN_NONE;
+}
+
+/*
+ * Returns the records of a pass as a native iterator rather than calling
+ * back for each.  Records are decoded into chunks as the background thread
+ * does, and turned into python objects one at a time by tp_iternext.  When
+ * replaying, the pass is gathered as by consume_batch() instead.
+ */
+static PyObject* 
+DTraceConsumer_consume_iter(DTraceConsumer* self, PyObject *args, PyObject *kwds) {
+  dtrace_workstatus_t status;
+  dtc_chunk_t *chunk;
+  PyObject *iter;
+
+  if (self->dtc_bg.dtbg_active || self->dtc_bg.dtbg_head != NULL) {
+    return _records_new(self, _dequeue(&self->dtc_bg), 1);
+  }
+
+  if (self->dtc_handle == NULL) {
+    self->dtc_callback = Py_None;
+    self->dtc_error = Py_None;
+    self->dtc_batch_max = 0;
+    self->dtc_batch_len = 0;
+
+    if ((self->dtc_batch = PyList_New(0)) == NULL) {
+      return NULL;
+    }
+
+    iter = _work(self, &status) == 0 ? PyObject_GetIter(self->dtc_batch) : NULL;
+    Py_CLEAR(self->dtc_batch);
+
+    return iter;
+  }
+
+  if (_work_native(self, &chunk) == -1) {
+    return NULL;
+  }
+
+  return _records_new(self, chunk, 0);
+}
+
+static PyObject* 
+DTraceConsumer_consume_raw(DTraceConsumer* self, PyObject *args, PyObject *kwds) {
+  static char *kwlist[] = {"callback", NULL};
+  PyObject* pyCallback = NULL;
+  
+  if ( !PyArg_ParseTupleAndKeywords(args, kwds, "O", kwlist, &pyCallback) ) {
+    PyErr_SetString(PyExc_AttributeError, "Invalid parameters: consume_raw accepts a callback function");
+    return NULL;
+  }  
+
+  if (_need_handle(self) == -1) {
+    return NULL;
+  }
+
+  if (self->dtc_bg.dtbg_active) {
+    PyErr_SetString(PyExc_RuntimeError, "raw consumption is not available while the background consumer is running");
+    return NULL;
+  }
+
+  dtrace_hdl_t *dtp = self->dtc_handle;
+  dtrace_workstatus_t status;
+  uint64_t start;
+
+  if (_work_check(self) == -1) {
+    return NULL;
+  }
+
+  self->dtc_callback = pyCallback;
+  self->dtc_error = Py_None;
+  self->dtc_raw.dtb_len = 0;
+
+  _handle_lock(self);
+  start = _now();
+  status = dtrace_work(dtp, NULL, _consume_raw, NULL, self);
+  _stats_work(self, start, self->dtc_stats.dts_callback);
+
+  if (self->dtc_cap.dtcp_fd != -1) {
+    _cap_flush(&self->dtc_cap, DTC_CAP_CONSUME);
+  }
+
+  _handle_unlock(self);
+
+  if (PyErr_Occurred() || _cap_check(self) == -1) {
+    self->dtc_raw.dtb_len = 0;
+    return NULL;
+  }
+
+  if (status == -1) {
+    self->dtc_raw.dtb_len = 0;
+
+    if (self->dtc_error != Py_None) {
+      PyErr_SetObject(PyExc_RuntimeError, self->dtc_error);
+    } else {
+      PyErr_SetObject(PyExc_RuntimeError, _error("couldn't consume: %s\n", dtrace_errmsg(dtp, dtrace_errno(dtp))));
+    }
+    return NULL;
+  }
+
+  if (_raw_flush(self, self->dtc_layouts) == -1) {
+    return NULL;
+  }
+
+  Py_RETURN_NONE;
+}
+
+/*
+ * Refreshes the status and snapshots the aggregation buffers, neither of
+ * which needs python, so other threads may run in the meantime, and then
+ * publishes the snapshot if publish() was called.  Must be called with the
+ * handle lock held.
+ */
+static int
+_snap(DTraceConsumer *self) {
+  dtrace_hdl_t *dtp = self->dtc_handle;
+  int rval;
+
+  if (self->dtc_replay.dtrp_base != NULL) {
+    return 0;
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+  rval = dtrace_status(dtp);
+  Py_END_ALLOW_THREADS
+
+  if (rval == -1) {
+    PyErr_SetObject(PyExc_RuntimeError, _error("couldn't get status: %s\n", dtrace_errmsg(dtp, dtrace_errno(dtp))));
+    return -1;
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+  rval = dtrace_aggregate_snap(dtp);
+  Py_END_ALLOW_THREADS
+
+  if (rval == -1) {
+    PyErr_SetObject(PyExc_RuntimeError, _error("couldn't snap aggregate: %s\n", dtrace_errmsg(dtp, dtrace_errno(dtp))));
+    return -1;
+  }
+
+  _tune_agg(self);
+  _publish(self);
+
+  return 0;
+}
+
+static PyObject* 
+DTraceConsumer_start_background(DTraceConsumer* self, PyObject *args, PyObject *kwds) {
+  static char *kwlist[] = {"switchrate", "maxqueue", NULL};
+  PyObject* pySwitchrate = Py_None;
+  Py_ssize_t maxqueue = 64 << 20;
+
+  if ( !PyArg_ParseTupleAndKeywords(args, kwds, "|On", kwlist, &pySwitchrate, &maxqueue) ) {
+    PyErr_SetString(PyExc_AttributeError, "Invalid parameters: start_background accepts an optional switchrate (in Hz, or as a string such as \"10ms\") and the maximum number of bytes to queue");
+    return NULL;
+  }
+
+  if (_need_handle(self) == -1) {
+    return NULL;
+  }
+
+  dtrace_hdl_t *dtp = self->dtc_handle;
+  dtc_background_t *bg = &self->dtc_bg;
+  char rate[64];
+  int err;
+
+  if (bg->dtbg_active) {
+    PyErr_SetString(PyExc_RuntimeError, "background consumer is already running");
+    return NULL;
+  }
+
+  if (pySwitchrate != Py_None) {
+    if (PyInt_Check(pySwitchrate) || PyLong_Check(pySwitchrate)) {
+      snprintf(rate, sizeof (rate), "%ldhz", PyInt_AsLong(pySwitchrate));
+    } else if (PyString_Check(pySwitchrate)) {
+      snprintf(rate, sizeof (rate), "%s", PyString_AsString(pySwitchrate));
+    } else {
+      PyErr_SetString(PyExc_TypeError, "switchrate must be an integer or a string");
+      return NULL;
+    }
+
+    if (dtrace_setopt(dtp, "switchrate", rate) == -1) {
+      PyErr_SetObject(PyExc_RuntimeError, _error("couldn't set switchrate to %s: %s\n", rate, dtrace_errmsg(dtp, dtrace_errno(dtp))));
+      return NULL;
+    }
+  }
+
+  bg->dtbg_stop = 0;
+  bg->dtbg_done = 0;
+  bg->dtbg_error[0] = '\0';
+  bg->dtbg_maxqueued = maxqueue;
+  bg->dtbg_active = 1;
+
+  if ((err = pthread_create(&bg->dtbg_thread, NULL, _background, self)) != 0) {
+    bg->dtbg_active = 0;
+    errno = err;
+    PyErr_SetObject(PyExc_RuntimeError, _error("couldn't start background consumer"));
+    return NULL;
+  }
+
+  Py_RETURN_NONE;
+}
+
+static PyObject* 
+DTraceConsumer_stop_background(DTraceConsumer* self, PyObject *args, PyObject *kwds) {
+  _background_stop(self);
+
+  Py_RETURN_NONE;
+}
+
+/*
+ * Returns a file descriptor that becomes readable whenever the background
+ * thread has queued data, or has stopped, so that an event loop can wait for
+ * it alongside its other descriptors and call consume() only when there is
+ * something to hand out.  consume() makes it unreadable again.
+ */
+static PyObject* 
+DTraceConsumer_fileno(DTraceConsumer* self, PyObject *args, PyObject *kwds) {
+  dtc_background_t *bg = &self->dtc_bg;
+  int fds[2], i;
+
+  if (_need_handle(self) == -1) {
+    return NULL;
+  }
+
+  if (bg->dtbg_wakeup[0] != -1) {
+    return PyInt_FromLong(bg->dtbg_wakeup[0]);
+  }
+
+  if (pipe(fds) == -1) {
+    return PyErr_SetFromErrno(PyExc_OSError);
+  }
+
+  for (i = 0; i < 2; i++) {
+    (void) fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+    (void) fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+  }
+
+  pthread_mutex_lock(&bg->dtbg_lock);
+  bg->dtbg_wakeup[0] = fds[0];
+  bg->dtbg_wakeup[1] = fds[1];
+
+  if (bg->dtbg_head != NULL || bg->dtbg_done) {
+    _wakeup(bg);
+  }
+
+  pthread_mutex_unlock(&bg->dtbg_lock);
+
+  return PyInt_FromLong(fds[0]);
+}
+
+/*
+ * Looks up an aggregation walk mode by name.
+ */
+static int
+_aggmode_parse(const char *mode, int *aggmodep) {
+  if (strcmp(mode, "remove") == 0) {
+    *aggmodep = DTC_AGGWALK_REMOVE;
+  } else if (strcmp(mode, "snapshot") == 0) {
+    *aggmodep = DTC_AGGWALK_SNAPSHOT;
+  } else if (strcmp(mode, "delta") == 0) {
+    *aggmodep = DTC_AGGWALK_DELTA;
+  } else {
+    PyErr_Format(PyExc_ValueError, "unknown aggwalk mode \"%s\"", mode);
+    return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * Sets the mode of the next aggregation walk.
+ */
+static void
+_aggmode_set(DTraceConsumer *dtc, int aggmode) {
+  dtc->dtc_aggmode = aggmode;
+
+  /*
+   * Removing the data invalidates what a delta walk last saw -- of all the
+   * variables, unless the walk selects some (see _aggwalk()).
+   */
+  if (aggmode == DTC_AGGWALK_REMOVE &&
+      dtc->dtc_aggsel.dtas_callbacks == NULL && dtc->dtc_aggsel.dtas_vars == NULL) {
+    _hash_free(&dtc->dtc_aggprev, 1);
+  }
+}
+
+/*
+ * Sets the mode of the next aggregation walk from its name.
+ */
+static int
+_aggmode(DTraceConsumer *dtc, const char *mode) {
+  int aggmode;
+
+  if (_aggmode_parse(mode, &aggmode) == -1) {
+    return -1;
+  }
+
+  _aggmode_set(dtc, aggmode);
+
+  return 0;
+}
+
+/*
+ * Snaps and walks the aggregations with dtc_callback, which is what
+ * aggwalk() does and what run() does once every aggrate.
+ */
+static int
+_aggwalk_pass(DTraceConsumer *self) {
+  dtrace_hdl_t *dtp = self->dtc_handle;
+  int rval;
+
+  self->dtc_error = Py_None;
+
+  _handle_lock(self);
+
+  if (_snap(self) == -1) {
+    _handle_unlock(self);
+    return -1;
+  }
+
+  rval = _aggregate_walk(self, _aggwalk, self);
+
+  if (rval == 0 && self->dtc_aggmode == DTC_AGGWALK_DELTA &&
+      _aggdelta_prune(self, self->dtc_aggsel.dtas_callbacks == NULL && self->dtc_aggsel.dtas_vars == NULL) == -1) {
+    _handle_unlock(self);
+    return -1;
+  }
+
+  _handle_unlock(self);
+
+  if (PyErr_Occurred()) {
+    return -1;
+  }
+
+  if (rval == -1) {
+
+    if (self->dtc_error != Py_None) {
+      PyErr_SetObject(PyExc_RuntimeError, self->dtc_error);
+    } else {
+      PyErr_SetObject(PyExc_RuntimeError, _error("couldn't walk aggregate: %s\n", dtrace_errmsg(dtp, dtrace_errno(dtp))));
+    }
+
+    return -1;
+  }
+
+  return 0;
+}
+
+static PyObject* 
+DTraceConsumer_aggwalk(DTraceConsumer* self, PyObject *args, PyObject *kwds) {
+  static char *kwlist[] = {"callback", "mode", "callbacks", "vars", NULL};
+  dtc_aggsel_t *sel = &self->dtc_aggsel;
+  PyObject* pyCallback = Py_None;
+  PyObject* pyCallbacks = Py_None;
+  PyObject* pyVars = Py_None;
+  PyObject* key;
+  PyObject* value;
+  Py_ssize_t pos = 0;
+  char* mode = "remove";
+  int rval;
+  
+  if ( !PyArg_ParseTupleAndKeywords(args, kwds, "|OsOO", kwlist, &pyCallback, &mode, &pyCallbacks, &pyVars) ||
+      (pyCallback == Py_None && pyCallbacks == Py_None) ||
+      (pyCallback != Py_None && !PyCallable_Check(pyCallback)) ||
+      (pyCallbacks != Py_None && !PyDict_Check(pyCallbacks)) ) {
+    PyErr_SetString(PyExc_AttributeError, "Invalid parameters: aggwalk accepts a callback function, an optional mode (\"remove\", \"snapshot\" or \"delta\"), an optional dict of callbacks by aggregation variable ID or name and an optional list of the variables to walk; it needs a callback or callbacks");
+    return NULL;
+  }  
+
+  while (pyCallbacks != Py_None && PyDict_Next(pyCallbacks, &pos, &key, &value)) {
+    if (!PyCallable_Check(value)) {
+      PyErr_SetString(PyExc_AttributeError, "Invalid parameters: the callbacks of aggwalk must be callable");
+      return NULL;
+    }
+  }
+
+  if (pyVars != Py_None && (pyVars = PySequence_Tuple(pyVars)) == NULL) {
+    return NULL;
+  }
+
+  /*
+   * As with consume(), a walk from the callback of another walk puts what
+   * that walk was doing back once it's done.
+   */
+  dtc_aggsel_t outer = *sel;
+  PyObject* callback = self->dtc_callback;
+  int aggmode = self->dtc_aggmode;
+
+  memset(sel, 0, sizeof (dtc_aggsel_t));
+  sel->dtas_callbacks = (pyCallbacks != Py_None ? pyCallbacks : NULL);
+  sel->dtas_vars = (pyVars != Py_None ? pyVars : NULL);
+  self->dtc_callback = (pyCallback != Py_None ? pyCallback : NULL);
+
+  if ((rval = _aggmode(self, mode)) == 0) {
+    rval = _aggwalk_pass(self);
+  }
+
+  /*
+   * run() and ConsumerGroup walk every variable through dtc_callback, with
+   * no selection (outer is empty but for nested walks).
+   */
+  Py_XDECREF(sel->dtas_vars);
+  free(sel->dtas_byvarid);
+  *sel = outer;
+  self->dtc_callback = callback;
+  self->dtc_aggmode = aggmode;
+
+  if (rval == -1) {
+    return NULL;
+  }
+
+  Py_RETURN_NONE;
+}
+
+/*
+ * Parses the duration of a run(), given in seconds or as a time string such
+ * as "30s", into ns; None leaves it at 0, for no limit.
+ */
+static int
+_duration(PyObject *obj, dtrace_optval_t *valp) {
+  double secs;
+
+  if (obj == Py_None) {
+    return 0;
+  }
+
+  if (PyString_Check(obj)) {
+    return _optval(obj, 1, valp);
+  }
+
+  if ((secs = PyFloat_AsDouble(obj)) == -1.0 && PyErr_Occurred()) {
+    return -1;
+  }
+
+  if (secs <= 0) {
+    PyErr_SetString(PyExc_ValueError, "duration must be positive");
+    return -1;
+  }
+
+  *valp = (dtrace_optval_t)(secs * 1000000000.0);
+  return 0;
+}
+
+/*
+ * Drives the d-program the way dtrace(1M) does: sleeps in libdtrace, without
+ * the GIL, until the next switchrate or aggrate deadline, consumes whatever
+ * is in the buffers and walks the aggregations once every aggrate.  Returns
+ * when exit() fires, the duration runs out or a callback raises, after a
+ * last walk of the aggregations.
+ */
+/*
+ * The loop of run(): consumes at switchrate with callback, walking the
+ * aggregations with aggcallback (if any) at aggrate and once more at the
+ * end, until the program is done or duration (if any) is up.
+ */
+static int
+_run(DTraceConsumer *self, PyObject *callback, PyObject *aggcallback, dtrace_optval_t duration) {
+  dtrace_hdl_t *dtp = self->dtc_handle;
+  dtrace_workstatus_t status = DTRACE_WORKSTATUS_OKAY;
+  dtrace_optval_t aggrate;
+  uint64_t start, now, lastagg;
+  int rval;
+
+  start = lastagg = _now();
+
+  while (status == DTRACE_WORKSTATUS_OKAY) {
+    Py_BEGIN_ALLOW_THREADS
+    dtrace_sleep(dtp);
+    Py_END_ALLOW_THREADS
+
+    if (PyErr_CheckSignals() == -1) {
+      return -1;
+    }
+
+    self->dtc_callback = callback;
+    self->dtc_error = Py_None;
+
+    if (_work(self, &status) == -1) {
+      return -1;
+    }
+
+    now = _now();
+
+    if (duration > 0 && now - start >= (uint64_t)duration) {
+      break;
+    }
+
+    if (aggcallback == NULL || status != DTRACE_WORKSTATUS_OKAY) {
+      continue;
+    }
+
+    _handle_lock(self);
+    rval = dtrace_getopt(dtp, "aggrate", &aggrate);
+    _handle_unlock(self);
+
+    if (rval == -1 || now - lastagg >= (uint64_t)aggrate) {
+      self->dtc_callback = aggcallback;
+
+      if (_aggwalk_pass(self) == -1) {
+        return -1;
+      }
+
+      lastagg = now;
+    }
+  }
+
+  if (aggcallback != NULL) {
+    self->dtc_callback = aggcallback;
+
+    if (_aggwalk_pass(self) == -1) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static PyObject* 
+DTraceConsumer_run(DTraceConsumer* self, PyObject *args, PyObject *kwds) {
+  static char *kwlist[] = {"callback", "aggcallback", "duration", "mode", NULL};
+  PyObject* pyCallback = NULL;
+  PyObject* pyAggCallback = Py_None;
+  PyObject* pyDuration = Py_None;
+  char* mode = "remove";
+  
+  if ( !PyArg_ParseTupleAndKeywords(args, kwds, "O|OOs", kwlist, &pyCallback, &pyAggCallback, &pyDuration, &mode) ) {
+    PyErr_SetString(PyExc_AttributeError, "Invalid parameters: run accepts a callback function, an optional aggregation callback function, an optional duration and an optional aggwalk mode");
+    return NULL;
+  }  
+
+  if (_need_handle(self) == -1) {
+    return NULL;
+  }
+
+  if (self->dtc_bg.dtbg_active) {
+    PyErr_SetString(PyExc_RuntimeError, "run is not available while the background consumer is running");
+    return NULL;
+  }
+
+  dtrace_optval_t duration = 0;
+  PyObject* callback = self->dtc_callback;
+  PyObject* batch = self->dtc_batch;
+  int aggmode = self->dtc_aggmode;
+  int rval;
+
+  if (_duration(pyDuration, &duration) == -1) {
+    return NULL;
+  }
+
+  if (pyAggCallback != Py_None && _aggmode(self, mode) == -1) {
+    return NULL;
+  }
+
+  /*
+   * As with consume() and aggwalk(), what an outer pass was doing is put
+   * back once we're done; our callbacks are only borrowed.
+   */
+  self->dtc_batch = NULL;
+  rval = _run(self, pyCallback, pyAggCallback != Py_None ? pyAggCallback : NULL, duration);
+  self->dtc_callback = callback;
+  self->dtc_batch = batch;
+  self->dtc_aggmode = aggmode;
+
+  if (rval == -1) {
+    return NULL;
+  }
+
+  Py_RETURN_NONE;
+}
+
+static PyObject* 
+DTraceConsumer_aggwalk_raw(DTraceConsumer* self, PyObject *args, PyObject *kwds) {
+  static char *kwlist[] = {"callback", NULL};
+  PyObject* pyCallback = NULL;
+  
+  if ( !PyArg_ParseTupleAndKeywords(args, kwds, "O", kwlist, &pyCallback) ) {
+    PyErr_SetString(PyExc_AttributeError, "Invalid parameters: aggwalk_raw accepts a callback function");
+    return NULL;
+  }  
+
+  dtrace_hdl_t *dtp = self->dtc_handle;
+  int rval;
+
+  self->dtc_callback = pyCallback;
+  self->dtc_raw.dtb_len = 0;
+
+  _handle_lock(self);
+
+  if (_snap(self) == -1) {
+    _handle_unlock(self);
+    return NULL;
+  }
+
+  rval = _aggregate_walk(self, _aggwalk_raw, self);
+  _handle_unlock(self);
+
+  if (PyErr_Occurred()) {
+    self->dtc_raw.dtb_len = 0;
+    return NULL;
+  }
+
+  if (rval == -1) {
+    self->dtc_raw.dtb_len = 0;
+    PyErr_SetObject(PyExc_RuntimeError, _error("couldn't walk aggregate: %s\n", dtrace_errmsg(dtp, dtrace_errno(dtp))));
+    return NULL;
+  }
+
+  if (_raw_flush(self, self->dtc_agglayouts) == -1) {
+    return NULL;
+  }
+
+  Py_RETURN_NONE;
+}
+
+static PyObject* 
+DTraceConsumer_aggsnapshot(DTraceConsumer* self, PyObject *args, PyObject *kwds) {
+  static char *kwlist[] = {"varid", NULL};
+  PyObject* pyVarid = Py_None;
+  
+  if ( !PyArg_ParseTupleAndKeywords(args, kwds, "|O", kwlist, &pyVarid) ) {
+    PyErr_SetString(PyExc_AttributeError, "Invalid parameters: aggsnapshot accepts an optional aggregation variable id");
+    return NULL;
+  }  
+
+  dtrace_hdl_t *dtp = self->dtc_handle;
+  dtc_snapshot_t snap;
+  PyObject* result = NULL;
+  PyObject* var;
+  int rval, i;
+
+  memset(&snap, 0, sizeof (snap));
+  snap.dtss_consumer = self;
+  snap.dtss_varid = DTRACE_AGGVARIDNONE;
+
+  if (pyVarid != Py_None && (snap.dtss_varid = PyInt_AsLong(pyVarid)) == (dtrace_aggvarid_t)-1 && PyErr_Occurred()) {
+    return NULL;
+  }
+
+  self->dtc_error = Py_None;
+
+  _handle_lock(self);
+
+  if (_snap(self) == -1) {
+    _handle_unlock(self);
+    return NULL;
+  }
+
+  rval = _aggregate_walk(self, _aggwalk_snapshot, &snap);
+  _handle_unlock(self);
+
+  if (PyErr_Occurred()) {
+    goto out;
+  }
+
+  if (rval == -1) {
+    if (self->dtc_error != Py_None) {
+      PyErr_SetObject(PyExc_RuntimeError, self->dtc_error);
+    } else {
+      PyErr_SetObject(PyExc_RuntimeError, _error("couldn't walk aggregate: %s\n", dtrace_errmsg(dtp, dtrace_errno(dtp))));
+    }
+    goto out;
+  }
+
+  if (snap.dtss_varid != DTRACE_AGGVARIDNONE) {
+    if (snap.dtss_nvars == 0) {
+      Py_INCREF(Py_None);
+      result = Py_None;
+    } else {
+      result = _snapvar_object(self, &snap.dtss_vars[0]);
+    }
+    goto out;
+  }
+
+  if ((result = PyDict_New()) == NULL) {
+    goto out;
+  }
+
+  for (i = 0; i < snap.dtss_nvars; i++) {
+    PyObject* varid = PyInt_FromLong(snap.dtss_vars[i].dts_varid);
+
+    var = NULL;
+
+    if (varid == NULL || (var = _snapvar_object(self, &snap.dtss_vars[i])) == NULL ||
+        PyDict_SetItem(result, varid, var) == -1) {
+      Py_XDECREF(varid);
+      Py_XDECREF(var);
+      Py_CLEAR(result);
+      goto out;
+    }
+
+    Py_DECREF(varid);
+    Py_DECREF(var);
+  }
+
+out:
+  _snapshot_free(&snap);
+  return result;
+}
+
+static PyObject* 
+DTraceConsumer_aggfolded(DTraceConsumer* self, PyObject *args, PyObject *kwds) {
+  static char *kwlist[] = {"varid", "mode", NULL};
+  PyObject* pyVarid = Py_None;
+  char* mode = "remove";
+  
+  if ( !PyArg_ParseTupleAndKeywords(args, kwds, "|Os", kwlist, &pyVarid, &mode) ) {
+    PyErr_SetString(PyExc_AttributeError, "Invalid parameters: aggfolded accepts an optional aggregation variable id and an optional mode (\"remove\", \"snapshot\" or \"delta\")");
+    return NULL;
+  }  
+
+  dtrace_hdl_t *dtp = self->dtc_handle;
+  dtc_folded_t fold;
+  PyObject* result = NULL;
+  size_t i;
+  int rval;
+
+  memset(&fold, 0, sizeof (fold));
+  fold.dtf_consumer = self;
+  fold.dtf_varid = DTRACE_AGGVARIDNONE;
+
+  if (pyVarid != Py_None && (fold.dtf_varid = PyInt_AsLong(pyVarid)) == (dtrace_aggvarid_t)-1 && PyErr_Occurred()) {
+    return NULL;
+  }
+
+  if (_aggmode(self, mode) == -1) {
+    return NULL;
+  }
+
+  self->dtc_error = Py_None;
+
+  _handle_lock(self);
+
+  if (_snap(self) == -1) {
+    _handle_unlock(self);
+    return NULL;
+  }
+
+  rval = _aggregate_walk(self, _aggwalk_folded, &fold);
+
+  if (rval == 0 && self->dtc_aggmode == DTC_AGGWALK_DELTA && _aggdelta_prune(self, 0) == -1) {
+    _handle_unlock(self);
+    goto out;
+  }
+
+  _handle_unlock(self);
+
+  if (PyErr_Occurred()) {
+    goto out;
+  }
+
+  if (rval == -1) {
+    if (self->dtc_error != Py_None) {
+      PyErr_SetObject(PyExc_RuntimeError, self->dtc_error);
+    } else {
+      PyErr_SetObject(PyExc_RuntimeError, _error("couldn't walk aggregate: %s\n", dtrace_errmsg(dtp, dtrace_errno(dtp))));
+    }
+    goto out;
+  }
+
+  /*
+   * The line buffer is done with; reuse it for the output.
+   */
+  fold.dtf_line.dtb_len = 0;
+
+  for (i = 0; i < fold.dtf_lines.dth_size; i++) {
+    dtc_hashent_t *ent = &fold.dtf_lines.dth_ents[i];
+    char *dst;
+    int len;
+
+    if (ent->dthe_key == NULL || ent->dthe_value == 0) {
+      continue;
+    }
+
+    if ((dst = _buf_reserve(&fold.dtf_line, ent->dthe_len + 24)) == NULL) {
+      PyErr_NoMemory();
+      goto out;
+    }
+
+    memcpy(dst, ent->dthe_key, ent->dthe_len);
+    len = snprintf(dst + ent->dthe_len, 24, " %lld\n", (long long)(int64_t)ent->dthe_value);
+    fold.dtf_line.dtb_len -= 24 - len;
+  }
+
+  result = PyString_FromStringAndSize(fold.dtf_line.dtb_data, fold.dtf_line.dtb_len);
+
+out:
+  _hash_free(&fold.dtf_lines, 0);
+  free(fold.dtf_line.dtb_data);
+  return result;
+}
+
+/*
+ * Returns the n first records of an aggregation variable, ordered by value
+ * or by key, converting only those to python objects.
+ */
+static PyObject* 
+DTraceConsumer_aggtop(DTraceConsumer* self, PyObject *args, PyObject *kwds) {
+  static char *kwlist[] = {"varid", "n", "by", "order", NULL};
+  int varid = 0;
+  Py_ssize_t n = 0;
+  char* by = "value";
+  char* order = "desc";
+  
+  if ( !PyArg_ParseTupleAndKeywords(args, kwds, "in|ss", kwlist, &varid, &n, &by, &order) ) {
+    PyErr_SetString(PyExc_AttributeError, "Invalid parameters: aggtop accepts an aggregation variable id, a number of records, an optional sort field (\"value\" or \"key\") and an optional order (\"desc\" or \"asc\")");
+    return NULL;
+  }  
+
+  dtrace_hdl_t *dtp = self->dtc_handle;
+  dtc_top_t top;
+  PyObject* result = NULL;
+  size_t i, count;
+  int rval;
+
+  memset(&top, 0, sizeof (top));
+  top.dtt_consumer = self;
+  top.dtt_varid = varid;
+  top.dtt_n = n;
+
+  if (n < 0) {
+    PyErr_SetString(PyExc_ValueError, "the number of records can't be negative");
+    return NULL;
+  }
+
+  if (strcmp(by, "value") != 0 && strcmp(by, "key") != 0) {
+    PyErr_Format(PyExc_ValueError, "invalid sort field \"%s\"; must be \"value\" or \"key\"", by);
+    return NULL;
+  }
+
+  if (strcmp(order, "desc") != 0 && strcmp(order, "asc") != 0) {
+    PyErr_Format(PyExc_ValueError, "invalid order \"%s\"; must be \"desc\" or \"asc\"", order);
+    return NULL;
+  }
+
+  top.dtt_bykey = strcmp(by, "key") == 0;
+  top.dtt_descending = strcmp(order, "desc") == 0;
+
+  if (n > 0 && (top.dtt_heap = calloc(n, sizeof (caddr_t))) == NULL) {
+    return PyErr_NoMemory();
+  }
+
+  self->dtc_error = Py_None;
+
+  _handle_lock(self);
+
+  if (_snap(self) == -1) {
+    _handle_unlock(self);
+    goto out;
+  }
+
+  rval = _aggregate_walk(self, _aggwalk_top, &top);
+
+  if (PyErr_Occurred()) {
+    _handle_unlock(self);
+    goto out;
+  }
+
+  if (rval == -1) {
+    _handle_unlock(self);
+
+    if (self->dtc_error != Py_None) {
+      PyErr_SetObject(PyExc_RuntimeError, self->dtc_error);
+    } else {
+      PyErr_SetObject(PyExc_RuntimeError, _error("couldn't walk aggregate: %s\n", dtrace_errmsg(dtp, dtrace_errno(dtp))));
+    }
+    goto out;
+  }
+
+  /*
+   * Popping the heap leaves the records in order, first one first.
+   */
+  for (count = top.dtt_count; top.dtt_count > 1; ) {
+    caddr_t tmp = top.dtt_heap[0];
+
+    top.dtt_heap[0] = top.dtt_heap[--top.dtt_count];
+    top.dtt_heap[top.dtt_count] = tmp;
+    _top_siftdown(&top, 0);
+  }
+
+  top.dtt_count = count;
+
+  if ((result = PyList_New(count)) == NULL) {
+    _handle_unlock(self);
+    goto out;
+  }
+
+  for (i = 0; i < count; i++) {
+    const dtrace_recdesc_t *aggrec = &top.dtt_desc->dtagd_rec[top.dtt_desc->dtagd_nrecs - 1];
+    dtrace_aggdata_t agg;
+    PyObject* keys;
+    PyObject* val;
+
+    memset(&agg, 0, sizeof (agg));
+    agg.dtada_handle = dtp;
+    agg.dtada_desc = (dtrace_aggdesc_t *)top.dtt_desc;
+    agg.dtada_data = top.dtt_heap[i];
+
+    if ((rval = _make_aggrec(self, &agg, (int64_t *)(agg.dtada_data + aggrec->dtrd_offset), &keys, &val)) != DTRACE_AGGWALK_NEXT) {
+      _handle_unlock(self);
+
+      if (rval == DTRACE_AGGWALK_ERROR) {
+        PyErr_SetObject(PyExc_RuntimeError, self->dtc_error);
+      }
+
+      Py_CLEAR(result);
+      goto out;
+    }
+
+    PyList_SET_ITEM(result, i, Py_BuildValue("(NN)", keys, val));
+
+    if (PyList_GET_ITEM(result, i) == NULL) {
+      _handle_unlock(self);
+      Py_CLEAR(result);
+      goto out;
+    }
+  }
+
+  _handle_unlock(self);
+
+out:
+  for (i = 0; i < top.dtt_count; i++) {
+    free(top.dtt_heap[i]);
+  }
+
+  free(top.dtt_heap);
+  return result;
+}
+
+static PyObject* 
+DTraceConsumer_aggclear(DTraceConsumer* self, PyObject *args, PyObject *kwds) {
+
+  if (_need_handle(self) == -1) {
+    return NULL;
+  }
+
+  dtrace_hdl_t *dtp = self->dtc_handle;
+  int rval;
+
+  _handle_lock(self);
+
+  Py_BEGIN_ALLOW_THREADS
+  rval = dtrace_status(dtp);
+  Py_END_ALLOW_THREADS
+
+  if (rval == -1) {
+    _handle_unlock(self);
+    PyErr_SetObject(PyExc_RuntimeError, _error("couldn't get status: %s\n", dtrace_errmsg(dtp, dtrace_errno(dtp))));
+    return NULL;
+  }
+
+  dtrace_aggregate_clear(dtp);
+  _handle_unlock(self);
+
+  _hash_free(&self->dtc_aggprev, 1);
+
+  Py_RETURN_NONE;
+}
+
+static PyObject* 
+DTraceConsumer_aggmin(DTraceConsumer* self, PyObject *args, PyObject *kwds) {
+  return Py_BuildValue("l", INT64_MIN);
+}
+
+static PyObject* 
+DTraceConsumer_aggmax(DTraceConsumer* self, PyObject *args, PyObject *kwds) {
+  return Py_BuildValue("l", INT64_MAX);
+}
+
+static PyObject* 
+DTraceConsumer_syminvalidate(DTraceConsumer* self, PyObject *args, PyObject *kwds) {
+  static char *kwlist[] = {"pid", NULL};
+  PyObject* pyPid = Py_None;
+  long pid = -1;
+
+  if ( !PyArg_ParseTupleAndKeywords(args, kwds, "|O", kwlist, &pyPid) ) {
+    PyErr_SetString(PyExc_AttributeError, "Invalid parameters: syminvalidate accepts an optional process id");
+    return NULL;
+  }
+
+  if (pyPid != Py_None && ((pid = PyInt_AsLong(pyPid)) == -1 || pid < 0)) {
+    if (!PyErr_Occurred()) {
+      PyErr_SetString(PyExc_ValueError, "pid must not be negative");
+    }
+    return NULL;
+  }
+
+  _handle_lock(self);
+  _sym_invalidate(&self->dtc_syms, pid, 1);
+  _handle_unlock(self);
+
+  Py_RETURN_NONE;
+}
+
+/*
+ * Builds the [[min, max], count] pairs for the non-empty buckets of the
+ * buffer-switch interval histogram, in microseconds.
+ */
+static PyObject*
+_make_switches(const dtc_stats_t *st) {
+  PyObject* buckets = PyList_New(0);
+  PyObject* datum;
+  int64_t min, max;
+  int i;
+
+  if (buckets == NULL) {
+    return NULL;
+  }
+
+  for (i = 0; i < DTC_STATS_NBUCKETS; i++) {
+
+    if (!st->dts_switches[i]) continue;
+
+    min = i == 0 ? 0 : 1LL << (i - 1);
+    max = i == 0 ? 0 : i == DTC_STATS_NBUCKETS - 1 ? INT64_MAX : (1LL << i) - 1;
+
+    if ((datum = Py_BuildValue("[(LL)K]", (PY_LONG_LONG)min, (PY_LONG_LONG)max, (unsigned PY_LONG_LONG)st->dts_switches[i])) == NULL ||
+        PyList_Append(buckets, datum) == -1) {
+      Py_XDECREF(datum);
+      Py_DECREF(buckets);
+      return NULL;
+    }
+
+    Py_DECREF(datum);
+  }
+
+  return buckets;
+}
+
+static PyObject* 
+DTraceConsumer_stats(DTraceConsumer* self, PyObject *args, PyObject *kwds) {
+  static char *kwlist[] = {"reset", NULL};
+  int reset = 0;
+  dtc_stats_t st;
+
+  if ( !PyArg_ParseTupleAndKeywords(args, kwds, "|i", kwlist, &reset) ) {
+    PyErr_SetString(PyExc_AttributeError, "Invalid parameters: stats accepts an optional flag to reset the counters");
+    return NULL;
+  }
+
+  _handle_lock(self);
+  st = self->dtc_stats;
+
+  if (reset) {
+    uint64_t lastswitch = self->dtc_stats.dts_lastswitch;
+
+    memset(&self->dtc_stats, 0, sizeof (dtc_stats_t));
+    self->dtc_stats.dts_lastswitch = lastswitch;
+  }
+
+  _handle_unlock(self);
+
+  return Py_BuildValue("{s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:d,s:d,s:K,s:N}",
+      "principal_drops", st.dts_drops[DTC_DROP_PRINCIPAL],
+      "aggregation_drops", st.dts_drops[DTC_DROP_AGGREGATION],
+      "speculation_drops", st.dts_drops[DTC_DROP_SPECULATION],
+      "dynvar_drops", st.dts_drops[DTC_DROP_DYNVAR],
+      "other_drops", st.dts_drops[DTC_DROP_OTHER],
+      "background_drops", self->dtc_bg.dtbg_drops,
+      "errors", st.dts_errors,
+      "firings", st.dts_firings,
+      "records", st.dts_records,
+      "bytes", st.dts_bytes,
+      "passes", st.dts_passes,
+      "work_time", st.dts_work / 1e9,
+      "callback_time", st.dts_callback / 1e9,
+      "switches", st.dts_nswitches,
+      "switch_intervals", _make_switches(&st));
+}
+
+static PyObject* 
+DTraceConsumer_capture(DTraceConsumer* self, PyObject *args, PyObject *kwds) {
+  static char *kwlist[] = {"path", NULL};
+  char* path = NULL;
+  
+  if ( !PyArg_ParseTupleAndKeywords(args, kwds, "z", kwlist, &path) ) {
+    PyErr_SetString(PyExc_AttributeError, "Invalid parameters: capture accepts the path of the capture file, or None to stop capturing");
+    return NULL;
+  }  
+
+  if (_need_handle(self) == -1) {
+    return NULL;
+  }
+
+  char magic[sizeof (DTC_CAP_MAGIC) - 1];
+  struct stat st;
+  int fd;
+
+  _handle_lock(self);
+  _cap_close(&self->dtc_cap);
+  _handle_unlock(self);
+
+  if (path == NULL) {
+    Py_RETURN_NONE;
+  }
+
+  /*
+   * An existing capture file is appended to.
+   */
+  if ((fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644)) == -1) {
+    return PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+  }
+
+  if (fstat(fd, &st) == -1 ||
+      (st.st_size == 0 && write(fd, DTC_CAP_MAGIC, sizeof (magic)) != sizeof (magic))) {
+    PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+    close(fd);
+    return NULL;
+  }
+
+  if (st.st_size != 0 &&
+      (pread(fd, magic, sizeof (magic), 0) != sizeof (magic) || memcmp(magic, DTC_CAP_MAGIC, sizeof (magic)) != 0)) {
+    PyErr_Format(PyExc_ValueError, "%s is not a capture file", path);
+    close(fd);
+    return NULL;
+  }
+
+  _handle_lock(self);
+  self->dtc_cap.dtcp_fd = fd;
+  _handle_unlock(self);
+
+  Py_RETURN_NONE;
+}
+
+static PyObject* 
+DTraceConsumer_publish(DTraceConsumer* self, PyObject *args, PyObject *kwds) {
+  static char *kwlist[] = {"path", "size", NULL};
+  char* path = NULL;
+  Py_ssize_t size = 65536;
+  int rval;
+  
+  if ( !PyArg_ParseTupleAndKeywords(args, kwds, "z|n", kwlist, &path, &size) || size <= 0 ) {
+    PyErr_SetString(PyExc_AttributeError, "Invalid parameters: publish accepts the path of the snapshot file, or None to stop publishing, and an optional initial size of its buffers");
+    return NULL;
+  }  
+
+  if (_need_handle(self) == -1) {
+    return NULL;
+  }
+
+  _handle_lock(self);
+  _pub_close(&self->dtc_pub);
+  rval = (path != NULL ? _pub_open(&self->dtc_pub, path, size) : 0);
+  _handle_unlock(self);
+
+  if (rval == -1) {
+    return NULL;
+  }
+
+  Py_RETURN_NONE;
+}
+
+static PyObject* 
+DTraceConsumer_stop(DTraceConsumer* self, PyObject *args, PyObject *kwds) {
+
+  if (_need_handle(self) == -1) {
+    return NULL;
+  }
+
+  dtrace_hdl_t *dtp = self->dtc_handle;
+
+  _background_stop(self);
+  
+  if (dtrace_stop(dtp) == -1) { 
+    PyErr_SetObject(PyExc_RuntimeError, _error("couldn't disable tracing: %s\n", dtrace_errmsg(dtp, dtrace_errno(dtp))));
+    return NULL;
+  }
+
+  _probes_flush(self);
+
+  Py_RETURN_NONE;
+}
+
+static PyObject* 
+DTraceConsumer_version(DTraceConsumer* self, PyObject *args, PyObject *kwds) {
+  return Py_BuildValue("s", _dtrace_version);
+}
+
+static PyObject*
+DTraceConsumer_getsymcachesize(DTraceConsumer* self, void *closure) {
+  return PyInt_FromSsize_t(self->dtc_syms.dtsc_max);
+}
+
+/*
+ * The background thread looks symbols up with the handle lock held, so the
+ * size of the cache only changes under it.  Entries beyond the new size are
+ * evicted right away.
+ */
+static int
+DTraceConsumer_setsymcachesize(DTraceConsumer* self, PyObject *value, void *closure) {
+  dtc_symcache_t *sc = &self->dtc_syms;
+  Py_ssize_t max;
+
+  if (value == NULL) {
+    PyErr_SetString(PyExc_TypeError, "can't delete symcache_size");
+    return -1;
+  }
+
+  if ((max = PyNumber_AsSsize_t(value, PyExc_OverflowError)) == -1 && PyErr_Occurred()) {
+    return -1;
+  }
+
+  _handle_lock(self);
+  sc->dtsc_max = max;
+
+  while (sc->dtsc_tail != NULL && (Py_ssize_t)sc->dtsc_count > (max > 0 ? max : 0)) {
+    _sym_remove(sc, sc->dtsc_tail, 1);
+  }
+
+  _handle_unlock(self);
+
+  return 0;
+}
+
+static PyObject*
+DTraceConsumer_getstructured(DTraceConsumer* self, void *closure) {
+  return PyBool_FromLong(self->dtc_structured);
+}
+
+/*
+ * Without libdtrace to format them, a replaying consumer can only hand out
+ * printf()s structured, so it stays that way.
+ */
+static int
+DTraceConsumer_setstructured(DTraceConsumer* self, PyObject *value, void *closure) {
+  int structured;
+
+  if (value == NULL) {
+    PyErr_SetString(PyExc_TypeError, "can't delete structured_printf");
+    return -1;
+  }
+
+  if ((structured = PyObject_IsTrue(value)) == -1) {
+    return -1;
+  }
+
+  if (!structured && self->dtc_replay.dtrp_base != NULL) {
+    PyErr_SetString(PyExc_AttributeError, "printf() records are always structured when replaying a capture");
+    return -1;
+  }
+
+  self->dtc_structured = structured;
+
+  return 0;
+}
+
+static PyGetSetDef DTraceConsumer_getset[] = {
+  {"symcache_size", (getter)DTraceConsumer_getsymcachesize, (setter)DTraceConsumer_setsymcachesize, "maximum number of resolved symbols to cache (0 disables the cache)", NULL},
+  {"structured_printf", (getter)DTraceConsumer_getstructured, (setter)DTraceConsumer_setstructured, "deliver printf() records as (format, args) tuples rather than formatted strings", NULL},
+  {NULL}  /* Sentinel */
+};
+
+static PyMemberDef DTraceConsumer_members[] = {
+  //{"handle", T_INT, offsetof(DTraceConsumer, dtc_handle), 0, "libdtrace state token"},
+  {"background_drops", T_ULONGLONG, offsetof(DTraceConsumer, dtc_bg.dtbg_drops), READONLY, "records dropped because the background queue was full"},
+  {"background_done", T_INT, offsetof(DTraceConsumer, dtc_bg.dtbg_done), READONLY, "whether the background thread has stopped, because the program is done or failed"},
+  {"histograms", T_BOOL, offsetof(DTraceConsumer, dtc_histograms), 0, "deliver quantized values as dtrace.Histogram objects rather than lists of buckets"},
+  {"strict", T_BOOL, offsetof(DTraceConsumer, dtc_strict), 0, "fail consumption on drops and ERROR probe firings, after counting them, rather than carrying on"},
+  {"symcache_hits", T_ULONGLONG, offsetof(DTraceConsumer, dtc_syms.dtsc_hits), READONLY, "symbol lookups answered from the cache"},
+  {"symcache_misses", T_ULONGLONG, offsetof(DTraceConsumer, dtc_syms.dtsc_misses), READONLY, "symbol lookups that had to be resolved"},
+  {"replay_eof", T_BOOL, offsetof(DTraceConsumer, dtc_replay.dtrp_eof), READONLY, "whether consume() has replayed the whole capture file"},
+  {"publish_error", T_OBJECT, offsetof(DTraceConsumer, dtc_pub.dtpb_error), READONLY, "why the last snapshot couldn't be published, or None"},
+  {NULL}  /* Sentinel */
+};
+
+static PyMethodDef DTraceConsumer_methods[] = {
+  {"strcompile", (PyCFunction)DTraceConsumer_strcompile, METH_VARARGS | METH_KEYWORDS, "compile the supplied d-program" },
+  {"setopt", (PyCFunction)DTraceConsumer_setopt, METH_VARARGS | METH_KEYWORDS, "set libdtrace options" },
+  {"getopt", (PyCFunction)DTraceConsumer_getopt, METH_VARARGS | METH_KEYWORDS, "get the value of a libdtrace option" },
+  {"autotune", (PyCFunction)DTraceConsumer_autotune, METH_VARARGS | METH_KEYWORDS, "tune buffer sizes and rates to the drops seen while consuming" },
+  {"tuning", (PyCFunction)DTraceConsumer_tuning, METH_VARARGS | METH_KEYWORDS, "return the options autotune() recommends for the next run" },
+  {"go", (PyCFunction)DTraceConsumer_go, METH_VARARGS | METH_KEYWORDS, "execute the compiled d-program" },
+  {"route", (PyCFunction)DTraceConsumer_route, METH_VARARGS | METH_KEYWORDS, "send the records of the probes matching a description to a callback, skipping probes that match no route" },
+  {"unroute", (PyCFunction)DTraceConsumer_unroute, METH_VARARGS | METH_KEYWORDS, "remove the routes for a probe description, or all routes" },
+  {"rollup", (PyCFunction)DTraceConsumer_rollup, METH_VARARGS | METH_KEYWORDS, "aggregate the records of the probes matching a description natively, by key" },
+  {"rollup_snapshot", (PyCFunction)DTraceConsumer_rollup_snapshot, METH_VARARGS | METH_KEYWORDS, "return the results of a rollup, or of all rollups" },
+  {"unrollup", (PyCFunction)DTraceConsumer_unrollup, METH_VARARGS | METH_KEYWORDS, "remove a rollup, or all rollups" },
+  {"consume", (PyCFunction)DTraceConsumer_consume, METH_VARARGS | METH_KEYWORDS, "consume outputs of the running d-program" },
+  {"consume_batch", (PyCFunction)DTraceConsumer_consume_batch, METH_VARARGS | METH_KEYWORDS, "consume outputs of the running d-program as lists of (probe, record) tuples" },
+  {"consume_iter", (PyCFunction)DTraceConsumer_consume_iter, METH_VARARGS | METH_KEYWORDS, "consume outputs of the running d-program as an iterator of (probe, record) tuples" },
+  {"consume_raw", (PyCFunction)DTraceConsumer_consume_raw, METH_VARARGS | METH_KEYWORDS, "consume outputs of the running d-program as a memoryview of raw probe firings" },
+  {"start_background", (PyCFunction)DTraceConsumer_start_background, METH_VARARGS | METH_KEYWORDS, "consume the running d-program from a native thread; consume() then drains what it has gathered" },
+  {"stop_background", (PyCFunction)DTraceConsumer_stop_background, METH_VARARGS | METH_KEYWORDS, "stop the native consumer thread" },
+  {"fileno", (PyCFunction)DTraceConsumer_fileno, METH_VARARGS | METH_KEYWORDS, "return a file descriptor that is readable when the native consumer thread has data" },
+  {"aggwalk", (PyCFunction)DTraceConsumer_aggwalk, METH_VARARGS | METH_KEYWORDS, "consume outputs for all aggregations of the running d-program" },
+  {"run", (PyCFunction)DTraceConsumer_run, METH_VARARGS | METH_KEYWORDS, "consume the running d-program and walk its aggregations at switchrate and aggrate until it exits" },
+  {"aggwalk_raw", (PyCFunction)DTraceConsumer_aggwalk_raw, METH_VARARGS | METH_KEYWORDS, "consume outputs for all aggregations as a memoryview of raw aggregation records" },
+  {"aggsnapshot", (PyCFunction)DTraceConsumer_aggsnapshot, METH_VARARGS | METH_KEYWORDS, "snapshot aggregations as columnar arrays, without consuming them" },
+  {"aggfolded", (PyCFunction)DTraceConsumer_aggfolded, METH_VARARGS | METH_KEYWORDS, "fold count() and sum() aggregations into folded-stack lines" },
+  {"aggtop", (PyCFunction)DTraceConsumer_aggtop, METH_VARARGS | METH_KEYWORDS, "return the first records of an aggregation, ordered by value or key" },
+  {"aggclear", (PyCFunction)DTraceConsumer_aggclear, METH_VARARGS | METH_KEYWORDS, "clear outputs for all aggregations of the running d-program" },
+  {"aggmin", (PyCFunction)DTraceConsumer_aggmin, METH_VARARGS | METH_KEYWORDS, "minimum int64 value" },
+  {"aggmax", (PyCFunction)DTraceConsumer_aggmax, METH_VARARGS | METH_KEYWORDS, "maximum int64 value" },
+  {"syminvalidate", (PyCFunction)DTraceConsumer_syminvalidate, METH_VARARGS | METH_KEYWORDS, "drop the cached symbols of a process, or of all processes" },
+  {"stats", (PyCFunction)DTraceConsumer_stats, METH_VARARGS | METH_KEYWORDS, "return the consumer's counters of drops, errors, records and time spent" },
+  {"capture", (PyCFunction)DTraceConsumer_capture, METH_VARARGS | METH_KEYWORDS, "append everything consumed and walked to a capture file" },
+  {"publish", (PyCFunction)DTraceConsumer_publish, METH_VARARGS | METH_KEYWORDS, "publish every aggregation snapshot to a file that dtrace.SnapshotReader reads" },
+  {"stop", (PyCFunction)DTraceConsumer_stop, METH_VARARGS | METH_KEYWORDS, "stop execution of the running d-program" },
+  {"version", (PyCFunction)DTraceConsumer_version, METH_VARARGS | METH_KEYWORDS, "return the version string of libdtrace" },
+  {NULL}  /* Sentinel */
+};
+
+static PyTypeObject DTraceConsumerType = {
+  PyObject_HEAD_INIT(NULL)
+  0,                         /*ob_size*/
+  "libdtrace.DTraceConsumer",             /*tp_name*/
+  sizeof(DTraceConsumer),             /*tp_basicsize*/
+  0,                         /*tp_itemsize*/
+  (destructor)DTraceConsumer_dealloc, /*tp_dealloc*/
+  0,                         /*tp_print*/
+  0,                         /*tp_getattr*/
+  0,                         /*tp_setattr*/
+  0,                         /*tp_compare*/
+  0,                         /*tp_repr*/
+  0,                         /*tp_as_number*/
+  0,                         /*tp_as_sequence*/
+  0,                         /*tp_as_mapping*/
+  0,                         /*tp_hash */
+  0,                         /*tp_call*/
+  0,                         /*tp_str*/
+  0,                         /*tp_getattro*/
+  0,                         /*tp_setattro*/
+  0,                         /*tp_as_buffer*/
+  Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /*tp_flags*/
+  "DTrace binding object",           /* tp_doc */
+  0,                     /* tp_traverse */
+  0,                     /* tp_clear */
+  0,                     /* tp_richcompare */
+  0,                     /* tp_weaklistoffset */
+  0,                     /* tp_iter */
+  0,                     /* tp_iternext */
+  DTraceConsumer_methods,             /* tp_methods */
+  DTraceConsumer_members,             /* tp_members */
+  DTraceConsumer_getset,     /* tp_getset */
+  0,                         /* tp_base */
+  0,                         /* tp_dict */
+  0,                         /* tp_descr_get */
+  0,                         /* tp_descr_set */
+  0,                         /* tp_dictoffset */
+  (initproc)DTraceConsumer_init,      /* tp_init */
+  0,                         /* tp_alloc */
+  PyType_GenericNew,                 /* tp_new */
+};
+
+
+//////////////////////////////////////////////////////////
+/////////////////////////////////////////// Consumer group 
+//////////////////////////////////////////////////////////
+
+/*
+ * Drives any number of consumers from one thread: rather than each handle
+ * sleeping in dtrace_sleep() on a thread of its own, the group sleeps, with
+ * the GIL released, until the earliest switchrate or aggrate deadline among
+ * its members, and runs the passes that are due.
+ */
+static int
+DTraceConsumerGroup_traverse(DTraceConsumerGroup* self, visitproc visit, void *arg) {
+  int i;
+
+  for (i = 0; i < self->dtg_nmembers; i++) {
+    Py_VISIT(self->dtg_members[i].dtgm_consumer);
+    Py_VISIT(self->dtg_members[i].dtgm_callback);
+    Py_VISIT(self->dtg_members[i].dtgm_aggcallback);
+  }
+
+  return 0;
+}
 
-  dtrace_probedata_t *data = bufdata->dtbda_probe;
-  const dtrace_recdesc_t *rec = bufdata->dtbda_recdesc;
-  DTraceConsumer *dtc = (DTraceConsumer *)arg;
+static void
+_member_clear(dtc_member_t *m) {
+  Py_CLEAR(m->dtgm_consumer);
+  Py_CLEAR(m->dtgm_callback);
+  Py_CLEAR(m->dtgm_aggcallback);
+}
 
-  if (rec == NULL || rec->dtrd_action != DTRACEACT_PRINTF)
-    return (DTRACE_HANDLE_OK);
+static int
+DTraceConsumerGroup_clear(DTraceConsumerGroup* self) {
+  dtc_member_t *members = self->dtg_members;
+  int i, n = self->dtg_nmembers;
 
+  self->dtg_members = NULL;
+  self->dtg_nmembers = self->dtg_maxmembers = 0;
 
-  PyObject* probe = _make_probedesc(data->dtpda_pdesc);
-  PyObject* record = Py_BuildValue("s", bufdata->dtbda_buffered);
+  for (i = 0; i < n; i++) {
+    _member_clear(&members[i]);
+  }
 
-  PyObject* result = PyObject_CallFunction((PyObject*)dtc->dtc_callback, "OO", probe, record);
-  Py_XDECREF(result);
+  free(members);
 
-  return (DTRACE_HANDLE_OK);
+  return 0;
 }
 
-static int 
-_consume(const dtrace_probedata_t *data, const dtrace_recdesc_t *rec, void *arg) {
-  DTraceConsumer *dtc = (DTraceConsumer *)arg;
-  dtrace_probedesc_t *pd = data->dtpda_pdesc;
+static void
+DTraceConsumerGroup_dealloc(DTraceConsumerGroup* self) {
+  PyObject_GC_UnTrack(self);
+  DTraceConsumerGroup_clear(self);
+  self->ob_type->tp_free((PyObject*)self);
+}
 
-  PyObject* probe = _make_probedesc(data->dtpda_pdesc);
+static Py_ssize_t
+DTraceConsumerGroup_length(DTraceConsumerGroup* self) {
+  Py_ssize_t n = 0;
+  int i;
 
-  if (rec == NULL) {
-    //PyObject* result = PyObject_CallFunction((PyObject*)dtc->dtc_callback, "OO", probe, Py_None);
-    //Py_XDECREF(result);
+  for (i = 0; i < self->dtg_nmembers; i++) {
+    n += !self->dtg_members[i].dtgm_removed;
+  }
 
-    return (DTRACE_CONSUME_NEXT);
+  return n;
+}
 
-  } else if (!_action_valid(rec)) {
+static int
+_group_find(DTraceConsumerGroup *g, PyObject *consumer) {
+  int i;
 
-    /*
-     * If this is a printf(), we'll defer to the bufhandler.
-     */     
-    if (rec->dtrd_action == DTRACEACT_PRINTF) {
-      return (DTRACE_CONSUME_THIS);
+  for (i = 0; i < g->dtg_nmembers; i++) {
+    if (!g->dtg_members[i].dtgm_removed && (PyObject *)g->dtg_members[i].dtgm_consumer == consumer) {
+      return i;
     }
+  }
 
+  return -1;
+}
 
-    char errbuf[256];
-    dtc->dtc_error = _error("unsupported action %s in record for %s:%s:%s:%s\n",
-                              _action(rec, errbuf, sizeof (errbuf)),
-                              pd->dtpd_provider, 
-                              pd->dtpd_mod,
-                              pd->dtpd_func, 
-                              pd->dtpd_name); 
+/*
+ * Drops the members that were removed while the group was running.
+ */
+static void
+_group_compact(DTraceConsumerGroup *g) {
+  int i, n = 0;
 
-    return (DTRACE_CONSUME_ABORT);
+  for (i = 0; i < g->dtg_nmembers; i++) {
+    if (g->dtg_members[i].dtgm_removed) {
+      _member_clear(&g->dtg_members[i]);
+    } else {
+      g->dtg_members[n++] = g->dtg_members[i];
+    }
   }
 
-  PyObject* record = _make_record(dtc, rec, data->dtpda_data);
-
-  PyObject* result = PyObject_CallFunction((PyObject*)dtc->dtc_callback, "OO", probe, record);  
-  Py_XDECREF(result);
-
-  return (DTRACE_CONSUME_NEXT);
+  g->dtg_nmembers = n;
 }
 
-//////////////////////////////////////////////////////////
-///////////////////////////////////////////////////// API 
-//////////////////////////////////////////////////////////
+/*
+ * Returns a rate option of a member in ns, or 0 if it can't be had.
+ */
+static uint64_t
+_group_rate(DTraceConsumer *dtc, const char *option) {
+  dtrace_optval_t rate;
+  int rval;
 
-static int
-DTraceConsumer_init(DTraceConsumer *self, PyObject *args, PyObject *kwds) {  
-  if ( self->dtc_handle ) {
-    //PyErr_SetString(PyExc_AttributeError, "cannot reinitialize \"DTraceConsumer\"");
-    return 0;
-  }
+  _handle_lock(dtc);
+  rval = dtrace_getopt(dtc->dtc_handle, option, &rate);
+  _handle_unlock(dtc);
 
-  int err;
-  dtrace_hdl_t *dtp;
+  return rval == -1 || rate <= 0 ? 0 : (uint64_t)rate;
+}
 
-  if ((dtp = self->dtc_handle = dtrace_open(DTRACE_VERSION, 0, &err)) == NULL) {
-    PyErr_SetString(PyExc_RuntimeError, dtrace_errmsg(NULL, err));
-    return -1;
-  }
+/*
+ * Runs whatever is due for member i: a buffer switch, an aggregation walk,
+ * or both.  A member whose program is done gets a last aggregation walk and
+ * leaves the group.  The member is looked up again after every callback, as
+ * the callbacks may add members, which moves the array.
+ */
+static int
+_group_pass(DTraceConsumerGroup *g, int i, uint64_t now) {
+  dtc_member_t *m = &g->dtg_members[i];
+  DTraceConsumer *dtc = m->dtgm_consumer;
+  dtrace_workstatus_t status = DTRACE_WORKSTATUS_OKAY;
+
+  PyObject* callback = dtc->dtc_callback;
+  PyObject* batch = dtc->dtc_batch;
+  int aggmode = dtc->dtc_aggmode;
+  int rval;
 
   /*
-   * Set our buffer size and aggregation buffer size to the de facto
-   * standard of 4M.
+   * A member may be consumed from the callback of one of its own passes,
+   * which gets its callback back once we're done, as with run().
    */
-  (void) dtrace_setopt(dtp, "bufsize", "4m");
-  (void) dtrace_setopt(dtp, "aggsize", "4m");
+  if (now >= m->dtgm_nextwork) {
+    dtc->dtc_callback = m->dtgm_callback;
+    dtc->dtc_batch = NULL;
+    dtc->dtc_error = Py_None;
 
+    rval = _work(dtc, &status);
+    dtc->dtc_callback = callback;
+    dtc->dtc_batch = batch;
 
-  
-  if (dtrace_handle_buffered(dtp, _bufhandler, self) == -1) {
-    PyErr_SetString(PyExc_AttributeError, dtrace_errmsg(dtp, dtrace_errno(dtp)));
+    if (rval == -1) {
+      return -1;
+    }
+
+    m = &g->dtg_members[i];
+    m->dtgm_nextwork = now + _group_rate(dtc, "switchrate");
   }
-  
 
-  self->dtc_ranges = NULL;
+  if (m->dtgm_aggcallback != NULL && (now >= m->dtgm_nextagg || status != DTRACE_WORKSTATUS_OKAY)) {
+    dtc->dtc_callback = m->dtgm_aggcallback;
+    _aggmode_set(dtc, m->dtgm_aggmode);
 
-  // ignore arguments
+    rval = _aggwalk_pass(dtc);
+    dtc->dtc_callback = callback;
+    dtc->dtc_aggmode = aggmode;
 
-  return 0;
-}
+    if (rval == -1) {
+      return -1;
+    }
 
-static void
-DTraceConsumer_dealloc(DTraceConsumer* self) {
-  if ( self->dtc_handle ) {
-    dtrace_close( self->dtc_handle );
-  }  
-  
-  self->ob_type->tp_free((PyObject*)self);
+    m = &g->dtg_members[i];
+    m->dtgm_nextagg = now + _group_rate(dtc, "aggrate");
+  }
+
+  if (status != DTRACE_WORKSTATUS_OKAY) {
+    m->dtgm_removed = 1;
+  }
+
+  return 0;
 }
 
 static PyObject* 
-DTraceConsumer_strcompile(DTraceConsumer* self, PyObject *args, PyObject *kwds) {
-
-  static char *kwlist[] = {"program", NULL};
-  char* program = NULL;
+DTraceConsumerGroup_add(DTraceConsumerGroup* self, PyObject *args, PyObject *kwds) {
+  static char *kwlist[] = {"consumer", "callback", "aggcallback", "mode", NULL};
+  PyObject* pyConsumer = NULL;
+  PyObject* pyCallback = NULL;
+  PyObject* pyAggCallback = Py_None;
+  char* mode = "remove";
   
-  if ( !PyArg_ParseTupleAndKeywords(args, kwds, "s", kwlist, &program) ) {
-    PyErr_SetString(PyExc_AttributeError, "strcompile accepts a python string as argument.");
+  if ( !PyArg_ParseTupleAndKeywords(args, kwds, "O!O|Os", kwlist, &DTraceConsumerType, &pyConsumer, &pyCallback, &pyAggCallback, &mode) ) {
+    PyErr_SetString(PyExc_AttributeError, "Invalid parameters: add accepts a DTraceConsumer, a callback function, an optional aggregation callback function and an optional aggwalk mode");
     return NULL;
-  } 
+  }  
 
-  dtrace_hdl_t *dtp = self->dtc_handle;
-  dtrace_prog_t *dp;
-  dtrace_proginfo_t info;
+  DTraceConsumer *dtc = (DTraceConsumer *)pyConsumer;
+  dtc_member_t *m;
 
-  if ((dp = dtrace_program_strcompile(dtp, program, DTRACE_PROBESPEC_NAME, 0, 0, NULL)) == NULL) {
-    PyErr_SetObject(PyExc_AttributeError, _error("couldn't compile '%s': %s\n", program, dtrace_errmsg(dtp, dtrace_errno(dtp))));
+  if (_need_handle(dtc) == -1) {
     return NULL;
   }
 
-  if (dtrace_program_exec(dtp, dp, &info) == -1) {
-    PyErr_SetObject(PyExc_AttributeError, _error("couldn't execute '%s': %s\n", program, dtrace_errmsg(dtp, dtrace_errno(dtp))));
+  if (_group_find(self, pyConsumer) != -1) {
+    PyErr_SetString(PyExc_ValueError, "consumer is already in the group");
     return NULL;
   }
 
-  Py_RETURN_NONE;
-}
-
-static PyObject* 
-DTraceConsumer_setopt(DTraceConsumer* self, PyObject *args, PyObject *kwds) {
-  printf("setopt\n");
-  Py_RETURN_NONE;
-}
+  int aggmode = DTC_AGGWALK_REMOVE;
 
-static PyObject* 
-DTraceConsumer_go(DTraceConsumer* self, PyObject *args, PyObject *kwds) {
-  if (dtrace_go(self->dtc_handle) == -1) {
-    PyErr_SetObject(PyExc_AttributeError, _error("couldn't enable tracing: %s\n", dtrace_errmsg(self->dtc_handle, dtrace_errno(self->dtc_handle))));
+  /*
+   * The mode is the member's: the consumer keeps its own, and what its delta
+   * walks last saw, until the group walks it.
+   */
+  if (pyAggCallback != Py_None && _aggmode_parse(mode, &aggmode) == -1) {
     return NULL;
   }
 
+  if (self->dtg_nmembers == self->dtg_maxmembers) {
+    int max = self->dtg_maxmembers ? self->dtg_maxmembers * 2 : 4;
+
+    if ((m = realloc(self->dtg_members, max * sizeof (dtc_member_t))) == NULL) {
+      return PyErr_NoMemory();
+    }
+
+    self->dtg_members = m;
+    self->dtg_maxmembers = max;
+  }
+
+  m = &self->dtg_members[self->dtg_nmembers++];
+  memset(m, 0, sizeof (dtc_member_t));
+
+  Py_INCREF(pyConsumer);
+  m->dtgm_consumer = dtc;
+  Py_INCREF(pyCallback);
+  m->dtgm_callback = pyCallback;
+
+  if (pyAggCallback != Py_None) {
+    Py_INCREF(pyAggCallback);
+    m->dtgm_aggcallback = pyAggCallback;
+    m->dtgm_aggmode = aggmode;
+    m->dtgm_nextagg = _now() + _group_rate(dtc, "aggrate");
+  }
+
   Py_RETURN_NONE;
 }
 
 static PyObject* 
-DTraceConsumer_consume(DTraceConsumer* self, PyObject *args, PyObject *kwds) {
-  static char *kwlist[] = {"callback", NULL};
-  PyObject* pyCallback = NULL;
+DTraceConsumerGroup_remove(DTraceConsumerGroup* self, PyObject *args, PyObject *kwds) {
+  static char *kwlist[] = {"consumer", NULL};
+  PyObject* pyConsumer = NULL;
   
-  if ( !PyArg_ParseTupleAndKeywords(args, kwds, "O", kwlist, &pyCallback) ) {
-    PyErr_SetString(PyExc_AttributeError, "Invalid parameters: consume accepts a callback function and a nullable array of objects that act as additional arguments to the callback as inputs");
+  if ( !PyArg_ParseTupleAndKeywords(args, kwds, "O", kwlist, &pyConsumer) ) {
+    PyErr_SetString(PyExc_AttributeError, "Invalid parameters: remove accepts a DTraceConsumer");
     return NULL;
   }  
 
-  dtrace_workstatus_t status;
-
+  int i;
 
-  self->dtc_callback = pyCallback;
-  self->dtc_error = Py_None;
+  if ((i = _group_find(self, pyConsumer)) == -1) {
+    PyErr_SetString(PyExc_ValueError, "consumer is not in the group");
+    return NULL;
+  }
 
-  status = dtrace_work(self->dtc_handle, NULL, NULL, _consume, self);
+  self->dtg_members[i].dtgm_removed = 1;
 
-  if (status == -1 && self->dtc_error != Py_None) {
-    PyErr_SetObject(PyExc_RuntimeError, self->dtc_error);
-    return NULL;
+  if (!self->dtg_running) {
+    _group_compact(self);
   }
 
   Py_RETURN_NONE;
 }
 
 static PyObject* 
-DTraceConsumer_aggwalk(DTraceConsumer* self, PyObject *args, PyObject *kwds) {
-  static char *kwlist[] = {"callback", NULL};
-  PyObject* pyCallback = NULL;
+DTraceConsumerGroup_run(DTraceConsumerGroup* self, PyObject *args, PyObject *kwds) {
+  static char *kwlist[] = {"duration", NULL};
+  PyObject* pyDuration = Py_None;
   
-  if ( !PyArg_ParseTupleAndKeywords(args, kwds, "O", kwlist, &pyCallback) ) {
-    PyErr_SetString(PyExc_AttributeError, "Invalid parameters: consume accepts a callback function and a nullable array of objects that act as additional arguments to the callback as inputs");
+  if ( !PyArg_ParseTupleAndKeywords(args, kwds, "|O", kwlist, &pyDuration) ) {
+    PyErr_SetString(PyExc_AttributeError, "Invalid parameters: run accepts an optional duration");
     return NULL;
   }  
 
-
-  dtrace_hdl_t *dtp = self->dtc_handle;
-  int rval;
-
-  self->dtc_callback = pyCallback;
-  self->dtc_error = Py_None;
-
-  if (dtrace_status(dtp) == -1) {
-    PyErr_SetObject(PyExc_RuntimeError, _error("couldn't get status: %s\n", dtrace_errmsg(dtp, dtrace_errno(dtp))));
+  if (self->dtg_running) {
+    PyErr_SetString(PyExc_RuntimeError, "the group is already running");
     return NULL;
   }
 
-  if (dtrace_aggregate_snap(dtp) == -1) {
-    PyErr_SetObject(PyExc_RuntimeError, _error("couldn't snap aggregate: %s\n", dtrace_errmsg(dtp, dtrace_errno(dtp))));
+  dtrace_optval_t duration = 0;
+  uint64_t start, now, next;
+  int i, rval = 0;
+
+  if (_duration(pyDuration, &duration) == -1) {
     return NULL;
   }
 
-  rval = dtrace_aggregate_walk(dtp, _aggwalk, self);
+  self->dtg_running = 1;
+  start = _now();
 
-  /*
-   * Flush the ranges cache; the ranges will go out of scope when the
-   * destructor for our HandleScope is called, and we cannot be left
-   * holding references.
-   */
-  _ranges_cache(self, DTRACE_AGGVARIDNONE, NULL);
-
-  if (rval == -1) {
+  while (rval == 0 && DTraceConsumerGroup_length(self) > 0) {
+    now = _now();
 
-    if (self->dtc_error != Py_None) {
-      PyErr_SetObject(PyExc_RuntimeError, self->dtc_error);
-      return NULL;
-    } else {
-      PyErr_SetObject(PyExc_RuntimeError, _error("couldn't walk aggregate: %s\n", dtrace_errmsg(dtp, dtrace_errno(dtp))));
-      return NULL;
+    if (duration > 0 && now - start >= (uint64_t)duration) {
+      break;
     }
-  }
 
-  Py_RETURN_NONE;
-}
+    next = duration > 0 ? start + duration : UINT64_MAX;
 
-static PyObject* 
-DTraceConsumer_aggclear(DTraceConsumer* self, PyObject *args, PyObject *kwds) {
+    for (i = 0; i < self->dtg_nmembers; i++) {
+      dtc_member_t *m = &self->dtg_members[i];
 
-  dtrace_hdl_t *dtp = self->dtc_handle;
+      if (m->dtgm_removed) {
+        continue;
+      }
 
-  if (dtrace_status(dtp) == -1) {
-    PyErr_SetObject(PyExc_RuntimeError, _error("couldn't get status: %s\n", dtrace_errmsg(dtp, dtrace_errno(dtp))));
-    return NULL;
-  }
+      if (m->dtgm_nextwork < next) {
+        next = m->dtgm_nextwork;
+      }
 
-  dtrace_aggregate_clear(dtp);
+      if (m->dtgm_aggcallback != NULL && m->dtgm_nextagg < next) {
+        next = m->dtgm_nextagg;
+      }
+    }
 
-  Py_RETURN_NONE;
-}
+    if (next > now) {
+      struct timespec ts;
 
-static PyObject* 
-DTraceConsumer_aggmin(DTraceConsumer* self, PyObject *args, PyObject *kwds) {
-  return Py_BuildValue("l", INT64_MIN);
-}
+      ts.tv_sec = (next - now) / 1000000000;
+      ts.tv_nsec = (next - now) % 1000000000;
 
-static PyObject* 
-DTraceConsumer_aggmax(DTraceConsumer* self, PyObject *args, PyObject *kwds) {
-  return Py_BuildValue("l", INT64_MAX);
-}
+      Py_BEGIN_ALLOW_THREADS
+      (void) nanosleep(&ts, NULL);
+      Py_END_ALLOW_THREADS
+    }
 
-static PyObject* 
-DTraceConsumer_stop(DTraceConsumer* self, PyObject *args, PyObject *kwds) {
+    if ((rval = PyErr_CheckSignals()) == -1) {
+      break;
+    }
 
-  dtrace_hdl_t *dtp = self->dtc_handle;
-  
-  if (dtrace_stop(dtp) == -1) { 
-    PyErr_SetObject(PyExc_RuntimeError, _error("couldn't disable tracing: %s\n", dtrace_errmsg(dtp, dtrace_errno(dtp))));
+    now = _now();
+
+    for (i = 0; rval == 0 && i < self->dtg_nmembers; i++) {
+      if (!self->dtg_members[i].dtgm_removed) {
+        rval = _group_pass(self, i, now);
+      }
+    }
+
+    _group_compact(self);
+  }
+
+  _group_compact(self);
+  self->dtg_running = 0;
+
+  if (rval == -1) {
     return NULL;
   }
 
   Py_RETURN_NONE;
 }
 
-static PyObject* 
-DTraceConsumer_version(DTraceConsumer* self, PyObject *args, PyObject *kwds) {
-  return Py_BuildValue("s", _dtrace_version);
-}
-
-static PyMemberDef DTraceConsumer_members[] = {
-  //{"handle", T_INT, offsetof(DTraceConsumer, dtc_handle), 0, "libdtrace state token"},
+static PyMethodDef DTraceConsumerGroup_methods[] = {
+  {"add", (PyCFunction)DTraceConsumerGroup_add, METH_VARARGS | METH_KEYWORDS, "drive a consumer from the group, dispatching to the given callbacks" },
+  {"remove", (PyCFunction)DTraceConsumerGroup_remove, METH_VARARGS | METH_KEYWORDS, "stop driving a consumer from the group" },
+  {"run", (PyCFunction)DTraceConsumerGroup_run, METH_VARARGS | METH_KEYWORDS, "consume every consumer of the group at its switchrate and aggrate until all are done" },
   {NULL}  /* Sentinel */
 };
 
-static PyMethodDef DTraceConsumer_methods[] = {
-  {"strcompile", (PyCFunction)DTraceConsumer_strcompile, METH_VARARGS, "compile the supplied d-program" },
-  {"setopt", (PyCFunction)DTraceConsumer_setopt, METH_VARARGS, "set libdtrace options" },
-  {"go", (PyCFunction)DTraceConsumer_go, METH_VARARGS, "execute the compiled d-program" },
-  {"consume", (PyCFunction)DTraceConsumer_consume, METH_VARARGS, "consume outputs of the running d-program" },
-  {"aggwalk", (PyCFunction)DTraceConsumer_aggwalk, METH_VARARGS, "consume outputs for all aggregations of the running d-program" },
-  {"aggclear", (PyCFunction)DTraceConsumer_aggclear, METH_VARARGS, "clear outputs for all aggregations of the running d-program" },
-  {"aggmin", (PyCFunction)DTraceConsumer_aggmin, METH_VARARGS, "minimum int64 value" },
-  {"aggmax", (PyCFunction)DTraceConsumer_aggmax, METH_VARARGS, "maximum int64 value" },
-  {"stop", (PyCFunction)DTraceConsumer_stop, METH_VARARGS, "stop execution of the running d-program" },
-  {"version", (PyCFunction)DTraceConsumer_version, METH_VARARGS, "return the version string of libdtrace" },
-  {NULL}  /* Sentinel */
+static PySequenceMethods DTraceConsumerGroup_as_sequence = {
+  (lenfunc)DTraceConsumerGroup_length, /* sq_length */
 };
 
-static PyTypeObject DTraceConsumerType = {
+static PyTypeObject DTraceConsumerGroupType = {
   PyObject_HEAD_INIT(NULL)
   0,                         /*ob_size*/
-  "libdtrace.DTraceConsumer",             /*tp_name*/
-  sizeof(DTraceConsumer),             /*tp_basicsize*/
+  "dtrace.ConsumerGroup",    /*tp_name*/
+  sizeof(DTraceConsumerGroup), /*tp_basicsize*/
   0,                         /*tp_itemsize*/
-  (destructor)DTraceConsumer_dealloc, /*tp_dealloc*/
+  (destructor)DTraceConsumerGroup_dealloc, /*tp_dealloc*/
   0,                         /*tp_print*/
   0,                         /*tp_getattr*/
   0,                         /*tp_setattr*/
   0,                         /*tp_compare*/
   0,                         /*tp_repr*/
   0,                         /*tp_as_number*/
-  0,                         /*tp_as_sequence*/
+  &DTraceConsumerGroup_as_sequence, /*tp_as_sequence*/
   0,                         /*tp_as_mapping*/
   0,                         /*tp_hash */
   0,                         /*tp_call*/
@@ -794,28 +10201,27 @@ static PyTypeObject DTraceConsumerType = {
   0,                         /*tp_getattro*/
   0,                         /*tp_setattro*/
   0,                         /*tp_as_buffer*/
-  Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /*tp_flags*/
-  "DTrace binding object",           /* tp_doc */
-  0,                     /* tp_traverse */
-  0,                     /* tp_clear */
+  Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC, /*tp_flags*/
+  "drives several DTrace consumers from one thread", /* tp_doc */
+  (traverseproc)DTraceConsumerGroup_traverse, /* tp_traverse */
+  (inquiry)DTraceConsumerGroup_clear, /* tp_clear */
   0,                     /* tp_richcompare */
   0,                     /* tp_weaklistoffset */
   0,                     /* tp_iter */
   0,                     /* tp_iternext */
-  DTraceConsumer_methods,             /* tp_methods */
-  DTraceConsumer_members,             /* tp_members */
+  DTraceConsumerGroup_methods,       /* tp_methods */
+  0,                         /* tp_members */
   0,                         /* tp_getset */
   0,                         /* tp_base */
   0,                         /* tp_dict */
   0,                         /* tp_descr_get */
   0,                         /* tp_descr_set */
   0,                         /* tp_dictoffset */
-  (initproc)DTraceConsumer_init,      /* tp_init */
+  0,                         /* tp_init */
   0,                         /* tp_alloc */
   PyType_GenericNew,                 /* tp_new */
 };
 
-
 //////////////////////////////////////////////////////////
 ///////////////////////////// Module
 //////////////////////////////////////////////////////////
@@ -832,10 +10238,40 @@ initdtrace(void)
 {
   PyObject* m;
 
+  PyEval_InitThreads();
+
   if ( PyType_Ready(&DTraceConsumerType) < 0 ) {
     return;
   } 
 
+  if ( PyType_Ready(&DTraceBufferType) < 0 ) {
+    return;
+  } 
+
+  if ( PyType_Ready(&DTraceConsumerGroupType) < 0 ) {
+    return;
+  } 
+
+  if ( PyType_Ready(&DTraceRecordsType) < 0 ) {
+    return;
+  } 
+
+  if ( PyType_Ready(&DTraceHistogramType) < 0 ) {
+    return;
+  } 
+
+  if ( PyType_Ready(&DTraceSnapshotReaderType) < 0 ) {
+    return;
+  } 
+
+  if ( _structseq_init(&DTraceProbeType, &DTraceProbe_desc) < 0 ) {
+    return;
+  } 
+
+  if ( _structseq_init(&DTraceAggSnapshotType, &DTraceAggSnapshot_desc) < 0 ) {
+    return;
+  } 
+
   m = Py_InitModule3("dtrace", module_methods, "python binding to libdtrace");
 
   
@@ -845,4 +10281,22 @@ initdtrace(void)
 
   Py_INCREF(&DTraceConsumerType);
   PyModule_AddObject(m, "DTraceConsumer", (PyObject *)&DTraceConsumerType);
+
+  Py_INCREF(&DTraceBufferType);
+  PyModule_AddObject(m, "Buffer", (PyObject *)&DTraceBufferType);
+
+  Py_INCREF(&DTraceConsumerGroupType);
+  PyModule_AddObject(m, "ConsumerGroup", (PyObject *)&DTraceConsumerGroupType);
+
+  Py_INCREF(&DTraceHistogramType);
+  PyModule_AddObject(m, "Histogram", (PyObject *)&DTraceHistogramType);
+
+  Py_INCREF(&DTraceSnapshotReaderType);
+  PyModule_AddObject(m, "SnapshotReader", (PyObject *)&DTraceSnapshotReaderType);
+
+  Py_INCREF(&DTraceProbeType);
+  PyModule_AddObject(m, "Probe", (PyObject *)&DTraceProbeType);
+
+  Py_INCREF(&DTraceAggSnapshotType);
+  PyModule_AddObject(m, "AggSnapshot", (PyObject *)&DTraceAggSnapshotType);
 }
\ No newline at end of file